@@ -23,6 +23,17 @@
 
 typedef struct bg_shout_s bg_shout_t;
 
+typedef struct
+  {
+  int queue_bytes;      /* Bytes waiting to be sent */
+  int queue_chunks;     /* Writes waiting to be sent */
+  int max_queue_bytes;
+  int64_t bytes_sent;
+  int64_t dropped_bytes;
+  int reconnects;
+  int connected;
+  } bg_shout_stats_t;
+
 bg_shout_t * bg_shout_create(int format);
 
 const bg_parameter_info_t * bg_shout_get_parameters(void);
@@ -40,6 +51,18 @@ void bg_shout_destroy(bg_shout_t *);
 
 int bg_shout_write(bg_shout_t *, const uint8_t * data, int len);
 
+/* Time is the presentation time of the data, used for pacing */
+int bg_shout_write_time(bg_shout_t *, const uint8_t * data, int len,
+                        gavl_time_t time);
+
+void bg_shout_get_stats(bg_shout_t *, bg_shout_stats_t * ret);
+
+/* Additional targets, available after opening */
+int bg_shout_get_num_targets(bg_shout_t *);
+
+void bg_shout_get_target_stats(bg_shout_t *, int target,
+                               bg_shout_stats_t * ret);
+
 /* Also closes */
 void bg_shout_destroy(bg_shout_t *);
 
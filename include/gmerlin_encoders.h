@@ -38,3 +38,69 @@ int bgen_id3v2_write(gavf_io_t * output, const bgen_id3v2_t *, int encoding);
 
 void bgen_id3v1_destroy(bgen_id3v1_t *);
 void bgen_id3v2_destroy(bgen_id3v2_t *);
+
+/* Segment parallel audio encoding (parallel.c) */
+
+typedef struct bgen_parallel_s bgen_parallel_t;
+
+/*
+ *  Create and open an encoder for one segment. It must accept the
+ *  format passed to bgen_parallel_create() and send the packets to psink.
+ */
+
+typedef gavl_audio_sink_t *
+(*bgen_parallel_create_func)(void * priv, void ** enc,
+                             gavl_packet_sink_t * psink);
+
+/* Flush and destroy an encoder */
+typedef void (*bgen_parallel_destroy_func)(void * enc);
+
+bgen_parallel_t *
+bgen_parallel_create(const gavl_audio_format_t * fmt,
+                     int delay, int num_threads,
+                     gavl_time_t segment_duration,
+                     bgen_parallel_create_func create_enc,
+                     bgen_parallel_destroy_func destroy_enc,
+                     void * priv);
+
+gavl_audio_sink_t * bgen_parallel_get_sink(bgen_parallel_t * p);
+
+void bgen_parallel_set_packet_sink(bgen_parallel_t * p,
+                                   gavl_packet_sink_t * psink);
+
+/* Encode the last segment and send all remaining packets */
+int bgen_parallel_flush(bgen_parallel_t * p);
+
+void bgen_parallel_destroy(bgen_parallel_t * p);
+
+/* Conversion kernels (SIMD versions are selected at runtime) */
+
+/* samples[i] *= factor */
+void bgen_scale_float(float * samples, int num, float factor);
+
+/*
+ *  Convert to 32 bit and divide by 2^shift. Like the / operator, the
+ *  results are rounded towards zero. dst and src may be the same for
+ *  bgen_shift_s32().
+ */
+
+void bgen_widen_s8(int32_t * dst, const int8_t * src, int num, int shift);
+void bgen_widen_s16(int32_t * dst, const int16_t * src, int num, int shift);
+void bgen_shift_s32(int32_t * dst, const int32_t * src, int num, int shift);
+
+/* RGBA <-> BGRA in place */
+void bgen_swap_rb_32(uint8_t * pixels, int num);
+
+/* Packed YUVA to planes, alpha is scaled from 0..255 to 16..235 */
+void bgen_split_yuva(uint8_t * y, uint8_t * u, uint8_t * v, uint8_t * a,
+                     const uint8_t * src, int num);
+
+/* Swap the bytes of 16 bit samples */
+void bgen_swap_16(uint16_t * dst, const uint16_t * src, int num);
+
+/* Unsigned <-> signed 8 bit samples */
+void bgen_flip_sign_8(uint8_t * dst, const uint8_t * src, int num);
+
+/* A-law and mu-law, bit-identical to libavcodec */
+void bgen_s16_to_alaw(uint8_t * dst, const int16_t * src, int num);
+void bgen_s16_to_ulaw(uint8_t * dst, const int16_t * src, int num);
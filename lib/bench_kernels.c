@@ -0,0 +1,323 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+
+/*
+ *  Micro-benchmarks of the kernel versions supported by the CPU. The C
+ *  versions are the loops, which were in the plugins before. The split
+ *  of packed YUVA is also measured with the table lookup of the former
+ *  yuv4mpeg code.
+ *
+ *  Build with "make bench_kernels", usage:
+ *
+ *  bench_kernels [elements]
+ *
+ *  Default: 1920 elements (one 1080p line or a few audio frames)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kernels.c"
+
+/* Minimum time per measurement */
+#define MIN_NS 200000000LL
+
+typedef struct
+  {
+  const char * name;
+  kernels_t k;
+  } variant_t;
+
+static variant_t variants[4];
+static int num_variants;
+
+static uint8_t alpha_table[256];
+
+static int num;
+
+static float   * buf_f;
+static int8_t  * buf_s8;
+static int16_t * buf_s16;
+static int32_t * buf_s32;
+static int32_t * buf_dst;
+static uint8_t * buf_pixels;
+static uint8_t * planes[4];
+
+static void get_variants(void)
+  {
+  /* Builds the companding tables of the C versions */
+  get_kernels();
+
+  variants[0].name = "C";
+  variants[0].k.scale_float = scale_float_c;
+  variants[0].k.widen_s8    = widen_s8_c;
+  variants[0].k.widen_s16   = widen_s16_c;
+  variants[0].k.shift_s32   = shift_s32_c;
+  variants[0].k.swap_rb_32  = swap_rb_32_c;
+  variants[0].k.split_yuva  = split_yuva_c;
+  variants[0].k.swap_16     = swap_16_c;
+  variants[0].k.flip_sign_8 = flip_sign_8_c;
+  variants[0].k.s16_to_alaw = s16_to_alaw_c;
+  variants[0].k.s16_to_ulaw = s16_to_ulaw_c;
+  num_variants = 1;
+  
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("sse2"))
+    {
+    variants[num_variants].name = "SSE2";
+    variants[num_variants].k.scale_float = scale_float_sse2;
+    variants[num_variants].k.widen_s8    = widen_s8_sse2;
+    variants[num_variants].k.widen_s16   = widen_s16_sse2;
+    variants[num_variants].k.shift_s32   = shift_s32_sse2;
+    variants[num_variants].k.swap_rb_32  = swap_rb_32_sse2;
+    variants[num_variants].k.split_yuva  = split_yuva_sse2;
+    variants[num_variants].k.swap_16     = swap_16_sse2;
+    variants[num_variants].k.flip_sign_8 = flip_sign_8_sse2;
+    variants[num_variants].k.s16_to_alaw = s16_to_alaw_sse2;
+    variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_sse2;
+    num_variants++;
+    }
+  if(__builtin_cpu_supports("avx2"))
+    {
+    variants[num_variants].name = "AVX2";
+    variants[num_variants].k.scale_float = scale_float_avx2;
+    variants[num_variants].k.widen_s8    = widen_s8_avx2;
+    variants[num_variants].k.widen_s16   = widen_s16_avx2;
+    variants[num_variants].k.shift_s32   = shift_s32_avx2;
+    variants[num_variants].k.swap_rb_32  = swap_rb_32_avx2;
+    variants[num_variants].k.split_yuva  = split_yuva_avx2;
+    variants[num_variants].k.swap_16     = swap_16_avx2;
+    variants[num_variants].k.flip_sign_8 = flip_sign_8_avx2;
+    variants[num_variants].k.s16_to_alaw = s16_to_alaw_avx2;
+    variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_avx2;
+    num_variants++;
+    }
+#endif
+
+#ifdef HAVE_NEON
+  variants[num_variants].name = "NEON";
+  variants[num_variants].k.scale_float = scale_float_neon;
+  variants[num_variants].k.widen_s8    = widen_s8_neon;
+  variants[num_variants].k.widen_s16   = widen_s16_neon;
+  variants[num_variants].k.shift_s32   = shift_s32_neon;
+  variants[num_variants].k.swap_rb_32  = swap_rb_32_neon;
+  variants[num_variants].k.split_yuva  = split_yuva_neon;
+  variants[num_variants].k.swap_16     = swap_16_neon;
+  variants[num_variants].k.flip_sign_8 = flip_sign_8_neon;
+  variants[num_variants].k.s16_to_alaw = s16_to_alaw_neon;
+  variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_neon;
+  num_variants++;
+#endif
+  }
+
+static int64_t get_ns(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+/* The former yuv4mpeg loop */
+
+static void split_yuva_table(uint8_t * y, uint8_t * u, uint8_t * v,
+                             uint8_t * a, const uint8_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    {
+    *(y++) = *(src++);
+    *(u++) = *(src++);
+    *(v++) = *(src++);
+    *(a++) = alpha_table[*(src++)];
+    }
+  }
+
+/* Benchmark functions */
+
+static void run_scale_float(const kernels_t * k)
+  {
+  /* Keep the values finite */
+  k->scale_float(buf_f, num, 1.0);
+  }
+
+static void run_widen_s8(const kernels_t * k)
+  {
+  k->widen_s8(buf_dst, buf_s8, num, 4);
+  }
+
+static void run_widen_s16(const kernels_t * k)
+  {
+  k->widen_s16(buf_dst, buf_s16, num, 4);
+  }
+
+static void run_shift_s32(const kernels_t * k)
+  {
+  k->shift_s32(buf_dst, buf_s32, num, 8);
+  }
+
+static void run_swap_rb_32(const kernels_t * k)
+  {
+  k->swap_rb_32(buf_pixels, num);
+  }
+
+static void run_split_yuva(const kernels_t * k)
+  {
+  if(k)
+    k->split_yuva(planes[0], planes[1], planes[2], planes[3],
+                  buf_pixels, num);
+  else
+    split_yuva_table(planes[0], planes[1], planes[2], planes[3],
+                     buf_pixels, num);
+  }
+
+static void run_swap_16(const kernels_t * k)
+  {
+  k->swap_16((uint16_t*)buf_dst, (const uint16_t*)buf_s16, num);
+  }
+
+static void run_flip_sign_8(const kernels_t * k)
+  {
+  k->flip_sign_8(planes[0], (const uint8_t*)buf_s8, num);
+  }
+
+static void run_s16_to_alaw(const kernels_t * k)
+  {
+  k->s16_to_alaw(planes[0], buf_s16, num);
+  }
+
+static void run_s16_to_ulaw(const kernels_t * k)
+  {
+  k->s16_to_ulaw(planes[0], buf_s16, num);
+  }
+
+/* Nanoseconds per element */
+
+static double measure(void (*func)(const kernels_t * k), const kernels_t * k)
+  {
+  int i;
+  int64_t iterations = 0;
+  int64_t start, time;
+
+  /* Warm up */
+  for(i = 0; i < 100; i++)
+    func(k);
+  
+  start = get_ns();
+  do
+    {
+    for(i = 0; i < 100; i++)
+      func(k);
+    iterations += 100;
+    time = get_ns() - start;
+    } while(time < MIN_NS);
+  
+  return (double)time / (double)(iterations * num);
+  }
+
+static void bench(const char * name, void (*func)(const kernels_t * k),
+                  int table)
+  {
+  int i;
+  double c_time = 0.0;
+  double t;
+  
+  printf("%s\n", name);
+
+  if(table)
+    {
+    c_time = measure(func, NULL);
+    printf("  %-6s %8.3f ns/element\n", "Table", c_time);
+    }
+  
+  for(i = 0; i < num_variants; i++)
+    {
+    t = measure(func, &variants[i].k);
+    if(!c_time)
+      c_time = t;
+    printf("  %-6s %8.3f ns/element %6.2fx\n", variants[i].name, t,
+           c_time / t);
+    }
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+
+  num = 1920;
+  if(argc > 1)
+    num = atoi(argv[1]);
+  if(num <= 0)
+    {
+    fprintf(stderr, "Usage: %s [elements]\n", argv[0]);
+    return 1;
+    }
+  
+  get_variants();
+
+  for(i = 0; i < 256; i++)
+    alpha_table[i] = 16 + ((i * ALPHA_MUL + 16384) >> 15);
+  
+  buf_f      = malloc(num * sizeof(*buf_f));
+  buf_s8     = malloc(num * sizeof(*buf_s8));
+  buf_s16    = malloc(num * sizeof(*buf_s16));
+  buf_s32    = malloc(num * sizeof(*buf_s32));
+  buf_dst    = malloc(num * sizeof(*buf_dst));
+  buf_pixels = malloc(num * 4);
+  for(i = 0; i < 4; i++)
+    planes[i] = malloc(num);
+
+  for(i = 0; i < num; i++)
+    {
+    buf_f[i]   = (float)(rand() - RAND_MAX / 2) / RAND_MAX;
+    buf_s8[i]  = rand();
+    buf_s16[i] = rand();
+    buf_s32[i] = rand() - RAND_MAX / 2;
+    }
+  for(i = 0; i < num * 4; i++)
+    buf_pixels[i] = rand();
+
+  printf("%d elements, speedup relative to the former code\n", num);
+  
+  bench("scale_float", run_scale_float, 0);
+  bench("widen_s8",    run_widen_s8,    0);
+  bench("widen_s16",   run_widen_s16,   0);
+  bench("shift_s32",   run_shift_s32,   0);
+  bench("swap_rb_32",  run_swap_rb_32,  0);
+  bench("split_yuva",  run_split_yuva,  1);
+  bench("swap_16",     run_swap_16,     0);
+  bench("flip_sign_8", run_flip_sign_8, 0);
+  bench("s16_to_alaw", run_s16_to_alaw, 0);
+  bench("s16_to_ulaw", run_s16_to_ulaw, 0);
+
+  free(buf_f);
+  free(buf_s8);
+  free(buf_s16);
+  free(buf_s32);
+  free(buf_dst);
+  free(buf_pixels);
+  for(i = 0; i < 4; i++)
+    free(planes[i]);
+  return 0;
+  }
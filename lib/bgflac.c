@@ -28,6 +28,7 @@
 #include <gavl/numptr.h>
 
 #include <config.h>
+#include <gmerlin_encoders.h>
 #include <bgflac.h>
 
 #include <gmerlin/log.h>
@@ -39,13 +40,12 @@ struct bg_flac_s
 
   int bits_per_sample;
   int shift_bits;
-  int divisor;
   //  int samples_per_block;
 
   int fixed_blocksize;
   
   void (*copy_frame)(int32_t * dst[], gavl_audio_frame_t * src,
-                     int num_channels);
+                     int num_channels, int shift);
 
   /* Buffer */
     
@@ -71,58 +71,30 @@ struct bg_flac_s
   };
 
 
-/* Copy functions */
+/* Copy and shift functions */
 
 static void copy_frame_8(int32_t * dst[], gavl_audio_frame_t * src,
-                         int num_channels)
+                         int num_channels, int shift)
   {
-  int i, j;
+  int i;
   for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < src->valid_samples; j++)
-      {
-      dst[i][j] = src->channels.s_8[i][j];
-      }
-    }
+    bgen_widen_s8(dst[i], src->channels.s_8[i], src->valid_samples, shift);
   }
 
 static void copy_frame_16(int32_t * dst[], gavl_audio_frame_t * src,
-                          int num_channels)
+                          int num_channels, int shift)
   {
-  int i, j;
+  int i;
   for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < src->valid_samples; j++)
-      {
-      dst[i][j] = src->channels.s_16[i][j];
-      }
-    }
-
+    bgen_widen_s16(dst[i], src->channels.s_16[i], src->valid_samples, shift);
   }
 
 static void copy_frame_32(int32_t * dst[], gavl_audio_frame_t * src,
-                          int num_channels)
+                          int num_channels, int shift)
   {
   int i;
   for(i = 0; i < num_channels; i++)
-    {
-    memcpy(dst[i], src->channels.s_32[i],
-           src->valid_samples * sizeof(dst[0][0]));
-    }
-  }
-
-static void do_shift(int32_t * dst[], int num_channels, int num_samples,
-                     int divisor)
-  {
-  int i, j;
-  
-  for(i = 0; i < num_channels; i++)
-    {
-    for(j = 0; j < num_samples; j++)
-      {
-      dst[i][j] /= divisor;
-      }
-    }
+    bgen_shift_s32(dst[i], src->channels.s_32[i], src->valid_samples, shift);
   }
 
 static const bg_parameter_info_t audio_parameters[] =
@@ -379,11 +351,8 @@ encode_audio_func(void * priv, gavl_audio_frame_t * frame)
 
   /* Copy and shift */
 
-  flac->copy_frame(flac->buffer, frame, flac->format->num_channels);
-
-  if(flac->shift_bits)
-    do_shift(flac->buffer, flac->format->num_channels,
-             frame->valid_samples, flac->divisor);
+  flac->copy_frame(flac->buffer, frame, flac->format->num_channels,
+                   flac->shift_bits);
 
   if(!FLAC__stream_encoder_process(flac->enc,
                                    (const FLAC__int32 **) flac->buffer,
@@ -431,7 +400,6 @@ bg_flac_start_uncompressed(bg_flac_t * flac,
     flac->shift_bits = 32 - flac->bits_per_sample;
     flac->format->sample_format = GAVL_SAMPLE_S32;
     }
-  flac->divisor = (1 << flac->shift_bits); 
 
   /* Set compression parameters from presets */
   
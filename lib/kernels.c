@@ -0,0 +1,1152 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Sample and pixel conversion kernels shared by the plugins
+ *
+ *  The SSE2 and AVX2 versions are selected at runtime depending on the
+ *  CPU, the NEON versions if the compiler targets a CPU with NEON.
+ *  All versions give exactly the same results as the C versions, which
+ *  also handle the remaining elements after the vectorized part.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "kernels"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ *  Alpha is scaled from 0..255 to 16..235 (rounded). For 8 bit
+ *  values this is exactly 16 + ((a * ALPHA_MUL + 16384) >> 15),
+ *  which is a rounding multiply high of 16 bit values.
+ */
+
+#define ALPHA_MUL 28142
+
+typedef struct
+  {
+  void (*scale_float)(float * samples, int num, float factor);
+  void (*widen_s8)(int32_t * dst, const int8_t * src, int num, int shift);
+  void (*widen_s16)(int32_t * dst, const int16_t * src, int num, int shift);
+  void (*shift_s32)(int32_t * dst, const int32_t * src, int num, int shift);
+  void (*swap_rb_32)(uint8_t * pixels, int num);
+  void (*split_yuva)(uint8_t * y, uint8_t * u, uint8_t * v, uint8_t * a,
+                     const uint8_t * src, int num);
+  void (*swap_16)(uint16_t * dst, const uint16_t * src, int num);
+  void (*flip_sign_8)(uint8_t * dst, const uint8_t * src, int num);
+  void (*s16_to_alaw)(uint8_t * dst, const int16_t * src, int num);
+  void (*s16_to_ulaw)(uint8_t * dst, const int16_t * src, int num);
+  } kernels_t;
+
+static kernels_t kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/* C versions */
+
+static void scale_float_c(float * samples, int num, float factor)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    samples[i] *= factor;
+  }
+
+/* Shifts are divisions rounded towards zero like the / operator */
+
+static void widen_s8_c(int32_t * dst, const int8_t * src, int num, int shift)
+  {
+  int i;
+  int32_t divisor = 1 << shift;
+  for(i = 0; i < num; i++)
+    dst[i] = src[i] / divisor;
+  }
+
+static void widen_s16_c(int32_t * dst, const int16_t * src, int num,
+                        int shift)
+  {
+  int i;
+  int32_t divisor = 1 << shift;
+  for(i = 0; i < num; i++)
+    dst[i] = src[i] / divisor;
+  }
+
+static void shift_s32_c(int32_t * dst, const int32_t * src, int num,
+                        int shift)
+  {
+  int i;
+  int32_t divisor = 1 << shift;
+  for(i = 0; i < num; i++)
+    dst[i] = src[i] / divisor;
+  }
+
+static void swap_rb_32_c(uint8_t * pixels, int num)
+  {
+  int i;
+  uint8_t swp;
+  for(i = 0; i < num; i++)
+    {
+    swp = pixels[0];
+    pixels[0] = pixels[2];
+    pixels[2] = swp;
+    pixels += 4;
+    }
+  }
+
+static void split_yuva_c(uint8_t * y, uint8_t * u, uint8_t * v, uint8_t * a,
+                         const uint8_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    {
+    y[i] = src[0];
+    u[i] = src[1];
+    v[i] = src[2];
+    a[i] = 16 + ((src[3] * ALPHA_MUL + 16384) >> 15);
+    src += 4;
+    }
+  }
+
+static void swap_16_c(uint16_t * dst, const uint16_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    dst[i] = (src[i] >> 8) | (src[i] << 8);
+  }
+
+static void flip_sign_8_c(uint8_t * dst, const uint8_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    dst[i] = src[i] ^ 0x80;
+  }
+
+/*
+ *  The companding tables are generated exactly like in libavcodec
+ *  (pcm_tablegen.h), so the output is identical.
+ */
+
+#define SIGN_BIT   (0x80)
+#define QUANT_MASK (0xf)
+#define SEG_SHIFT  (4)
+#define SEG_MASK   (0x70)
+#define BIAS       (0x84)
+
+static uint8_t linear_to_alaw[16384];
+static uint8_t linear_to_ulaw[16384];
+
+static int alaw2linear(unsigned char a_val)
+  {
+  int t, seg;
+
+  a_val ^= 0x55;
+
+  t = a_val & QUANT_MASK;
+  seg = ((unsigned)a_val & SEG_MASK) >> SEG_SHIFT;
+  if(seg)
+    t = (t + t + 1 + 32) << (seg + 2);
+  else
+    t = (t + t + 1) << 3;
+
+  return (a_val & SIGN_BIT) ? t : -t;
+  }
+
+static int ulaw2linear(unsigned char u_val)
+  {
+  int t;
+
+  u_val = ~u_val;
+
+  t = ((u_val & QUANT_MASK) << 3) + BIAS;
+  t <<= ((unsigned)u_val & SEG_MASK) >> SEG_SHIFT;
+
+  return (u_val & SIGN_BIT) ? (BIAS - t) : (t - BIAS);
+  }
+
+static void build_xlaw_table(uint8_t * linear_to_xlaw,
+                             int (*xlaw2linear)(unsigned char),
+                             int mask)
+  {
+  int i, j, v, v1, v2;
+
+  j = 1;
+  linear_to_xlaw[8192] = mask;
+  for(i = 0; i < 127; i++)
+    {
+    v1 = xlaw2linear(i ^ mask);
+    v2 = xlaw2linear((i + 1) ^ mask);
+    v = (v1 + v2 + 4) >> 3;
+    for(; j < v; j++)
+      {
+      linear_to_xlaw[8192 - j] = (i ^ (mask ^ 0x80));
+      linear_to_xlaw[8192 + j] = (i ^ mask);
+      }
+    }
+  for(; j < 8192; j++)
+    {
+    linear_to_xlaw[8192 - j] = (127 ^ (mask ^ 0x80));
+    linear_to_xlaw[8192 + j] = (127 ^ mask);
+    }
+  linear_to_xlaw[0] = linear_to_xlaw[1];
+  }
+
+static void s16_to_alaw_c(uint8_t * dst, const int16_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    dst[i] = linear_to_alaw[(src[i] + 32768) >> 2];
+  }
+
+static void s16_to_ulaw_c(uint8_t * dst, const int16_t * src, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    dst[i] = linear_to_ulaw[(src[i] + 32768) >> 2];
+  }
+
+/*
+ *  The SIMD versions compute the table entries. With the magnitude
+ *  j = |s >> 2| and c being the number of thresholds reached by j,
+ *  the code is
+ *
+ *  16 * c + min((j + bias) >> (shift + c), 31) + offset
+ *
+ *  XORed with mask for positive and with mask ^ 0x80 for negative
+ *  samples. The thresholds are the first magnitudes of each segment
+ *  in the tables. test_kernels checks all 65536 inputs.
+ */
+
+#define XLAW_THRESHOLDS 7
+
+typedef struct
+  {
+  int16_t thresholds[XLAW_THRESHOLDS];
+  int16_t bias;
+  int16_t shift;
+  int16_t offset;
+  int16_t mask;
+  } xlaw_t;
+
+/* A-law has one segment less, j never reaches the last threshold */
+
+static const xlaw_t alaw =
+  {
+    .thresholds = { 129, 258, 516, 1032, 2064, 4128, INT16_MAX },
+    .bias       = 0,
+    .shift      = 2,
+    .offset     = 0,
+    .mask       = 0xd5,
+  };
+
+static const xlaw_t ulaw =
+  {
+    .thresholds = { 32, 96, 225, 483, 999, 2031, 4095 },
+    .bias       = 33,
+    .shift      = 1,
+    .offset     = -16,
+    .mask       = 0xff,
+  };
+
+#ifdef HAVE_X86
+
+/* SSE2 */
+
+static TARGET_SSE2 void scale_float_sse2(float * samples, int num,
+                                         float factor)
+  {
+  int i;
+  __m128 f = _mm_set1_ps(factor);
+  
+  for(i = 0; i + 4 <= num; i += 4)
+    _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), f));
+  
+  scale_float_c(samples + i, num - i, factor);
+  }
+
+static inline TARGET_SSE2 __m128i div_sse2(__m128i x, __m128i mask,
+                                           __m128i count)
+  {
+  /* Add divisor - 1 to negative values before shifting */
+  return _mm_sra_epi32(_mm_add_epi32(x, _mm_and_si128(_mm_srai_epi32(x, 31),
+                                                      mask)), count);
+  }
+
+static TARGET_SSE2 void widen_s8_sse2(int32_t * dst, const int8_t * src,
+                                      int num, int shift)
+  {
+  int i;
+  __m128i x, lo, hi;
+  __m128i mask = _mm_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    x = _mm_loadu_si128((const __m128i*)(src + i));
+    
+    /* Sign extend by moving the bytes to the top */
+    lo = _mm_unpacklo_epi8(x, x);
+    hi = _mm_unpackhi_epi8(x, x);
+
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     div_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 24),
+                              mask, count));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     div_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 24),
+                              mask, count));
+    _mm_storeu_si128((__m128i*)(dst + i + 8),
+                     div_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 24),
+                              mask, count));
+    _mm_storeu_si128((__m128i*)(dst + i + 12),
+                     div_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 24),
+                              mask, count));
+    }
+  widen_s8_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_SSE2 void widen_s16_sse2(int32_t * dst, const int16_t * src,
+                                       int num, int shift)
+  {
+  int i;
+  __m128i x;
+  __m128i mask = _mm_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     div_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16),
+                              mask, count));
+    _mm_storeu_si128((__m128i*)(dst + i + 4),
+                     div_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16),
+                              mask, count));
+    }
+  widen_s16_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_SSE2 void shift_s32_sse2(int32_t * dst, const int32_t * src,
+                                       int num, int shift)
+  {
+  int i;
+  __m128i mask = _mm_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 4 <= num; i += 4)
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     div_sse2(_mm_loadu_si128((const __m128i*)(src + i)),
+                              mask, count));
+  shift_s32_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_SSE2 void swap_rb_32_sse2(uint8_t * pixels, int num)
+  {
+  int i;
+  __m128i p;
+  __m128i mask_ga = _mm_set1_epi32(0xff00ff00);
+  __m128i mask_r = _mm_set1_epi32(0xff);
+  
+  for(i = 0; i + 4 <= num; i += 4)
+    {
+    p = _mm_loadu_si128((const __m128i*)(pixels + 4 * i));
+    p = _mm_or_si128(_mm_and_si128(p, mask_ga),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), mask_r),
+                                  _mm_slli_epi32(_mm_and_si128(p, mask_r), 16)));
+    _mm_storeu_si128((__m128i*)(pixels + 4 * i), p);
+    }
+  swap_rb_32_c(pixels + 4 * i, num - i);
+  }
+
+/* Pack the low bytes of 16 32 bit values */
+
+static inline TARGET_SSE2 __m128i pack_sse2(__m128i p0, __m128i p1,
+                                            __m128i p2, __m128i p3)
+  {
+  return _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+  }
+
+/* Scale alpha values in 32 bit lanes */
+
+static inline TARGET_SSE2 __m128i alpha_sse2(__m128i a)
+  {
+  /* a * ALPHA_MUL + 1 * 16384 */
+  a = _mm_madd_epi16(_mm_or_si128(a, _mm_set1_epi32(0x10000)),
+                     _mm_set1_epi32((16384 << 16) | ALPHA_MUL));
+  return _mm_add_epi32(_mm_srli_epi32(a, 15), _mm_set1_epi32(16));
+  }
+
+static TARGET_SSE2 void split_yuva_sse2(uint8_t * y, uint8_t * u,
+                                        uint8_t * v, uint8_t * a,
+                                        const uint8_t * src, int num)
+  {
+  int i;
+  __m128i p0, p1, p2, p3;
+  __m128i mask = _mm_set1_epi32(0xff);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    p0 = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+    p1 = _mm_loadu_si128((const __m128i*)(src + 4 * i + 16));
+    p2 = _mm_loadu_si128((const __m128i*)(src + 4 * i + 32));
+    p3 = _mm_loadu_si128((const __m128i*)(src + 4 * i + 48));
+
+    _mm_storeu_si128((__m128i*)(y + i),
+                     pack_sse2(_mm_and_si128(p0, mask),
+                               _mm_and_si128(p1, mask),
+                               _mm_and_si128(p2, mask),
+                               _mm_and_si128(p3, mask)));
+    _mm_storeu_si128((__m128i*)(u + i),
+                     pack_sse2(_mm_and_si128(_mm_srli_epi32(p0, 8), mask),
+                               _mm_and_si128(_mm_srli_epi32(p1, 8), mask),
+                               _mm_and_si128(_mm_srli_epi32(p2, 8), mask),
+                               _mm_and_si128(_mm_srli_epi32(p3, 8), mask)));
+    _mm_storeu_si128((__m128i*)(v + i),
+                     pack_sse2(_mm_and_si128(_mm_srli_epi32(p0, 16), mask),
+                               _mm_and_si128(_mm_srli_epi32(p1, 16), mask),
+                               _mm_and_si128(_mm_srli_epi32(p2, 16), mask),
+                               _mm_and_si128(_mm_srli_epi32(p3, 16), mask)));
+    _mm_storeu_si128((__m128i*)(a + i),
+                     pack_sse2(alpha_sse2(_mm_srli_epi32(p0, 24)),
+                               alpha_sse2(_mm_srli_epi32(p1, 24)),
+                               alpha_sse2(_mm_srli_epi32(p2, 24)),
+                               alpha_sse2(_mm_srli_epi32(p3, 24))));
+    }
+  split_yuva_c(y + i, u + i, v + i, a + i, src + 4 * i, num - i);
+  }
+
+static TARGET_SSE2 void swap_16_sse2(uint16_t * dst, const uint16_t * src,
+                                     int num)
+  {
+  int i;
+  __m128i x;
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+    }
+  swap_16_c(dst + i, src + i, num - i);
+  }
+
+static TARGET_SSE2 void flip_sign_8_sse2(uint8_t * dst, const uint8_t * src,
+                                         int num)
+  {
+  int i;
+  __m128i sign = _mm_set1_epi8((char)0x80);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)),
+                                   sign));
+  flip_sign_8_c(dst + i, src + i, num - i);
+  }
+
+/*
+ *  There are no variable shifts, so (j + bias) >> (shift + c) is a
+ *  multiply high with 2^(16 - shift - c). The reached thresholds are
+ *  contiguous, so this factor is 2^(16 - shift) minus the weights
+ *  2^(15 - shift - k) of the reached thresholds k.
+ *
+ *  The constants are copied to the stack, because they could alias
+ *  the destination bytes.
+ */
+
+typedef struct
+  {
+  __m128i thresholds[XLAW_THRESHOLDS];
+  __m128i weights[XLAW_THRESHOLDS];
+  __m128i factor;
+  __m128i bias;
+  __m128i offset;
+  __m128i mask;
+  } xlaw_sse2_t;
+
+static inline TARGET_SSE2 void xlaw_init_sse2(xlaw_sse2_t * ret,
+                                              const xlaw_t * x)
+  {
+  int k;
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    {
+    /* j > threshold - 1 */
+    ret->thresholds[k] = _mm_set1_epi16(x->thresholds[k] - 1);
+    ret->weights[k] = _mm_set1_epi16(1 << (15 - x->shift - k));
+    }
+  ret->factor = _mm_set1_epi16(1 << (16 - x->shift));
+  ret->bias   = _mm_set1_epi16(x->bias);
+  ret->offset = _mm_set1_epi16(x->offset);
+  ret->mask   = _mm_set1_epi16(x->mask);
+  }
+
+/* A-law or mu-law codes of 8 samples in 16 bit lanes */
+
+static inline TARGET_SSE2 __m128i xlaw_sse2(__m128i s, const xlaw_sse2_t * x)
+  {
+  int k;
+  __m128i neg, j, f, c, m;
+  
+  s = _mm_srai_epi16(s, 2);
+  neg = _mm_srai_epi16(s, 15);
+  j = _mm_sub_epi16(_mm_xor_si128(s, neg), neg);
+
+  f = x->factor;
+  c = _mm_setzero_si128();
+  
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    {
+    m = _mm_cmpgt_epi16(j, x->thresholds[k]);
+    f = _mm_sub_epi16(f, _mm_and_si128(m, x->weights[k]));
+    c = _mm_sub_epi16(c, m);
+    }
+
+  j = _mm_mulhi_epu16(_mm_add_epi16(j, x->bias), f);
+  j = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(c, 4),
+                                  _mm_min_epi16(j, _mm_set1_epi16(31))),
+                    x->offset);
+  return _mm_xor_si128(j, _mm_xor_si128(x->mask,
+                                        _mm_and_si128(neg,
+                                                      _mm_set1_epi16(0x80))));
+  }
+
+/* Returns the number of converted samples */
+
+static inline TARGET_SSE2 int s16_to_xlaw_sse2(uint8_t * dst,
+                                               const int16_t * src, int num,
+                                               const xlaw_t * x)
+  {
+  int i;
+  xlaw_sse2_t c;
+
+  xlaw_init_sse2(&c, x);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    _mm_storeu_si128((__m128i*)(dst + i),
+                     _mm_packus_epi16(xlaw_sse2(_mm_loadu_si128((const __m128i*)(src + i)), &c),
+                                      xlaw_sse2(_mm_loadu_si128((const __m128i*)(src + i + 8)), &c)));
+  return i;
+  }
+
+static TARGET_SSE2 void s16_to_alaw_sse2(uint8_t * dst, const int16_t * src,
+                                         int num)
+  {
+  int i = s16_to_xlaw_sse2(dst, src, num, &alaw);
+  s16_to_alaw_c(dst + i, src + i, num - i);
+  }
+
+static TARGET_SSE2 void s16_to_ulaw_sse2(uint8_t * dst, const int16_t * src,
+                                         int num)
+  {
+  int i = s16_to_xlaw_sse2(dst, src, num, &ulaw);
+  s16_to_ulaw_c(dst + i, src + i, num - i);
+  }
+
+/* AVX2 */
+
+static TARGET_AVX2 void scale_float_avx2(float * samples, int num,
+                                         float factor)
+  {
+  int i;
+  __m256 f = _mm256_set1_ps(factor);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    _mm256_storeu_ps(samples + i,
+                     _mm256_mul_ps(_mm256_loadu_ps(samples + i), f));
+  
+  scale_float_c(samples + i, num - i, factor);
+  }
+
+static inline TARGET_AVX2 __m256i div_avx2(__m256i x, __m256i mask,
+                                           __m128i count)
+  {
+  return _mm256_sra_epi32(_mm256_add_epi32(x,
+                                           _mm256_and_si256(_mm256_srai_epi32(x, 31),
+                                                            mask)), count);
+  }
+
+static TARGET_AVX2 void widen_s8_avx2(int32_t * dst, const int8_t * src,
+                                      int num, int shift)
+  {
+  int i;
+  __m256i mask = _mm256_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        div_avx2(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(src + i))),
+                                 mask, count));
+  
+  widen_s8_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_AVX2 void widen_s16_avx2(int32_t * dst, const int16_t * src,
+                                       int num, int shift)
+  {
+  int i;
+  __m256i mask = _mm256_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        div_avx2(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i))),
+                                 mask, count));
+  
+  widen_s16_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_AVX2 void shift_s32_avx2(int32_t * dst, const int32_t * src,
+                                       int num, int shift)
+  {
+  int i;
+  __m256i mask = _mm256_set1_epi32((1 << shift) - 1);
+  __m128i count = _mm_cvtsi32_si128(shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        div_avx2(_mm256_loadu_si256((const __m256i*)(src + i)),
+                                 mask, count));
+  shift_s32_c(dst + i, src + i, num - i, shift);
+  }
+
+static TARGET_AVX2 void swap_rb_32_avx2(uint8_t * pixels, int num)
+  {
+  int i;
+  __m256i p;
+  __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                     10, 9, 8, 11, 14, 13, 12, 15,
+                                     2, 1, 0, 3, 6, 5, 4, 7,
+                                     10, 9, 8, 11, 14, 13, 12, 15);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    p = _mm256_loadu_si256((const __m256i*)(pixels + 4 * i));
+    _mm256_storeu_si256((__m256i*)(pixels + 4 * i),
+                        _mm256_shuffle_epi8(p, shuffle));
+    }
+  swap_rb_32_c(pixels + 4 * i, num - i);
+  }
+
+/*
+ *  Pack the low bytes of 32 32 bit values. The packs work within the
+ *  128 bit lanes, so the 4 byte groups must be reordered afterwards.
+ */
+
+static inline TARGET_AVX2 __m256i pack_avx2(__m256i p0, __m256i p1,
+                                            __m256i p2, __m256i p3)
+  {
+  __m256i ret = _mm256_packus_epi16(_mm256_packs_epi32(p0, p1),
+                                    _mm256_packs_epi32(p2, p3));
+  return _mm256_permutevar8x32_epi32(ret, _mm256_setr_epi32(0, 4, 1, 5,
+                                                            2, 6, 3, 7));
+  }
+
+static inline TARGET_AVX2 __m256i alpha_avx2(__m256i a)
+  {
+  a = _mm256_madd_epi16(_mm256_or_si256(a, _mm256_set1_epi32(0x10000)),
+                        _mm256_set1_epi32((16384 << 16) | ALPHA_MUL));
+  return _mm256_add_epi32(_mm256_srli_epi32(a, 15), _mm256_set1_epi32(16));
+  }
+
+static TARGET_AVX2 void split_yuva_avx2(uint8_t * y, uint8_t * u,
+                                        uint8_t * v, uint8_t * a,
+                                        const uint8_t * src, int num)
+  {
+  int i;
+  __m256i p0, p1, p2, p3;
+  __m256i mask = _mm256_set1_epi32(0xff);
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    {
+    p0 = _mm256_loadu_si256((const __m256i*)(src + 4 * i));
+    p1 = _mm256_loadu_si256((const __m256i*)(src + 4 * i + 32));
+    p2 = _mm256_loadu_si256((const __m256i*)(src + 4 * i + 64));
+    p3 = _mm256_loadu_si256((const __m256i*)(src + 4 * i + 96));
+
+    _mm256_storeu_si256((__m256i*)(y + i),
+                        pack_avx2(_mm256_and_si256(p0, mask),
+                                  _mm256_and_si256(p1, mask),
+                                  _mm256_and_si256(p2, mask),
+                                  _mm256_and_si256(p3, mask)));
+    _mm256_storeu_si256((__m256i*)(u + i),
+                        pack_avx2(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p1, 8), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p2, 8), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p3, 8), mask)));
+    _mm256_storeu_si256((__m256i*)(v + i),
+                        pack_avx2(_mm256_and_si256(_mm256_srli_epi32(p0, 16), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p1, 16), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p2, 16), mask),
+                                  _mm256_and_si256(_mm256_srli_epi32(p3, 16), mask)));
+    _mm256_storeu_si256((__m256i*)(a + i),
+                        pack_avx2(alpha_avx2(_mm256_srli_epi32(p0, 24)),
+                                  alpha_avx2(_mm256_srli_epi32(p1, 24)),
+                                  alpha_avx2(_mm256_srli_epi32(p2, 24)),
+                                  alpha_avx2(_mm256_srli_epi32(p3, 24))));
+    }
+  split_yuva_c(y + i, u + i, v + i, a + i, src + 4 * i, num - i);
+  }
+
+static TARGET_AVX2 void swap_16_avx2(uint16_t * dst, const uint16_t * src,
+                                     int num)
+  {
+  int i;
+  __m256i shuffle = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                     9, 8, 11, 10, 13, 12, 15, 14,
+                                     1, 0, 3, 2, 5, 4, 7, 6,
+                                     9, 8, 11, 10, 13, 12, 15, 14);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i)),
+                                            shuffle));
+  swap_16_c(dst + i, src + i, num - i);
+  }
+
+static TARGET_AVX2 void flip_sign_8_avx2(uint8_t * dst, const uint8_t * src,
+                                         int num)
+  {
+  int i;
+  __m256i sign = _mm256_set1_epi8((char)0x80);
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + i)),
+                                         sign));
+  flip_sign_8_c(dst + i, src + i, num - i);
+  }
+
+/* Variable shifts need 32 bit lanes, so the same as for SSE2 */
+
+typedef struct
+  {
+  __m256i thresholds[XLAW_THRESHOLDS];
+  __m256i weights[XLAW_THRESHOLDS];
+  __m256i factor;
+  __m256i bias;
+  __m256i offset;
+  __m256i mask;
+  } xlaw_avx2_t;
+
+static inline TARGET_AVX2 void xlaw_init_avx2(xlaw_avx2_t * ret,
+                                              const xlaw_t * x)
+  {
+  int k;
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    {
+    ret->thresholds[k] = _mm256_set1_epi16(x->thresholds[k] - 1);
+    ret->weights[k] = _mm256_set1_epi16(1 << (15 - x->shift - k));
+    }
+  ret->factor = _mm256_set1_epi16(1 << (16 - x->shift));
+  ret->bias   = _mm256_set1_epi16(x->bias);
+  ret->offset = _mm256_set1_epi16(x->offset);
+  ret->mask   = _mm256_set1_epi16(x->mask);
+  }
+
+static inline TARGET_AVX2 __m256i xlaw_avx2(__m256i s, const xlaw_avx2_t * x)
+  {
+  int k;
+  __m256i neg, j, f, c, m;
+  
+  s = _mm256_srai_epi16(s, 2);
+  neg = _mm256_srai_epi16(s, 15);
+  j = _mm256_sub_epi16(_mm256_xor_si256(s, neg), neg);
+
+  f = x->factor;
+  c = _mm256_setzero_si256();
+  
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    {
+    m = _mm256_cmpgt_epi16(j, x->thresholds[k]);
+    f = _mm256_sub_epi16(f, _mm256_and_si256(m, x->weights[k]));
+    c = _mm256_sub_epi16(c, m);
+    }
+
+  j = _mm256_mulhi_epu16(_mm256_add_epi16(j, x->bias), f);
+  j = _mm256_add_epi16(_mm256_add_epi16(_mm256_slli_epi16(c, 4),
+                                        _mm256_min_epi16(j, _mm256_set1_epi16(31))),
+                       x->offset);
+  return _mm256_xor_si256(j, _mm256_xor_si256(x->mask,
+                                              _mm256_and_si256(neg,
+                                                               _mm256_set1_epi16(0x80))));
+  }
+
+static inline TARGET_AVX2 int s16_to_xlaw_avx2(uint8_t * dst,
+                                               const int16_t * src, int num,
+                                               const xlaw_t * x)
+  {
+  int i;
+  __m256i ret;
+  xlaw_avx2_t c;
+
+  xlaw_init_avx2(&c, x);
+  
+  for(i = 0; i + 32 <= num; i += 32)
+    {
+    /* The pack works within the 128 bit lanes */
+    ret = _mm256_packus_epi16(xlaw_avx2(_mm256_loadu_si256((const __m256i*)(src + i)), &c),
+                              xlaw_avx2(_mm256_loadu_si256((const __m256i*)(src + i + 16)), &c));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_permute4x64_epi64(ret, 0xd8));
+    }
+  return i;
+  }
+
+static TARGET_AVX2 void s16_to_alaw_avx2(uint8_t * dst, const int16_t * src,
+                                         int num)
+  {
+  int i = s16_to_xlaw_avx2(dst, src, num, &alaw);
+  s16_to_alaw_c(dst + i, src + i, num - i);
+  }
+
+static TARGET_AVX2 void s16_to_ulaw_avx2(uint8_t * dst, const int16_t * src,
+                                         int num)
+  {
+  int i = s16_to_xlaw_avx2(dst, src, num, &ulaw);
+  s16_to_ulaw_c(dst + i, src + i, num - i);
+  }
+
+#endif // HAVE_X86
+
+#ifdef HAVE_NEON
+
+static void scale_float_neon(float * samples, int num, float factor)
+  {
+  int i;
+  for(i = 0; i + 4 <= num; i += 4)
+    vst1q_f32(samples + i, vmulq_n_f32(vld1q_f32(samples + i), factor));
+  scale_float_c(samples + i, num - i, factor);
+  }
+
+static inline int32x4_t div_neon(int32x4_t x, int32x4_t mask,
+                                 int32x4_t count)
+  {
+  return vshlq_s32(vaddq_s32(x, vandq_s32(vshrq_n_s32(x, 31), mask)),
+                   count);
+  }
+
+static void widen_s8_neon(int32_t * dst, const int8_t * src, int num,
+                          int shift)
+  {
+  int i;
+  int16x8_t x;
+  int32x4_t mask = vdupq_n_s32((1 << shift) - 1);
+  int32x4_t count = vdupq_n_s32(-shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = vmovl_s8(vld1_s8(src + i));
+    vst1q_s32(dst + i, div_neon(vmovl_s16(vget_low_s16(x)), mask, count));
+    vst1q_s32(dst + i + 4, div_neon(vmovl_s16(vget_high_s16(x)),
+                                    mask, count));
+    }
+  widen_s8_c(dst + i, src + i, num - i, shift);
+  }
+
+static void widen_s16_neon(int32_t * dst, const int16_t * src, int num,
+                           int shift)
+  {
+  int i;
+  int16x8_t x;
+  int32x4_t mask = vdupq_n_s32((1 << shift) - 1);
+  int32x4_t count = vdupq_n_s32(-shift);
+  
+  for(i = 0; i + 8 <= num; i += 8)
+    {
+    x = vld1q_s16(src + i);
+    vst1q_s32(dst + i, div_neon(vmovl_s16(vget_low_s16(x)), mask, count));
+    vst1q_s32(dst + i + 4, div_neon(vmovl_s16(vget_high_s16(x)),
+                                    mask, count));
+    }
+  widen_s16_c(dst + i, src + i, num - i, shift);
+  }
+
+static void shift_s32_neon(int32_t * dst, const int32_t * src, int num,
+                           int shift)
+  {
+  int i;
+  int32x4_t mask = vdupq_n_s32((1 << shift) - 1);
+  int32x4_t count = vdupq_n_s32(-shift);
+
+  for(i = 0; i + 4 <= num; i += 4)
+    vst1q_s32(dst + i, div_neon(vld1q_s32(src + i), mask, count));
+  shift_s32_c(dst + i, src + i, num - i, shift);
+  }
+
+static void swap_rb_32_neon(uint8_t * pixels, int num)
+  {
+  int i;
+  uint8x16x4_t p;
+  uint8x16_t swp;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    p = vld4q_u8(pixels + 4 * i);
+    swp = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = swp;
+    vst4q_u8(pixels + 4 * i, p);
+    }
+  swap_rb_32_c(pixels + 4 * i, num - i);
+  }
+
+/* vqrdmulh gives (2 * a * b + 32768) >> 16 */
+
+static inline uint8x8_t alpha_neon(uint8x8_t a)
+  {
+  int16x8_t x = vreinterpretq_s16_u16(vmovl_u8(a));
+  x = vaddq_s16(vqrdmulhq_n_s16(x, ALPHA_MUL), vdupq_n_s16(16));
+  return vmovn_u16(vreinterpretq_u16_s16(x));
+  }
+
+static void split_yuva_neon(uint8_t * y, uint8_t * u, uint8_t * v,
+                            uint8_t * a, const uint8_t * src, int num)
+  {
+  int i;
+  uint8x16x4_t p;
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    {
+    p = vld4q_u8(src + 4 * i);
+    vst1q_u8(y + i, p.val[0]);
+    vst1q_u8(u + i, p.val[1]);
+    vst1q_u8(v + i, p.val[2]);
+    vst1q_u8(a + i, vcombine_u8(alpha_neon(vget_low_u8(p.val[3])),
+                                alpha_neon(vget_high_u8(p.val[3]))));
+    }
+  split_yuva_c(y + i, u + i, v + i, a + i, src + 4 * i, num - i);
+  }
+
+static void swap_16_neon(uint16_t * dst, const uint16_t * src, int num)
+  {
+  int i;
+  for(i = 0; i + 8 <= num; i += 8)
+    vst1q_u16(dst + i,
+              vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(vld1q_u16(src + i)))));
+  swap_16_c(dst + i, src + i, num - i);
+  }
+
+static void flip_sign_8_neon(uint8_t * dst, const uint8_t * src, int num)
+  {
+  int i;
+  uint8x16_t sign = vdupq_n_u8(0x80);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), sign));
+  flip_sign_8_c(dst + i, src + i, num - i);
+  }
+
+static inline uint8x8_t xlaw_neon(int16x8_t s, const int16x8_t * thresholds,
+                                  const xlaw_t * x)
+  {
+  int k;
+  int16x8_t neg, j, c;
+  
+  s = vshrq_n_s16(s, 2);
+  neg = vshrq_n_s16(s, 15);
+  j = vabsq_s16(s);
+  c = vdupq_n_s16(0);
+  
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    c = vsubq_s16(c, vreinterpretq_s16_u16(vcgeq_s16(j, thresholds[k])));
+
+  /* Negative counts shift to the right */
+  j = vshlq_s16(vaddq_s16(j, vdupq_n_s16(x->bias)),
+                vnegq_s16(vaddq_s16(c, vdupq_n_s16(x->shift))));
+  j = vaddq_s16(vaddq_s16(vshlq_n_s16(c, 4), vminq_s16(j, vdupq_n_s16(31))),
+                vdupq_n_s16(x->offset));
+  j = veorq_s16(j, veorq_s16(vdupq_n_s16(x->mask),
+                             vandq_s16(neg, vdupq_n_s16(0x80))));
+  return vmovn_u16(vreinterpretq_u16_s16(j));
+  }
+
+static inline int s16_to_xlaw_neon(uint8_t * dst, const int16_t * src,
+                                   int num, const xlaw_t * x)
+  {
+  int i, k;
+  int16x8_t thresholds[XLAW_THRESHOLDS];
+
+  for(k = 0; k < XLAW_THRESHOLDS; k++)
+    thresholds[k] = vdupq_n_s16(x->thresholds[k]);
+  
+  for(i = 0; i + 16 <= num; i += 16)
+    vst1q_u8(dst + i,
+             vcombine_u8(xlaw_neon(vld1q_s16(src + i), thresholds, x),
+                         xlaw_neon(vld1q_s16(src + i + 8), thresholds, x)));
+  return i;
+  }
+
+static void s16_to_alaw_neon(uint8_t * dst, const int16_t * src, int num)
+  {
+  int i = s16_to_xlaw_neon(dst, src, num, &alaw);
+  s16_to_alaw_c(dst + i, src + i, num - i);
+  }
+
+static void s16_to_ulaw_neon(uint8_t * dst, const int16_t * src, int num)
+  {
+  int i = s16_to_xlaw_neon(dst, src, num, &ulaw);
+  s16_to_ulaw_c(dst + i, src + i, num - i);
+  }
+
+#endif // HAVE_NEON
+
+static void init_kernels(void)
+  {
+  const char * name = "C";
+
+  build_xlaw_table(linear_to_alaw, alaw2linear, 0xd5);
+  build_xlaw_table(linear_to_ulaw, ulaw2linear, 0xff);
+  
+  kernels.scale_float = scale_float_c;
+  kernels.widen_s8    = widen_s8_c;
+  kernels.widen_s16   = widen_s16_c;
+  kernels.shift_s32   = shift_s32_c;
+  kernels.swap_rb_32  = swap_rb_32_c;
+  kernels.split_yuva  = split_yuva_c;
+  kernels.swap_16     = swap_16_c;
+  kernels.flip_sign_8 = flip_sign_8_c;
+  kernels.s16_to_alaw = s16_to_alaw_c;
+  kernels.s16_to_ulaw = s16_to_ulaw_c;
+
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  
+  if(__builtin_cpu_supports("sse2"))
+    {
+    kernels.scale_float = scale_float_sse2;
+    kernels.widen_s8    = widen_s8_sse2;
+    kernels.widen_s16   = widen_s16_sse2;
+    kernels.shift_s32   = shift_s32_sse2;
+    kernels.swap_rb_32  = swap_rb_32_sse2;
+    kernels.split_yuva  = split_yuva_sse2;
+    kernels.swap_16     = swap_16_sse2;
+    kernels.flip_sign_8 = flip_sign_8_sse2;
+    kernels.s16_to_alaw = s16_to_alaw_sse2;
+    kernels.s16_to_ulaw = s16_to_ulaw_sse2;
+    name = "SSE2";
+    }
+  if(__builtin_cpu_supports("avx2"))
+    {
+    kernels.scale_float = scale_float_avx2;
+    kernels.widen_s8    = widen_s8_avx2;
+    kernels.widen_s16   = widen_s16_avx2;
+    kernels.shift_s32   = shift_s32_avx2;
+    kernels.swap_rb_32  = swap_rb_32_avx2;
+    kernels.split_yuva  = split_yuva_avx2;
+    kernels.swap_16     = swap_16_avx2;
+    kernels.flip_sign_8 = flip_sign_8_avx2;
+    kernels.s16_to_alaw = s16_to_alaw_avx2;
+    kernels.s16_to_ulaw = s16_to_ulaw_avx2;
+    name = "AVX2";
+    }
+#endif
+
+#ifdef HAVE_NEON
+  kernels.scale_float = scale_float_neon;
+  kernels.widen_s8    = widen_s8_neon;
+  kernels.widen_s16   = widen_s16_neon;
+  kernels.shift_s32   = shift_s32_neon;
+  kernels.swap_rb_32  = swap_rb_32_neon;
+  kernels.split_yuva  = split_yuva_neon;
+  kernels.swap_16     = swap_16_neon;
+  kernels.flip_sign_8 = flip_sign_8_neon;
+  kernels.s16_to_alaw = s16_to_alaw_neon;
+  kernels.s16_to_ulaw = s16_to_ulaw_neon;
+  name = "NEON";
+#endif
+  
+  bg_log(BG_LOG_DEBUG, LOG_DOMAIN, "Using %s kernels", name);
+  }
+
+static const kernels_t * get_kernels(void)
+  {
+  pthread_once(&kernels_once, init_kernels);
+  return &kernels;
+  }
+
+void bgen_scale_float(float * samples, int num, float factor)
+  {
+  get_kernels()->scale_float(samples, num, factor);
+  }
+
+void bgen_widen_s8(int32_t * dst, const int8_t * src, int num, int shift)
+  {
+  get_kernels()->widen_s8(dst, src, num, shift);
+  }
+
+void bgen_widen_s16(int32_t * dst, const int16_t * src, int num, int shift)
+  {
+  get_kernels()->widen_s16(dst, src, num, shift);
+  }
+
+void bgen_shift_s32(int32_t * dst, const int32_t * src, int num, int shift)
+  {
+  if(!shift)
+    {
+    if(dst != src)
+      memcpy(dst, src, num * sizeof(*dst));
+    return;
+    }
+  get_kernels()->shift_s32(dst, src, num, shift);
+  }
+
+void bgen_swap_rb_32(uint8_t * pixels, int num)
+  {
+  get_kernels()->swap_rb_32(pixels, num);
+  }
+
+void bgen_split_yuva(uint8_t * y, uint8_t * u, uint8_t * v, uint8_t * a,
+                     const uint8_t * src, int num)
+  {
+  get_kernels()->split_yuva(y, u, v, a, src, num);
+  }
+
+void bgen_swap_16(uint16_t * dst, const uint16_t * src, int num)
+  {
+  get_kernels()->swap_16(dst, src, num);
+  }
+
+void bgen_flip_sign_8(uint8_t * dst, const uint8_t * src, int num)
+  {
+  get_kernels()->flip_sign_8(dst, src, num);
+  }
+
+void bgen_s16_to_alaw(uint8_t * dst, const int16_t * src, int num)
+  {
+  get_kernels()->s16_to_alaw(dst, src, num);
+  }
+
+void bgen_s16_to_ulaw(uint8_t * dst, const int16_t * src, int num)
+  {
+  get_kernels()->s16_to_ulaw(dst, src, num);
+  }
@@ -0,0 +1,429 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Segment parallel audio encoding
+ *
+ *  The input is cut into segments of segment_duration. Each segment is
+ *  encoded by its own encoder instance in its own thread. The encoders
+ *  also get some frames before (preroll) and after (postroll) the
+ *  segment, so the bit allocation, block switching and MDCT overlap
+ *  are settled when the first kept frame is encoded.
+ *
+ *  All encoders produce packets on the same grid (first timestamp minus
+ *  encoder delay, multiples of the frame size). From each encoder we
+ *  keep the packets with timestamps inside its segment, shifted by the
+ *  encoder delay. The kept packets are sent in order, so pts, duration
+ *  and pre_skip are the same as with a single encoder.
+ *
+ *  Costs at the segment boundaries:
+ *  - The frames around a boundary come from two independent encodes.
+ *    The MDCT overlap of the last frame of one segment and the first
+ *    frame of the next mixes slightly different quantization noise, and
+ *    the block types of the two frames can disagree. This is normally
+ *    inaudible.
+ *  - MP3 frames can borrow bytes from previous frames (bit reservoir).
+ *    The encoders must not use it, because the previous frames are from
+ *    another encoder. Without the reservoir, CBR files have the same
+ *    size but difficult passages get fewer bits. VBR and ABR files
+ *    become slightly larger (typically 1-3 %).
+ *  - preroll + postroll samples are encoded twice per segment,
+ *    which is negligible for segments of several seconds.
+ *
+ *  Memory usage is about (threads + 1) segments of uncompressed audio.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gmerlin_encoders.h>
+
+#include <gmerlin/log.h>
+#define LOG_DOMAIN "parallel"
+
+typedef struct
+  {
+  gavl_audio_frame_t * frame;
+  gavl_audio_format_t fmt;
+
+  /* Sample positions relative to the first sample */
+  int64_t start;
+  int64_t end;
+
+  /* Timestamps of the packets to keep */
+  int64_t keep_start;
+  int64_t keep_end;
+  int keep_all_start;
+  int keep_all_end;
+  
+  void * enc;
+  bgen_parallel_destroy_func destroy_enc;
+  gavl_audio_sink_t * asink;
+  gavl_packet_sink_t * psink;
+
+  gavl_packet_t * packets;
+  int num_packets;
+  int packets_alloc;
+
+  pthread_t thread;
+  int have_thread;
+  int got_error;
+  } job_t;
+
+struct bgen_parallel_s
+  {
+  gavl_audio_format_t fmt;
+  
+  int num_threads;
+  int delay;
+
+  int64_t segment_samples;
+  int64_t preroll;
+  int64_t postroll;
+
+  int64_t t0;
+
+  /* Segment which is currently filled */
+  job_t * cur;
+  int64_t cur_index;
+  
+  /* Running jobs, oldest first */
+  job_t ** running;
+  int num_running;
+
+  bgen_parallel_create_func create_enc;
+  bgen_parallel_destroy_func destroy_enc;
+  void * priv;
+
+  gavl_audio_sink_t * asink;
+  gavl_packet_sink_t * psink;
+
+  int num_segments;
+  int got_error;
+  };
+
+static gavl_sink_status_t put_packet_func(void * priv, gavl_packet_t * p)
+  {
+  job_t * job = priv;
+
+  if((!job->keep_all_start && (p->pts < job->keep_start)) ||
+     (!job->keep_all_end && (p->pts >= job->keep_end)))
+    return GAVL_SINK_OK;
+
+  if(job->num_packets == job->packets_alloc)
+    {
+    job->packets_alloc += 256;
+    job->packets = realloc(job->packets,
+                           job->packets_alloc * sizeof(*job->packets));
+    memset(job->packets + job->num_packets, 0,
+           (job->packets_alloc - job->num_packets) * sizeof(*job->packets));
+    }
+  gavl_packet_init(&job->packets[job->num_packets]);
+  gavl_packet_copy(&job->packets[job->num_packets], p);
+  job->num_packets++;
+  return GAVL_SINK_OK;
+  }
+
+/* Job for segment k */
+
+static job_t * job_create(bgen_parallel_t * p, int64_t k)
+  {
+  job_t * job = calloc(1, sizeof(*job));
+
+  job->start = k * p->segment_samples - p->preroll;
+  job->end = (k + 1) * p->segment_samples + p->postroll;
+
+  if(job->start < 0)
+    job->start = 0;
+
+  job->keep_start = p->t0 + k * p->segment_samples - p->delay;
+  job->keep_end = p->t0 + (k + 1) * p->segment_samples - p->delay;
+
+  if(!k)
+    job->keep_all_start = 1;
+  
+  gavl_audio_format_copy(&job->fmt, &p->fmt);
+  job->fmt.samples_per_frame = job->end - job->start;
+  job->frame = gavl_audio_frame_create(&job->fmt);
+  job->frame->valid_samples = 0;
+  job->frame->timestamp = p->t0 + job->start;
+  
+  job->psink = gavl_packet_sink_create(NULL, put_packet_func, job);
+
+  /* Encoders are created here (and not in the threads), because
+     some libraries initialize global tables */
+  job->destroy_enc = p->destroy_enc;
+  job->asink = p->create_enc(p->priv, &job->enc, job->psink);
+  if(!job->asink)
+    job->got_error = 1;
+  return job;
+  }
+
+static void job_destroy(job_t * job)
+  {
+  int i;
+  if(job->enc)
+    job->destroy_enc(job->enc);
+  for(i = 0; i < job->num_packets; i++)
+    gavl_packet_free(&job->packets[i]);
+  if(job->packets)
+    free(job->packets);
+  if(job->frame)
+    gavl_audio_frame_destroy(job->frame);
+  if(job->psink)
+    gavl_packet_sink_destroy(job->psink);
+  free(job);
+  }
+
+static void * job_thread(void * data)
+  {
+  job_t * job = data;
+
+  if(job->frame->valid_samples &&
+     (gavl_audio_sink_put_frame(job->asink, job->frame) != GAVL_SINK_OK))
+    job->got_error = 1;
+
+  /* Flushes the encoder */
+  job->destroy_enc(job->enc);
+  job->enc = NULL;
+  return NULL;
+  }
+
+/* Wait for the oldest job and send its packets */
+
+static void finish_job(bgen_parallel_t * p)
+  {
+  int i;
+  job_t * job = p->running[0];
+
+  if(job->have_thread)
+    pthread_join(job->thread, NULL);
+
+  p->num_running--;
+  if(p->num_running)
+    memmove(p->running, p->running + 1,
+            p->num_running * sizeof(*p->running));
+  
+  if(job->got_error)
+    p->got_error = 1;
+
+  for(i = 0; i < job->num_packets; i++)
+    {
+    if(p->got_error)
+      break;
+    if(gavl_packet_sink_put_packet(p->psink, &job->packets[i]) != GAVL_SINK_OK)
+      p->got_error = 1;
+    }
+  job_destroy(job);
+  }
+
+static void start_job(bgen_parallel_t * p, job_t * job)
+  {
+  if(job->got_error)
+    {
+    p->got_error = 1;
+    job_destroy(job);
+    return;
+    }
+  
+  if(p->num_running == p->num_threads)
+    finish_job(p);
+
+  /* Without a thread, the segment is encoded right here */
+  if(!pthread_create(&job->thread, NULL, job_thread, job))
+    job->have_thread = 1;
+  else
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Cannot create thread, encoding segment %d without it",
+           p->num_segments);
+    job_thread(job);
+    }
+  
+  p->running[p->num_running++] = job;
+  p->num_segments++;
+  }
+
+/* Current segment is full: Start the next one with the overlap */
+
+static void next_job(bgen_parallel_t * p)
+  {
+  job_t * old = p->cur;
+  int64_t src_pos;
+  
+  p->cur_index++;
+  p->cur = job_create(p, p->cur_index);
+
+  src_pos = p->cur->start - old->start;
+  
+  p->cur->frame->valid_samples =
+    gavl_audio_frame_copy(&p->fmt,
+                          p->cur->frame,                      /* dst */
+                          old->frame,                         /* src */
+                          0,                                  /* dst_pos */
+                          src_pos,                            /* src_pos */
+                          p->cur->fmt.samples_per_frame,      /* dst_size */
+                          old->frame->valid_samples - src_pos); /* src_size */
+  
+  start_job(p, old);
+  }
+
+static gavl_sink_status_t
+write_audio_func(void * data, gavl_audio_frame_t * frame)
+  {
+  int samples_done = 0;
+  int samples_copied;
+  job_t * job;
+  bgen_parallel_t * p = data;
+
+  if(p->t0 == GAVL_TIME_UNDEFINED)
+    {
+    p->t0 = frame->timestamp;
+    p->cur_index = 0;
+    p->cur = job_create(p, 0);
+    }
+  
+  while(samples_done < frame->valid_samples)
+    {
+    job = p->cur;
+    
+    samples_copied =
+      gavl_audio_frame_copy(&p->fmt,
+                            job->frame,                                       /* dst */
+                            frame,                                            /* src */
+                            job->frame->valid_samples,                        /* dst_pos */
+                            samples_done,                                     /* src_pos */
+                            job->fmt.samples_per_frame - job->frame->valid_samples, /* dst_size */
+                            frame->valid_samples - samples_done);             /* src_size */
+
+    samples_done += samples_copied;
+    job->frame->valid_samples += samples_copied;
+
+    if(job->frame->valid_samples == job->fmt.samples_per_frame)
+      next_job(p);
+
+    if(p->got_error || p->cur->got_error)
+      return GAVL_SINK_ERROR;
+    }
+  return GAVL_SINK_OK;
+  }
+
+bgen_parallel_t *
+bgen_parallel_create(const gavl_audio_format_t * fmt,
+                     int delay, int num_threads,
+                     gavl_time_t segment_duration,
+                     bgen_parallel_create_func create_enc,
+                     bgen_parallel_destroy_func destroy_enc,
+                     void * priv)
+  {
+  int frame_size;
+  bgen_parallel_t * ret = calloc(1, sizeof(*ret));
+
+  gavl_audio_format_copy(&ret->fmt, fmt);
+
+  ret->delay = delay;
+  ret->num_threads = num_threads;
+  ret->create_enc = create_enc;
+  ret->destroy_enc = destroy_enc;
+  ret->priv = priv;
+  ret->t0 = GAVL_TIME_UNDEFINED;
+  
+  frame_size = fmt->samples_per_frame;
+  
+  /* Preroll: Encoder delay plus one frame, rounded to full frames */
+  ret->preroll = ((delay + frame_size - 1) / frame_size + 1) * frame_size;
+  ret->postroll = ret->preroll;
+  
+  ret->segment_samples = gavl_time_to_samples(fmt->samplerate,
+                                              segment_duration);
+  
+  if(ret->segment_samples < 4 * (ret->preroll + ret->postroll))
+    ret->segment_samples = 4 * (ret->preroll + ret->postroll);
+  
+  ret->segment_samples =
+    ((ret->segment_samples + frame_size - 1) / frame_size) * frame_size;
+
+  ret->running = calloc(num_threads, sizeof(*ret->running));
+  
+  ret->asink = gavl_audio_sink_create(NULL, write_audio_func, ret, &ret->fmt);
+  return ret;
+  }
+
+gavl_audio_sink_t * bgen_parallel_get_sink(bgen_parallel_t * p)
+  {
+  return p->asink;
+  }
+
+void bgen_parallel_set_packet_sink(bgen_parallel_t * p,
+                                   gavl_packet_sink_t * psink)
+  {
+  p->psink = psink;
+  }
+
+int bgen_parallel_flush(bgen_parallel_t * p)
+  {
+  /* Last segment gets everything up to the end */
+  if(p->cur)
+    {
+    p->cur->keep_all_end = 1;
+    start_job(p, p->cur);
+    p->cur = NULL;
+    }
+
+  while(p->num_running)
+    finish_job(p);
+
+  if(p->num_segments)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Encoded %d segments of %.1f seconds with %d threads",
+           p->num_segments,
+           (double)p->segment_samples / (double)p->fmt.samplerate,
+           p->num_threads);
+  p->num_segments = 0;
+  
+  return !p->got_error;
+  }
+
+void bgen_parallel_destroy(bgen_parallel_t * p)
+  {
+  /* Not flushed: Discard the packets */
+  while(p->num_running)
+    {
+    if(p->running[0]->have_thread)
+      pthread_join(p->running[0]->thread, NULL);
+    job_destroy(p->running[0]);
+    p->num_running--;
+    memmove(p->running, p->running + 1,
+            p->num_running * sizeof(*p->running));
+    }
+  
+  if(p->cur)
+    job_destroy(p->cur);
+
+  if(p->running)
+    free(p->running);
+  if(p->asink)
+    gavl_audio_sink_destroy(p->asink);
+  free(p);
+  }
@@ -0,0 +1,660 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+
+/*
+ *  Checks all kernel versions supported by the CPU against the loops
+ *  they replaced: Random lengths (including the tails after the
+ *  vectorized parts), unaligned buffers and all shift values. Guard
+ *  bytes after the destination must stay untouched.
+ *
+ *  The alpha remap is checked against the table of the former
+ *  yuv4mpeg code, A-law and mu-law against the tables of the C
+ *  versions for all 65536 samples.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "kernels.c"
+
+#define MAX_NUM   1000
+#define NUM_RUNS  200
+#define GUARD     64
+#define GUARD_VAL 0xa5
+
+/* yj_8_to_y_8 from the former y4m_common.c */
+
+static const uint8_t yj_8_to_y_8[256] = 
+{
+  0x10, 0x11, 0x12, 0x13, 0x13, 0x14, 0x15, 0x16, 
+  0x17, 0x18, 0x19, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 
+  0x1e, 0x1f, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 
+  0x25, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 
+  0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x31, 
+  0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x38, 
+  0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3e, 0x3f, 
+  0x40, 0x41, 0x42, 0x43, 0x44, 0x44, 0x45, 0x46, 
+  0x47, 0x48, 0x49, 0x4a, 0x4a, 0x4b, 0x4c, 0x4d, 
+  0x4e, 0x4f, 0x50, 0x50, 0x51, 0x52, 0x53, 0x54, 
+  0x55, 0x56, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 
+  0x5c, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 
+  0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x68, 
+  0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6e, 0x6f, 
+  0x70, 0x71, 0x72, 0x73, 0x74, 0x74, 0x75, 0x76, 
+  0x77, 0x78, 0x79, 0x7a, 0x7a, 0x7b, 0x7c, 0x7d, 
+  0x7e, 0x7f, 0x80, 0x81, 0x81, 0x82, 0x83, 0x84, 
+  0x85, 0x86, 0x87, 0x87, 0x88, 0x89, 0x8a, 0x8b, 
+  0x8c, 0x8d, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 
+  0x93, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 
+  0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0x9f, 
+  0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa5, 0xa6, 
+  0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xab, 0xac, 0xad, 
+  0xae, 0xaf, 0xb0, 0xb1, 0xb1, 0xb2, 0xb3, 0xb4, 
+  0xb5, 0xb6, 0xb7, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 
+  0xbc, 0xbd, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 
+  0xc3, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 
+  0xca, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 
+  0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd6, 
+  0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdc, 0xdd, 
+  0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe2, 0xe3, 0xe4, 
+  0xe5, 0xe6, 0xe7, 0xe8, 0xe8, 0xe9, 0xea, 0xeb, 
+};
+
+typedef struct
+  {
+  const char * name;
+  kernels_t k;
+  } variant_t;
+
+static variant_t variants[4];
+static int num_variants;
+
+static void get_variants(void)
+  {
+  /* Builds the companding tables of the C versions */
+  get_kernels();
+
+  variants[0].name = "C";
+  variants[0].k.scale_float = scale_float_c;
+  variants[0].k.widen_s8    = widen_s8_c;
+  variants[0].k.widen_s16   = widen_s16_c;
+  variants[0].k.shift_s32   = shift_s32_c;
+  variants[0].k.swap_rb_32  = swap_rb_32_c;
+  variants[0].k.split_yuva  = split_yuva_c;
+  variants[0].k.swap_16     = swap_16_c;
+  variants[0].k.flip_sign_8 = flip_sign_8_c;
+  variants[0].k.s16_to_alaw = s16_to_alaw_c;
+  variants[0].k.s16_to_ulaw = s16_to_ulaw_c;
+  num_variants = 1;
+  
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("sse2"))
+    {
+    variants[num_variants].name = "SSE2";
+    variants[num_variants].k.scale_float = scale_float_sse2;
+    variants[num_variants].k.widen_s8    = widen_s8_sse2;
+    variants[num_variants].k.widen_s16   = widen_s16_sse2;
+    variants[num_variants].k.shift_s32   = shift_s32_sse2;
+    variants[num_variants].k.swap_rb_32  = swap_rb_32_sse2;
+    variants[num_variants].k.split_yuva  = split_yuva_sse2;
+    variants[num_variants].k.swap_16     = swap_16_sse2;
+    variants[num_variants].k.flip_sign_8 = flip_sign_8_sse2;
+    variants[num_variants].k.s16_to_alaw = s16_to_alaw_sse2;
+    variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_sse2;
+    num_variants++;
+    }
+  else
+    printf("SSE2 not supported by the CPU\n");
+  
+  if(__builtin_cpu_supports("avx2"))
+    {
+    variants[num_variants].name = "AVX2";
+    variants[num_variants].k.scale_float = scale_float_avx2;
+    variants[num_variants].k.widen_s8    = widen_s8_avx2;
+    variants[num_variants].k.widen_s16   = widen_s16_avx2;
+    variants[num_variants].k.shift_s32   = shift_s32_avx2;
+    variants[num_variants].k.swap_rb_32  = swap_rb_32_avx2;
+    variants[num_variants].k.split_yuva  = split_yuva_avx2;
+    variants[num_variants].k.swap_16     = swap_16_avx2;
+    variants[num_variants].k.flip_sign_8 = flip_sign_8_avx2;
+    variants[num_variants].k.s16_to_alaw = s16_to_alaw_avx2;
+    variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_avx2;
+    num_variants++;
+    }
+  else
+    printf("AVX2 not supported by the CPU\n");
+#endif
+
+#ifdef HAVE_NEON
+  variants[num_variants].name = "NEON";
+  variants[num_variants].k.scale_float = scale_float_neon;
+  variants[num_variants].k.widen_s8    = widen_s8_neon;
+  variants[num_variants].k.widen_s16   = widen_s16_neon;
+  variants[num_variants].k.shift_s32   = shift_s32_neon;
+  variants[num_variants].k.swap_rb_32  = swap_rb_32_neon;
+  variants[num_variants].k.split_yuva  = split_yuva_neon;
+  variants[num_variants].k.swap_16     = swap_16_neon;
+  variants[num_variants].k.flip_sign_8 = flip_sign_8_neon;
+  variants[num_variants].k.s16_to_alaw = s16_to_alaw_neon;
+  variants[num_variants].k.s16_to_ulaw = s16_to_ulaw_neon;
+  num_variants++;
+#endif
+  }
+
+/* Reproducible on all platforms */
+
+static uint32_t rand_state = 1;
+
+static uint32_t get_rand(void)
+  {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+  }
+
+static void fill_random(uint8_t * data, int len)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    data[i] = get_rand();
+  }
+
+/* Extreme values are more likely than with plain random numbers */
+
+static void fill_random_s32(int32_t * data, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    {
+    switch(get_rand() % 8)
+      {
+      case 0:
+        data[i] = INT32_MIN;
+        break;
+      case 1:
+        data[i] = INT32_MAX;
+        break;
+      case 2:
+        data[i] = -(int32_t)(get_rand() % 256);
+        break;
+      default:
+        data[i] = (int32_t)((get_rand() << 16) ^ get_rand());
+        break;
+      }
+    }
+  }
+
+/* Lengths and offsets of one run */
+
+static int get_num(int run)
+  {
+  /* All short lengths, then random ones */
+  if(run < 70)
+    return run;
+  return get_rand() % (MAX_NUM + 1);
+  }
+
+static int check_guard(const uint8_t * guard, const char * name,
+                       const char * func, int num)
+  {
+  int i;
+  for(i = 0; i < GUARD; i++)
+    {
+    if(guard[i] != GUARD_VAL)
+      {
+      fprintf(stderr, "%s %s: Wrote past the end for %d elements\n",
+              name, func, num);
+      return 0;
+      }
+    }
+  return 1;
+  }
+
+static int report(const char * name, const char * func, int num, int shift)
+  {
+  if(shift >= 0)
+    fprintf(stderr, "%s %s differs for %d elements, shift %d\n",
+            name, func, num, shift);
+  else
+    fprintf(stderr, "%s %s differs for %d elements\n", name, func, num);
+  return 0;
+  }
+
+static int test_scale_float(const variant_t * v, uint8_t * buf1,
+                            uint8_t * buf2)
+  {
+  int run, i, num, off;
+  float * samples;
+  float * ref;
+  float factor = 32767.0;
+  
+  for(run = 0; run < NUM_RUNS; run++)
+    {
+    num = get_num(run);
+    off = get_rand() % 4;
+    
+    samples = (float*)buf1 + off;
+    ref = (float*)buf2;
+    
+    for(i = 0; i < num; i++)
+      samples[i] = (float)((int32_t)get_rand() - (1 << 23)) / (1 << 23);
+    memset(samples + num, GUARD_VAL, GUARD);
+    
+    for(i = 0; i < num; i++)
+      ref[i] = samples[i] * factor;
+
+    v->k.scale_float(samples, num, factor);
+
+    if(memcmp(samples, ref, num * sizeof(*ref)))
+      return report(v->name, "scale_float", num, -1);
+    if(!check_guard((uint8_t*)(samples + num), v->name, "scale_float", num))
+      return 0;
+    }
+  return 1;
+  }
+
+static int test_widen_s8(const variant_t * v, uint8_t * buf1,
+                         uint8_t * buf2)
+  {
+  int run, i, num, shift;
+  int8_t * src;
+  int32_t * dst;
+  int32_t ref[MAX_NUM];
+  
+  for(shift = 0; shift < 8; shift++)
+    {
+    for(run = 0; run < NUM_RUNS; run++)
+      {
+      num = get_num(run);
+      src = (int8_t*)(buf1 + get_rand() % 16);
+      dst = (int32_t*)buf2 + get_rand() % 8;
+
+      fill_random((uint8_t*)src, num);
+      memset(dst, GUARD_VAL, (num * sizeof(*dst)) + GUARD);
+      
+      for(i = 0; i < num; i++)
+        ref[i] = src[i] / (1 << shift);
+
+      v->k.widen_s8(dst, src, num, shift);
+
+      if(memcmp(dst, ref, num * sizeof(*dst)))
+        return report(v->name, "widen_s8", num, shift);
+      if(!check_guard((uint8_t*)(dst + num), v->name, "widen_s8", num))
+        return 0;
+      }
+    }
+  return 1;
+  }
+
+static int test_widen_s16(const variant_t * v, uint8_t * buf1,
+                          uint8_t * buf2)
+  {
+  int run, i, num, shift;
+  int16_t * src;
+  int32_t * dst;
+  int32_t ref[MAX_NUM];
+  
+  for(shift = 0; shift < 16; shift++)
+    {
+    for(run = 0; run < NUM_RUNS; run++)
+      {
+      num = get_num(run);
+      src = (int16_t*)buf1 + get_rand() % 8;
+      dst = (int32_t*)buf2 + get_rand() % 8;
+
+      fill_random((uint8_t*)src, num * sizeof(*src));
+      memset(dst, GUARD_VAL, (num * sizeof(*dst)) + GUARD);
+      
+      for(i = 0; i < num; i++)
+        ref[i] = src[i] / (1 << shift);
+
+      v->k.widen_s16(dst, src, num, shift);
+
+      if(memcmp(dst, ref, num * sizeof(*dst)))
+        return report(v->name, "widen_s16", num, shift);
+      if(!check_guard((uint8_t*)(dst + num), v->name, "widen_s16", num))
+        return 0;
+      }
+    }
+  return 1;
+  }
+
+/* Shifts up to 31 would overflow the divisor of the former code */
+
+static int test_shift_s32(const variant_t * v, uint8_t * buf1,
+                          uint8_t * buf2)
+  {
+  int run, i, num, shift, in_place;
+  int32_t * src;
+  int32_t * dst;
+  int32_t ref[MAX_NUM];
+  
+  for(shift = 0; shift < 31; shift++)
+    {
+    for(run = 0; run < NUM_RUNS; run++)
+      {
+      num = get_num(run);
+      in_place = run & 1;
+      src = (int32_t*)buf1 + get_rand() % 8;
+
+      fill_random_s32(src, num);
+      
+      for(i = 0; i < num; i++)
+        ref[i] = src[i] / (1 << shift);
+
+      if(in_place)
+        dst = src;
+      else
+        dst = (int32_t*)buf2 + get_rand() % 8;
+      
+      memset(dst + num, GUARD_VAL, GUARD);
+      
+      v->k.shift_s32(dst, src, num, shift);
+
+      if(memcmp(dst, ref, num * sizeof(*dst)))
+        return report(v->name, in_place ? "shift_s32 (in place)" :
+                      "shift_s32", num, shift);
+      if(!check_guard((uint8_t*)(dst + num), v->name, "shift_s32", num))
+        return 0;
+      }
+    }
+  return 1;
+  }
+
+static int test_swap_rb_32(const variant_t * v, uint8_t * buf1,
+                           uint8_t * buf2)
+  {
+  int run, i, num;
+  uint8_t * pixels;
+  uint8_t * ref;
+  
+  for(run = 0; run < NUM_RUNS; run++)
+    {
+    num = get_num(run);
+    pixels = buf1 + get_rand() % 16;
+    ref = buf2;
+
+    fill_random(pixels, num * 4);
+    memset(pixels + num * 4, GUARD_VAL, GUARD);
+
+    for(i = 0; i < num; i++)
+      {
+      ref[4*i]   = pixels[4*i+2];
+      ref[4*i+1] = pixels[4*i+1];
+      ref[4*i+2] = pixels[4*i];
+      ref[4*i+3] = pixels[4*i+3];
+      }
+    
+    v->k.swap_rb_32(pixels, num);
+
+    if(memcmp(pixels, ref, num * 4))
+      return report(v->name, "swap_rb_32", num, -1);
+    if(!check_guard(pixels + num * 4, v->name, "swap_rb_32", num))
+      return 0;
+    }
+  return 1;
+  }
+
+static int test_split_yuva(const variant_t * v, uint8_t * buf1,
+                           uint8_t * buf2)
+  {
+  int run, i, j, num;
+  uint8_t * src;
+  uint8_t * planes[4];
+  
+  for(run = 0; run < NUM_RUNS + 1; run++)
+    {
+    src = buf1 + get_rand() % 16;
+    
+    /* The first run has all alpha values */
+    if(!run)
+      {
+      num = 256;
+      fill_random(src, num * 4);
+      for(i = 0; i < num; i++)
+        src[4*i+3] = i;
+      }
+    else
+      {
+      num = get_num(run - 1);
+      fill_random(src, num * 4);
+      }
+
+    for(i = 0; i < 4; i++)
+      {
+      planes[i] = buf2 + i * (MAX_NUM + 2 * GUARD) + get_rand() % 16;
+      memset(planes[i], GUARD_VAL, num + GUARD);
+      }
+    
+    v->k.split_yuva(planes[0], planes[1], planes[2], planes[3], src, num);
+
+    for(i = 0; i < num; i++)
+      {
+      for(j = 0; j < 3; j++)
+        {
+        if(planes[j][i] != src[4*i+j])
+          return report(v->name, "split_yuva", num, -1);
+        }
+      if(planes[3][i] != yj_8_to_y_8[src[4*i+3]])
+        return report(v->name, "split_yuva (alpha)", num, -1);
+      }
+    for(i = 0; i < 4; i++)
+      {
+      if(!check_guard(planes[i] + num, v->name, "split_yuva", num))
+        return 0;
+      }
+    }
+  return 1;
+  }
+
+static int test_swap_16(const variant_t * v, uint8_t * buf1,
+                        uint8_t * buf2)
+  {
+  int run, i, num;
+  uint8_t * src;
+  uint8_t * dst;
+
+  for(run = 0; run < NUM_RUNS; run++)
+    {
+    num = get_num(run);
+    src = buf1 + 2 * (get_rand() % 8);
+    dst = buf2 + 2 * (get_rand() % 8);
+
+    fill_random(src, num * 2);
+    memset(dst, GUARD_VAL, num * 2 + GUARD);
+
+    v->k.swap_16((uint16_t*)dst, (const uint16_t*)src, num);
+
+    for(i = 0; i < num; i++)
+      {
+      if((dst[2*i] != src[2*i+1]) || (dst[2*i+1] != src[2*i]))
+        return report(v->name, "swap_16", num, -1);
+      }
+    if(!check_guard(dst + num * 2, v->name, "swap_16", num))
+      return 0;
+    }
+  return 1;
+  }
+
+static int test_flip_sign_8(const variant_t * v, uint8_t * buf1,
+                            uint8_t * buf2)
+  {
+  int run, i, num;
+  uint8_t * src;
+  uint8_t * dst;
+
+  for(run = 0; run < NUM_RUNS; run++)
+    {
+    num = get_num(run);
+    src = buf1 + get_rand() % 16;
+    dst = buf2 + get_rand() % 16;
+
+    fill_random(src, num);
+    memset(dst, GUARD_VAL, num + GUARD);
+
+    v->k.flip_sign_8(dst, src, num);
+
+    for(i = 0; i < num; i++)
+      {
+      if(dst[i] != (uint8_t)(src[i] - 128))
+        return report(v->name, "flip_sign_8", num, -1);
+      }
+    if(!check_guard(dst + num, v->name, "flip_sign_8", num))
+      return 0;
+    }
+  return 1;
+  }
+
+/* The companding tables of the C versions are the reference */
+
+static int check_xlaw(const variant_t * v, const char * func,
+                      void (*s16_to_xlaw)(uint8_t * dst, const int16_t * src,
+                                          int num),
+                      const uint8_t * table, const int16_t * src,
+                      uint8_t * dst, int num)
+  {
+  int i;
+  
+  memset(dst, GUARD_VAL, num + GUARD);
+  
+  s16_to_xlaw(dst, src, num);
+
+  for(i = 0; i < num; i++)
+    {
+    if(dst[i] != table[(src[i] + 32768) >> 2])
+      {
+      fprintf(stderr, "%s %s differs for sample %d\n", v->name, func,
+              src[i]);
+      return 0;
+      }
+    }
+  return check_guard(dst + num, v->name, func, num);
+  }
+
+static int test_xlaw(const variant_t * v, const char * func,
+                     void (*s16_to_xlaw)(uint8_t * dst, const int16_t * src,
+                                         int num),
+                     const uint8_t * table, uint8_t * buf1, uint8_t * buf2)
+  {
+  int run, i, num, first;
+  int16_t * src;
+  uint8_t * dst;
+
+  /* All samples in blocks of MAX_NUM */
+  for(first = INT16_MIN; first <= INT16_MAX; first += num)
+    {
+    num = INT16_MAX + 1 - first;
+    if(num > MAX_NUM)
+      num = MAX_NUM;
+    
+    src = (int16_t*)buf1 + get_rand() % 8;
+    dst = buf2 + get_rand() % 16;
+    
+    for(i = 0; i < num; i++)
+      src[i] = first + i;
+    
+    if(!check_xlaw(v, func, s16_to_xlaw, table, src, dst, num))
+      return 0;
+    }
+
+  for(run = 0; run < NUM_RUNS; run++)
+    {
+    num = get_num(run);
+    src = (int16_t*)buf1 + get_rand() % 8;
+    dst = buf2 + get_rand() % 16;
+    
+    fill_random((uint8_t*)src, num * 2);
+
+    if(!check_xlaw(v, func, s16_to_xlaw, table, src, dst, num))
+      return 0;
+    }
+  return 1;
+  }
+
+/* The exported functions, which also handle shift == 0 themselves */
+
+static int test_dispatch(uint8_t * buf1, uint8_t * buf2)
+  {
+  int i;
+  int32_t * src = (int32_t*)buf1;
+  int32_t * dst = (int32_t*)buf2;
+  
+  fill_random_s32(src, MAX_NUM);
+  
+  bgen_shift_s32(dst, src, MAX_NUM, 0);
+  if(memcmp(dst, src, MAX_NUM * sizeof(*dst)))
+    return report("Exported", "bgen_shift_s32", MAX_NUM, 0);
+
+  bgen_shift_s32(src, src, MAX_NUM, 0);
+  if(memcmp(dst, src, MAX_NUM * sizeof(*dst)))
+    return report("Exported", "bgen_shift_s32 (in place)", MAX_NUM, 0);
+  
+  bgen_shift_s32(dst, src, MAX_NUM, 8);
+  for(i = 0; i < MAX_NUM; i++)
+    {
+    if(dst[i] != src[i] / 256)
+      return report("Exported", "bgen_shift_s32", MAX_NUM, 8);
+    }
+  return 1;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int ret = 0;
+  uint8_t * buf1;
+  uint8_t * buf2;
+
+  /* Large enough for the 4 planes of split_yuva() */
+  buf1 = malloc(4 * (MAX_NUM + 2 * GUARD) * sizeof(int32_t));
+  buf2 = malloc(4 * (MAX_NUM + 2 * GUARD) * sizeof(int32_t));
+  
+  get_variants();
+
+  for(i = 0; i < num_variants; i++)
+    {
+    if(!test_scale_float(&variants[i], buf1, buf2) ||
+       !test_widen_s8(&variants[i], buf1, buf2) ||
+       !test_widen_s16(&variants[i], buf1, buf2) ||
+       !test_shift_s32(&variants[i], buf1, buf2) ||
+       !test_swap_rb_32(&variants[i], buf1, buf2) ||
+       !test_split_yuva(&variants[i], buf1, buf2) ||
+       !test_swap_16(&variants[i], buf1, buf2) ||
+       !test_flip_sign_8(&variants[i], buf1, buf2) ||
+       !test_xlaw(&variants[i], "s16_to_alaw", variants[i].k.s16_to_alaw,
+                  linear_to_alaw, buf1, buf2) ||
+       !test_xlaw(&variants[i], "s16_to_ulaw", variants[i].k.s16_to_ulaw,
+                  linear_to_ulaw, buf1, buf2))
+      ret = 1;
+    else
+      printf("%s kernels identical\n", variants[i].name);
+    }
+
+  if(!test_dispatch(buf1, buf2))
+    ret = 1;
+  
+  free(buf1);
+  free(buf2);
+  return ret;
+  }
@@ -0,0 +1,478 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+
+/*
+ *  Checks segment parallel encoding against a single encoder. The
+ *  encoder is a model of faac and lame: It has a delay, produces
+ *  packets on a fixed frame grid and cuts the duration of the last
+ *  packet at the end of the input. The packet data is a hash over the
+ *  current and the previous frame (the MDCT overlap), so a too short
+ *  preroll or wrongly selected packets change the output.
+ *
+ *  The packets from bgen_parallel must have the same pts, duration and
+ *  data as the ones from a single encoder. This is checked with
+ *  different thread counts and also if no threads can be created.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <pthread.h>
+
+/* Lets the thread creation fail on demand */
+
+static int fail_threads = 0;
+
+static int test_pthread_create(pthread_t * thread,
+                               const pthread_attr_t * attr,
+                               void *(*func)(void *), void * arg);
+
+#define pthread_create test_pthread_create
+#include "parallel.c"
+#undef pthread_create
+
+static int test_pthread_create(pthread_t * thread,
+                               const pthread_attr_t * attr,
+                               void *(*func)(void *), void * arg)
+  {
+  if(fail_threads)
+    return -1;
+  return pthread_create(thread, attr, func, arg);
+  }
+
+#define SAMPLERATE   48000
+#define NUM_CHANNELS 2
+#define HASH_LEN     8
+
+typedef struct
+  {
+  int frame_size;
+  int delay;
+  } config_t;
+
+static const config_t configs[] =
+  {
+    { 1024, 1024 }, /* faac */
+    { 1152, 1105 }, /* lame */
+  };
+
+#define NUM_CONFIGS (int)(sizeof(configs)/sizeof(configs[0]))
+
+/* Reproducible on all platforms */
+
+static uint32_t rand_state = 1;
+
+static uint32_t get_rand(void)
+  {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+  }
+
+/* Encoder model */
+
+typedef struct
+  {
+  gavl_audio_format_t fmt;
+  gavl_audio_frame_t * frame;
+  int16_t * last_frame;
+  
+  int64_t in_pts;
+  int64_t out_pts;
+  int delay;
+
+  gavl_audio_sink_t * asink;
+  gavl_packet_sink_t * psink;
+  gavl_packet_t p;
+  } enc_t;
+
+static uint64_t hash_samples(uint64_t h, const int16_t * s, int num)
+  {
+  int i;
+  for(i = 0; i < num; i++)
+    {
+    h ^= (uint16_t)s[i];
+    h *= 1099511628211ULL;
+    }
+  return h;
+  }
+
+static int encode_frame(enc_t * e)
+  {
+  int i;
+  uint64_t h;
+  int num = e->fmt.samples_per_frame * NUM_CHANNELS;
+  
+  /* Zero padding of the last frame */
+  memset(e->frame->samples.s_16 + e->frame->valid_samples * NUM_CHANNELS, 0,
+         (e->fmt.samples_per_frame - e->frame->valid_samples) *
+         NUM_CHANNELS * sizeof(int16_t));
+  
+  h = hash_samples(14695981039346656037ULL, e->last_frame, num);
+  h = hash_samples(h, e->frame->samples.s_16, num);
+  memcpy(e->last_frame, e->frame->samples.s_16, num * sizeof(int16_t));
+  
+  gavl_packet_reset(&e->p);
+  gavl_packet_alloc(&e->p, HASH_LEN);
+  for(i = 0; i < HASH_LEN; i++)
+    e->p.data[i] = h >> (8 * i);
+  e->p.data_len = HASH_LEN;
+  
+  e->p.pts = e->out_pts;
+  e->p.duration = e->fmt.samples_per_frame;
+  if(e->p.pts + e->p.duration > e->in_pts)
+    e->p.duration = e->in_pts - e->p.pts;
+  e->out_pts += e->p.duration;
+
+  e->frame->valid_samples = 0;
+  return gavl_packet_sink_put_packet(e->psink, &e->p) == GAVL_SINK_OK;
+  }
+
+static gavl_sink_status_t enc_put_func(void * priv, gavl_audio_frame_t * f)
+  {
+  int done = 0;
+  int copied;
+  int zeros;
+  enc_t * e = priv;
+
+  /* The delay are zero samples before the input */
+  if(e->in_pts == GAVL_TIME_UNDEFINED)
+    {
+    e->in_pts = f->timestamp;
+    e->out_pts = f->timestamp - e->delay;
+
+    zeros = e->delay;
+    while(zeros)
+      {
+      copied = e->fmt.samples_per_frame - e->frame->valid_samples;
+      if(copied > zeros)
+        copied = zeros;
+      memset(e->frame->samples.s_16 + e->frame->valid_samples * NUM_CHANNELS,
+             0, copied * NUM_CHANNELS * sizeof(int16_t));
+      e->frame->valid_samples += copied;
+      zeros -= copied;
+      
+      if((e->frame->valid_samples == e->fmt.samples_per_frame) &&
+         !encode_frame(e))
+        return GAVL_SINK_ERROR;
+      }
+    }
+  
+  while(done < f->valid_samples)
+    {
+    copied = gavl_audio_frame_copy(&e->fmt, e->frame, f,
+                                   e->frame->valid_samples, done,
+                                   e->fmt.samples_per_frame -
+                                   e->frame->valid_samples,
+                                   f->valid_samples - done);
+    done += copied;
+    e->frame->valid_samples += copied;
+    e->in_pts += copied;
+
+    if((e->frame->valid_samples == e->fmt.samples_per_frame) &&
+       !encode_frame(e))
+      return GAVL_SINK_ERROR;
+    }
+  return GAVL_SINK_OK;
+  }
+
+static gavl_audio_sink_t *
+enc_create(void * priv, void ** ret, gavl_packet_sink_t * psink)
+  {
+  const config_t * cfg = priv;
+  enc_t * e = calloc(1, sizeof(*e));
+
+  e->fmt.samplerate = SAMPLERATE;
+  e->fmt.num_channels = NUM_CHANNELS;
+  e->fmt.sample_format = GAVL_SAMPLE_S16;
+  e->fmt.interleave_mode = GAVL_INTERLEAVE_ALL;
+  e->fmt.samples_per_frame = cfg->frame_size;
+  e->delay = cfg->delay;
+  
+  e->frame = gavl_audio_frame_create(&e->fmt);
+  e->last_frame = calloc(cfg->frame_size * NUM_CHANNELS, sizeof(int16_t));
+
+  e->frame->valid_samples = 0;
+  
+  e->in_pts = GAVL_TIME_UNDEFINED;
+  e->psink = psink;
+  gavl_packet_init(&e->p);
+  e->asink = gavl_audio_sink_create(NULL, enc_put_func, e, &e->fmt);
+  *ret = e;
+  return e->asink;
+  }
+
+/* Flushes like the real encoders */
+
+static void enc_destroy(void * priv)
+  {
+  enc_t * e = priv;
+
+  if(e->in_pts != GAVL_TIME_UNDEFINED)
+    {
+    while(e->out_pts < e->in_pts)
+      {
+      if(!encode_frame(e))
+        break;
+      }
+    }
+  gavl_audio_sink_destroy(e->asink);
+  gavl_audio_frame_destroy(e->frame);
+  gavl_packet_free(&e->p);
+  free(e->last_frame);
+  free(e);
+  }
+
+/* Encoded stream */
+
+typedef struct
+  {
+  gavl_packet_t * packets;
+  int num_packets;
+  int packets_alloc;
+  } stream_t;
+
+static gavl_sink_status_t stream_put_func(void * priv, gavl_packet_t * p)
+  {
+  stream_t * s = priv;
+  
+  if(s->num_packets == s->packets_alloc)
+    {
+    s->packets_alloc += 1024;
+    s->packets = realloc(s->packets, s->packets_alloc * sizeof(*s->packets));
+    }
+  gavl_packet_init(&s->packets[s->num_packets]);
+  gavl_packet_copy(&s->packets[s->num_packets], p);
+  s->num_packets++;
+  return GAVL_SINK_OK;
+  }
+
+static void stream_free(stream_t * s)
+  {
+  int i;
+  for(i = 0; i < s->num_packets; i++)
+    gavl_packet_free(&s->packets[i]);
+  if(s->packets)
+    free(s->packets);
+  memset(s, 0, sizeof(*s));
+  }
+
+/* Encode the input in frames of random sizes */
+
+static int encode(const config_t * cfg, const int16_t * input,
+                  int num_samples, int64_t t0, int threads,
+                  stream_t * s)
+  {
+  int num, pos = 0;
+  int ret = 1;
+  gavl_audio_format_t fmt;
+  gavl_audio_frame_t * f;
+  gavl_audio_sink_t * asink;
+  gavl_packet_sink_t * psink;
+  bgen_parallel_t * p = NULL;
+  void * enc = NULL;
+  uint32_t state = rand_state;
+  
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.samplerate = SAMPLERATE;
+  fmt.num_channels = NUM_CHANNELS;
+  fmt.sample_format = GAVL_SAMPLE_S16;
+  fmt.interleave_mode = GAVL_INTERLEAVE_ALL;
+  fmt.samples_per_frame = cfg->frame_size;
+
+  psink = gavl_packet_sink_create(NULL, stream_put_func, s);
+  
+  if(threads)
+    {
+    p = bgen_parallel_create(&fmt, cfg->delay, threads,
+                             gavl_seconds_to_time(1.0),
+                             enc_create, enc_destroy, (void*)cfg);
+    bgen_parallel_set_packet_sink(p, psink);
+    asink = bgen_parallel_get_sink(p);
+    }
+  else
+    asink = enc_create((void*)cfg, &enc, psink);
+
+  f = gavl_audio_frame_create(NULL);
+
+  /* Same input frames for all runs */
+  rand_state = state;
+  
+  while(pos < num_samples)
+    {
+    num = 1 + get_rand() % 5000;
+    if(num > num_samples - pos)
+      num = num_samples - pos;
+
+    f->samples.s_16 = (int16_t*)input + pos * NUM_CHANNELS;
+    f->valid_samples = num;
+    f->timestamp = t0 + pos;
+
+    if(gavl_audio_sink_put_frame(asink, f) != GAVL_SINK_OK)
+      {
+      fprintf(stderr, "Encoding failed\n");
+      ret = 0;
+      break;
+      }
+    pos += num;
+    }
+
+  if(p)
+    {
+    if(!bgen_parallel_flush(p))
+      {
+      fprintf(stderr, "Flushing failed\n");
+      ret = 0;
+      }
+    bgen_parallel_destroy(p);
+    }
+  else
+    enc_destroy(enc);
+
+  gavl_audio_frame_null(f);
+  gavl_audio_frame_destroy(f);
+  gavl_packet_sink_destroy(psink);
+  return ret;
+  }
+
+static int compare_streams(const stream_t * s1, const stream_t * s2)
+  {
+  int i;
+  
+  if(s1->num_packets != s2->num_packets)
+    {
+    fprintf(stderr, "Got %d packets instead of %d\n",
+            s2->num_packets, s1->num_packets);
+    return 0;
+    }
+  
+  for(i = 0; i < s1->num_packets; i++)
+    {
+    if((s1->packets[i].pts != s2->packets[i].pts) ||
+       (s1->packets[i].duration != s2->packets[i].duration))
+      {
+      fprintf(stderr,
+              "Packet %d: pts %"PRId64" duration %"PRId64
+              " instead of %"PRId64" %"PRId64"\n",
+              i, s2->packets[i].pts, s2->packets[i].duration,
+              s1->packets[i].pts, s1->packets[i].duration);
+      return 0;
+      }
+    if((s1->packets[i].data_len != s2->packets[i].data_len) ||
+       memcmp(s1->packets[i].data, s2->packets[i].data,
+              s1->packets[i].data_len))
+      {
+      fprintf(stderr, "Packet %d (pts %"PRId64"): Data differs\n",
+              i, s1->packets[i].pts);
+      return 0;
+      }
+    }
+  return 1;
+  }
+
+static int test_config(const config_t * cfg, int num_samples)
+  {
+  int i;
+  int ret = 1;
+  int16_t * input;
+  int64_t duration = 0;
+  stream_t single;
+  stream_t parallel;
+  int64_t t0 = get_rand() % 100000;
+  
+  static const int threads[] = { 1, 2, 4 };
+  
+  memset(&single, 0, sizeof(single));
+  memset(&parallel, 0, sizeof(parallel));
+
+  input = malloc(num_samples * NUM_CHANNELS * sizeof(*input));
+  for(i = 0; i < num_samples * NUM_CHANNELS; i++)
+    input[i] = get_rand();
+
+  encode(cfg, input, num_samples, t0, 0, &single);
+
+  for(i = 0; i < single.num_packets; i++)
+    duration += single.packets[i].duration;
+  
+  /* Sanity check of the model */
+  if(!single.num_packets ||
+     (single.packets[0].pts != t0 - cfg->delay) ||
+     (duration != num_samples + cfg->delay))
+    {
+    fprintf(stderr, "Single encoder: Wrong timestamps\n");
+    ret = 0;
+    goto fail;
+    }
+  
+  /* The last run can't create threads */
+  for(i = 0; i < 4; i++)
+    {
+    fail_threads = (i == 3);
+    
+    if(!encode(cfg, input, num_samples, t0,
+               fail_threads ? 2 : threads[i], &parallel) ||
+       !compare_streams(&single, &parallel))
+      {
+      if(fail_threads)
+        fprintf(stderr, "Frame size %d, delay %d, %d samples, "
+                "no threads: Failed\n",
+                cfg->frame_size, cfg->delay, num_samples);
+      else
+        fprintf(stderr, "Frame size %d, delay %d, %d samples, "
+                "%d threads: Failed\n",
+                cfg->frame_size, cfg->delay, num_samples, threads[i]);
+      ret = 0;
+      }
+    stream_free(&parallel);
+    }
+  
+  if(ret)
+    printf("Frame size %d, delay %d, %d samples: %d packets identical\n",
+           cfg->frame_size, cfg->delay, num_samples, single.num_packets);
+  
+  fail:
+  fail_threads = 0;
+  stream_free(&single);
+  free(input);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int ret = 0;
+  int segment;
+  
+  for(i = 0; i < NUM_CONFIGS; i++)
+    {
+    /* Segments of 1 s, rounded up to full frames */
+    segment = ((SAMPLERATE + configs[i].frame_size - 1) /
+               configs[i].frame_size) * configs[i].frame_size;
+    
+    /* Shorter than one segment, exactly at a segment boundary and
+       in between */
+    if(!test_config(&configs[i], 30000) ||
+       !test_config(&configs[i], 5 * segment) ||
+       !test_config(&configs[i], 400000 + get_rand() % 100000))
+      ret = 1;
+    }
+  return ret;
+  }
@@ -0,0 +1,1093 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Streams to a stand-in for an Icecast server on the loopback
+ *  interface. The server accepts source connections (PUT or SOURCE)
+ *  and metadata updates, records the received data with their arrival
+ *  times and can stop reading or drop the connection on demand.
+ *
+ *  Checked are the pacing of timestamped data, the burst after
+ *  connecting, waiting and dropping with a full buffer, reconnecting
+ *  with the Ogg headers sent again, the metadata sent again after
+ *  reconnecting and archive files, which must never lose data.
+ *
+ *  MP3 streams consist of chunks without 0xff bytes, so libshout finds
+ *  no frame headers and passes them unchanged. Ogg streams are Opus
+ *  pages, which libshout can parse.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bgshout.c"
+
+#define MAX_CONNECTIONS 16
+#define MAX_REQUESTS    8
+
+/* Timeout for everything, which should happen */
+#define TIMEOUT (10*GAVL_TIME_SCALE)
+
+/* Allowed delay of the sender */
+#define TOLERANCE (GAVL_TIME_SCALE/2)
+
+#define MS (GAVL_TIME_SCALE/1000)
+
+/* Stand-in server */
+
+typedef struct
+  {
+  uint8_t * data;
+  int len;
+  int alloc;
+
+  /* Arrival times of the data */
+  int * read_ends;
+  gavl_time_t * read_times;
+  int num_reads;
+  int reads_alloc;
+  } connection_t;
+
+typedef struct
+  {
+  int fd;
+  int port;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  int quit;
+
+  /* Set by the tests */
+  gavl_time_t pause_until; /* Don't read stream data before */
+  int close_after;         /* Drop the stream after that many bytes */
+
+  connection_t conns[MAX_CONNECTIONS];
+  int num_conns;
+  int source_fd;
+
+  /* Metadata requests and the number of stream connections before */
+  char * metadata[MAX_REQUESTS];
+  int metadata_conns[MAX_REQUESTS];
+  int num_metadata;
+  } server_t;
+
+static const char * metadata_response =
+  "HTTP/1.0 200 OK\r\n"
+  "Content-Type: text/xml\r\n"
+  "\r\n"
+  "<?xml version=\"1.0\"?>\n"
+  "<iceresponse><message>Metadata update successful</message>"
+  "<return>1</return></iceresponse>\n";
+
+static void send_string(int fd, const char * str)
+  {
+  if(send(fd, str, strlen(str), MSG_NOSIGNAL) < 0)
+    fprintf(stderr, "Sending response failed: %s\n", strerror(errno));
+  }
+
+/* Read a request header but nothing after it */
+
+static int read_request(int fd, char * ret, int len)
+  {
+  int pos = 0;
+
+  while(pos < len - 1)
+    {
+    if(recv(fd, ret + pos, 1, 0) <= 0)
+      return 0;
+    pos++;
+    ret[pos] = '\0';
+    if((pos >= 4) && !memcmp(ret + pos - 4, "\r\n\r\n", 4))
+      return 1;
+    }
+  return 0;
+  }
+
+static void accept_connection(server_t * srv)
+  {
+  int fd;
+  char request[4096];
+  struct timeval tv;
+  connection_t * c;
+
+  if((fd = accept(srv->fd, NULL, NULL)) < 0)
+    return;
+
+  tv.tv_sec = 2;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  /* Answer capability requests on the same connection */
+  while(1)
+    {
+    if(!read_request(fd, request, sizeof(request)))
+      {
+      close(fd);
+      return;
+      }
+    if(strncmp(request, "OPTIONS ", 8))
+      break;
+    send_string(fd, "HTTP/1.1 200 OK\r\n"
+                "Allow: GET, PUT, SOURCE, OPTIONS\r\n"
+                "Content-Length: 0\r\n\r\n");
+    }
+
+  if(!strncmp(request, "GET /admin/metadata", 19))
+    {
+    pthread_mutex_lock(&srv->mutex);
+    if(srv->num_metadata < MAX_REQUESTS)
+      {
+      *strchr(request, '\r') = '\0';
+      srv->metadata[srv->num_metadata] = gavl_strdup(request);
+      srv->metadata_conns[srv->num_metadata] = srv->num_conns;
+      srv->num_metadata++;
+      }
+    pthread_mutex_unlock(&srv->mutex);
+    send_string(fd, metadata_response);
+    close(fd);
+    return;
+    }
+
+  if((strncmp(request, "PUT ", 4) && strncmp(request, "SOURCE ", 7)) ||
+     (srv->num_conns == MAX_CONNECTIONS))
+    {
+    send_string(fd, "HTTP/1.0 400 Bad Request\r\n\r\n");
+    close(fd);
+    return;
+    }
+
+  /* The connection is counted before the client knows about it */
+  pthread_mutex_lock(&srv->mutex);
+  if(srv->source_fd >= 0)
+    close(srv->source_fd);
+  srv->source_fd = fd;
+  c = &srv->conns[srv->num_conns++];
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_unlock(&srv->mutex);
+
+  send_string(fd, "HTTP/1.0 200 OK\r\n\r\n");
+  }
+
+static void read_source(server_t * srv)
+  {
+  int result;
+  connection_t * c;
+
+  pthread_mutex_lock(&srv->mutex);
+
+  c = &srv->conns[srv->num_conns-1];
+
+  if(c->len + 65536 > c->alloc)
+    {
+    c->alloc = c->len + 65536 * 4;
+    c->data = realloc(c->data, c->alloc);
+    }
+  if(c->num_reads == c->reads_alloc)
+    {
+    c->reads_alloc += 1024;
+    c->read_ends = realloc(c->read_ends,
+                           c->reads_alloc * sizeof(*c->read_ends));
+    c->read_times = realloc(c->read_times,
+                            c->reads_alloc * sizeof(*c->read_times));
+    }
+
+  result = recv(srv->source_fd, c->data + c->len, 65536, 0);
+
+  if(result <= 0)
+    {
+    close(srv->source_fd);
+    srv->source_fd = -1;
+    }
+  else
+    {
+    c->len += result;
+    c->read_ends[c->num_reads] = c->len;
+    c->read_times[c->num_reads] = get_wallclock();
+    c->num_reads++;
+
+    if(srv->close_after && (c->len >= srv->close_after))
+      {
+      close(srv->source_fd);
+      srv->source_fd = -1;
+      srv->close_after = 0;
+      }
+    }
+  pthread_mutex_unlock(&srv->mutex);
+  }
+
+static void * server_thread(void * data)
+  {
+  int num_fds;
+  struct pollfd fds[2];
+  server_t * srv = data;
+
+  while(1)
+    {
+    pthread_mutex_lock(&srv->mutex);
+    if(srv->quit)
+      {
+      pthread_mutex_unlock(&srv->mutex);
+      break;
+      }
+
+    fds[0].fd = srv->fd;
+    fds[0].events = POLLIN;
+    num_fds = 1;
+
+    if((srv->source_fd >= 0) && (get_wallclock() >= srv->pause_until))
+      {
+      fds[1].fd = srv->source_fd;
+      fds[1].events = POLLIN;
+      num_fds = 2;
+      }
+    pthread_mutex_unlock(&srv->mutex);
+
+    if(poll(fds, num_fds, 10) <= 0)
+      continue;
+
+    if(fds[0].revents & POLLIN)
+      accept_connection(srv);
+
+    /* The stream might have been replaced by a new connection */
+    if((num_fds > 1) && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+       (fds[1].fd == srv->source_fd))
+      read_source(srv);
+    }
+  return NULL;
+  }
+
+static server_t * server_create(void)
+  {
+  int val;
+  server_t * srv;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  srv = calloc(1, sizeof(*srv));
+  srv->source_fd = -1;
+  pthread_mutex_init(&srv->mutex, NULL);
+
+  srv->fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  val = 1;
+  setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+  /* Small receive buffers make the sender notice a paused server */
+  val = 8192;
+  setsockopt(srv->fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  if(bind(srv->fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+     listen(srv->fd, 8) ||
+     getsockname(srv->fd, (struct sockaddr*)&addr, &len))
+    {
+    fprintf(stderr, "Cannot create server: %s\n", strerror(errno));
+    close(srv->fd);
+    free(srv);
+    return NULL;
+    }
+  srv->port = ntohs(addr.sin_port);
+
+  pthread_create(&srv->thread, NULL, server_thread, srv);
+  return srv;
+  }
+
+static void server_destroy(server_t * srv)
+  {
+  int i;
+
+  pthread_mutex_lock(&srv->mutex);
+  srv->quit = 1;
+  pthread_mutex_unlock(&srv->mutex);
+  pthread_join(srv->thread, NULL);
+
+  if(srv->source_fd >= 0)
+    close(srv->source_fd);
+  close(srv->fd);
+
+  for(i = 0; i < srv->num_conns; i++)
+    {
+    if(srv->conns[i].data)
+      free(srv->conns[i].data);
+    if(srv->conns[i].read_ends)
+      free(srv->conns[i].read_ends);
+    if(srv->conns[i].read_times)
+      free(srv->conns[i].read_times);
+    }
+  for(i = 0; i < srv->num_metadata; i++)
+    free(srv->metadata[i]);
+  pthread_mutex_destroy(&srv->mutex);
+  free(srv);
+  }
+
+/* Arrival time of a byte */
+
+static gavl_time_t arrival_time(const connection_t * c, int pos)
+  {
+  int i;
+  for(i = 0; i < c->num_reads; i++)
+    {
+    if(c->read_ends[i] > pos)
+      return c->read_times[i];
+    }
+  return GAVL_TIME_UNDEFINED;
+  }
+
+/* Client */
+
+static void set_int(bg_shout_t * s, const char * name, int i)
+  {
+  gavl_value_t val;
+  gavl_value_init(&val);
+  gavl_value_set_int(&val, i);
+  bg_shout_set_parameter(s, name, &val);
+  gavl_value_free(&val);
+  }
+
+static void set_string(bg_shout_t * s, const char * name, const char * str)
+  {
+  gavl_value_t val;
+  gavl_value_init(&val);
+  gavl_value_set_string(&val, str);
+  bg_shout_set_parameter(s, name, &val);
+  gavl_value_free(&val);
+  }
+
+/* Buffer and burst sizes in kB */
+
+static bg_shout_t * open_shout_targets(server_t * srv, int format,
+                                       int buffer_size,
+                                       const char * buffer_full,
+                                       int burst_size,
+                                       const char * targets)
+  {
+  bg_shout_t * s = bg_shout_create(format);
+
+  set_string(s, "server", "127.0.0.1");
+  set_int(s, "port", srv->port);
+  set_string(s, "mount",
+             (format == SHOUT_FORMAT_OGG) ? "/test.ogg" : "/test.mp3");
+  set_string(s, "password", "hackme");
+  set_int(s, "buffer_size", buffer_size);
+  set_string(s, "buffer_full", buffer_full);
+  set_int(s, "burst_size", burst_size);
+  set_int(s, "reconnect", 1);
+  set_int(s, "reconnect_delay", 1);
+  if(targets)
+    set_string(s, "targets", targets);
+  bg_shout_set_parameter(s, NULL, NULL);
+
+#ifdef SHOUT_TLS_DISABLED
+  shout_set_tls(s->s, SHOUT_TLS_DISABLED);
+#endif
+
+  if(!bg_shout_open(s))
+    {
+    bg_shout_destroy(s);
+    return NULL;
+    }
+  return s;
+  }
+
+static bg_shout_t * open_shout(server_t * srv, int format,
+                               int buffer_size, const char * buffer_full,
+                               int burst_size)
+  {
+  return open_shout_targets(srv, format, buffer_size, buffer_full,
+                            burst_size, NULL);
+  }
+
+/* Wait until everything is sent, close and wait until the server
+   got everything */
+
+static int close_shout(server_t * srv, bg_shout_t * s)
+  {
+  int done;
+  bg_shout_stats_t stats;
+  gavl_time_t end = get_wallclock() + TIMEOUT;
+
+  while(1)
+    {
+    bg_shout_get_stats(s, &stats);
+    if(!stats.queue_bytes)
+      break;
+    if(get_wallclock() > end)
+      {
+      fprintf(stderr, "%d bytes not sent\n", stats.queue_bytes);
+      bg_shout_destroy(s);
+      return 0;
+      }
+    usleep(10000);
+    }
+
+  bg_shout_destroy(s);
+
+  while(1)
+    {
+    pthread_mutex_lock(&srv->mutex);
+    done = (srv->source_fd < 0);
+    pthread_mutex_unlock(&srv->mutex);
+    if(done)
+      return 1;
+    if(get_wallclock() > end)
+      {
+      fprintf(stderr, "Server didn't get the end of the stream\n");
+      return 0;
+      }
+    usleep(10000);
+    }
+  }
+
+/* MP3 data: Chunks with a sequence number and no 0xff bytes */
+
+static void make_chunk(uint8_t * data, int len, int seq)
+  {
+  int i;
+  data[0] = seq & 0x7f;
+  data[1] = (seq >> 7) & 0x7f;
+  for(i = 2; i < len; i++)
+    data[i] = (seq * 7 + i) & 0x7f;
+  }
+
+/*
+ *  Check, that a stream consists of chunks with increasing sequence
+ *  numbers. Returns the number of chunks or -1. A cut off chunk at the
+ *  end is allowed if partial is set.
+ */
+
+static int check_chunks(const uint8_t * data, int len, int chunk_size,
+                        int partial, int * first, int * last)
+  {
+  int num = 0;
+  int seq;
+  uint8_t * chunk = malloc(chunk_size);
+
+  *last = -1;
+
+  while(len >= chunk_size)
+    {
+    seq = data[0] | (data[1] << 7);
+    make_chunk(chunk, chunk_size, seq);
+    if(memcmp(chunk, data, chunk_size) || (seq <= *last))
+      {
+      fprintf(stderr, "Chunk %d is wrong\n", num);
+      free(chunk);
+      return -1;
+      }
+    if(!num)
+      *first = seq;
+    *last = seq;
+    data += chunk_size;
+    len -= chunk_size;
+    num++;
+    }
+  free(chunk);
+
+  if(len && !partial)
+    {
+    fprintf(stderr, "%d bytes after the last chunk\n", len);
+    return -1;
+    }
+  return num;
+  }
+
+/* Ogg data: An Opus stream */
+
+#define SERIALNO      0x12345678
+#define OPUS_PAYLOAD  100
+#define OPUS_SAMPLES  960
+
+static uint32_t crc_table[256];
+
+static void init_crc(void)
+  {
+  int i, j;
+  uint32_t r;
+
+  for(i = 0; i < 256; i++)
+    {
+    r = (uint32_t)i << 24;
+    for(j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+    crc_table[i] = r;
+    }
+  }
+
+/* Page with one packet shorter than 255 bytes. Returns the length */
+
+static int make_page(uint8_t * ret, const uint8_t * packet, int len,
+                     int64_t granulepos, int pageno, int bos)
+  {
+  int i;
+  uint32_t crc = 0;
+
+  memcpy(ret, "OggS", 4);
+  ret[4] = 0;
+  ret[5] = bos ? 0x02 : 0x00;
+  GAVL_64LE_2_PTR(granulepos, ret + 6);
+  GAVL_32LE_2_PTR(SERIALNO, ret + 14);
+  GAVL_32LE_2_PTR(pageno, ret + 18);
+  GAVL_32LE_2_PTR(0, ret + 22);
+  ret[26] = 1;
+  ret[27] = len;
+  memcpy(ret + 28, packet, len);
+
+  for(i = 0; i < 28 + len; i++)
+    crc = (crc << 8) ^ crc_table[((crc >> 24) & 0xff) ^ ret[i]];
+  GAVL_32LE_2_PTR(crc, ret + 22);
+  return 28 + len;
+  }
+
+/* Identification and comment header */
+
+static int make_opus_header(uint8_t * ret)
+  {
+  int len;
+  uint8_t packet[64];
+
+  memcpy(packet, "OpusHead", 8);
+  packet[8] = 1;                      /* Version */
+  packet[9] = 2;                      /* Channels */
+  GAVL_16LE_2_PTR(312, packet + 10);  /* Pre-skip */
+  GAVL_32LE_2_PTR(48000, packet + 12);
+  GAVL_16LE_2_PTR(0, packet + 16);    /* Gain */
+  packet[18] = 0;                     /* Channel mapping */
+  len = make_page(ret, packet, 19, 0, 0, 1);
+
+  memcpy(packet, "OpusTags", 8);
+  GAVL_32LE_2_PTR(4, packet + 8);
+  memcpy(packet + 12, "test", 4);
+  GAVL_32LE_2_PTR(0, packet + 16);
+  len += make_page(ret + len, packet, 20, 0, 1, 0);
+  return len;
+  }
+
+/* 20 ms CELT frame */
+
+static int make_opus_page(uint8_t * ret, int seq)
+  {
+  uint8_t packet[1 + OPUS_PAYLOAD];
+
+  packet[0] = 0xf8;
+  make_chunk(packet + 1, OPUS_PAYLOAD, seq);
+  return make_page(ret, packet, 1 + OPUS_PAYLOAD,
+                   (int64_t)(seq + 1) * OPUS_SAMPLES, seq + 2, 0);
+  }
+
+/* Tests */
+
+#define PACE_CHUNKS   20
+#define PACE_SIZE     1000
+#define PACE_DURATION (50*MS)
+
+/*
+ *  Timestamped chunks must not arrive before their time. The first
+ *  burst_size bytes are sent at once and the stream keeps this lead
+ *  afterwards.
+ */
+
+static int test_pacing(server_t * srv, int burst_size)
+  {
+  int i;
+  int first, last;
+  int lead_chunks;
+  uint8_t chunk[PACE_SIZE];
+  bg_shout_t * s;
+  gavl_time_t start, t, min_time, max_time;
+  const connection_t * c;
+
+  if(!(s = open_shout(srv, SHOUT_FORMAT_MP3, 1024, "wait", burst_size)))
+    return 0;
+
+  for(i = 0; i < PACE_CHUNKS; i++)
+    {
+    make_chunk(chunk, PACE_SIZE, i);
+    bg_shout_write_time(s, chunk, PACE_SIZE, i * PACE_DURATION);
+    }
+
+  if(!close_shout(srv, s))
+    return 0;
+
+  c = &srv->conns[srv->num_conns-1];
+
+  if(check_chunks(c->data, c->len, PACE_SIZE, 0, &first, &last) !=
+     PACE_CHUNKS)
+    {
+    fprintf(stderr, "Pacing: Got %d bytes instead of %d\n",
+            c->len, PACE_CHUNKS * PACE_SIZE);
+    return 0;
+    }
+
+  /* Chunks, which are sent ahead of time */
+  lead_chunks = (burst_size * 1024 + PACE_SIZE - 1) / PACE_SIZE;
+
+  start = arrival_time(c, 0);
+
+  for(i = 0; i < PACE_CHUNKS; i++)
+    {
+    t = arrival_time(c, i * PACE_SIZE);
+
+    if(i <= lead_chunks)
+      min_time = start;
+    else
+      min_time = start + (i - lead_chunks) * PACE_DURATION - 10 * MS;
+
+    if(i < lead_chunks)
+      max_time = start + TOLERANCE / 5;
+    else
+      max_time = min_time + TOLERANCE;
+
+    if((t < min_time) || (t > max_time))
+      {
+      fprintf(stderr,
+              "Pacing, burst %d kB: Chunk %d arrived after %d ms, "
+              "expected %d - %d ms\n", burst_size, i,
+              (int)((t - start) / MS), (int)((min_time - start) / MS),
+              (int)((max_time - start) / MS));
+      return 0;
+      }
+    }
+
+  printf("Pacing, burst %d kB: %d chunks in %d ms\n", burst_size,
+         PACE_CHUNKS, (int)((t - start) / MS));
+  return 1;
+  }
+
+#define FULL_CHUNKS 4096
+#define FULL_SIZE   4096
+#define FULL_PAUSE  GAVL_TIME_SCALE
+
+/*
+ *  The server stops reading for a while. With "wait" the encoder must
+ *  wait and nothing is lost, with "drop" the encoder must not wait and
+ *  the oldest data are dropped. The stream is much larger than the
+ *  socket buffers, which can grow to several MB on the loopback
+ *  interface.
+ */
+
+static int test_buffer_full(server_t * srv, int drop)
+  {
+  int i;
+  int num, first, last;
+  uint8_t chunk[FULL_SIZE];
+  bg_shout_t * s;
+  bg_shout_stats_t stats;
+  gavl_time_t start, duration;
+  const connection_t * c;
+  const char * mode = drop ? "drop" : "wait";
+
+  if(!(s = open_shout(srv, SHOUT_FORMAT_MP3, 64, mode, 0)))
+    return 0;
+
+  pthread_mutex_lock(&srv->mutex);
+  srv->pause_until = get_wallclock() + FULL_PAUSE;
+  pthread_mutex_unlock(&srv->mutex);
+
+  start = get_wallclock();
+  for(i = 0; i < FULL_CHUNKS; i++)
+    {
+    make_chunk(chunk, FULL_SIZE, i);
+    if(bg_shout_write(s, chunk, FULL_SIZE) != FULL_SIZE)
+      {
+      fprintf(stderr, "Buffer full, %s: Writing failed\n", mode);
+      bg_shout_destroy(s);
+      return 0;
+      }
+    }
+  duration = get_wallclock() - start;
+
+  bg_shout_get_stats(s, &stats);
+
+  if(!close_shout(srv, s))
+    return 0;
+
+  c = &srv->conns[srv->num_conns-1];
+
+  if((num = check_chunks(c->data, c->len, FULL_SIZE, 0, &first, &last)) < 0)
+    return 0;
+
+  if(last != FULL_CHUNKS - 1)
+    {
+    fprintf(stderr, "Buffer full, %s: Last chunk missing\n", mode);
+    return 0;
+    }
+
+  if(drop)
+    {
+    if((duration > FULL_PAUSE / 2) || !stats.dropped_bytes ||
+       (c->len + stats.dropped_bytes != FULL_CHUNKS * FULL_SIZE))
+      {
+      fprintf(stderr, "Buffer full, drop: Encoder waited %d ms, "
+              "%d bytes received, %"PRId64" dropped\n",
+              (int)(duration / MS), c->len, stats.dropped_bytes);
+      return 0;
+      }
+    }
+  else
+    {
+    if((duration < FULL_PAUSE / 2) || stats.dropped_bytes ||
+       (num != FULL_CHUNKS))
+      {
+      fprintf(stderr, "Buffer full, wait: Encoder waited %d ms, "
+              "%d bytes received, %"PRId64" dropped\n",
+              (int)(duration / MS), c->len, stats.dropped_bytes);
+      return 0;
+      }
+    }
+
+  printf("Buffer full, %s: Encoder waited %d ms, %d chunks received\n",
+         mode, (int)(duration / MS), num);
+  return 1;
+  }
+
+#define RECONNECT_PAGES 60
+
+/*
+ *  The server drops the connection. The new connection must start
+ *  with the Ogg headers, followed by the remaining pages.
+ */
+
+static int test_reconnect(server_t * srv)
+  {
+  int i;
+  int len;
+  int header_len;
+  int conn;
+  int seq;
+  int last = -1;
+  uint8_t header[256];
+  uint8_t page[256];
+  bg_shout_t * s;
+  const connection_t * c;
+
+  if(!(s = open_shout(srv, SHOUT_FORMAT_OGG, 1024, "wait", 0)))
+    return 0;
+
+  conn = srv->num_conns - 1;
+
+  header_len = make_opus_header(header);
+
+  pthread_mutex_lock(&srv->mutex);
+  srv->close_after = header_len + 10 * (28 + 1 + OPUS_PAYLOAD);
+  pthread_mutex_unlock(&srv->mutex);
+
+  bg_shout_write(s, header, header_len);
+
+  for(i = 0; i < RECONNECT_PAGES; i++)
+    {
+    len = make_opus_page(page, i);
+    bg_shout_write(s, page, len);
+    }
+
+  if(!close_shout(srv, s))
+    return 0;
+
+  if(srv->num_conns != conn + 2)
+    {
+    fprintf(stderr, "Reconnect: %d connections instead of 2\n",
+            srv->num_conns - conn);
+    return 0;
+    }
+
+  for(i = 0; i < 2; i++)
+    {
+    c = &srv->conns[conn + i];
+    if((c->len < header_len) || memcmp(c->data, header, header_len))
+      {
+      fprintf(stderr, "Reconnect: Connection %d doesn't start with "
+              "the headers\n", i + 1);
+      return 0;
+      }
+    }
+
+  /* The pages after the headers must be the remaining ones */
+  c = &srv->conns[conn + 1];
+  i = header_len;
+
+  while(i < c->len)
+    {
+    seq = c->data[i + 28 + 1] | (c->data[i + 28 + 2] << 7);
+    len = make_opus_page(page, seq);
+
+    if((i + len > c->len) || memcmp(c->data + i, page, len) ||
+       (seq <= last))
+      {
+      fprintf(stderr, "Reconnect: Wrong page at byte %d\n", i);
+      return 0;
+      }
+    last = seq;
+    i += len;
+    }
+
+  if(last != RECONNECT_PAGES - 1)
+    {
+    fprintf(stderr, "Reconnect: Last page missing\n");
+    return 0;
+    }
+
+  printf("Reconnect: Headers sent again, %d of %d pages received after "
+         "reconnecting\n", (c->len - header_len) / len, RECONNECT_PAGES);
+  return 1;
+  }
+
+/*
+ *  Metadata are sent after connecting and again after reconnecting
+ */
+
+static int test_metadata(server_t * srv)
+  {
+  int i;
+  int conn;
+  int metadata;
+  int first, last;
+  uint8_t chunk[PACE_SIZE];
+  gavl_dictionary_t m;
+  bg_shout_t * s;
+  const connection_t * c;
+
+  if(!(s = open_shout(srv, SHOUT_FORMAT_MP3, 1024, "wait", 0)))
+    return 0;
+
+  conn = srv->num_conns - 1;
+  metadata = srv->num_metadata;
+
+  pthread_mutex_lock(&srv->mutex);
+  srv->close_after = 5 * PACE_SIZE;
+  pthread_mutex_unlock(&srv->mutex);
+
+  gavl_dictionary_init(&m);
+  gavl_dictionary_set_string(&m, GAVL_META_LABEL, "TestSong");
+  bg_shout_update_metadata(s, &m);
+  gavl_dictionary_free(&m);
+
+  for(i = 0; i < PACE_CHUNKS; i++)
+    {
+    make_chunk(chunk, PACE_SIZE, i);
+    bg_shout_write_time(s, chunk, PACE_SIZE, i * PACE_DURATION);
+    }
+
+  if(!close_shout(srv, s))
+    return 0;
+
+  if((srv->num_conns != conn + 2) ||
+     (srv->num_metadata != metadata + 2))
+    {
+    fprintf(stderr, "Metadata: %d connections, %d metadata updates\n",
+            srv->num_conns - conn, srv->num_metadata - metadata);
+    return 0;
+    }
+
+  for(i = 0; i < 2; i++)
+    {
+    if(!strstr(srv->metadata[metadata + i], "mode=updinfo") ||
+       !strstr(srv->metadata[metadata + i], "TestSong") ||
+       (srv->metadata_conns[metadata + i] != conn + i + 1))
+      {
+      fprintf(stderr, "Metadata: Wrong update %d: %s\n", i + 1,
+              srv->metadata[metadata + i]);
+      return 0;
+      }
+    }
+
+  c = &srv->conns[conn + 1];
+  if((check_chunks(c->data, c->len, PACE_SIZE, 0, &first, &last) < 0) ||
+     (last != PACE_CHUNKS - 1))
+    {
+    fprintf(stderr, "Metadata: Wrong data after reconnecting\n");
+    return 0;
+    }
+
+  printf("Metadata: Sent again after reconnecting\n");
+  return 1;
+  }
+
+/*
+ *  Archive file: A pipe, whose reader stops reading for a while. The
+ *  archive must get every chunk even though the primary server drops
+ *  data, so the encoder must wait. If the reader goes away, writing
+ *  must fail.
+ */
+
+typedef struct
+  {
+  const char * filename;
+  int max_len; /* Stop reading after that many bytes */
+  uint8_t * data;
+  int len;
+  } archive_reader_t;
+
+static void * archive_thread(void * data)
+  {
+  int fd;
+  int result;
+  gavl_time_t end;
+  archive_reader_t * r = data;
+
+  if((fd = open(r->filename, O_RDONLY)) < 0)
+    return NULL;
+
+  end = get_wallclock() + FULL_PAUSE;
+  while(get_wallclock() < end)
+    usleep(10000);
+
+  while(r->len < r->max_len)
+    {
+    result = read(fd, r->data + r->len, r->max_len - r->len);
+    if(result <= 0)
+      break;
+    r->len += result;
+    }
+  close(fd);
+  return NULL;
+  }
+
+static int test_archive(server_t * srv, int fail)
+  {
+  int i;
+  int num, first, last;
+  int written = 0;
+  char filename[64];
+  uint8_t chunk[FULL_SIZE];
+  bg_shout_t * s;
+  bg_shout_stats_t stats;
+  gavl_time_t start, duration;
+  pthread_t thread;
+  int joined = 0;
+  archive_reader_t r;
+  const char * mode = fail ? "reader gone" : "reader stalled";
+  int ret = 0;
+
+  snprintf(filename, sizeof(filename), "/tmp/test_shout_%d.fifo",
+           (int)getpid());
+  if(mkfifo(filename, 0600))
+    {
+    fprintf(stderr, "Cannot create %s: %s\n", filename, strerror(errno));
+    return 0;
+    }
+
+  memset(&r, 0, sizeof(r));
+  r.filename = filename;
+  r.max_len = fail ? FULL_SIZE * 16 : FULL_SIZE * FULL_CHUNKS;
+  r.data = malloc(r.max_len);
+  pthread_create(&thread, NULL, archive_thread, &r);
+
+  if(!(s = open_shout_targets(srv, SHOUT_FORMAT_MP3, 64, "drop", 0,
+                              filename)))
+    {
+    /* Unblock the reader */
+    close(open(filename, O_WRONLY));
+    goto end;
+    }
+
+  start = get_wallclock();
+  for(i = 0; i < FULL_CHUNKS; i++)
+    {
+    make_chunk(chunk, FULL_SIZE, i);
+    if(bg_shout_write(s, chunk, FULL_SIZE) != FULL_SIZE)
+      break;
+    written++;
+    }
+  duration = get_wallclock() - start;
+
+  bg_shout_get_target_stats(s, 0, &stats);
+
+  if(!close_shout(srv, s))
+    goto end;
+  pthread_join(thread, NULL);
+  joined = 1;
+
+  if(fail)
+    {
+    if(written == FULL_CHUNKS)
+      {
+      fprintf(stderr, "Archive, %s: Writing didn't fail\n", mode);
+      goto end;
+      }
+    printf("Archive, %s: Writing failed after %d chunks\n", mode,
+           written);
+    ret = 1;
+    goto end;
+    }
+
+  if(written != FULL_CHUNKS)
+    {
+    fprintf(stderr, "Archive, %s: Writing failed\n", mode);
+    goto end;
+    }
+
+  if(((num = check_chunks(r.data, r.len, FULL_SIZE, 0, &first, &last)) !=
+      FULL_CHUNKS) || stats.dropped_bytes || (duration < FULL_PAUSE / 2))
+    {
+    fprintf(stderr, "Archive, %s: Encoder waited %d ms, %d bytes "
+            "written, %"PRId64" dropped\n", mode, (int)(duration / MS),
+            r.len, stats.dropped_bytes);
+    goto end;
+    }
+
+  printf("Archive, %s: Encoder waited %d ms, %d chunks written\n",
+         mode, (int)(duration / MS), num);
+  ret = 1;
+
+  end:
+  if(!joined)
+    pthread_join(thread, NULL);
+  unlink(filename);
+  free(r.data);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int ret = 0;
+  server_t * srv;
+
+  /* Writing to the dropped connection */
+  signal(SIGPIPE, SIG_IGN);
+
+  init_crc();
+
+  if(!(srv = server_create()))
+    return 1;
+
+  if(!test_pacing(srv, 0) ||
+     !test_pacing(srv, 8) ||
+     !test_buffer_full(srv, 0) ||
+     !test_buffer_full(srv, 1) ||
+     !test_reconnect(srv) ||
+     !test_metadata(srv) ||
+     !test_archive(srv, 0) ||
+     !test_archive(srv, 1))
+    ret = 1;
+
+  server_destroy(srv);
+  return ret;
+  }
@@ -1456,7 +1456,7 @@ dnl
 
 AC_DEFUN([GMERLIN_CHECK_OGG],[
 
-OGG_REQUIRED="1.1"
+OGG_REQUIRED="1.3.0"
 have_ogg=false
 AH_TEMPLATE([HAVE_OGG], [Ogg libraries are there])
 
@@ -70,7 +70,13 @@ struct bg_faac_s
   unsigned long bitRate;
   unsigned long quantqual;
   int shortctl;
-   
+
+  /* Segment parallel encoding */
+  gavl_dictionary_t params; /* For creating the segment encoders */
+  int num_threads;
+  gavl_time_t segment_duration;
+  bgen_parallel_t * parallel;
+  int segment_encoder;
   };
 
 
@@ -156,6 +162,25 @@ static const bg_parameter_info_t parameters[] =
       .type =        BG_PARAMETER_CHECKBUTTON,
       .val_default = GAVL_VALUE_INIT_INT(0)
     },
+    {
+      .name =        "threads",
+      .long_name =   TRS("Threads"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1),
+      .val_max =     GAVL_VALUE_INIT_INT(256),
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Encode segments of the track in parallel. 1 disables parallel encoding."),
+    },
+    {
+      .name =        "segment_duration",
+      .long_name =   TRS("Segment duration (s)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(5),
+      .val_max =     GAVL_VALUE_INIT_INT(3600),
+      .val_default = GAVL_VALUE_INIT_INT(30),
+      .help_string = TRS("Duration of the segments for parallel encoding. \
+Longer segments have fewer boundaries but need more memory."),
+    },
     { /* End of parameters */ }
   };
 
@@ -171,7 +196,10 @@ void bg_faac_set_parameter(bg_faac_t * ctx, const char * name,
     {
     return;
     }
-  else if(!strcmp(name, "object_type"))
+
+  gavl_dictionary_set(&ctx->params, name, v);
+  
+  if(!strcmp(name, "object_type"))
     {
     if(!strcmp(v->v.str, "mpeg2_main"))
       {
@@ -230,12 +258,20 @@ void bg_faac_set_parameter(bg_faac_t * ctx, const char * name,
     {
     ctx->allowMidside = !v->v.i;
     }
+  else if(!strcmp(name, "threads"))
+    {
+    ctx->num_threads = v->v.i;
+    }
+  else if(!strcmp(name, "segment_duration"))
+    {
+    ctx->segment_duration = gavl_seconds_to_time(v->v.i);
+    }
 
   }
 
 static int flush_audio(bg_faac_t * ctx)
   {
-  int i, imax;
+  int imax;
   int bytes_encoded;
   int num_samples;
   
@@ -245,8 +281,7 @@ static int flush_audio(bg_faac_t * ctx)
 
   imax = ctx->frame->valid_samples * ctx->fmt.num_channels;
   
-  for(i = 0; i < imax; i++)
-    ctx->frame->samples.f[i] *= 32767.0;
+  bgen_scale_float(ctx->frame->samples.f, imax, 32767.0);
   
   /* Encode the stuff */
 
@@ -322,6 +357,7 @@ write_audio_func_faac(void * data, gavl_audio_frame_t * frame)
     
     samples_done += samples_copied;
     ctx->frame->valid_samples += samples_copied;
+    ctx->in_pts += samples_copied;
     
     /* Encode buffer */
 
@@ -332,11 +368,46 @@ write_audio_func_faac(void * data, gavl_audio_frame_t * frame)
       }
     }
   
-  ctx->in_pts += ctx->frame->valid_samples;
   return GAVL_SINK_OK;
   }
 
 
+/* Encoder for one segment with the same settings */
+
+static gavl_audio_sink_t *
+create_segment_encoder(void * priv, void ** enc, gavl_packet_sink_t * psink)
+  {
+  int i;
+  gavl_audio_format_t fmt;
+  gavl_compression_info_t ci;
+  gavl_audio_sink_t * ret;
+  bg_faac_t * ctx = priv;
+  bg_faac_t * seg = bg_faac_create();
+
+  seg->segment_encoder = 1;
+  
+  for(i = 0; i < ctx->params.num_entries; i++)
+    bg_faac_set_parameter(seg, ctx->params.entries[i].name,
+                          &ctx->params.entries[i].v);
+  
+  gavl_audio_format_copy(&fmt, &ctx->fmt);
+
+  /* Same output format (raw or ADTS) */
+  gavl_compression_info_init(&ci);
+  ret = bg_faac_open(seg, ctx->enc_config->outputFormat ? NULL : &ci,
+                     &fmt, NULL);
+  gavl_compression_info_free(&ci);
+  
+  bg_faac_set_packet_sink(seg, psink);
+  *enc = seg;
+  return ret;
+  }
+
+static void destroy_segment_encoder(void * enc)
+  {
+  bg_faac_destroy(enc);
+  }
+
 gavl_audio_sink_t * bg_faac_open(bg_faac_t * ctx,
                                  gavl_compression_info_t * ci,
                                  gavl_audio_format_t * fmt,
@@ -440,13 +511,26 @@ gavl_audio_sink_t * bg_faac_open(bg_faac_t * ctx,
                                   &SizeOfDecoderSpecificInfo);
     ci->global_header_len = SizeOfDecoderSpecificInfo;
     ci->pre_skip = FAAC_DELAY;
-    gavl_dictionary_set_string_nocopy(m, GAVL_META_SOFTWARE,
-                            bg_sprintf("libfaac %s", ctx->enc_config->name));
+    if(m)
+      gavl_dictionary_set_string_nocopy(m, GAVL_META_SOFTWARE,
+                                        bg_sprintf("libfaac %s", ctx->enc_config->name));
     
     }
   
   ctx->in_pts = GAVL_TIME_UNDEFINED;
   ctx->out_pts = GAVL_TIME_UNDEFINED;
+
+  if((ctx->num_threads > 1) && !ctx->segment_encoder)
+    {
+    ctx->parallel = bgen_parallel_create(&ctx->fmt, FAAC_DELAY,
+                                         ctx->num_threads,
+                                         ctx->segment_duration,
+                                         create_segment_encoder,
+                                         destroy_segment_encoder,
+                                         ctx);
+    return bgen_parallel_get_sink(ctx->parallel);
+    }
+  
   return ctx->asink;
   }
 
@@ -454,6 +538,8 @@ void bg_faac_set_packet_sink(bg_faac_t * ctx,
                              gavl_packet_sink_t * psink)
   {
   ctx->psink = psink;
+  if(ctx->parallel)
+    bgen_parallel_set_packet_sink(ctx->parallel, psink);
   }
 
 void bg_faac_destroy(bg_faac_t * ctx)
@@ -461,7 +547,13 @@ void bg_faac_destroy(bg_faac_t * ctx)
   int result;
   /* Flush remaining audio data */
 
-  if(ctx->enc)
+  if(ctx->parallel)
+    {
+    bgen_parallel_flush(ctx->parallel);
+    bgen_parallel_destroy(ctx->parallel);
+    ctx->parallel = NULL;
+    }
+  else if(ctx->enc)
     {
     while(1)
       {
@@ -487,6 +579,8 @@ void bg_faac_destroy(bg_faac_t * ctx)
     gavl_audio_sink_destroy(ctx->asink);
     ctx->asink = NULL;
     }
-    
+
+  gavl_dictionary_free(&ctx->params);
+  
   free(ctx);
   }
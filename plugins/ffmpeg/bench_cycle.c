@@ -0,0 +1,273 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Times the create-open-start-close cycle of the ffmpeg encoder
+ *  plugin, which a transcoder runs for every track: create, set the
+ *  format parameters, open to memory, add an audio and a video stream,
+ *  set their parameters, start, close and destroy. No frames are
+ *  encoded.
+ *
+ *  The cycles run first with the warm parameter and encoder caches,
+ *  then with both caches emptied before every cycle. The latter is
+ *  what every cycle cost without them.
+ *
+ *  Build with "make bench_cycle", usage:
+ *
+ *  bench_cycle [cycles [format]]
+ *
+ *  Default: 200 avi (PCM audio and MPEG-4 video, 1280x720)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ffmpeg_common.h"
+
+#include <gmerlin/cfg_registry.h>
+#include <gmerlin/log.h>
+
+/* From e_ffmpeg.c */
+extern const bg_encoder_plugin_t the_plugin;
+
+enum
+  {
+    PHASE_CREATE, /* Create, format parameters */
+    PHASE_OPEN,   /* Open, add streams, stream parameters */
+    PHASE_START,
+    PHASE_CLOSE,  /* Close, destroy */
+    NUM_PHASES,
+  };
+
+static const char * phase_names[NUM_PHASES] =
+  {
+    "create",
+    "open",
+    "start",
+    "close",
+  };
+
+typedef struct
+  {
+  bg_cfg_section_t * format_section;
+  bg_cfg_section_t * audio_section;
+  bg_cfg_section_t * video_section;
+  gavl_audio_format_t afmt;
+  gavl_video_format_t vfmt;
+  } setup_t;
+
+static int64_t get_ns(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+static void set_audio_parameter(void * data, const char * name,
+                                const gavl_value_t * v)
+  {
+  the_plugin.set_audio_parameter(data, 0, name, v);
+  }
+
+static void set_video_parameter(void * data, const char * name,
+                                const gavl_value_t * v)
+  {
+  the_plugin.set_video_parameter(data, 0, name, v);
+  }
+
+/* Add the times of the phases to t */
+
+static int cycle(const setup_t * s, int64_t * t)
+  {
+  void * enc;
+  gavf_io_t * io;
+  gavl_audio_format_t afmt;
+  gavl_video_format_t vfmt;
+  int64_t start = get_ns();
+  int64_t now;
+  int ret = 0;
+  
+  enc = the_plugin.common.create();
+  bg_cfg_section_apply(s->format_section,
+                       the_plugin.common.get_parameters(enc),
+                       the_plugin.common.set_parameter, enc);
+
+  now = get_ns();
+  t[PHASE_CREATE] += now - start;
+  start = now;
+  
+  io = gavf_io_create_mem_write();
+  
+  if(!the_plugin.open_io(enc, io, NULL))
+    {
+    fprintf(stderr, "Opening failed\n");
+    the_plugin.common.destroy(enc);
+    gavf_io_destroy(io);
+    return 0;
+    }
+
+  /* The plugin may change the formats */
+  gavl_audio_format_copy(&afmt, &s->afmt);
+  gavl_video_format_copy(&vfmt, &s->vfmt);
+  
+  the_plugin.add_audio_stream(enc, NULL, &afmt);
+  the_plugin.add_video_stream(enc, NULL, &vfmt);
+
+  bg_cfg_section_apply(s->audio_section,
+                       the_plugin.get_audio_parameters(enc),
+                       set_audio_parameter, enc);
+  bg_cfg_section_apply(s->video_section,
+                       the_plugin.get_video_parameters(enc),
+                       set_video_parameter, enc);
+
+  now = get_ns();
+  t[PHASE_OPEN] += now - start;
+  start = now;
+  
+  if(!the_plugin.start(enc))
+    {
+    fprintf(stderr, "Starting failed\n");
+    goto fail;
+    }
+  
+  now = get_ns();
+  t[PHASE_START] += now - start;
+  start = now;
+  
+  ret = 1;
+  
+  fail:
+  the_plugin.close(enc, 0);
+  the_plugin.common.destroy(enc);
+  gavf_io_destroy(io);
+  
+  t[PHASE_CLOSE] += get_ns() - start;
+  return ret;
+  }
+
+/* Returns the wall time per cycle in µs */
+
+static double measure(const setup_t * s, int cycles, int cached)
+  {
+  int i;
+  int64_t t[NUM_PHASES];
+  int64_t total = 0;
+  
+  memset(t, 0, sizeof(t));
+
+  /* Fill the caches */
+  if(cached && !cycle(s, t))
+    return -1.0;
+  
+  memset(t, 0, sizeof(t));
+  
+  for(i = 0; i < cycles; i++)
+    {
+    if(!cached)
+      {
+      bg_ffmpeg_free_parameter_cache();
+      bg_ffmpeg_free_encoder_cache();
+      }
+    if(!cycle(s, t))
+      return -1.0;
+    }
+
+  printf("%-9s", cached ? "warm" : "no cache");
+  for(i = 0; i < NUM_PHASES; i++)
+    {
+    printf(" %9.1f", (double)t[i] / (1000.0 * cycles));
+    total += t[i];
+    }
+  printf(" %9.1f\n", (double)total / (1000.0 * cycles));
+  
+  return (double)total / (1000.0 * cycles);
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int cycles = 200;
+  void * enc;
+  setup_t s;
+  double t_warm, t_cold;
+  
+  if(argc > 1)
+    cycles = atoi(argv[1]);
+
+  /* Don't log every file */
+  bg_log_set_verbose(BG_LOG_ERROR | BG_LOG_WARNING);
+  
+  memset(&s, 0, sizeof(s));
+
+  /* Default parameters like a frontend, which has no saved config */
+  enc = the_plugin.common.create();
+  s.format_section =
+    bg_cfg_section_create_from_parameters("format",
+                                          the_plugin.common.get_parameters(enc));
+  s.audio_section =
+    bg_cfg_section_create_from_parameters("audio",
+                                          the_plugin.get_audio_parameters(enc));
+  s.video_section =
+    bg_cfg_section_create_from_parameters("video",
+                                          the_plugin.get_video_parameters(enc));
+  the_plugin.common.destroy(enc);
+
+  if(argc > 2)
+    bg_cfg_section_set_parameter_string(s.format_section, "format", argv[2]);
+  
+  s.afmt.samplerate = 48000;
+  s.afmt.num_channels = 2;
+  s.afmt.sample_format = GAVL_SAMPLE_S16;
+  s.afmt.interleave_mode = GAVL_INTERLEAVE_ALL;
+  s.afmt.samples_per_frame = 1024;
+  gavl_set_channel_setup(&s.afmt);
+
+  s.vfmt.image_width = 1280;
+  s.vfmt.image_height = 720;
+  s.vfmt.frame_width = 1280;
+  s.vfmt.frame_height = 720;
+  s.vfmt.pixel_width = 1;
+  s.vfmt.pixel_height = 1;
+  s.vfmt.pixelformat = GAVL_YUV_420_P;
+  s.vfmt.timescale = 25;
+  s.vfmt.frame_duration = 1;
+  s.vfmt.framerate_mode = GAVL_FRAMERATE_CONSTANT;
+  
+  printf("%d cycles, times in us\n", cycles);
+  printf("%-9s", "cache");
+  for(i = 0; i < NUM_PHASES; i++)
+    printf(" %9s", phase_names[i]);
+  printf(" %9s\n", "cycle");
+  
+  if(((t_warm = measure(&s, cycles, 1)) < 0.0) ||
+     ((t_cold = measure(&s, cycles, 0)) < 0.0))
+    return 1;
+
+  printf("Caches save %.1f us per cycle (%.1fx)\n", t_cold - t_warm,
+         t_cold / t_warm);
+
+  bg_cfg_section_destroy(s.format_section);
+  bg_cfg_section_destroy(s.audio_section);
+  bg_cfg_section_destroy(s.video_section);
+  return 0;
+  }
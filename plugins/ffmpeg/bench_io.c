@@ -0,0 +1,221 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Counts the write callbacks of the custom I/O context for different
+ *  buffer sizes. The I/O is set up like in bg_ffmpeg_start() and
+ *  packets with the size of a 1080p stream are multiplexed. The data
+ *  is discarded.
+ *
+ *  Build with "make bench_io", usage:
+ *
+ *  bench_io [format [seconds [kbit/s]]]
+ *
+ *  Default: mp4 600 8000 (10 minutes 1080p at 8 Mbit/s)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libavformat/avformat.h>
+
+#define FPS              25
+#define KEYFRAME_INTERVAL 50
+
+typedef struct
+  {
+  int64_t pos;
+  int64_t len;
+  int64_t num_writes;
+  int64_t num_seeks;
+  } output_t;
+
+static int io_write(void * opaque, uint8_t * buf, int size)
+  {
+  output_t * out = opaque;
+  out->num_writes++;
+  out->pos += size;
+  if(out->pos > out->len)
+    out->len = out->pos;
+  return size;
+  }
+
+static int64_t io_seek(void * opaque, int64_t off, int whence)
+  {
+  output_t * out = opaque;
+
+  switch(whence)
+    {
+    case SEEK_SET:
+      out->pos = off;
+      break;
+    case SEEK_CUR:
+      out->pos += off;
+      break;
+    case SEEK_END:
+      out->pos = out->len + off;
+      break;
+    case AVSEEK_SIZE:
+      return out->len;
+    default:
+      return -1;
+    }
+  out->num_seeks++;
+  return out->pos;
+  }
+
+static int run(const char * format, int seconds, int kbits,
+               int buffer_size, int seekable, output_t * out)
+  {
+  int i;
+  int num_frames;
+  int frame_size;
+  int ret = 0;
+  AVFormatContext * ctx = NULL;
+  AVStream * st;
+  AVPacket * pkt = NULL;
+  AVDictionary * options = NULL;
+  unsigned char * io_buffer;
+
+  memset(out, 0, sizeof(*out));
+
+  if(avformat_alloc_output_context2(&ctx, NULL, format, NULL) < 0)
+    {
+    fprintf(stderr, "Unknown format %s\n", format);
+    return 0;
+    }
+
+  st = avformat_new_stream(ctx, NULL);
+  st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+  st->codecpar->codec_id = AV_CODEC_ID_MPEG4;
+  st->codecpar->width = 1920;
+  st->codecpar->height = 1080;
+  st->codecpar->bit_rate = kbits * 1000;
+  st->time_base.num = 1;
+  st->time_base.den = FPS;
+
+  io_buffer = av_malloc(buffer_size);
+  ctx->pb = avio_alloc_context(io_buffer, buffer_size, 1, out, NULL,
+                               io_write, seekable ? io_seek : NULL);
+  if(!seekable)
+    ctx->pb->seekable = 0;
+  ctx->flush_packets = seekable ? 0 : 1;
+
+  /* Non-seekable MP4 is written like the fragmented MP4 format */
+  if(!seekable && (!strcmp(format, "mp4") || !strcmp(format, "mov")))
+    av_dict_set(&options, "movflags",
+                "frag_keyframe+empty_moov+default_base_moof", 0);
+  
+  if(avformat_write_header(ctx, &options) < 0)
+    {
+    fprintf(stderr, "Writing header failed\n");
+    goto fail;
+    }
+
+  /* Keyframes are 4 times as large as the other frames */
+  num_frames = seconds * FPS;
+  frame_size = (int)((int64_t)kbits * 1000 / 8 / FPS);
+
+  pkt = av_packet_alloc();
+
+  for(i = 0; i < num_frames; i++)
+    {
+    int size;
+
+    if(!(i % KEYFRAME_INTERVAL))
+      size = frame_size * 4;
+    else
+      size = frame_size - (frame_size * 3) / (KEYFRAME_INTERVAL - 1);
+
+    if(av_new_packet(pkt, size) < 0)
+      goto fail;
+    memset(pkt->data, 0, size);
+
+    pkt->stream_index = 0;
+    pkt->pts = pkt->dts = av_rescale_q(i, (AVRational){ 1, FPS },
+                                       st->time_base);
+    pkt->duration = av_rescale_q(1, (AVRational){ 1, FPS },
+                                 st->time_base);
+    if(!(i % KEYFRAME_INTERVAL))
+      pkt->flags |= AV_PKT_FLAG_KEY;
+
+    if(av_interleaved_write_frame(ctx, pkt) < 0)
+      {
+      fprintf(stderr, "Writing packet %d failed\n", i);
+      goto fail;
+      }
+    av_packet_unref(pkt);
+    }
+
+  av_write_trailer(ctx);
+  avio_flush(ctx->pb);
+  ret = 1;
+
+  fail:
+  if(pkt)
+    av_packet_free(&pkt);
+  av_dict_free(&options);
+  av_free(ctx->pb->buffer);
+  av_free(ctx->pb);
+  avformat_free_context(ctx);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i, j;
+  output_t out;
+  const char * format = "mp4";
+  int seconds = 600;
+  int kbits = 8000;
+
+  static const int buffer_sizes[] = { 2048, 4096, 65536, 1024*1024 };
+
+  if(argc > 1)
+    format = argv[1];
+  if(argc > 2)
+    seconds = atoi(argv[2]);
+  if(argc > 3)
+    kbits = atoi(argv[3]);
+
+#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+  av_register_all();
+#endif
+
+  printf("%s, %d s, %d kbit/s\n", format, seconds, kbits);
+  printf("%-9s %-9s %12s %10s %8s\n",
+         "buffer", "seekable", "bytes", "writes", "seeks");
+
+  for(i = 0; i < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); i++)
+    {
+    for(j = 1; j >= 0; j--)
+      {
+      if(!run(format, seconds, kbits, buffer_sizes[i], j, &out))
+        continue;
+      printf("%-9d %-9s %12"PRId64" %10"PRId64" %8"PRId64"\n",
+             buffer_sizes[i], j ? "yes" : "no",
+             out.len, out.num_writes, out.num_seeks);
+      }
+    }
+  return 0;
+  }
@@ -0,0 +1,147 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Compares the lookup of codec parameters with bsearch() in the
+ *  sorted table (bg_ffmpeg_set_codec_parameter()) with the former
+ *  chain of strcmp() calls, which tested the names in table order.
+ *  Looked up are all names of the table and some names, which are
+ *  handled elsewhere and not found.
+ *
+ *  Build with "make bench_params", usage:
+ *
+ *  bench_params [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "codecs.c"
+
+static const char * other_names[] =
+  {
+    "codec",
+    "ff_frame_threads",
+    "ff_turbo_first_pass",
+    "framerate",
+  };
+
+#define NUM_OTHER_NAMES (int)(sizeof(other_names)/sizeof(other_names[0]))
+
+static int64_t get_ns(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+static const codec_param_t * find_strcmp(const char * name)
+  {
+  int i;
+  for(i = 0; i < NUM_CODEC_PARAMS; i++)
+    {
+    if(!strcmp(name, codec_params[i].name))
+      return &codec_params[i];
+    }
+  return NULL;
+  }
+
+static const codec_param_t * find_bsearch(const char * name)
+  {
+  const codec_param_t * const * res;
+  
+  if(!(res = bsearch(name, codec_params_sorted, NUM_CODEC_PARAMS,
+                     sizeof(codec_params_sorted[0]),
+                     compare_codec_param_name)))
+    return NULL;
+  return *res;
+  }
+
+/* Nanoseconds per lookup */
+
+static double measure(const codec_param_t * (*func)(const char * name),
+                      const char ** names, int num_names, int iterations)
+  {
+  int i, j;
+  int found = 0;
+  int64_t start;
+
+  start = get_ns();
+  for(i = 0; i < iterations; i++)
+    {
+    for(j = 0; j < num_names; j++)
+      {
+      if(func(names[j]))
+        found++;
+      }
+    }
+  
+  /* Keep the loop */
+  if(found < 0)
+    printf("%d\n", found);
+  
+  return (double)(get_ns() - start) / ((double)iterations * num_names);
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int num_names = 0;
+  int iterations = 100000;
+  const char ** names;
+  double t_strcmp, t_bsearch;
+  
+  if(argc > 1)
+    iterations = atoi(argv[1]);
+  
+  pthread_once(&codec_params_once, sort_codec_params);
+
+  names = malloc((NUM_CODEC_PARAMS + NUM_OTHER_NAMES) * sizeof(*names));
+  
+  for(i = 0; i < NUM_CODEC_PARAMS; i++)
+    names[num_names++] = codec_params[i].name;
+  for(i = 0; i < NUM_OTHER_NAMES; i++)
+    names[num_names++] = other_names[i];
+
+  /* Both must find the same entries */
+  for(i = 0; i < num_names; i++)
+    {
+    if(find_strcmp(names[i]) != find_bsearch(names[i]))
+      {
+      fprintf(stderr, "Lookup of %s differs\n", names[i]);
+      return 1;
+      }
+    }
+  
+  t_strcmp  = measure(find_strcmp,  names, num_names, iterations);
+  t_bsearch = measure(find_bsearch, names, num_names, iterations);
+  
+  printf("%d parameters, %d other names\n", (int)NUM_CODEC_PARAMS,
+         NUM_OTHER_NAMES);
+  printf("strcmp:  %8.1f ns/lookup\n", t_strcmp);
+  printf("bsearch: %8.1f ns/lookup (%.1fx)\n", t_bsearch,
+         t_strcmp / t_bsearch);
+
+  free(names);
+  return 0;
+  }
@@ -19,8 +19,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * *****************************************************************/
 
+#include <pthread.h>
+
 #include "ffmpeg_common.h"
 
+#include <gmerlin_encoders.h>
+
 #include <gmerlin/utils.h>
 #include <gmerlin/cfg_registry.h>
 
@@ -43,6 +47,65 @@ static void
 get_pixelformat_converter(bg_ffmpeg_codec_context_t * ctx, enum AVPixelFormat fmt,
                           int do_convert);
 
+/*
+ *  avcodec_find_encoder() walks the list of all registered codecs.
+ *  Remember the results for the next codec contexts.
+ */
+
+static pthread_once_t register_once = PTHREAD_ONCE_INIT;
+
+typedef struct
+  {
+  enum AVCodecID id;
+  AVCodec * codec;
+  } encoder_cache_t;
+
+static encoder_cache_t * encoder_cache = NULL;
+static int encoder_cache_len = 0;
+static pthread_mutex_t encoder_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static AVCodec * lookup_encoder(enum AVCodecID id)
+  {
+  int i;
+  AVCodec * ret;
+  
+  pthread_mutex_lock(&encoder_cache_mutex);
+
+  for(i = 0; i < encoder_cache_len; i++)
+    {
+    if(encoder_cache[i].id == id)
+      {
+      ret = encoder_cache[i].codec;
+      pthread_mutex_unlock(&encoder_cache_mutex);
+      return ret;
+      }
+    }
+
+  /* Negative results are cached as well */
+  ret = avcodec_find_encoder(id);
+  
+  encoder_cache = realloc(encoder_cache,
+                          (encoder_cache_len+1) * sizeof(*encoder_cache));
+  encoder_cache[encoder_cache_len].id = id;
+  encoder_cache[encoder_cache_len].codec = ret;
+  encoder_cache_len++;
+  
+  pthread_mutex_unlock(&encoder_cache_mutex);
+  return ret;
+  }
+
+/* Called when the module is unloaded */
+
+void __attribute__((destructor)) bg_ffmpeg_free_encoder_cache(void)
+  {
+  if(encoder_cache)
+    {
+    free(encoder_cache);
+    encoder_cache = NULL;
+    }
+  encoder_cache_len = 0;
+  }
+
 static int find_encoder(bg_ffmpeg_codec_context_t * ctx)
   {
   if(ctx->id == AV_CODEC_ID_NONE)
@@ -51,7 +114,7 @@ static int find_encoder(bg_ffmpeg_codec_context_t * ctx)
   if(ctx->codec)
     return 1;
   
-  if(!(ctx->codec = avcodec_find_encoder(ctx->id)))
+  if(!(ctx->codec = lookup_encoder(ctx->id)))
     {
     bg_log(BG_LOG_ERROR, LOG_DOMAIN,
            "Codec %s not available in your libavcodec installation",
@@ -77,7 +140,7 @@ bg_ffmpeg_codec_context_t * bg_ffmpeg_codec_create(int type,
   {
   bg_ffmpeg_codec_context_t * ret;
 
-  avcodec_register_all();
+  pthread_once(&register_once, avcodec_register_all);
   
   ret = calloc(1, sizeof(*ret));
   
@@ -123,6 +186,17 @@ static void apply_func(void * priv, const char * name, const gavl_value_t * val)
     return;
 
   ctx = priv;
+
+  if(!strcmp(name, "ff_frame_threads"))
+    {
+    ctx->num_frame_threads = val->v.i;
+    return;
+    }
+  if(!strcmp(name, "ff_turbo_first_pass"))
+    {
+    ctx->turbo_first_pass = val->v.i;
+    return;
+    }
   
   bg_ffmpeg_set_codec_parameter(ctx->avctx,
                                 &ctx->options,
@@ -159,12 +233,19 @@ void bg_ffmpeg_codec_set_parameter(bg_ffmpeg_codec_context_t * ctx,
                          ctx);
     
     }
+  else if(!strcmp(name, "ff_frame_threads"))
+    ctx->num_frame_threads = v->v.i;
+  else if(!strcmp(name, "ff_turbo_first_pass"))
+    ctx->turbo_first_pass = v->v.i;
   else if(bg_encoder_set_framerate_parameter(&ctx->fr, name, v))
     return;
   
   }
 
+/* avctx is the opened codec context */
+
 static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
+                                AVCodecContext * avctx,
                                 gavl_compression_info_t * ci,
                                 gavl_dictionary_t * m)
   {
@@ -177,11 +258,11 @@ static int set_compression_info(bg_ffmpeg_codec_context_t * ctx,
 
     /* Extract extradata */
 
-    if(ctx->avctx->extradata_size)
+    if(avctx->extradata_size)
       {
-      ci->global_header_len = ctx->avctx->extradata_size;
+      ci->global_header_len = avctx->extradata_size;
       ci->global_header = malloc(ci->global_header_len);
-      memcpy(ci->global_header, ctx->avctx->extradata, ci->global_header_len);
+      memcpy(ci->global_header, avctx->extradata, ci->global_header_len);
       }
     }
   if(m)
@@ -322,6 +403,61 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
   }
 
 
+/* Native PCM encoding: Convert straight from the frame into packets */
+
+static gavl_sink_status_t
+write_audio_func_pcm(void * data, gavl_audio_frame_t * frame)
+  {
+  int num;
+  int bytes;
+  int src_bytes;
+  int samples_written = 0;
+  bg_ffmpeg_codec_context_t * ctx = data;
+
+  if(ctx->in_pts == GAVL_TIME_UNDEFINED)
+    {
+    ctx->in_pts = frame->timestamp;
+    ctx->out_pts = ctx->in_pts;
+    }
+
+  src_bytes = gavl_bytes_per_sample(ctx->afmt.sample_format) *
+    ctx->afmt.num_channels;
+  
+  /* Packets have at most samples_per_frame samples like the ones
+     from libavcodec */
+  
+  while(samples_written < frame->valid_samples)
+    {
+    num = frame->valid_samples - samples_written;
+    if(num > ctx->afmt.samples_per_frame)
+      num = ctx->afmt.samples_per_frame;
+
+    bytes = num * ctx->afmt.num_channels * ctx->pcm_bytes;
+    
+    gavl_packet_reset(&ctx->gp);
+    gavl_packet_alloc(&ctx->gp, bytes);
+
+    ctx->pcm_encode(frame->samples.u_8 + samples_written * src_bytes,
+                    ctx->gp.data, num * ctx->afmt.num_channels);
+    
+    ctx->gp.data_len = bytes;
+    ctx->gp.pts      = ctx->out_pts;
+    ctx->gp.duration = num;
+    ctx->gp.flags   |= GAVL_PACKET_KEYFRAME;
+    
+    ctx->in_pts  += num;
+    ctx->out_pts += num;
+    
+    if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+      {
+      ctx->flags |= FLAG_ERROR;
+      return GAVL_SINK_ERROR;
+      }
+    samples_written += num;
+    }
+  return GAVL_SINK_OK;
+  }
+
 void bg_ffmpeg_set_audio_format_avctx(AVCodecContext * avctx,
                                       const gavl_audio_format_t * fmt)
   {
@@ -364,9 +500,8 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
 
   
   /* Sample format */
-  ctx->avctx->sample_fmt = ctx->codec->sample_fmts[0];
-  fmt->sample_format =
-    bg_sample_format_ffmpeg_2_gavl(ctx->avctx->sample_fmt, &fmt->interleave_mode);
+  ctx->avctx->sample_fmt =
+    bg_ffmpeg_choose_sampleformat(ctx->codec->sample_fmts, fmt);
 
   /* Set codec specific stuff */
   switch(ctx->avctx->codec_id)
@@ -394,7 +529,7 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
 
   /* Decide whether we need a global header */
   if(!ctx->format ||
-     ((ofmt = guess_format(ctx->format->short_name, NULL, NULL)) &&
+     ((ofmt = guess_format(FORMAT_MUXER(ctx->format), NULL, NULL)) &&
       (ofmt->flags & AVFMT_GLOBALHEADER)))
     ctx->avctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
   
@@ -410,41 +545,46 @@ gavl_audio_sink_t * bg_ffmpeg_codec_open_audio(bg_ffmpeg_codec_context_t * ctx,
   else
     fmt->samples_per_frame = ctx->avctx->frame_size;
   
-  ctx->aframe = gavl_audio_frame_create(fmt);
+  /* Copy format for later use */
+  gavl_audio_format_copy(&ctx->afmt, fmt);
 
-  /* Set up AVFrame */
-  if(fmt->interleave_mode == GAVL_INTERLEAVE_ALL)
-    {
-    ctx->frame->extended_data = ctx->frame->data;
-    ctx->frame->linesize[0] = ctx->aframe->channel_stride * fmt->num_channels;
-    ctx->frame->extended_data[0] = ctx->aframe->samples.u_8;
-    }
+  gavl_packet_alloc(&ctx->gp, 32768);
+
+  if(bg_ffmpeg_pcm_init(ctx, fmt))
+    ctx->asink = gavl_audio_sink_create(NULL, write_audio_func_pcm, ctx, fmt);
   else
     {
-    int i;
-    if(fmt->num_channels > AV_NUM_DATA_POINTERS)
-      ctx->frame->extended_data = av_mallocz(fmt->num_channels *
-                                             sizeof(*ctx->frame->extended_data));
-    else
+    ctx->aframe = gavl_audio_frame_create(fmt);
+
+    /* Set up AVFrame */
+    if(fmt->interleave_mode == GAVL_INTERLEAVE_ALL)
+      {
       ctx->frame->extended_data = ctx->frame->data;
+      ctx->frame->linesize[0] = ctx->aframe->channel_stride * fmt->num_channels;
+      ctx->frame->extended_data[0] = ctx->aframe->samples.u_8;
+      }
+    else
+      {
+      int i;
+      if(fmt->num_channels > AV_NUM_DATA_POINTERS)
+        ctx->frame->extended_data = av_mallocz(fmt->num_channels *
+                                               sizeof(*ctx->frame->extended_data));
+      else
+        ctx->frame->extended_data = ctx->frame->data;
     
-    for(i = 0; i < fmt->num_channels; i++)
-      ctx->frame->extended_data[i] = ctx->aframe->channels.u_8[i];
-    ctx->frame->linesize[0] = ctx->aframe->channel_stride;
-    }
-  
-  /* Mute frame */
-  gavl_audio_frame_mute(ctx->aframe, fmt);
-  ctx->aframe->valid_samples = 0;
-  
-  gavl_packet_alloc(&ctx->gp, 32768);
+      for(i = 0; i < fmt->num_channels; i++)
+        ctx->frame->extended_data[i] = ctx->aframe->channels.u_8[i];
+      ctx->frame->linesize[0] = ctx->aframe->channel_stride;
+      }
   
-  ctx->asink = gavl_audio_sink_create(NULL, write_audio_func, ctx, fmt);
+    /* Mute frame */
+    gavl_audio_frame_mute(ctx->aframe, fmt);
+    ctx->aframe->valid_samples = 0;
   
-  /* Copy format for later use */
-  gavl_audio_format_copy(&ctx->afmt, fmt);
+    ctx->asink = gavl_audio_sink_create(NULL, write_audio_func, ctx, fmt);
+    }
 
-  set_compression_info(ctx, ci, m);
+  set_compression_info(ctx, ctx->avctx, ci, m);
 
   if(ci)
     {
@@ -482,6 +622,260 @@ int bg_ffmpeg_codec_set_video_pass(bg_ffmpeg_codec_context_t * ctx,
   return 1;
   }
 
+/* Packet from the encoder, pts is in the codec timebase */
+
+static void put_video_packet(bg_ffmpeg_codec_context_t * ctx,
+                             gavl_packet_t * gp)
+  {
+  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+    gp->pts *= ctx->vfmt.frame_duration;
+    
+  /* Detect VP8 alternate reference frames */
+  if((ctx->id == AV_CODEC_ID_VP8) &&
+     !(gp->data[0] & 0x10))
+    gp->flags |= GAVL_PACKET_NOOUTPUT; 
+  else
+    {
+    /* Decide frame type */
+    if(gp->pts < ctx->out_pts)
+      gp->flags |= GAVL_PACKET_TYPE_B;
+    else
+      {
+      if(gp->flags & GAVL_PACKET_KEYFRAME)
+        gp->flags |= GAVL_PACKET_TYPE_I;
+      else
+        gp->flags |= GAVL_PACKET_TYPE_P;
+      ctx->out_pts = gp->pts;
+      }
+
+    if(!bg_encoder_pts_cache_pop_packet(ctx->pc, gp, -1, gp->pts))
+      {
+      ctx->flags |= FLAG_ERROR;
+      bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+             "Got no packet in cache for pts %"PRId64, gp->pts);
+      //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", gp->pts);
+      }
+    //      else
+    //        fprintf(stderr, "pop packet: %"PRId64"\n", gp->pts);
+    }
+  /* Write frame */
+
+  //    fprintf(stderr, "Put video packet\n");
+  //    gavl_packet_dump(gp);
+    
+  if(gavl_packet_sink_put_packet(ctx->psink, gp) != GAVL_SINK_OK)
+    {
+    ctx->flags |= FLAG_ERROR;
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+           "Writing packet failed");
+    }
+  }
+
+/*
+ *  Multipass statistics
+ *
+ *  The first pass collects the statistics in memory. When it is
+ *  finished, they are written to the stats file in one go and kept in
+ *  a process wide list, from which the last pass takes them. The file
+ *  is read only if the last pass runs in another process.
+ *
+ *  If the last pass never comes (e.g. it runs in another process), the
+ *  statistics would stay in memory. The list therefore keeps only the
+ *  most recent MAX_STATS_BUFFERS entries, older ones are read from the
+ *  file again. The list is freed when the module is unloaded.
+ */
+
+#define MAX_STATS_BUFFERS 4
+
+typedef struct
+  {
+  char * filename;
+  char * data;
+  int len;
+  } stats_buffer_t;
+
+static stats_buffer_t * stats_buffers = NULL;
+static int num_stats_buffers = 0;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with the mutex locked, the data is freed if free_data is set */
+
+static void remove_stats_buffer(int i, int free_data)
+  {
+  if(free_data)
+    av_free(stats_buffers[i].data);
+  free(stats_buffers[i].filename);
+  num_stats_buffers--;
+  if(i < num_stats_buffers)
+    memmove(stats_buffers + i, stats_buffers + i + 1,
+            (num_stats_buffers - i) * sizeof(*stats_buffers));
+  }
+
+/* Called when the module is unloaded */
+
+static void __attribute__((destructor)) free_stats_buffers(void)
+  {
+  while(num_stats_buffers)
+    remove_stats_buffer(0, 1);
+  if(stats_buffers)
+    {
+    free(stats_buffers);
+    stats_buffers = NULL;
+    }
+  }
+
+static void append_stats(bg_ffmpeg_codec_context_t * ctx, const char * str)
+  {
+  int len = strlen(str);
+
+  if(ctx->stats_len + len + 1 > ctx->stats_alloc)
+    {
+    ctx->stats_alloc = (ctx->stats_len + len + 1) * 2;
+    if(ctx->stats_alloc < 65536)
+      ctx->stats_alloc = 65536;
+    ctx->stats = av_realloc(ctx->stats, ctx->stats_alloc);
+    }
+  memcpy(ctx->stats + ctx->stats_len, str, len + 1);
+  ctx->stats_len += len;
+  }
+
+/* Called when the first pass is finished */
+
+static void finish_stats(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+
+  if(ctx->stats_file)
+    {
+    if(ctx->stats_len &&
+       (fwrite(ctx->stats, 1, ctx->stats_len, ctx->stats_file) < ctx->stats_len))
+      bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Writing %s failed",
+             ctx->stats_filename);
+    fclose(ctx->stats_file);
+    ctx->stats_file = NULL;
+    }
+
+  if(!ctx->stats)
+    return;
+  
+  pthread_mutex_lock(&stats_mutex);
+
+  /* Replace statistics of an earlier run */
+  for(i = 0; i < num_stats_buffers; i++)
+    {
+    if(!strcmp(stats_buffers[i].filename, ctx->stats_filename))
+      {
+      remove_stats_buffer(i, 1);
+      break;
+      }
+    }
+
+  /* Drop the oldest entry */
+  if(num_stats_buffers == MAX_STATS_BUFFERS)
+    {
+    bg_log(BG_LOG_DEBUG, LOG_DOMAIN,
+           "Dropping statistics of %s from memory",
+           stats_buffers[0].filename);
+    remove_stats_buffer(0, 1);
+    }
+  
+  if(!stats_buffers)
+    stats_buffers = malloc(MAX_STATS_BUFFERS * sizeof(*stats_buffers));
+
+  i = num_stats_buffers++;
+  stats_buffers[i].filename = gavl_strdup(ctx->stats_filename);
+  stats_buffers[i].data = ctx->stats;
+  stats_buffers[i].len = ctx->stats_len;
+  
+  pthread_mutex_unlock(&stats_mutex);
+
+  ctx->stats = NULL;
+  ctx->stats_len = 0;
+  ctx->stats_alloc = 0;
+  }
+
+/* Take the statistics from memory, returns NULL if we don't have them */
+
+static char * get_stats(const char * filename)
+  {
+  int i;
+  char * ret = NULL;
+  
+  pthread_mutex_lock(&stats_mutex);
+
+  for(i = 0; i < num_stats_buffers; i++)
+    {
+    if(!strcmp(stats_buffers[i].filename, filename))
+      {
+      ret = stats_buffers[i].data;
+      remove_stats_buffer(i, 0);
+      break;
+      }
+    }
+  
+  pthread_mutex_unlock(&stats_mutex);
+  return ret;
+  }
+
+static char * read_stats(const char * filename)
+  {
+  FILE * f;
+  int len;
+  char * ret;
+
+  if(!(f = fopen(filename, "r")))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Cannot open %s", filename);
+    return NULL;
+    }
+  
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+      
+  ret = av_malloc(len + 1);
+  if(fread(ret, 1, len, f) < len)
+    {
+    av_free(ret);
+    ret = NULL;
+    }
+  else
+    ret[len] = '\0';
+  
+  fclose(f);
+  return ret;
+  }
+
+/*
+ *  Turbo first pass: The statistics depend mostly on the frame types
+ *  and quantizers, which are left alone. Expensive analysis only
+ *  makes the first pass slower.
+ */
+
+static void set_turbo_first_pass(bg_ffmpeg_codec_context_t * ctx)
+  {
+  if(ctx->id == AV_CODEC_ID_H264)
+    {
+    /* Same as x264 --pass 1 without --slow-firstpass */
+    ctx->avctx->refs = 1;
+    ctx->avctx->me_subpel_quality = 2;
+    av_dict_set(&ctx->options, "partitions", "none", 0);
+    av_dict_set(&ctx->options, "8x8dct", "0", 0);
+    av_dict_set(&ctx->options, "trellis", "0", 0);
+    av_dict_set(&ctx->options, "mixed-refs", "0", 0);
+    av_dict_set(&ctx->options, "weightp", "none", 0);
+    av_dict_set(&ctx->options, "motion-est", "dia", 0);
+    }
+  else
+    {
+    ctx->avctx->mb_decision = FF_MB_DECISION_SIMPLE;
+    ctx->avctx->trellis = 0;
+    if(ctx->avctx->me_subpel_quality > 2)
+      ctx->avctx->me_subpel_quality = 2;
+    }
+  bg_log(BG_LOG_INFO, LOG_DOMAIN, "Using turbo first pass");
+  }
+
 static int flush_video(bg_ffmpeg_codec_context_t * ctx,
                        AVFrame * frame)
   {
@@ -521,61 +915,294 @@ static int flush_video(bg_ffmpeg_codec_context_t * ctx,
     
     ctx->gp.data_len = pkt.size;
     ctx->gp.data = pkt.data;
+
+    put_video_packet(ctx, &ctx->gp);
     
-    if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
-      ctx->gp.pts *= ctx->vfmt.frame_duration;
+    /* Collect stats */
+    if((ctx->pass == 1) && ctx->avctx->stats_out)
+      append_stats(ctx, ctx->avctx->stats_out);
+
+    ctx->gp.data = NULL;
     
-    /* Detect VP8 alternate reference frames */
-    if((ctx->id == AV_CODEC_ID_VP8) &&
-       !(ctx->gp.data[0] & 0x10))
-      ctx->gp.flags |= GAVL_PACKET_NOOUTPUT; 
+    av_packet_unref(&pkt);
+    }
+  
+  return 1;
+  }
+
+/*
+ *  Frame parallel encoding for intra-only codecs.
+ *  Each thread has its own codec context and encodes one frame at a time.
+ *  Since frames are distributed round robin, the oldest frame in flight
+ *  is always the one of the next thread.
+ */
+
+#define JOB_IDLE   0
+#define JOB_QUEUED 1
+#define JOB_DONE   2
+
+struct bg_ffmpeg_frame_thread_s
+  {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int have_thread;
+  
+  int state;
+  int quit;
+  int error;
+  
+  AVCodecContext * avctx;
+  AVFrame * frame;
+  gavl_video_frame_t * vframe;
+
+  gavl_packet_t gp;
+  };
+
+static void * frame_thread_func(void * data)
+  {
+  int result;
+  AVPacket pkt;
+  bg_ffmpeg_frame_thread_t * t = data;
+
+  pthread_mutex_lock(&t->mutex);
+  
+  while(1)
+    {
+    while((t->state != JOB_QUEUED) && !t->quit)
+      pthread_cond_wait(&t->cond, &t->mutex);
+
+    if(t->quit)
+      break;
+    
+    pthread_mutex_unlock(&t->mutex);
+
+    gavl_packet_reset(&t->gp);
+    
+    if(avcodec_send_frame(t->avctx, t->frame) < 0)
+      t->error = 1;
     else
       {
-      /* Decide frame type */
-      if(ctx->gp.pts < ctx->out_pts)
-        ctx->gp.flags |= GAVL_PACKET_TYPE_B;
-      else
-        {
-        if(ctx->gp.flags & GAVL_PACKET_KEYFRAME)
-          ctx->gp.flags |= GAVL_PACKET_TYPE_I;
-        else
-          ctx->gp.flags |= GAVL_PACKET_TYPE_P;
-        ctx->out_pts = ctx->gp.pts;
-        }
+      /* Intra-only codecs return exactly one packet */
+      av_init_packet(&pkt);
+      result = avcodec_receive_packet(t->avctx, &pkt);
 
-      if(!bg_encoder_pts_cache_pop_packet(ctx->pc, &ctx->gp, -1, ctx->gp.pts))
+      if(!result)
         {
-        ctx->flags |= FLAG_ERROR;
-        bg_log(BG_LOG_ERROR, LOG_DOMAIN,
-               "Got no packet in cache for pts %"PRId64, ctx->gp.pts);
-        //     fprintf(stderr, "Got no packet in cache for pts %"PRId64"\n", ctx->gp.pts);
+        gavl_packet_alloc(&t->gp, pkt.size);
+        memcpy(t->gp.data, pkt.data, pkt.size);
+        t->gp.data_len = pkt.size;
+        t->gp.pts = pkt.pts;
+        if(pkt.flags & AV_PKT_FLAG_KEY)
+          t->gp.flags |= GAVL_PACKET_KEYFRAME;
+        av_packet_unref(&pkt);
         }
-      //      else
-        //        fprintf(stderr, "pop packet: %"PRId64"\n", ctx->gp.pts);
+      else
+        t->error = 1;
       }
-    /* Write frame */
+    
+    pthread_mutex_lock(&t->mutex);
+    t->state = JOB_DONE;
+    pthread_cond_broadcast(&t->cond);
+    }
+  
+  pthread_mutex_unlock(&t->mutex);
+  return NULL;
+  }
+
+/* Wait until the thread is idle. A finished packet is written */
+
+static void frame_thread_wait(bg_ffmpeg_codec_context_t * ctx,
+                              bg_ffmpeg_frame_thread_t * t)
+  {
+  pthread_mutex_lock(&t->mutex);
+  while(t->state == JOB_QUEUED)
+    pthread_cond_wait(&t->cond, &t->mutex);
+  pthread_mutex_unlock(&t->mutex);
+  
+  if(t->state != JOB_DONE)
+    return;
+
+  t->state = JOB_IDLE;
+
+  if(t->error)
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Encoding frame failed");
+    ctx->flags |= FLAG_ERROR;
+    return;
+    }
+  put_video_packet(ctx, &t->gp);
+  }
+
+/*
+ *  Each frame in flight has an entry in the pts cache, which has a
+ *  fixed size. Returns how many of max frames fit.
+ */
 
-    //    fprintf(stderr, "Put video packet\n");
-    //    gavl_packet_dump(&ctx->gp);
+static int pts_cache_frames(int max)
+  {
+  int ret;
+  bg_encoder_pts_cache_t * pc = bg_encoder_pts_cache_create();
+  gavl_video_frame_t * f = gavl_video_frame_create(NULL);
+
+  for(ret = 0; ret < max; ret++)
+    {
+    f->timestamp = ret;
+    f->duration = 1;
+    if(!bg_encoder_pts_cache_push_frame(pc, f))
+      break;
+    }
+  gavl_video_frame_destroy(f);
+  bg_encoder_pts_cache_destroy(pc);
+  return ret;
+  }
+
+static int init_frame_threads(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+  AVDictionary * options;
+  bg_ffmpeg_frame_thread_t * t;
+  
+  ctx->frame_threads = calloc(ctx->num_frame_threads,
+                              sizeof(*ctx->frame_threads));
+  
+  for(i = 0; i < ctx->num_frame_threads; i++)
+    {
+    t = &ctx->frame_threads[i];
+
+    /* Copy the settings before ctx->avctx is opened */
+    t->avctx = avcodec_alloc_context3(NULL);
+    if(avcodec_copy_context(t->avctx, ctx->avctx) < 0)
+      return 0;
+
+    options = NULL;
+    av_dict_copy(&options, ctx->options, 0);
     
-    if(gavl_packet_sink_put_packet(ctx->psink, &ctx->gp) != GAVL_SINK_OK)
+    if(avcodec_open2(t->avctx, ctx->codec, &options) < 0)
       {
-      ctx->flags |= FLAG_ERROR;
-      bg_log(BG_LOG_ERROR, LOG_DOMAIN,
-             "Writing packet failed");
+      av_dict_free(&options);
+      return 0;
       }
-    /* Write stats */
-    if((ctx->pass == 1) && ctx->avctx->stats_out && ctx->stats_file)
-      fprintf(ctx->stats_file, "%s", ctx->avctx->stats_out);
-
-    ctx->gp.data = NULL;
+    av_dict_free(&options);
     
-    av_packet_unref(&pkt);
+    t->frame = av_frame_alloc();
+    t->frame->width  = ctx->vfmt.image_width;
+    t->frame->height = ctx->vfmt.image_height;
+    t->frame->format = t->avctx->pix_fmt;
+    t->vframe = gavl_video_frame_create(&ctx->vfmt);
+
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if(pthread_create(&t->thread, NULL, frame_thread_func, t))
+      {
+      pthread_mutex_destroy(&t->mutex);
+      pthread_cond_destroy(&t->cond);
+      return 0;
+      }
+    t->have_thread = 1;
     }
-  
   return 1;
   }
 
+static void flush_frame_threads(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+  for(i = 0; i < ctx->num_frame_threads; i++)
+    {
+    frame_thread_wait(ctx, &ctx->frame_threads[ctx->next_frame_thread]);
+    ctx->next_frame_thread = (ctx->next_frame_thread + 1) %
+      ctx->num_frame_threads;
+    }
+  }
+
+static void destroy_frame_threads(bg_ffmpeg_codec_context_t * ctx)
+  {
+  int i;
+  bg_ffmpeg_frame_thread_t * t;
+  
+  for(i = 0; i < ctx->num_frame_threads; i++)
+    {
+    t = &ctx->frame_threads[i];
+
+    if(t->have_thread)
+      {
+      pthread_mutex_lock(&t->mutex);
+      t->quit = 1;
+      pthread_cond_broadcast(&t->cond);
+      pthread_mutex_unlock(&t->mutex);
+      pthread_join(t->thread, NULL);
+      
+      pthread_mutex_destroy(&t->mutex);
+      pthread_cond_destroy(&t->cond);
+      }
+    if(t->vframe)
+      gavl_video_frame_destroy(t->vframe);
+    if(t->avctx)
+      {
+      avcodec_close(t->avctx);
+      av_free(t->avctx);
+      }
+    if(t->frame)
+      av_frame_free(&t->frame);
+    gavl_packet_free(&t->gp);
+    }
+  free(ctx->frame_threads);
+  ctx->frame_threads = NULL;
+  }
+
+static gavl_video_frame_t * get_video_func_threads(void * data)
+  {
+  bg_ffmpeg_codec_context_t * ctx = data;
+  bg_ffmpeg_frame_thread_t * t = &ctx->frame_threads[ctx->next_frame_thread];
+  frame_thread_wait(ctx, t);
+  return t->vframe;
+  }
+
+static gavl_sink_status_t
+write_video_func_threads(void * data, gavl_video_frame_t * frame)
+  {
+  bg_ffmpeg_codec_context_t * ctx = data;
+  bg_ffmpeg_frame_thread_t * t = &ctx->frame_threads[ctx->next_frame_thread];
+
+  frame_thread_wait(ctx, t);
+  
+  if(ctx->flags & FLAG_ERROR)
+    return GAVL_SINK_ERROR;
+  
+  if(!bg_encoder_pts_cache_push_frame(ctx->pc, frame))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "PTS cache full");
+    return GAVL_SINK_ERROR;
+    }
+
+  /* Frame is owned by the caller */
+  if(frame != t->vframe)
+    gavl_video_frame_copy(&ctx->vfmt, t->vframe, frame);
+  
+  if(ctx->convert_frame)
+    ctx->convert_frame(ctx, t->vframe);
+  
+  t->frame->pts = frame->timestamp;
+  if(ctx->vfmt.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+    t->frame->pts /= ctx->vfmt.frame_duration;
+
+  t->frame->data[0]     = t->vframe->planes[0];
+  t->frame->data[1]     = t->vframe->planes[1];
+  t->frame->data[2]     = t->vframe->planes[2];
+  t->frame->linesize[0] = t->vframe->strides[0];
+  t->frame->linesize[1] = t->vframe->strides[1];
+  t->frame->linesize[2] = t->vframe->strides[2];
+
+  pthread_mutex_lock(&t->mutex);
+  t->state = JOB_QUEUED;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->mutex);
+  
+  ctx->next_frame_thread = (ctx->next_frame_thread + 1) %
+    ctx->num_frame_threads;
+  return GAVL_SINK_OK;
+  }
+
 static gavl_sink_status_t
 write_video_func(void * data, gavl_video_frame_t * frame)
   {
@@ -647,6 +1274,7 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
                                                gavl_dictionary_t * m)
   {
   int do_convert = 0;
+  int max_threads;
   const ffmpeg_codec_info_t * info;
   gavl_video_sink_get_func get_func = NULL;
   AVOutputFormat * ofmt;
@@ -699,32 +1327,21 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   
   if(ctx->total_passes)
     {
-    int stats_len;
-    
     if(ctx->pass == 1)
       {
       ctx->stats_file = fopen(ctx->stats_filename, "w");
       ctx->avctx->flags |= CODEC_FLAG_PASS1;
+
+      if(ctx->turbo_first_pass)
+        set_turbo_first_pass(ctx);
       }
     else if(ctx->pass == ctx->total_passes)
       {
-      ctx->stats_file = fopen(ctx->stats_filename, "r");
-      fseek(ctx->stats_file, 0, SEEK_END);
-      stats_len = ftell(ctx->stats_file);
-      fseek(ctx->stats_file, 0, SEEK_SET);
-      
-      ctx->avctx->stats_in = av_malloc(stats_len + 1);
-      if(fread(ctx->avctx->stats_in, 1,
-               stats_len, ctx->stats_file) < stats_len)
-        {
-        av_free(ctx->avctx->stats_in);
-        ctx->avctx->stats_in = NULL;
-        }
+      if((ctx->avctx->stats_in = get_stats(ctx->stats_filename)))
+        bg_log(BG_LOG_DEBUG, LOG_DOMAIN,
+               "Using statistics of the first pass from memory");
       else
-        ctx->avctx->stats_in[stats_len] = '\0';
-      
-      fclose(ctx->stats_file);
-      ctx->stats_file = NULL;
+        ctx->avctx->stats_in = read_stats(ctx->stats_filename);
       
       ctx->avctx->flags |= CODEC_FLAG_PASS2;
       }
@@ -733,11 +1350,40 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   
   /* Decide whether we need a global header */
   if(!ctx->format ||
-     ((ofmt = guess_format(ctx->format->short_name, NULL, NULL)) &&
+     ((ofmt = guess_format(FORMAT_MUXER(ctx->format), NULL, NULL)) &&
       (ofmt->flags & AVFMT_GLOBALHEADER)))
     ctx->avctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
   
-  if(avcodec_open2(ctx->avctx, ctx->codec, &ctx->options) < 0)
+  gavl_video_format_copy(&ctx->vfmt, fmt);
+
+  /* Frame threads work only if the frames are independent */
+  if((ctx->num_frame_threads > 1) &&
+     (!(info->flags & FLAG_INTRA_ONLY) || ctx->total_passes))
+    ctx->num_frame_threads = 0;
+
+  if(ctx->num_frame_threads > 1)
+    {
+    max_threads = pts_cache_frames(ctx->num_frame_threads);
+    if(max_threads < ctx->num_frame_threads)
+      {
+      bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+             "PTS cache holds %d frames, reducing frame threads from %d",
+             max_threads, ctx->num_frame_threads);
+      ctx->num_frame_threads = max_threads;
+      }
+    }
+  
+  if((ctx->num_frame_threads > 1) && !init_frame_threads(ctx))
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Initializing frame threads failed, encoding one frame at a time");
+    destroy_frame_threads(ctx);
+    ctx->num_frame_threads = 0;
+    }
+  
+  /* With frame threads, the main context only holds the settings */
+  if(!ctx->frame_threads &&
+     (avcodec_open2(ctx->avctx, ctx->codec, &ctx->options) < 0))
     {
     bg_log(BG_LOG_ERROR, LOG_DOMAIN, "avcodec_open2 failed for video");
     return NULL;
@@ -747,8 +1393,6 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
   
   //  gavl_packet_alloc(&ctx->gp, fmt->image_width * fmt->image_width * 4);
   
-  gavl_video_format_copy(&ctx->vfmt, fmt);
-
   /* Create temporary frame if necessary */
   if(do_convert)
     {
@@ -760,10 +1404,20 @@ gavl_video_sink_t * bg_ffmpeg_codec_open_video(bg_ffmpeg_codec_context_t * ctx,
     
     }
 
-  ctx->vsink = gavl_video_sink_create(get_func, write_video_func, ctx, &ctx->vfmt);
+  if(ctx->frame_threads)
+    {
+    bg_log(BG_LOG_INFO, LOG_DOMAIN, "Encoding %d frames in parallel",
+           ctx->num_frame_threads);
+    ctx->vsink = gavl_video_sink_create(get_video_func_threads,
+                                        write_video_func_threads,
+                                        ctx, &ctx->vfmt);
+    }
+  else
+    ctx->vsink = gavl_video_sink_create(get_func, write_video_func, ctx, &ctx->vfmt);
   
   /* Set up compression info */
-  set_compression_info(ctx, ci, m);
+  set_compression_info(ctx, ctx->frame_threads ?
+                       ctx->frame_threads[0].avctx : ctx->avctx, ci, m);
 
   if(ci)
     {
@@ -805,11 +1459,13 @@ void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx)
   if(!(ctx->flags & FLAG_INITIALIZED))
     return;
 
-  if(ctx->type == AVMEDIA_TYPE_VIDEO)
+  if(ctx->frame_threads)
+    flush_frame_threads(ctx);
+  else if(ctx->type == AVMEDIA_TYPE_VIDEO)
     flush_video(ctx, NULL);
   else // Audio
     {
-    while(1)
+    while(ctx->aframe)
       {
       // fprintf(stderr, "Flush audio %d\n", ctx->aframe->valid_samples);
       result = flush_audio(ctx);
@@ -825,19 +1481,28 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
   {
   if(!(ctx->flags & FLAG_FLUSHED))
     bg_ffmpeg_codec_flush(ctx);
+
+  if(ctx->pass == 1)
+    finish_stats(ctx);
   
   /* Close */
 
   if(ctx->avctx->stats_in)
     {
-    free(ctx->avctx->stats_in);
+    av_free(ctx->avctx->stats_in);
     ctx->avctx->stats_in = NULL;
     }
 //  if(ctx->flags & FLAG_INITIALIZED)
     avcodec_close(ctx->avctx);
+
+  if(ctx->frame_threads)
+    destroy_frame_threads(ctx);
   
   /* Destroy */
 
+  /* Left over by avcodec_open2() or unused with frame threads */
+  av_dict_free(&ctx->options);
+  
   if(ctx->avctx_priv)
     av_free(ctx->avctx_priv);
   
@@ -866,6 +1531,9 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
   if(ctx->stats_file)
     fclose(ctx->stats_file);
   
+  if(ctx->stats)
+    av_free(ctx->stats);
+  
   gavl_packet_free(&ctx->gp);
   free(ctx);
   }
@@ -876,22 +1544,11 @@ void bg_ffmpeg_codec_destroy(bg_ffmpeg_codec_context_t * ctx)
 
 static void convert_frame_bgra(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f)
   {
-  int i, j;
-  uint8_t * ptr;
-  uint8_t swp;
+  int i;
   
+  /* RGBA -> BGRA */
   for(i = 0; i < ctx->vfmt.image_height; i++)
-    {
-    ptr = f->planes[0] + i * f->strides[0];
-    for(j = 0; j < ctx->vfmt.image_width; j++)
-      {
-      /* RGBA -> BGRA */
-      swp = ptr[0];
-      ptr[0] = ptr[2];
-      ptr[2] = swp;
-      ptr += 4;
-      }
-    }
+    bgen_swap_rb_32(f->planes[0] + i * f->strides[0], ctx->vfmt.image_width);
   }
 
 static void 
@@ -20,6 +20,8 @@
  * *****************************************************************/
 
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
 
 #include "ffmpeg_common.h"
 #include "params.h"
@@ -270,6 +272,7 @@ static const bg_parameter_info_t parameters_mpeg4[] = {
   ENCODE_PARAM_VIDEO_QPEL,
   ENCODE_PARAM_VIDEO_MASKING,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_TURBO_FIRST_PASS,
   { /* End of parameters */ }
 };
 
@@ -277,6 +280,7 @@ static const bg_parameter_info_t parameters_mjpeg[] = {
   ENCODE_PARAM_VIDEO_RATECONTROL,
   ENCODE_PARAM_VIDEO_QUANTIZER_I,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_FRAME_THREADS,
   { /* End of parameters */ }
 };
 
@@ -288,6 +292,7 @@ static const bg_parameter_info_t parameters_mpeg1[] = {
   ENCODE_PARAM_VIDEO_ME_PRE,
   ENCODE_PARAM_VIDEO_MASKING,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_TURBO_FIRST_PASS,
   { /* End of parameters */ }
 };
 
@@ -300,6 +305,7 @@ static const bg_parameter_info_t parameters_msmpeg4v3[] = {
   ENCODE_PARAM_VIDEO_ME_PRE,
   ENCODE_PARAM_VIDEO_MASKING,
   ENCODE_PARAM_VIDEO_MISC,
+  PARAM_TURBO_FIRST_PASS,
   { /* End of parameters */ }
 };
 
@@ -386,6 +392,7 @@ static const bg_parameter_info_t parameters_libx264[] = {
     .val_default = GAVL_VALUE_INIT_INT(-1),
     .help_string = TRS("Negative means disable, 0 means lossless"),
   },
+  PARAM_TURBO_FIRST_PASS,
   { /* End */ },
 };
 
@@ -537,6 +544,7 @@ static const bg_parameter_info_t parameters_tga[] = {
     .long_name = TRS("Use RLE compression"),
     .type =      BG_PARAMETER_CHECKBUTTON,
   },
+  PARAM_FRAME_THREADS,
   { /* */ }
 };
 
@@ -1047,73 +1055,73 @@ typedef struct
   int i;
   } enum_t;
 
+/*
+ *  Codec parameters are set through a table, which is sorted once
+ *  and searched with bsearch()
+ */
+
+#define PARAM_TYPE_INT          0 /* ctx->var = val * scale */
+#define PARAM_TYPE_STR_INT      1 /* ctx->var = atoi(val) * scale */
+#define PARAM_TYPE_FLOAT        2
+#define PARAM_TYPE_QP2LAMBDA    3 /* Integer field */
+#define PARAM_TYPE_QP2LAMBDA_F  4 /* Float field */
+#define PARAM_TYPE_ENUM         5
+#define PARAM_TYPE_FLAG         6 /* Set or clear bits */
+#define PARAM_TYPE_CHOICE       7 /* ctx->var = val ? arg : arg2 */
+#define PARAM_TYPE_DICT_STRING  8
+#define PARAM_TYPE_DICT_FLOAT   9
+#define PARAM_TYPE_DICT_INT    10
+
+typedef struct
+  {
+  const char * name;
+  int type;
+
+  size_t offset; /* In AVCodecContext */
+  int size;      /* Of integer fields */
+
+  int64_t arg;
+  int64_t arg2;
+
+  const enum_t * enums;
+  int num_enums;
+
+  const char * key; /* For the options dictionary */
+  } codec_param_t;
+
+#define FIELD(var) \
+  .offset = offsetof(AVCodecContext, var),     \
+  .size = sizeof(((AVCodecContext*)0)->var)
+
 #define PARAM_INT(n, var) \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.i;                         \
-    }
+  { .name = n, .type = PARAM_TYPE_INT, FIELD(var), .arg = 1 }
 
-#define PARAM_INT_SCALE(n, var, scale)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.i * scale;                 \
-    }
+#define PARAM_INT_SCALE(n, var, scale) \
+  { .name = n, .type = PARAM_TYPE_INT, FIELD(var), .arg = scale }
 
 #define PARAM_STR_INT_SCALE(n, var, scale) \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = atoi(val->v.str) * scale; \
-    }
+  { .name = n, .type = PARAM_TYPE_STR_INT, FIELD(var), .arg = scale }
 
+#define PARAM_QP2LAMBDA(n, var) \
+  { .name = n, .type = PARAM_TYPE_QP2LAMBDA, FIELD(var) }
 
-#define PARAM_QP2LAMBDA(n, var)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = (int)(val->v.d * FF_QP2LAMBDA+0.5);  \
-    }
-#define PARAM_FLOAT(n, var)   \
-  if(!strcmp(n, name)) \
-    { \
-    ctx->var = val->v.d;                 \
-    }
+#define PARAM_QP2LAMBDA_FLOAT(n, var) \
+  { .name = n, .type = PARAM_TYPE_QP2LAMBDA_F, FIELD(var) }
 
-#define PARAM_CMP_CHROMA(n,var)              \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->var |= FF_CMP_CHROMA;                \
-    else                                        \
-      ctx->var &= ~FF_CMP_CHROMA;               \
-                                                \
-    }                                           \
-  }
+#define PARAM_FLOAT(n, var) \
+  { .name = n, .type = PARAM_TYPE_FLOAT, FIELD(var) }
 
-#define PARAM_FLAG(n,flag)                  \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->flags |= flag;                \
-    else                                        \
-      ctx->flags &= ~flag;               \
-                                                \
-    }                                           \
-  }
+#define PARAM_CMP_CHROMA(n, var) \
+  { .name = n, .type = PARAM_TYPE_FLAG, FIELD(var), .arg = FF_CMP_CHROMA }
 
-#define PARAM_FLAG2(n,flag)                  \
-  {                                             \
-  if(!strcmp(n, name))                    \
-    {                                           \
-    if(val->v.i)                            \
-      ctx->flags2 |= flag;                \
-    else                                        \
-      ctx->flags2 &= ~flag;               \
-                                                \
-    }                                           \
-  }
+#define PARAM_FLAG(n, flag) \
+  { .name = n, .type = PARAM_TYPE_FLAG, FIELD(flags), .arg = flag }
 
-  
+#define PARAM_FLAG2(n, flag) \
+  { .name = n, .type = PARAM_TYPE_FLAG, FIELD(flags2), .arg = flag }
+
+#define PARAM_CHOICE(n, var, on, off) \
+  { .name = n, .type = PARAM_TYPE_CHOICE, FIELD(var), .arg = on, .arg2 = off }
 
 static const enum_t me_method[] =
   {
@@ -1163,44 +1171,162 @@ static const enum_t faac_profile[] =
   };
 
 #define PARAM_ENUM(n, var, arr) \
-  if(!strcmp(n, name)) \
-    { \
-    for(i = 0; i < sizeof(arr)/sizeof(arr[0]); i++) \
-      {                                             \
-      if(!strcmp(val->v.str, arr[i].s))       \
-        {                                           \
-        ctx->var = arr[i].i;                        \
-        break;                                      \
-        }                                           \
-      }                                             \
-    }
+  { .name = n, .type = PARAM_TYPE_ENUM, FIELD(var), \
+    .enums = arr, .num_enums = sizeof(arr)/sizeof(arr[0]) }
 
 #define PARAM_DICT_STRING(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    if(val->v.str && (val->v.str[0] != '$')) \
-      av_dict_set(options,                      \
-                  ffmpeg_key, val->v.str, 0); \
-    }
+  { .name = n, .type = PARAM_TYPE_DICT_STRING, .key = ffmpeg_key }
 
 #define PARAM_DICT_FLOAT(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    char * str; \
-    str = bg_sprintf("%f", val->v.d); \
-    av_dict_set(options, ffmpeg_key, str, 0); \
-    free(str); \
-    }
+  { .name = n, .type = PARAM_TYPE_DICT_FLOAT, .key = ffmpeg_key }
 
 #define PARAM_DICT_INT(n, ffmpeg_key) \
-  if(!strcmp(n, name)) \
-    { \
-    char * str; \
-    str = bg_sprintf("%d", val->v.i); \
-    av_dict_set(options, ffmpeg_key, str, 0); \
-    free(str); \
-    }
+  { .name = n, .type = PARAM_TYPE_DICT_INT, .key = ffmpeg_key }
+
+/*
+ *   The order of the entries doesn't matter: The table is sorted by name
+ *   in sort_codec_params() and searched with bsearch(), so each name
+ *   must appear only once.
+ */
+
+static const codec_param_t codec_params[] =
+  {
+  PARAM_INT_SCALE("ff_bit_rate_video",bit_rate,1000),
+  PARAM_INT_SCALE("ff_bit_rate_audio",bit_rate,1000),
+  
+  PARAM_STR_INT_SCALE("ff_bit_rate_str", bit_rate, 1000),
+
+  PARAM_INT_SCALE("ff_bit_rate_tolerance",bit_rate_tolerance,1000),
+  PARAM_INT("ff_gop_size",gop_size),
+  PARAM_FLOAT("ff_qcompress",qcompress),
+  PARAM_FLOAT("ff_qblur",qblur),
+  PARAM_INT("ff_qmin",qmin),
+  PARAM_INT("ff_qmax",qmax),
+  PARAM_INT("ff_max_qdiff",max_qdiff),
+  PARAM_INT("ff_max_b_frames",max_b_frames),
+  PARAM_FLOAT("ff_b_quant_factor",b_quant_factor),
+  PARAM_INT("ff_strict_std_compliance",strict_std_compliance),
+  PARAM_QP2LAMBDA_FLOAT("ff_b_quant_offset",b_quant_offset),
+  PARAM_INT("ff_rc_min_rate",rc_min_rate),
+  PARAM_INT("ff_rc_max_rate",rc_max_rate),
+  PARAM_INT_SCALE("ff_rc_buffer_size",rc_buffer_size,1000),
+  PARAM_FLOAT("ff_i_quant_factor",i_quant_factor),
+  PARAM_QP2LAMBDA_FLOAT("ff_i_quant_offset",i_quant_offset),
+  PARAM_FLOAT("ff_lumi_masking",lumi_masking),
+  PARAM_FLOAT("ff_temporal_cplx_masking",temporal_cplx_masking),
+  PARAM_FLOAT("ff_spatial_cplx_masking",spatial_cplx_masking),
+  PARAM_FLOAT("ff_p_masking",p_masking),
+  PARAM_FLOAT("ff_dark_masking",dark_masking),
+  PARAM_ENUM("ff_me_cmp",me_cmp,compare_func),
+  PARAM_CMP_CHROMA("ff_me_cmp_chroma",me_cmp),
+  PARAM_ENUM("ff_me_sub_cmp",me_sub_cmp,compare_func),
+  PARAM_CMP_CHROMA("ff_me_sub_cmp_chroma",me_sub_cmp),
+  PARAM_ENUM("ff_mb_cmp",mb_cmp,compare_func),
+  PARAM_CMP_CHROMA("ff_mb_cmp_chroma",mb_cmp),
+  PARAM_ENUM("ff_ildct_cmp",ildct_cmp,compare_func),
+  PARAM_CMP_CHROMA("ff_ildct_cmp_chroma",ildct_cmp),
+  PARAM_INT("ff_dia_size",dia_size),
+  PARAM_INT("ff_last_predictor_count",last_predictor_count),
+  PARAM_ENUM("ff_me_pre_cmp",me_pre_cmp,compare_func),
+  PARAM_CMP_CHROMA("ff_pre_me_cmp_chroma",me_pre_cmp),
+  PARAM_INT("ff_pre_dia_size",pre_dia_size),
+  PARAM_INT("ff_me_subpel_quality",me_subpel_quality),
+  PARAM_INT("ff_me_range",me_range),
+  PARAM_ENUM("ff_mb_decision",mb_decision,mb_decision),
+  PARAM_INT_SCALE("ff_rc_initial_buffer_occupancy",rc_initial_buffer_occupancy,1000),
+  PARAM_INT("ff_nsse_weight",nsse_weight),
+  PARAM_QP2LAMBDA("ff_mb_lmin", mb_lmin),
+  PARAM_QP2LAMBDA("ff_mb_lmax", mb_lmax),
+  PARAM_INT("ff_bidir_refine",bidir_refine),
+  PARAM_INT("ff_keyint_min",keyint_min),
+  PARAM_FLAG("ff_flag_qscale",CODEC_FLAG_QSCALE),
+  PARAM_FLAG("ff_flag_4mv",CODEC_FLAG_4MV),
+  PARAM_FLAG("ff_flag_qpel",CODEC_FLAG_QPEL),
+  PARAM_FLAG("ff_flag_gmc",CODEC_FLAG_GMC),
+  PARAM_FLAG("ff_flag_mv0",CODEC_FLAG_MV0),
+  //  PARAM_FLAG("ff_flag_part",CODEC_FLAG_PART),
+  PARAM_FLAG("ff_flag_gray",CODEC_FLAG_GRAY),
+  PARAM_FLAG("ff_flag_emu_edge",CODEC_FLAG_EMU_EDGE),
+  PARAM_FLAG("ff_flag_normalize_aqp",CODEC_FLAG_NORMALIZE_AQP),
+  //  PARAM_FLAG("ff_flag_alt_scan",CODEC_FLAG_ALT_SCAN),
+  PARAM_INT("ff_trellis",trellis),
+  PARAM_FLAG("ff_flag_bitexact",CODEC_FLAG_BITEXACT),
+  PARAM_FLAG("ff_flag_ac_pred",CODEC_FLAG_AC_PRED),
+  //  PARAM_FLAG("ff_flag_h263p_umv",CODEC_FLAG_H263P_UMV),
+  //  PARAM_FLAG("ff_flag_cbp_rd",CODEC_FLAG_CBP_RD),
+  //  PARAM_FLAG("ff_flag_qp_rd",CODEC_FLAG_QP_RD),
+  //  PARAM_FLAG("ff_flag_h263p_aiv",CODEC_FLAG_H263P_AIV),
+  //  PARAM_FLAG("ffx_flag_obmc",CODEC_FLAG_OBMC),
+  PARAM_FLAG("ff_flag_loop_filter",CODEC_FLAG_LOOP_FILTER),
+  //  PARAM_FLAG("ff_flag_h263p_slice_struct",CODEC_FLAG_H263P_SLICE_STRUCT),
+  PARAM_FLAG("ff_flag_closed_gop",CODEC_FLAG_CLOSED_GOP),
+  PARAM_FLAG2("ff_flag2_fast",CODEC_FLAG2_FAST),
+  //  PARAM_FLAG2("ff_flag2_strict_gop",CODEC_FLAG2_STRICT_GOP),
+  PARAM_INT("ff_thread_count",thread_count),
+  
+  PARAM_DICT_STRING("libx264_preset", "preset"),
+  PARAM_DICT_STRING("libx264_tune",   "tune"),
+  PARAM_DICT_FLOAT("libx264_crf", "crf"),
+  PARAM_DICT_FLOAT("libx264_qp", "qp"),
+
+  PARAM_ENUM("faac_profile", profile, faac_profile),
+
+  PARAM_INT_SCALE("faac_quality", global_quality, FF_QP2LAMBDA),
+  PARAM_INT_SCALE("vorbis_quality", global_quality, FF_QP2LAMBDA),
+  
+  PARAM_CHOICE("tga_rle", coder_type, FF_CODER_TYPE_RLE, FF_CODER_TYPE_RAW),
+  
+  PARAM_DICT_STRING("libvpx_deadline", "deadline"),
+  PARAM_DICT_INT("libvpx_cpu-used",   "cpu-used"),
+  PARAM_DICT_INT("libvpx_auto-alt-ref", "alt-ref"),
+  PARAM_DICT_INT("libvpx_lag-in-frames", "lag-in-frames"),
+  PARAM_DICT_INT("libvpx_arnr-max-frames", "arnr-max-frames"),
+  PARAM_DICT_INT("libvpx_crf", "crf"),
+  PARAM_DICT_STRING("libvpx_arnr-type", "arnr-type"),
+  };
+
+#define NUM_CODEC_PARAMS (sizeof(codec_params)/sizeof(codec_params[0]))
+
+static const codec_param_t * codec_params_sorted[NUM_CODEC_PARAMS];
+static pthread_once_t codec_params_once = PTHREAD_ONCE_INIT;
+
+static int compare_codec_param(const void * p1, const void * p2)
+  {
+  const codec_param_t * const * c1 = p1;
+  const codec_param_t * const * c2 = p2;
+  return strcmp((*c1)->name, (*c2)->name);
+  }
+
+static int compare_codec_param_name(const void * key, const void * p)
+  {
+  const codec_param_t * const * c = p;
+  return strcmp(key, (*c)->name);
+  }
+
+static void sort_codec_params()
+  {
+  int i;
+  for(i = 0; i < NUM_CODEC_PARAMS; i++)
+    codec_params_sorted[i] = &codec_params[i];
+  qsort(codec_params_sorted, NUM_CODEC_PARAMS, sizeof(codec_params_sorted[0]),
+        compare_codec_param);
+  }
 
+static void set_int_field(void * ptr, int size, int64_t val)
+  {
+  if(size == sizeof(int64_t))
+    *((int64_t*)ptr) = val;
+  else
+    *((int*)ptr) = val;
+  }
+
+static int64_t get_int_field(void * ptr, int size)
+  {
+  if(size == sizeof(int64_t))
+    return *((int64_t*)ptr);
+  else
+    return *((int*)ptr);
+  }
 
 void
 bg_ffmpeg_set_codec_parameter(AVCodecContext * ctx,
@@ -1209,112 +1335,71 @@ bg_ffmpeg_set_codec_parameter(AVCodecContext * ctx,
                               const gavl_value_t * val)
   {
   int i;
-/*
- *   IMPORTANT: To keep the mess at a reasonable level,
- *   *all* parameters *must* appear in the same order as in
- *   the AVCocecContext structure, except the flags, which come at the very end
- */
-  
-  PARAM_INT_SCALE("ff_bit_rate_video",bit_rate,1000);
-  PARAM_INT_SCALE("ff_bit_rate_audio",bit_rate,1000);
+  const codec_param_t * const * res;
+  const codec_param_t * p;
+  void * ptr;
+  char * str;
   
-  PARAM_STR_INT_SCALE("ff_bit_rate_str", bit_rate, 1000);
-
-  PARAM_INT_SCALE("ff_bit_rate_tolerance",bit_rate_tolerance,1000);
-  PARAM_INT("ff_gop_size",gop_size);
-  PARAM_FLOAT("ff_qcompress",qcompress);
-  PARAM_FLOAT("ff_qblur",qblur);
-  PARAM_INT("ff_qmin",qmin);
-  PARAM_INT("ff_qmax",qmax);
-  PARAM_INT("ff_max_qdiff",max_qdiff);
-  PARAM_INT("ff_max_b_frames",max_b_frames);
-  PARAM_FLOAT("ff_b_quant_factor",b_quant_factor);
-  PARAM_INT("ff_strict_std_compliance",strict_std_compliance);
-  PARAM_QP2LAMBDA("ff_b_quant_offset",b_quant_offset);
-  PARAM_INT("ff_rc_min_rate",rc_min_rate);
-  PARAM_INT("ff_rc_max_rate",rc_max_rate);
-  PARAM_INT_SCALE("ff_rc_buffer_size",rc_buffer_size,1000);
-  PARAM_FLOAT("ff_i_quant_factor",i_quant_factor);
-  PARAM_QP2LAMBDA("ff_i_quant_offset",i_quant_offset);
-  PARAM_FLOAT("ff_lumi_masking",lumi_masking);
-  PARAM_FLOAT("ff_temporal_cplx_masking",temporal_cplx_masking);
-  PARAM_FLOAT("ff_spatial_cplx_masking",spatial_cplx_masking);
-  PARAM_FLOAT("ff_p_masking",p_masking);
-  PARAM_FLOAT("ff_dark_masking",dark_masking);
-  PARAM_ENUM("ff_me_cmp",me_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_me_cmp_chroma",me_cmp);
-  PARAM_ENUM("ff_me_sub_cmp",me_sub_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_me_sub_cmp_chroma",me_sub_cmp);
-  PARAM_ENUM("ff_mb_cmp",mb_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_mb_cmp_chroma",mb_cmp);
-  PARAM_ENUM("ff_ildct_cmp",ildct_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_ildct_cmp_chroma",ildct_cmp);
-  PARAM_INT("ff_dia_size",dia_size);
-  PARAM_INT("ff_last_predictor_count",last_predictor_count);
-  PARAM_ENUM("ff_me_pre_cmp",me_pre_cmp,compare_func);
-  PARAM_CMP_CHROMA("ff_pre_me_cmp_chroma",me_pre_cmp);
-  PARAM_INT("ff_pre_dia_size",pre_dia_size);
-  PARAM_INT("ff_me_subpel_quality",me_subpel_quality);
-  PARAM_INT("ff_me_range",me_range);
-  PARAM_ENUM("ff_mb_decision",mb_decision,mb_decision);
-  PARAM_INT_SCALE("ff_rc_initial_buffer_occupancy",rc_initial_buffer_occupancy,1000);
-  PARAM_INT("ff_nsse_weight",nsse_weight);
-  PARAM_QP2LAMBDA("ff_mb_lmin", mb_lmin);
-  PARAM_QP2LAMBDA("ff_mb_lmax", mb_lmax);
-  PARAM_INT("ff_bidir_refine",bidir_refine);
-  PARAM_INT("ff_keyint_min",keyint_min);
-  PARAM_FLAG("ff_flag_qscale",CODEC_FLAG_QSCALE);
-  PARAM_FLAG("ff_flag_4mv",CODEC_FLAG_4MV);
-  PARAM_FLAG("ff_flag_qpel",CODEC_FLAG_QPEL);
-  PARAM_FLAG("ff_flag_gmc",CODEC_FLAG_GMC);
-  PARAM_FLAG("ff_flag_mv0",CODEC_FLAG_MV0);
-  //  PARAM_FLAG("ff_flag_part",CODEC_FLAG_PART);
-  PARAM_FLAG("ff_flag_gray",CODEC_FLAG_GRAY);
-  PARAM_FLAG("ff_flag_emu_edge",CODEC_FLAG_EMU_EDGE);
-  PARAM_FLAG("ff_flag_normalize_aqp",CODEC_FLAG_NORMALIZE_AQP);
-  //  PARAM_FLAG("ff_flag_alt_scan",CODEC_FLAG_ALT_SCAN);
-  PARAM_INT("ff_trellis",trellis);
-  PARAM_FLAG("ff_flag_bitexact",CODEC_FLAG_BITEXACT);
-  PARAM_FLAG("ff_flag_ac_pred",CODEC_FLAG_AC_PRED);
-  //  PARAM_FLAG("ff_flag_h263p_umv",CODEC_FLAG_H263P_UMV);
-  //  PARAM_FLAG("ff_flag_cbp_rd",CODEC_FLAG_CBP_RD);
-  //  PARAM_FLAG("ff_flag_qp_rd",CODEC_FLAG_QP_RD);
-  //  PARAM_FLAG("ff_flag_h263p_aiv",CODEC_FLAG_H263P_AIV);
-  //  PARAM_FLAG("ffx_flag_obmc",CODEC_FLAG_OBMC);
-  PARAM_FLAG("ff_flag_loop_filter",CODEC_FLAG_LOOP_FILTER);
-  //  PARAM_FLAG("ff_flag_h263p_slice_struct",CODEC_FLAG_H263P_SLICE_STRUCT);
-  PARAM_FLAG("ff_flag_closed_gop",CODEC_FLAG_CLOSED_GOP);
-  PARAM_FLAG2("ff_flag2_fast",CODEC_FLAG2_FAST);
-  //  PARAM_FLAG2("ff_flag2_strict_gop",CODEC_FLAG2_STRICT_GOP);
-  PARAM_INT("ff_thread_count",thread_count);
-  
-  PARAM_DICT_STRING("libx264_preset", "preset");
-  PARAM_DICT_STRING("libx264_tune",   "tune");
-  PARAM_DICT_FLOAT("libx264_crf", "crf");
-  PARAM_DICT_FLOAT("libx264_qp", "qp");
+  pthread_once(&codec_params_once, sort_codec_params);
 
-  PARAM_ENUM("faac_profile", profile, faac_profile);
+  if(!(res = bsearch(name, codec_params_sorted, NUM_CODEC_PARAMS,
+                     sizeof(codec_params_sorted[0]), compare_codec_param_name)))
+    return;
 
-  if(!strcmp(name, "faac_quality"))
-    ctx->global_quality = FF_QP2LAMBDA * val->v.i;
-  else if(!strcmp(name, "vorbis_quality"))
-    ctx->global_quality = FF_QP2LAMBDA * val->v.i;
+  p = *res;
+  ptr = (uint8_t*)ctx + p->offset;
   
-  if(!strcmp(name, "tga_rle"))
+  switch(p->type)
     {
-    if(val->v.i)
-      ctx->coder_type = FF_CODER_TYPE_RLE;
-    else
-      ctx->coder_type = FF_CODER_TYPE_RAW;
+    case PARAM_TYPE_INT:
+      set_int_field(ptr, p->size, val->v.i * p->arg);
+      break;
+    case PARAM_TYPE_STR_INT:
+      set_int_field(ptr, p->size, atoi(val->v.str) * p->arg);
+      break;
+    case PARAM_TYPE_FLOAT:
+      *((float*)ptr) = val->v.d;
+      break;
+    case PARAM_TYPE_QP2LAMBDA:
+      set_int_field(ptr, p->size, (int)(val->v.d * FF_QP2LAMBDA+0.5));
+      break;
+    case PARAM_TYPE_QP2LAMBDA_F:
+      *((float*)ptr) = (int)(val->v.d * FF_QP2LAMBDA+0.5);
+      break;
+    case PARAM_TYPE_ENUM:
+      for(i = 0; i < p->num_enums; i++)
+        {
+        if(!strcmp(val->v.str, p->enums[i].s))
+          {
+          set_int_field(ptr, p->size, p->enums[i].i);
+          break;
+          }
+        }
+      break;
+    case PARAM_TYPE_FLAG:
+      if(val->v.i)
+        set_int_field(ptr, p->size, get_int_field(ptr, p->size) | p->arg);
+      else
+        set_int_field(ptr, p->size, get_int_field(ptr, p->size) & ~p->arg);
+      break;
+    case PARAM_TYPE_CHOICE:
+      set_int_field(ptr, p->size, val->v.i ? p->arg : p->arg2);
+      break;
+    case PARAM_TYPE_DICT_STRING:
+      if(val->v.str && (val->v.str[0] != '$'))
+        av_dict_set(options, p->key, val->v.str, 0);
+      break;
+    case PARAM_TYPE_DICT_FLOAT:
+      str = bg_sprintf("%f", val->v.d);
+      av_dict_set(options, p->key, str, 0);
+      free(str);
+      break;
+    case PARAM_TYPE_DICT_INT:
+      str = bg_sprintf("%d", val->v.i);
+      av_dict_set(options, p->key, str, 0);
+      free(str);
+      break;
     }
-  
-  PARAM_DICT_STRING("libvpx_deadline", "deadline");
-  PARAM_DICT_INT("libvpx_cpu-used",   "cpu-used");
-  PARAM_DICT_INT("libvpx_auto-alt-ref", "alt-ref");
-  PARAM_DICT_INT("libvpx_lag-in-frames", "lag-in-frames");
-  PARAM_DICT_INT("libvpx_arnr-max-frames", "arnr-max-frames");
-  PARAM_DICT_INT("libvpx_crf", "crf");
-  PARAM_DICT_STRING("libvpx_arnr-type", "arnr-type");
   }
 
 /* Type conversion */
@@ -1422,6 +1507,8 @@ void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
                                   gavl_pixelformat_t * gavl_fmt, int * do_convert)
   {
   int i, num;
+  int penalty = 0;
+  gavl_pixelformat_t in_fmt;
   gavl_pixelformat_t * gavl_fmts;
 
   /* Count pixelformats */
@@ -1448,9 +1535,17 @@ void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
     }
   gavl_fmts[num] = GAVL_PIXELFORMAT_NONE;
 
-  *gavl_fmt = gavl_pixelformat_get_best(*gavl_fmt, gavl_fmts, NULL);
+  /* gavl knows the conversion penalties */
+  in_fmt = *gavl_fmt;
+  *gavl_fmt = gavl_pixelformat_get_best(in_fmt, gavl_fmts, &penalty);
   *ffmpeg_fmt = bg_pixelformat_gavl_2_ffmpeg(*gavl_fmt, do_convert, supported);
   free(gavl_fmts);
+
+  if(*gavl_fmt != in_fmt)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Converting pixelformat %s -> %s (penalty: %d)",
+           gavl_pixelformat_to_string(in_fmt),
+           gavl_pixelformat_to_string(*gavl_fmt), penalty);
   }
 
 static const struct
@@ -1494,6 +1589,101 @@ gavl_sample_format_t bg_sample_format_ffmpeg_2_gavl(enum AVSampleFormat p,
   return GAVL_SAMPLE_NONE;
   }
 
+/* Check whether all values of src can be represented in dst */
+
+static int sample_format_lossless(gavl_sample_format_t src,
+                                  gavl_sample_format_t dst)
+  {
+  switch(src)
+    {
+    case GAVL_SAMPLE_U8:
+    case GAVL_SAMPLE_S8:
+    case GAVL_SAMPLE_U16:
+    case GAVL_SAMPLE_S16:
+      return (dst != GAVL_SAMPLE_U8) && (dst != GAVL_SAMPLE_S8);
+    case GAVL_SAMPLE_S32:
+      return (dst == GAVL_SAMPLE_S32) || (dst == GAVL_SAMPLE_DOUBLE);
+    case GAVL_SAMPLE_FLOAT:
+      return (dst == GAVL_SAMPLE_FLOAT) || (dst == GAVL_SAMPLE_DOUBLE);
+    case GAVL_SAMPLE_DOUBLE:
+      return (dst == GAVL_SAMPLE_DOUBLE);
+    default:
+      break;
+    }
+  return 0;
+  }
+
+/*
+ *  Estimated cost of converting the input into a sampleformat.
+ *  Lossy conversions are always more expensive than lossless ones.
+ */
+
+static int sample_format_cost(const gavl_audio_format_t * in,
+                              gavl_sample_format_t fmt,
+                              gavl_interleave_mode_t il)
+  {
+  int ret = 0;
+
+  if(fmt != in->sample_format)
+    {
+    /* Converting means touching every sample */
+    ret += 2 * gavl_bytes_per_sample(fmt);
+    if(!sample_format_lossless(in->sample_format, fmt))
+      ret += 100;
+    }
+
+  /* Interleaving doesn't matter for mono */
+  if((il != in->interleave_mode) && (in->num_channels > 1))
+    ret += 1;
+  return ret;
+  }
+
+enum AVSampleFormat
+bg_ffmpeg_choose_sampleformat(const enum AVSampleFormat * supported,
+                              gavl_audio_format_t * fmt)
+  {
+  int i;
+  int cost;
+  int min_cost = -1;
+  gavl_sample_format_t gavl_fmt;
+  gavl_interleave_mode_t il;
+  enum AVSampleFormat ret = supported[0];
+  gavl_sample_format_t ret_fmt = GAVL_SAMPLE_NONE;
+  gavl_interleave_mode_t ret_il = GAVL_INTERLEAVE_ALL;
+  
+  for(i = 0; supported[i] != AV_SAMPLE_FMT_NONE; i++)
+    {
+    if((gavl_fmt = bg_sample_format_ffmpeg_2_gavl(supported[i], &il)) ==
+       GAVL_SAMPLE_NONE)
+      continue;
+    
+    cost = sample_format_cost(fmt, gavl_fmt, il);
+    
+    if((min_cost < 0) || (cost < min_cost))
+      {
+      min_cost = cost;
+      ret = supported[i];
+      ret_fmt = gavl_fmt;
+      ret_il = il;
+      }
+    }
+
+  if(ret_fmt == GAVL_SAMPLE_NONE)
+    ret_fmt = bg_sample_format_ffmpeg_2_gavl(ret, &ret_il);
+  
+  if(min_cost > 0)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Converting samples %s (%s) -> %s (%s), cost: %d",
+           gavl_sample_format_to_string(fmt->sample_format),
+           gavl_interleave_mode_to_string(fmt->interleave_mode),
+           gavl_sample_format_to_string(ret_fmt),
+           gavl_interleave_mode_to_string(ret_il), min_cost);
+  
+  fmt->sample_format = ret_fmt;
+  fmt->interleave_mode = ret_il;
+  return ret;
+  }
+
 /* Compressed stream support */
 
 static const struct
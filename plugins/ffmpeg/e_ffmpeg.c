@@ -138,7 +138,7 @@ static const ffmpeg_format_info_t formats[] =
       .video_codecs = (enum AVCodecID[]){ AV_CODEC_ID_MPEG1VIDEO,
                                         AV_CODEC_ID_MPEG2VIDEO,
                                         AV_CODEC_ID_NONE },
-      .flags = FLAG_CONSTANT_FRAMERATE | FLAG_PIPE,
+      .flags = FLAG_CONSTANT_FRAMERATE | FLAG_PIPE | FLAG_SEGMENTS,
     },
     {
       .name =       "Matroska",
@@ -188,7 +188,22 @@ static const ffmpeg_format_info_t formats[] =
       .video_codecs = (enum AVCodecID[]){  AV_CODEC_ID_MPEG4,
                                            AV_CODEC_ID_H264,
                                            AV_CODEC_ID_NONE },
+      .flags = FLAG_SEGMENTS | FLAG_FASTSTART,
+    },
+    {
+      .name =       "Fragmented MP4",
+      .short_name = "fmp4",
+      .extension =  "mp4",
+      .muxer =      "mp4",
+      .max_audio_streams = -1,
+      .max_video_streams = -1,
+      .audio_codecs = (enum AVCodecID[]){  AV_CODEC_ID_AAC,
+                                           AV_CODEC_ID_NONE },
 
+      .video_codecs = (enum AVCodecID[]){  AV_CODEC_ID_MPEG4,
+                                           AV_CODEC_ID_H264,
+                                           AV_CODEC_ID_NONE },
+      .flags = FLAG_PIPE | FLAG_SEGMENTS | FLAG_FRAGMENTED,
     },
 #if 0 // Encoded file is messed up
     {
@@ -20,6 +20,7 @@
  * *****************************************************************/
 
 #include <config.h>
+#include <pthread.h>
 #include AVFORMAT_HEADER
 #include <gmerlin/plugin.h>
 #include <gmerlin/pluginfuncs.h>
@@ -37,6 +38,9 @@
 #define FLAG_INTRA_ONLY         (1<<1)
 #define FLAG_B_FRAMES           (1<<2)
 #define FLAG_PIPE               (1<<3) // Format can be written savely to pipes
+#define FLAG_SEGMENTS           (1<<4) // Format can be split into segments
+#define FLAG_FRAGMENTED         (1<<5) // Fragmented MP4
+#define FLAG_FASTSTART          (1<<6) // Space for the index can be reserved
 
 typedef struct
   {
@@ -54,6 +58,7 @@ typedef struct
   char * name;
   char * short_name;
   char * extension;
+  char * muxer; // If different from short_name
   
   int max_audio_streams;
   int max_video_streams;
@@ -65,6 +70,8 @@ typedef struct
   
   } ffmpeg_format_info_t;
 
+#define FORMAT_MUXER(f) ((f)->muxer ? (f)->muxer : (f)->short_name)
+
 /* codecs.c */
 
 bg_parameter_info_t *
@@ -114,6 +121,9 @@ bg_ffmpeg_get_codec_info(enum AVCodecID id, int type);
 
 typedef struct bg_ffmpeg_codec_context_s bg_ffmpeg_codec_context_t;
 
+/* Encoder thread for intra-only codecs (codec.c) */
+typedef struct bg_ffmpeg_frame_thread_s bg_ffmpeg_frame_thread_t;
+
 struct bg_ffmpeg_codec_context_s
   {
   AVCodec * codec;
@@ -136,6 +146,13 @@ struct bg_ffmpeg_codec_context_s
   int pass;
   int total_passes;
   FILE * stats_file;
+
+  /* First pass: Statistics collected in memory */
+  char * stats;
+  int stats_len;
+  int stats_alloc;
+
+  int turbo_first_pass;
   
   /* Only non-null within the format writer */
   const ffmpeg_format_info_t * format;
@@ -155,6 +172,10 @@ struct bg_ffmpeg_codec_context_s
 
   /* Audio frame to encode */
   gavl_audio_frame_t * aframe;
+
+  /* Native PCM encoder (pcm.c), aframe is not used then */
+  void (*pcm_encode)(const uint8_t * src, uint8_t * dst, int num);
+  int pcm_bytes;
   
   /*
    * Video frame to encode.
@@ -174,9 +195,20 @@ struct bg_ffmpeg_codec_context_s
      we are too lazy to support all variants in gavl */
   
   void (*convert_frame)(bg_ffmpeg_codec_context_t * ctx, gavl_video_frame_t * f);
-  
+
+  /* Frame parallel encoding. Frames are distributed round robin,
+     so the packets come back in the right order */
+  int num_frame_threads;
+  bg_ffmpeg_frame_thread_t * frame_threads;
+  int next_frame_thread;
   };
 
+/* pcm.c */
+
+/* Returns 1 if the codec can be encoded without libavcodec */
+int bg_ffmpeg_pcm_init(bg_ffmpeg_codec_context_t * ctx,
+                       const gavl_audio_format_t * fmt);
+
 
 void bg_ffmpeg_set_video_dimensions_avctx(AVCodecContext * avctx,
                                           const gavl_video_format_t * fmt);
@@ -226,6 +258,9 @@ void bg_ffmpeg_codec_set_packet_sink(bg_ffmpeg_codec_context_t * ctx,
 
 void bg_ffmpeg_codec_flush(bg_ffmpeg_codec_context_t * ctx);
 
+/* Forget the encoder lookups (for benchmarks) */
+void bg_ffmpeg_free_encoder_cache(void);
+
 /* ffmpeg_common.c */
 
 typedef struct ffmpeg_priv_s ffmpeg_priv_t;
@@ -273,6 +308,20 @@ typedef struct
   AVRational time_base;
   } bg_ffmpeg_text_stream_t;
 
+/* Additional video rendition (ladder.c) */
+typedef struct bg_ffmpeg_rendition_s bg_ffmpeg_rendition_t;
+
+/* Finished segment (segment.c) */
+typedef struct bg_ffmpeg_segment_s bg_ffmpeg_segment_t;
+
+/* Packet waiting for the mux thread */
+
+typedef struct
+  {
+  AVPacket * pkt;
+  gavl_time_t time;
+  } bg_ffmpeg_mux_entry_t;
+
 struct ffmpeg_priv_s
   {
   int num_audio_streams;
@@ -300,10 +349,124 @@ struct ffmpeg_priv_s
   
   bg_encoder_callbacks_t * cb;
   
+  /* Passed to avformat_write_header() */
+  AVDictionary * format_options;
+  gavl_time_t fragment_duration; /* 0: Fragment at each keyframe */
+  
   gavf_io_t * io;
   unsigned char * io_buffer;
+  int io_buffer_size; /* 0: Automatic */
+
+  /* Statistics */
+  int64_t num_writes;
+  int64_t bytes_written;
+
+  /* Mux thread (mux.c) */
+  int64_t mux_max_bytes;       /* 0: Write from the encoder thread */
+  gavl_time_t mux_max_duration;
+
+  pthread_t mux_thread;
+  pthread_mutex_t mux_mutex;
+  pthread_cond_t mux_cond;
+  int mux_running;
+  int mux_quit;
+  
+  bg_ffmpeg_mux_entry_t * mux_queue; /* Ring buffer */
+  int mux_alloc;
+  int mux_head;
+  int mux_num;
+  int64_t mux_bytes;
+
+  /* Queue statistics */
+  int64_t mux_packets;
+  int64_t mux_num_sum;
+  int mux_max_num;
+  int64_t mux_peak_bytes;
+  int64_t mux_blocked;
+
+  /* Renditions (ladder.c) */
+  char * ladder;
+
+  /* Video parameters of the first stream */
+  char ** ladder_names;
+  gavl_value_t * ladder_values;
+  int num_ladder_params;
+
+  int ladder_pass;
+  int ladder_total_passes;
+  char * ladder_stats_file;
+  
+  bg_ffmpeg_rendition_t * renditions;
+  int num_renditions;
+  gavl_video_sink_t * ladder_sink;
+
+  /* Segmenting (segment.c) */
+  gavl_time_t segment_duration; /* 0: Write a single file */
+  int segment_list_size;        /* 0: List all segments */
+
+  char * segment_base;          /* Non-NULL if we write segments */
+  char * segment_playlist;
+  int segment_index;
+  int segment_stream;           /* Index of the AVStream starting segments */
+  gavl_time_t segment_start;
+  gavl_time_t segment_end;
+
+  /* Packets after the segment duration */
+  bg_ffmpeg_mux_entry_t * segment_pending;
+  int segment_num_pending;
+  int segment_pending_alloc;
+
+  bg_ffmpeg_segment_t * segments;
+  int num_segments;
+
+  /* Reserved index space (moov.c) */
+  int moov_reserve;
+  gavl_time_t moov_expected_duration; /* From the parameters */
+  gavl_time_t moov_duration;
+
+  int64_t moov_reserved;  /* 0: Not reserved */
+  int64_t moov_pos;
+  int64_t * moov_samples; /* Per AVStream */
+  int64_t * moov_keyframes;
+  int moov_relocated;
   };
 
+/* mux.c */
+
+void bg_ffmpeg_mux_start(ffmpeg_priv_t * priv);
+int bg_ffmpeg_mux_write(ffmpeg_priv_t * priv, AVPacket * pkt);
+int bg_ffmpeg_mux_flush(ffmpeg_priv_t * priv);
+void bg_ffmpeg_mux_stop(ffmpeg_priv_t * priv);
+
+/* moov.c */
+
+void bg_ffmpeg_moov_init(ffmpeg_priv_t * priv,
+                         const gavl_dictionary_t * metadata);
+void bg_ffmpeg_moov_reserve(ffmpeg_priv_t * priv);
+void bg_ffmpeg_moov_start(ffmpeg_priv_t * priv);
+void bg_ffmpeg_moov_count(ffmpeg_priv_t * priv, const AVPacket * pkt);
+void bg_ffmpeg_moov_finish(ffmpeg_priv_t * priv);
+void bg_ffmpeg_moov_close(ffmpeg_priv_t * priv);
+
+/* segment.c */
+
+/* Returns the filename of the first segment */
+char * bg_ffmpeg_segment_open(ffmpeg_priv_t * priv, const char * filename);
+void bg_ffmpeg_segment_start(ffmpeg_priv_t * priv);
+int bg_ffmpeg_segment_write(ffmpeg_priv_t * priv, AVPacket * pkt,
+                            gavl_time_t time);
+int bg_ffmpeg_segment_flush(ffmpeg_priv_t * priv);
+void bg_ffmpeg_segment_close(ffmpeg_priv_t * priv, int do_delete);
+void bg_ffmpeg_segment_free(ffmpeg_priv_t * priv);
+
+/* ladder.c */
+
+void bg_ffmpeg_ladder_set_parameter(ffmpeg_priv_t * priv, const char * name,
+                                    const gavl_value_t * v);
+int bg_ffmpeg_ladder_start(ffmpeg_priv_t * priv);
+int bg_ffmpeg_ladder_close(ffmpeg_priv_t * priv, int do_delete);
+void bg_ffmpeg_ladder_free(ffmpeg_priv_t * priv);
+
 extern const bg_encoder_framerate_t
 bg_ffmpeg_mpeg_framerates[];
 
@@ -311,6 +474,9 @@ void * bg_ffmpeg_create(const ffmpeg_format_info_t * formats);
 
 void bg_ffmpeg_destroy(void*);
 
+/* Free the shared parameters. No instance may exist (for benchmarks) */
+void bg_ffmpeg_free_parameter_cache(void);
+
 void bg_ffmpeg_set_callbacks(void * data,
                              bg_encoder_callbacks_t * cb);
 
@@ -390,6 +556,12 @@ void bg_ffmpeg_choose_pixelformat(const enum AVPixelFormat * supported,
 gavl_sample_format_t bg_sample_format_ffmpeg_2_gavl(enum AVSampleFormat p,
                                                     gavl_interleave_mode_t * il);
 
+/* Choose the sampleformat with the cheapest conversion from fmt
+   and set fmt to it */
+enum AVSampleFormat
+bg_ffmpeg_choose_sampleformat(const enum AVSampleFormat * supported,
+                              gavl_audio_format_t * fmt);
+
 enum AVCodecID bg_codec_id_gavl_2_ffmpeg(gavl_codec_id_t gavl);
 gavl_codec_id_t bg_codec_id_ffmpeg_2_gavl(enum AVCodecID ffmpeg);
 
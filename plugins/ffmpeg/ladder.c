@@ -0,0 +1,465 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Renditions: Additional, downscaled versions of the video stream.
+ *
+ *  Each rendition is a complete encoder instance writing into its own
+ *  file. The input frames are scaled in a cascade (largest rendition
+ *  from the input, each smaller one from the next larger one) and
+ *  encoded in one thread per rendition.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+
+#define LOG_DOMAIN "ffmpeg.ladder"
+
+#define JOB_IDLE   0
+#define JOB_QUEUED 1
+#define JOB_DONE   2
+
+struct bg_ffmpeg_rendition_s
+  {
+  int height;
+  int bitrate; /* kbps, 0: Same as the video stream */
+
+  ffmpeg_priv_t * enc;
+  gavl_video_sink_t * sink;
+  gavl_video_format_t fmt;
+  gavl_video_frame_t * frame;
+
+  gavl_video_scaler_t * scaler;
+  int parent; /* Rendition, we are scaled from or -1 for the input */
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int running;
+  int state;
+  int quit;
+  int error;
+  };
+
+/* Parameters of the video stream, which are passed to the renditions */
+
+void bg_ffmpeg_ladder_set_parameter(ffmpeg_priv_t * priv, const char * name,
+                                    const gavl_value_t * v)
+  {
+  if(!name)
+    return;
+
+  priv->ladder_names = realloc(priv->ladder_names,
+                               (priv->num_ladder_params+1) *
+                               sizeof(*priv->ladder_names));
+  priv->ladder_values = realloc(priv->ladder_values,
+                                (priv->num_ladder_params+1) *
+                                sizeof(*priv->ladder_values));
+
+  priv->ladder_names[priv->num_ladder_params] = gavl_strdup(name);
+  memset(&priv->ladder_values[priv->num_ladder_params], 0,
+         sizeof(priv->ladder_values[priv->num_ladder_params]));
+  gavl_value_copy(&priv->ladder_values[priv->num_ladder_params], v);
+  priv->num_ladder_params++;
+  }
+
+static int compare_height(const void * p1, const void * p2)
+  {
+  const bg_ffmpeg_rendition_t * r1 = p1;
+  const bg_ffmpeg_rendition_t * r2 = p2;
+  return r2->height - r1->height;
+  }
+
+/* Format: height[:bitrate],height[:bitrate],... */
+
+static void parse_renditions(ffmpeg_priv_t * priv)
+  {
+  char * rest;
+  const char * pos = priv->ladder;
+  bg_ffmpeg_rendition_t * r;
+
+  while(*pos)
+    {
+    int height = strtol(pos, &rest, 10);
+
+    if((rest == pos) || (height <= 0))
+      {
+      bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Invalid rendition: %s", pos);
+      return;
+      }
+
+    priv->renditions = realloc(priv->renditions,
+                               (priv->num_renditions+1) *
+                               sizeof(*priv->renditions));
+    r = &priv->renditions[priv->num_renditions];
+    memset(r, 0, sizeof(*r));
+    r->height = height;
+    priv->num_renditions++;
+
+    pos = rest;
+    if(*pos == ':')
+      {
+      pos++;
+      r->bitrate = strtol(pos, &rest, 10);
+      pos = rest;
+      }
+    while(*pos == ',' || *pos == ' ')
+      pos++;
+    }
+
+  qsort(priv->renditions, priv->num_renditions,
+        sizeof(*priv->renditions), compare_height);
+  }
+
+static char * rendition_filename(const char * filename, int height)
+  {
+  const char * ext = strrchr(filename, '.');
+
+  if(!ext || strchr(ext, '/'))
+    return bg_sprintf("%s_%dp", filename, height);
+
+  return bg_sprintf("%.*s_%dp%s", (int)(ext - filename), filename,
+                    height, ext);
+  }
+
+static void * rendition_thread(void * data)
+  {
+  bg_ffmpeg_rendition_t * r = data;
+
+  pthread_mutex_lock(&r->mutex);
+
+  while(1)
+    {
+    while((r->state != JOB_QUEUED) && !r->quit)
+      pthread_cond_wait(&r->cond, &r->mutex);
+
+    if(r->quit)
+      break;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    if(gavl_video_sink_put_frame(r->sink, r->frame) != GAVL_SINK_OK)
+      r->error = 1;
+
+    pthread_mutex_lock(&r->mutex);
+    r->state = JOB_DONE;
+    pthread_cond_broadcast(&r->cond);
+    }
+
+  pthread_mutex_unlock(&r->mutex);
+  return NULL;
+  }
+
+static void rendition_wait(bg_ffmpeg_rendition_t * r)
+  {
+  pthread_mutex_lock(&r->mutex);
+  while(r->state == JOB_QUEUED)
+    pthread_cond_wait(&r->cond, &r->mutex);
+  r->state = JOB_IDLE;
+  pthread_mutex_unlock(&r->mutex);
+  }
+
+static int start_rendition(ffmpeg_priv_t * priv, bg_ffmpeg_rendition_t * r,
+                           const gavl_video_format_t * src_fmt)
+  {
+  int i;
+  char * filename;
+  gavl_value_t val;
+  bg_ffmpeg_video_stream_t * st;
+
+  r->enc = bg_ffmpeg_create(priv->formats);
+  bg_ffmpeg_set_callbacks(r->enc, priv->cb);
+
+  /* Format parameters */
+  gavl_value_init(&val);
+  gavl_value_set_string(&val, priv->format->short_name);
+  bg_ffmpeg_set_parameter(r->enc, "format", &val);
+  gavl_value_free(&val);
+
+  r->enc->io_buffer_size   = priv->io_buffer_size;
+  r->enc->mux_max_bytes    = priv->mux_max_bytes;
+  r->enc->mux_max_duration = priv->mux_max_duration;
+
+  filename = rendition_filename(priv->ctx->filename, r->height);
+  if(!bg_ffmpeg_open(r->enc, filename, NULL))
+    {
+    free(filename);
+    return 0;
+    }
+  free(filename);
+
+  av_dict_copy(&r->enc->ctx->metadata, priv->ctx->metadata, 0);
+
+  /* Same format as the input, just smaller */
+  gavl_video_format_copy(&r->fmt, &priv->video_streams[0].format);
+
+  r->fmt.image_width = (r->fmt.image_width * r->height *
+                        r->fmt.pixel_height) /
+    (r->fmt.image_height * r->fmt.pixel_width);
+  r->fmt.image_width &= ~1;
+  r->fmt.image_height = r->height;
+  r->fmt.pixel_width = 1;
+  r->fmt.pixel_height = 1;
+  r->fmt.frame_width = r->fmt.image_width;
+  r->fmt.frame_height = r->fmt.image_height;
+
+  bg_ffmpeg_add_video_stream(r->enc, NULL, &r->fmt);
+
+  for(i = 0; i < priv->num_ladder_params; i++)
+    bg_ffmpeg_set_video_parameter(r->enc, 0, priv->ladder_names[i],
+                                  &priv->ladder_values[i]);
+  bg_ffmpeg_set_video_parameter(r->enc, 0, NULL, NULL);
+
+  st = &r->enc->video_streams[0];
+
+  if(!st->com.codec)
+    return 0;
+
+  if(r->bitrate)
+    st->com.codec->avctx->bit_rate = r->bitrate * 1000;
+
+  if(priv->ladder_total_passes)
+    {
+    filename = bg_sprintf("%s.%dp", priv->ladder_stats_file, r->height);
+    bg_ffmpeg_set_video_pass(r->enc, 0, priv->ladder_pass,
+                             priv->ladder_total_passes, filename);
+    free(filename);
+    }
+
+  if(!bg_ffmpeg_start(r->enc))
+    return 0;
+
+  /* The frames are converted once for all renditions */
+  if(st->format.pixelformat != r->fmt.pixelformat)
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+           "Rendition %dp needs another pixelformat", r->height);
+    return 0;
+    }
+
+  r->sink = bg_ffmpeg_get_video_sink(r->enc, 0);
+  r->frame = gavl_video_frame_create(&r->fmt);
+
+  r->scaler = gavl_video_scaler_create();
+  if(!gavl_video_scaler_init(r->scaler, src_fmt, &r->fmt))
+    return 0;
+
+  pthread_mutex_init(&r->mutex, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  pthread_create(&r->thread, NULL, rendition_thread, r);
+  r->running = 1;
+
+  bg_log(BG_LOG_INFO, LOG_DOMAIN, "Encoding rendition %dx%d",
+         r->fmt.image_width, r->fmt.image_height);
+  return 1;
+  }
+
+static gavl_video_frame_t * get_frame_ladder(void * data)
+  {
+  ffmpeg_priv_t * priv = data;
+  return gavl_video_sink_get_frame(priv->video_streams[0].sink);
+  }
+
+static gavl_sink_status_t put_frame_ladder(void * data,
+                                           gavl_video_frame_t * frame)
+  {
+  int i;
+  bg_ffmpeg_rendition_t * r;
+  const gavl_video_frame_t * src;
+  ffmpeg_priv_t * priv = data;
+
+  /*
+   *  A rendition can be scaled from the frame of its parent. The
+   *  parent must not be encoding that frame meanwhile, so all
+   *  renditions are scaled before the first one is queued.
+   */
+  
+  for(i = 0; i < priv->num_renditions; i++)
+    {
+    r = &priv->renditions[i];
+    rendition_wait(r);
+
+    if(r->error)
+      return GAVL_SINK_ERROR;
+
+    if(r->parent < 0)
+      src = frame;
+    else
+      {
+      rendition_wait(&priv->renditions[r->parent]);
+      src = priv->renditions[r->parent].frame;
+      }
+    
+    gavl_video_scaler_scale(r->scaler, src, r->frame);
+    gavl_video_frame_copy_metadata(r->frame, frame);
+    }
+
+  for(i = 0; i < priv->num_renditions; i++)
+    {
+    r = &priv->renditions[i];
+    pthread_mutex_lock(&r->mutex);
+    r->state = JOB_QUEUED;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    }
+
+  return gavl_video_sink_put_frame(priv->video_streams[0].sink, frame);
+  }
+
+int bg_ffmpeg_ladder_start(ffmpeg_priv_t * priv)
+  {
+  int i;
+  const gavl_video_format_t * src_fmt;
+  bg_ffmpeg_video_stream_t * st;
+
+  if(!priv->ladder || !priv->num_video_streams)
+    return 1;
+
+  if(!priv->ctx->filename[0] || priv->io ||
+     !strncmp(priv->ctx->filename, "pipe:", 5))
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Renditions can only be written to files");
+    return 1;
+    }
+
+  if(priv->num_video_streams > 1)
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Renditions are supported only for one video stream");
+    return 1;
+    }
+
+  st = &priv->video_streams[0];
+
+  if(st->com.flags & STREAM_IS_COMPRESSED)
+    return 1;
+
+  parse_renditions(priv);
+
+  src_fmt = &st->format;
+
+  for(i = 0; i < priv->num_renditions; i++)
+    {
+    bg_ffmpeg_rendition_t * r = &priv->renditions[i];
+
+    /* Scale from the next larger rendition */
+    r->parent = i - 1;
+    if((r->parent >= 0) && (priv->renditions[r->parent].height < r->height))
+      r->parent = -1;
+
+    if(r->parent < 0)
+      src_fmt = &st->format;
+    else
+      src_fmt = &priv->renditions[r->parent].fmt;
+
+    if(!start_rendition(priv, r, src_fmt))
+      {
+      bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Starting rendition %dp failed",
+             r->height);
+      return 0;
+      }
+    }
+
+  if(priv->num_renditions)
+    priv->ladder_sink = gavl_video_sink_create(get_frame_ladder,
+                                               put_frame_ladder,
+                                               priv, &st->format);
+  return 1;
+  }
+
+int bg_ffmpeg_ladder_close(ffmpeg_priv_t * priv, int do_delete)
+  {
+  int i;
+  int ret = 1;
+  bg_ffmpeg_rendition_t * r;
+
+  for(i = 0; i < priv->num_renditions; i++)
+    {
+    r = &priv->renditions[i];
+
+    if(r->running)
+      {
+      rendition_wait(r);
+
+      pthread_mutex_lock(&r->mutex);
+      r->quit = 1;
+      pthread_cond_broadcast(&r->cond);
+      pthread_mutex_unlock(&r->mutex);
+      pthread_join(r->thread, NULL);
+
+      pthread_mutex_destroy(&r->mutex);
+      pthread_cond_destroy(&r->cond);
+      }
+
+    if(r->error)
+      ret = 0;
+
+    if(r->enc)
+      {
+      if(r->enc->ctx && !bg_ffmpeg_close(r->enc, do_delete))
+        ret = 0;
+      bg_ffmpeg_destroy(r->enc);
+      }
+    if(r->scaler)
+      gavl_video_scaler_destroy(r->scaler);
+    if(r->frame)
+      gavl_video_frame_destroy(r->frame);
+    }
+
+  if(priv->renditions)
+    {
+    free(priv->renditions);
+    priv->renditions = NULL;
+    }
+  priv->num_renditions = 0;
+
+  if(priv->ladder_sink)
+    {
+    gavl_video_sink_destroy(priv->ladder_sink);
+    priv->ladder_sink = NULL;
+    }
+  return ret;
+  }
+
+void bg_ffmpeg_ladder_free(ffmpeg_priv_t * priv)
+  {
+  int i;
+  for(i = 0; i < priv->num_ladder_params; i++)
+    {
+    free(priv->ladder_names[i]);
+    gavl_value_free(&priv->ladder_values[i]);
+    }
+  if(priv->ladder_names)
+    free(priv->ladder_names);
+  if(priv->ladder_values)
+    free(priv->ladder_values);
+  if(priv->ladder)
+    free(priv->ladder);
+  if(priv->ladder_stats_file)
+    free(priv->ladder_stats_file);
+  }
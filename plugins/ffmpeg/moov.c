@@ -0,0 +1,307 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Faststart MP4 without rewriting the file: Space for the moov atom
+ *  is reserved after the ftyp atom (moov_size option of the mp4 muxer)
+ *  and the moov atom is written there at the end.
+ *
+ *  The index size is estimated with an upper bound of the bytes per
+ *  sample. If the counted samples don't fit into the reserved space
+ *  at the end, the space becomes a free atom and the moov atom is
+ *  moved to the front by the muxer (faststart flag).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+#include <gmerlin/log.h>
+#include <gavl/metatags.h>
+#include <gavl/numptr.h>
+
+#include <libavutil/opt.h>
+
+#define LOG_DOMAIN "ffmpeg.moov"
+
+/* Bytes in the moov atom independent of the number of samples */
+#define TRACK_OVERHEAD 4096
+#define FILE_OVERHEAD  8192
+
+/* Bytes written by the muxer between the reserved space and the samples
+   (8 byte free atom and the mdat header) */
+#define MDAT_HEADER_SIZE 16
+
+/* Frame rate assumed for variable framerate streams */
+#define VFR_FPS 60
+
+typedef struct
+  {
+  int is_video;
+  int vfr;
+  int b_frames;
+  } stream_info_t;
+
+static void get_stream_info(ffmpeg_priv_t * priv, int index,
+                            stream_info_t * ret)
+  {
+  int i;
+  memset(ret, 0, sizeof(*ret));
+
+  for(i = 0; i < priv->num_video_streams; i++)
+    {
+    bg_ffmpeg_video_stream_t * st = &priv->video_streams[i];
+    if(st->com.stream->index == index)
+      {
+      ret->is_video = 1;
+      ret->vfr = (st->format.framerate_mode != GAVL_FRAMERATE_CONSTANT);
+      ret->b_frames = !!(st->com.ci.flags & GAVL_COMPRESSION_HAS_B_FRAMES);
+      return;
+      }
+    }
+  }
+
+/*
+ *  Upper bound for the index size. Worst case per sample:
+ *  stsz (4), stco/co64 and stsc entry for a chunk of its own (8 + 12).
+ *  Video also: stss (4) per keyframe, stts (8) for variable framerates
+ *  and ctts (8) with B-frames.
+ */
+
+static int64_t index_size(ffmpeg_priv_t * priv,
+                          const int64_t * samples,
+                          const int64_t * keyframes)
+  {
+  int i;
+  int64_t per_sample;
+  int64_t ret = FILE_OVERHEAD;
+  stream_info_t info;
+
+  for(i = 0; i < priv->ctx->nb_streams; i++)
+    {
+    get_stream_info(priv, i, &info);
+
+    per_sample = 4 + 8 + 12;
+
+    ret += TRACK_OVERHEAD;
+
+    if(info.is_video)
+      {
+      if(info.vfr)
+        per_sample += 8;
+      if(info.b_frames)
+        per_sample += 8;
+      ret += 4 * keyframes[i];
+      }
+    ret += per_sample * samples[i];
+    }
+  return ret;
+  }
+
+/* Samples of each stream for the expected duration */
+
+static void expected_samples(ffmpeg_priv_t * priv, int64_t * samples)
+  {
+  int i;
+  double seconds = gavl_time_to_seconds(priv->moov_duration);
+
+  /* Text streams: One subtitle per second */
+  for(i = 0; i < priv->ctx->nb_streams; i++)
+    samples[i] = (int64_t)seconds + 1;
+
+  for(i = 0; i < priv->num_audio_streams; i++)
+    {
+    bg_ffmpeg_audio_stream_t * st = &priv->audio_streams[i];
+    int samples_per_frame = st->format.samples_per_frame;
+
+    if(samples_per_frame <= 0)
+      samples_per_frame = 1024;
+
+    samples[st->com.stream->index] =
+      (int64_t)(seconds * st->format.samplerate / samples_per_frame) + 1;
+    }
+
+  for(i = 0; i < priv->num_video_streams; i++)
+    {
+    bg_ffmpeg_video_stream_t * st = &priv->video_streams[i];
+    double fps;
+
+    if(st->format.framerate_mode == GAVL_FRAMERATE_CONSTANT)
+      fps = (double)st->format.timescale / (double)st->format.frame_duration;
+    else
+      fps = VFR_FPS;
+    samples[st->com.stream->index] = (int64_t)(seconds * fps) + 1;
+    }
+  }
+
+void bg_ffmpeg_moov_init(ffmpeg_priv_t * priv,
+                         const gavl_dictionary_t * metadata)
+  {
+  gavl_time_t duration;
+
+  priv->moov_duration = priv->moov_expected_duration;
+
+  if(metadata &&
+     gavl_dictionary_get_long(metadata, GAVL_META_APPROX_DURATION,
+                              &duration) &&
+     (duration > 0))
+    priv->moov_duration = duration;
+  }
+
+void bg_ffmpeg_moov_reserve(ffmpeg_priv_t * priv)
+  {
+  int64_t * samples;
+
+  if(!priv->moov_reserve ||
+     !(priv->format->flags & FLAG_FASTSTART) ||
+     priv->segment_base)
+    return;
+
+  if(priv->moov_duration <= 0)
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Duration unknown, not reserving space for the index");
+    return;
+    }
+
+  samples = calloc(priv->ctx->nb_streams, sizeof(*samples));
+  expected_samples(priv, samples);
+
+  /* Every video frame could be a keyframe */
+  priv->moov_reserved = index_size(priv, samples, samples);
+
+  /* Margin for a longer duration than expected */
+  priv->moov_reserved += priv->moov_reserved / 10;
+  free(samples);
+
+  if(priv->moov_reserved > INT_MAX)
+    priv->moov_reserved = INT_MAX;
+
+  av_dict_set_int(&priv->format_options, "moov_size", priv->moov_reserved, 0);
+
+  priv->moov_samples = calloc(priv->ctx->nb_streams,
+                              sizeof(*priv->moov_samples));
+  priv->moov_keyframes = calloc(priv->ctx->nb_streams,
+                                sizeof(*priv->moov_keyframes));
+
+  bg_log(BG_LOG_INFO, LOG_DOMAIN,
+         "Reserving %"PRId64" bytes for the index of %.1f seconds",
+         priv->moov_reserved, gavl_time_to_seconds(priv->moov_duration));
+  }
+
+/* Called after the header is written */
+
+void bg_ffmpeg_moov_start(ffmpeg_priv_t * priv)
+  {
+  if(!priv->moov_reserved)
+    return;
+  priv->moov_pos = avio_tell(priv->ctx->pb) - MDAT_HEADER_SIZE -
+    priv->moov_reserved;
+  }
+
+void bg_ffmpeg_moov_count(ffmpeg_priv_t * priv, const AVPacket * pkt)
+  {
+  if(!priv->moov_samples)
+    return;
+  priv->moov_samples[pkt->stream_index]++;
+  if(pkt->flags & AV_PKT_FLAG_KEY)
+    priv->moov_keyframes[pkt->stream_index]++;
+  }
+
+/* Called before the trailer is written */
+
+void bg_ffmpeg_moov_finish(ffmpeg_priv_t * priv)
+  {
+  int64_t needed;
+  AVIOContext * pb = priv->ctx->pb;
+  int64_t pos;
+
+  if(!priv->moov_reserved)
+    return;
+
+  needed = index_size(priv, priv->moov_samples, priv->moov_keyframes);
+
+  /* The muxer needs 8 more bytes for the free atom after moov */
+  if(needed + 8 <= priv->moov_reserved)
+    return;
+
+  bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+         "Index might need %"PRId64" bytes but only %"PRId64" are reserved, writing it after the samples",
+         needed, priv->moov_reserved);
+
+  /* Turn the reserved space into a free atom */
+  pos = avio_tell(pb);
+  avio_seek(pb, priv->moov_pos, SEEK_SET);
+  avio_wb32(pb, priv->moov_reserved);
+  avio_wl32(pb, MKTAG('f','r','e','e'));
+  avio_seek(pb, pos, SEEK_SET);
+
+  av_opt_set_int(priv->ctx->priv_data, "moov_size", 0, 0);
+
+  /* Relocating needs to read the file */
+  if(!priv->io)
+    av_opt_set(priv->ctx->priv_data, "movflags", "+faststart", 0);
+
+  priv->moov_relocated = 1;
+  }
+
+/* Called after the file is closed */
+
+void bg_ffmpeg_moov_close(ffmpeg_priv_t * priv)
+  {
+  FILE * f;
+  uint8_t buf[8];
+  int64_t moov_size;
+
+  if(!priv->moov_reserved)
+    return;
+
+  /* Check, what the muxer wrote into the reserved space */
+  if(!priv->moov_relocated && !priv->io &&
+     (f = fopen(priv->ctx->filename, "rb")))
+    {
+    if(!fseek(f, priv->moov_pos, SEEK_SET) &&
+       (fread(buf, 1, 8, f) == 8) &&
+       !memcmp(buf + 4, "moov", 4))
+      {
+      moov_size = GAVL_PTR_2_32BE(buf);
+      bg_log(BG_LOG_INFO, LOG_DOMAIN,
+             "Index: %"PRId64" bytes, %"PRId64" of %"PRId64" reserved bytes unused",
+             moov_size, priv->moov_reserved - moov_size,
+             priv->moov_reserved);
+      }
+    fclose(f);
+    }
+  else if(priv->moov_relocated)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "%"PRId64" reserved bytes unused", priv->moov_reserved);
+
+  free(priv->moov_samples);
+  priv->moov_samples = NULL;
+  free(priv->moov_keyframes);
+  priv->moov_keyframes = NULL;
+  priv->moov_reserved = 0;
+  priv->moov_relocated = 0;
+  }
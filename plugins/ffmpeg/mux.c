@@ -0,0 +1,258 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Mux thread: av_interleaved_write_frame() is called from a separate
+ *  thread, so slow writes don't stall the encoders. The encoders block
+ *  only if the queued packets exceed the size or duration limit.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+#include <gmerlin/log.h>
+
+#define LOG_DOMAIN "ffmpeg.mux"
+
+static gavl_time_t packet_time(ffmpeg_priv_t * priv, AVPacket * pkt)
+  {
+  AVStream * st = priv->ctx->streams[pkt->stream_index];
+
+  if(pkt->dts == AV_NOPTS_VALUE)
+    return GAVL_TIME_UNDEFINED;
+  return av_rescale_q(pkt->dts, st->time_base, AV_TIME_BASE_Q);
+  }
+
+/* Called with the mutex locked */
+
+static int queue_full(ffmpeg_priv_t * priv)
+  {
+  bg_ffmpeg_mux_entry_t * first;
+  bg_ffmpeg_mux_entry_t * last;
+
+  if(!priv->mux_num)
+    return 0;
+
+  if(priv->mux_bytes >= priv->mux_max_bytes)
+    return 1;
+
+  if(priv->mux_max_duration > 0)
+    {
+    first = &priv->mux_queue[priv->mux_head];
+    last = &priv->mux_queue[(priv->mux_head + priv->mux_num - 1) %
+                            priv->mux_alloc];
+    if((first->time != GAVL_TIME_UNDEFINED) &&
+       (last->time != GAVL_TIME_UNDEFINED) &&
+       (last->time - first->time >= priv->mux_max_duration))
+      return 1;
+    }
+  return 0;
+  }
+
+static void * mux_thread(void * data)
+  {
+  AVPacket * pkt;
+  int size;
+  int result;
+  int drop;
+  ffmpeg_priv_t * priv = data;
+
+  pthread_mutex_lock(&priv->mux_mutex);
+
+  while(1)
+    {
+    while(!priv->mux_num && !priv->mux_quit)
+      pthread_cond_wait(&priv->mux_cond, &priv->mux_mutex);
+
+    if(!priv->mux_num) /* Quit and queue is empty */
+      break;
+
+    pkt = priv->mux_queue[priv->mux_head].pkt;
+    drop = priv->got_error;
+    pthread_mutex_unlock(&priv->mux_mutex);
+
+    size = pkt->size;
+
+    /* Takes over the reference. After an error, the remaining
+       packets are dropped. */
+    result = drop ? 0 : av_interleaved_write_frame(priv->ctx, pkt);
+    av_packet_free(&pkt);
+
+    pthread_mutex_lock(&priv->mux_mutex);
+
+    priv->mux_head = (priv->mux_head + 1) % priv->mux_alloc;
+    priv->mux_num--;
+    priv->mux_bytes -= size;
+
+    if(result)
+      priv->got_error = 1;
+
+    pthread_cond_broadcast(&priv->mux_cond);
+    }
+  pthread_mutex_unlock(&priv->mux_mutex);
+  return NULL;
+  }
+
+void bg_ffmpeg_mux_start(ffmpeg_priv_t * priv)
+  {
+  if(priv->mux_max_bytes <= 0)
+    return;
+
+  pthread_mutex_init(&priv->mux_mutex, NULL);
+  pthread_cond_init(&priv->mux_cond, NULL);
+  priv->mux_quit = 0;
+
+  if(pthread_create(&priv->mux_thread, NULL, mux_thread, priv))
+    {
+    bg_log(BG_LOG_WARNING, LOG_DOMAIN,
+           "Cannot create mux thread, writing from the encoder thread");
+    pthread_mutex_destroy(&priv->mux_mutex);
+    pthread_cond_destroy(&priv->mux_cond);
+    return;
+    }
+  priv->mux_running = 1;
+  }
+
+int bg_ffmpeg_mux_write(ffmpeg_priv_t * priv, AVPacket * pkt)
+  {
+  int i;
+  bg_ffmpeg_mux_entry_t * e;
+
+  bg_ffmpeg_moov_count(priv, pkt);
+  
+  if(!priv->mux_running)
+    return !av_interleaved_write_frame(priv->ctx, pkt);
+
+  pthread_mutex_lock(&priv->mux_mutex);
+
+  if(queue_full(priv))
+    {
+    priv->mux_blocked++;
+    while(queue_full(priv) && !priv->got_error)
+      pthread_cond_wait(&priv->mux_cond, &priv->mux_mutex);
+    }
+
+  if(priv->got_error)
+    {
+    pthread_mutex_unlock(&priv->mux_mutex);
+    return 0;
+    }
+
+  /* Grow the ring buffer, the oldest entry goes to the start */
+  if(priv->mux_num == priv->mux_alloc)
+    {
+    bg_ffmpeg_mux_entry_t * queue;
+    queue = calloc(priv->mux_alloc + 64, sizeof(*queue));
+    
+    for(i = 0; i < priv->mux_num; i++)
+      queue[i] = priv->mux_queue[(priv->mux_head + i) % priv->mux_alloc];
+
+    if(priv->mux_queue)
+      free(priv->mux_queue);
+    priv->mux_queue = queue;
+    priv->mux_head = 0;
+    priv->mux_alloc += 64;
+    }
+
+  e = &priv->mux_queue[(priv->mux_head + priv->mux_num) % priv->mux_alloc];
+
+  /* Packet data is owned by the encoder: Make a refcounted copy */
+  e->pkt = av_packet_alloc();
+  if(av_packet_ref(e->pkt, pkt) < 0)
+    {
+    av_packet_free(&e->pkt);
+    pthread_mutex_unlock(&priv->mux_mutex);
+    return 0;
+    }
+  e->time = packet_time(priv, pkt);
+
+  priv->mux_num++;
+  priv->mux_bytes += pkt->size;
+
+  /* Statistics */
+  if(priv->mux_num > priv->mux_max_num)
+    priv->mux_max_num = priv->mux_num;
+  if(priv->mux_bytes > priv->mux_peak_bytes)
+    priv->mux_peak_bytes = priv->mux_bytes;
+  priv->mux_num_sum += priv->mux_num;
+  priv->mux_packets++;
+
+  pthread_cond_broadcast(&priv->mux_cond);
+  pthread_mutex_unlock(&priv->mux_mutex);
+  return 1;
+  }
+
+/*
+ *  Wait until the queue is empty. Returns 1 if all packets were
+ *  written, 0 after a write error (the rest of the queue is dropped).
+ */
+
+int bg_ffmpeg_mux_flush(ffmpeg_priv_t * priv)
+  {
+  int ret;
+  
+  if(!priv->mux_running)
+    return !priv->got_error;
+
+  pthread_mutex_lock(&priv->mux_mutex);
+  while(priv->mux_num)
+    pthread_cond_wait(&priv->mux_cond, &priv->mux_mutex);
+  ret = !priv->got_error;
+  pthread_mutex_unlock(&priv->mux_mutex);
+  return ret;
+  }
+
+/* Write all queued packets and stop the thread */
+
+void bg_ffmpeg_mux_stop(ffmpeg_priv_t * priv)
+  {
+  if(!priv->mux_running)
+    return;
+
+  pthread_mutex_lock(&priv->mux_mutex);
+  priv->mux_quit = 1;
+  pthread_cond_broadcast(&priv->mux_cond);
+  pthread_mutex_unlock(&priv->mux_mutex);
+
+  pthread_join(priv->mux_thread, NULL);
+
+  pthread_mutex_destroy(&priv->mux_mutex);
+  pthread_cond_destroy(&priv->mux_cond);
+  priv->mux_running = 0;
+
+  if(priv->mux_packets)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Mux queue: %"PRId64" packets, average depth: %.1f, maximum depth: %d packets / %"PRId64" bytes, encoder blocked %"PRId64" times",
+           priv->mux_packets,
+           (double)priv->mux_num_sum / (double)priv->mux_packets,
+           priv->mux_max_num, priv->mux_peak_bytes, priv->mux_blocked);
+
+  if(priv->mux_queue)
+    {
+    free(priv->mux_queue);
+    priv->mux_queue = NULL;
+    }
+  priv->mux_alloc = 0;
+  priv->mux_head = 0;
+  }
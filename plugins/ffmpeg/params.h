@@ -1019,3 +1019,24 @@ RC buffer size") \
     .val_default = GAVL_VALUE_INIT_INT(0), \
     .help_string = TRS("Number of threads to use") \
   }
+
+/**  */
+#define PARAM_TURBO_FIRST_PASS  \
+  { \
+    .name = "ff_turbo_first_pass", \
+    .long_name = TRS("Turbo first pass"),    \
+    .type = BG_PARAMETER_CHECKBUTTON,     \
+    .val_default = GAVL_VALUE_INIT_INT(1), \
+    .help_string = TRS("Use faster motion estimation and mode decision in the first pass of multipass encodings. The rate control of the last pass is hardly affected.") \
+  }
+
+#define PARAM_FRAME_THREADS  \
+  { \
+    .name = "ff_frame_threads", \
+    .long_name = TRS("Frame threads"),    \
+    .type = BG_PARAMETER_INT,             \
+    .val_min = GAVL_VALUE_INIT_INT(1),     \
+    .val_max = GAVL_VALUE_INIT_INT(64),    \
+    .val_default = GAVL_VALUE_INIT_INT(1), \
+    .help_string = TRS("Encode this many frames in parallel, each with its own encoder instance. Limited by the number of frames the timestamp cache can hold.") \
+  }
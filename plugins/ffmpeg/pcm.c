@@ -0,0 +1,136 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+
+/*
+ *  Native encoders for PCM, A-law and mu-law. libavcodec only does a
+ *  byte swap or a table lookup for these, so we convert the samples
+ *  directly from the caller's frame into the packet with the shared
+ *  kernels. The codec is still opened to get the stream parameters
+ *  for the muxer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+#include <gmerlin/log.h>
+
+#include <gmerlin_encoders.h>
+
+#define LOG_DOMAIN "ffmpeg.pcm"
+
+/* num is the number of samples (all channels) */
+
+static void encode_copy_16(const uint8_t * src, uint8_t * dst, int num)
+  {
+  memcpy(dst, src, num * 2);
+  }
+
+static void encode_swap_16(const uint8_t * src, uint8_t * dst, int num)
+  {
+  bgen_swap_16((uint16_t *)dst, (const uint16_t *)src, num);
+  }
+
+static void encode_copy_8(const uint8_t * src, uint8_t * dst, int num)
+  {
+  memcpy(dst, src, num);
+  }
+
+static void encode_u8_to_s8(const uint8_t * src, uint8_t * dst, int num)
+  {
+  bgen_flip_sign_8(dst, src, num);
+  }
+
+static void encode_alaw(const uint8_t * src, uint8_t * dst, int num)
+  {
+  bgen_s16_to_alaw(dst, (const int16_t *)src, num);
+  }
+
+static void encode_ulaw(const uint8_t * src, uint8_t * dst, int num)
+  {
+  bgen_s16_to_ulaw(dst, (const int16_t *)src, num);
+  }
+
+#ifdef WORDS_BIGENDIAN
+#define encode_s16le encode_swap_16
+#define encode_s16be encode_copy_16
+#else
+#define encode_s16le encode_copy_16
+#define encode_s16be encode_swap_16
+#endif
+
+int bg_ffmpeg_pcm_init(bg_ffmpeg_codec_context_t * ctx,
+                       const gavl_audio_format_t * fmt)
+  {
+  gavl_sample_format_t in_fmt;
+
+  switch(ctx->avctx->codec_id)
+    {
+    case AV_CODEC_ID_PCM_S16LE:
+      ctx->pcm_encode = encode_s16le;
+      ctx->pcm_bytes = 2;
+      in_fmt = GAVL_SAMPLE_S16;
+      break;
+    case AV_CODEC_ID_PCM_S16BE:
+      ctx->pcm_encode = encode_s16be;
+      ctx->pcm_bytes = 2;
+      in_fmt = GAVL_SAMPLE_S16;
+      break;
+    case AV_CODEC_ID_PCM_S8:
+      ctx->pcm_encode = encode_u8_to_s8;
+      ctx->pcm_bytes = 1;
+      in_fmt = GAVL_SAMPLE_U8;
+      break;
+    case AV_CODEC_ID_PCM_U8:
+      ctx->pcm_encode = encode_copy_8;
+      ctx->pcm_bytes = 1;
+      in_fmt = GAVL_SAMPLE_U8;
+      break;
+    case AV_CODEC_ID_PCM_ALAW:
+      ctx->pcm_encode = encode_alaw;
+      ctx->pcm_bytes = 1;
+      in_fmt = GAVL_SAMPLE_S16;
+      break;
+    case AV_CODEC_ID_PCM_MULAW:
+      ctx->pcm_encode = encode_ulaw;
+      ctx->pcm_bytes = 1;
+      in_fmt = GAVL_SAMPLE_S16;
+      break;
+    default:
+      return 0;
+    }
+
+  /* Should be what bg_ffmpeg_choose_sampleformat() selected */
+  if((fmt->sample_format != in_fmt) ||
+     ((fmt->num_channels > 1) &&
+      (fmt->interleave_mode != GAVL_INTERLEAVE_ALL)))
+    {
+    ctx->pcm_encode = NULL;
+    return 0;
+    }
+  
+  bg_log(BG_LOG_DEBUG, LOG_DOMAIN, "Using native encoder for %s",
+         bg_ffmpeg_get_codec_name(ctx->avctx->codec_id));
+  return 1;
+  }
@@ -0,0 +1,473 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Segmenting: The output is split into numbered files. A new segment
+ *  starts with the first keyframe of the first video stream (or the
+ *  first packet of the first audio stream) after the segment duration.
+ *
+ *  Packets of the other streams, which are at or after the segment
+ *  duration, are held back until the boundary is known. Then they
+ *  are written into the segment, their timestamp belongs to.
+ *
+ *  The encoders are not touched at a boundary. The format context of
+ *  the next segment is created with copies of the stream parameters
+ *  of the previous one.
+ *
+ *  With the mux thread, the switch waits until the queue is written
+ *  into the old file. The encoders stall for that time at each
+ *  boundary. Switching in the mux thread would avoid this, but the
+ *  encoder thread uses the streams of the current format context for
+ *  rescaling the timestamps.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <config.h>
+
+#include "ffmpeg_common.h"
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+
+#define LOG_DOMAIN "ffmpeg.segment"
+
+struct bg_ffmpeg_segment_s
+  {
+  char * filename;
+  gavl_time_t duration;
+  };
+
+static char * segment_filename(ffmpeg_priv_t * priv, int index)
+  {
+  return bg_sprintf("%s-%05d.%s", priv->segment_base, index,
+                    priv->format->extension);
+  }
+
+char * bg_ffmpeg_segment_open(ffmpeg_priv_t * priv, const char * filename)
+  {
+  const char * ext = strrchr(filename, '.');
+  const char * slash = strrchr(filename, '/');
+  char * ret;
+
+  if(!ext || (slash && (ext < slash)))
+    ext = filename + strlen(filename);
+
+  priv->segment_base = gavl_strndup(filename, ext);
+  priv->segment_playlist = bg_sprintf("%s.m3u8", priv->segment_base);
+  priv->segment_index = 0;
+  priv->segment_start = GAVL_TIME_UNDEFINED;
+  priv->segment_end = GAVL_TIME_UNDEFINED;
+
+  if(!bg_encoder_cb_create_output_file(priv->cb, priv->segment_playlist))
+    return NULL;
+
+  ret = segment_filename(priv, 0);
+
+  if(!bg_encoder_cb_create_output_file(priv->cb, ret))
+    {
+    free(ret);
+    return NULL;
+    }
+  return ret;
+  }
+
+void bg_ffmpeg_segment_start(ffmpeg_priv_t * priv)
+  {
+  if(!priv->segment_base)
+    return;
+
+  if(priv->num_video_streams)
+    priv->segment_stream = priv->video_streams[0].com.stream->index;
+  else if(priv->num_audio_streams)
+    priv->segment_stream = priv->audio_streams[0].com.stream->index;
+  else
+    priv->segment_stream = -1;
+  }
+
+/* Playlist */
+
+static const char * get_basename(const char * filename)
+  {
+  const char * pos = strrchr(filename, '/');
+  return pos ? pos + 1 : filename;
+  }
+
+static int write_playlist(ffmpeg_priv_t * priv, int finished)
+  {
+  int i;
+  int first;
+  int64_t max_duration = 0;
+  char * tmp_filename;
+  FILE * out;
+
+  first = 0;
+  if(priv->segment_list_size &&
+     (priv->num_segments > priv->segment_list_size))
+    first = priv->num_segments - priv->segment_list_size;
+
+  for(i = first; i < priv->num_segments; i++)
+    {
+    if(priv->segments[i].duration > max_duration)
+      max_duration = priv->segments[i].duration;
+    }
+
+  /* Write a new file and rename it, so readers never see a partial list */
+
+  tmp_filename = bg_sprintf("%s.tmp", priv->segment_playlist);
+
+  if(!(out = fopen(tmp_filename, "w")))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Cannot open %s", tmp_filename);
+    free(tmp_filename);
+    return 0;
+    }
+
+  fprintf(out, "#EXTM3U\n");
+  fprintf(out, "#EXT-X-VERSION:3\n");
+  fprintf(out, "#EXT-X-TARGETDURATION:%d\n",
+          (int)((max_duration + GAVL_TIME_SCALE - 1) / GAVL_TIME_SCALE));
+  fprintf(out, "#EXT-X-MEDIA-SEQUENCE:%d\n", first);
+
+  for(i = first; i < priv->num_segments; i++)
+    {
+    fprintf(out, "#EXTINF:%.3f,\n%s\n",
+            gavl_time_to_seconds(priv->segments[i].duration),
+            get_basename(priv->segments[i].filename));
+    }
+
+  if(finished)
+    fprintf(out, "#EXT-X-ENDLIST\n");
+
+  fclose(out);
+
+  if(rename(tmp_filename, priv->segment_playlist))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Cannot rename %s to %s",
+           tmp_filename, priv->segment_playlist);
+    remove(tmp_filename);
+    free(tmp_filename);
+    return 0;
+    }
+
+  free(tmp_filename);
+  return 1;
+  }
+
+static void add_segment(ffmpeg_priv_t * priv, gavl_time_t end)
+  {
+  priv->segments = realloc(priv->segments,
+                           (priv->num_segments+1) * sizeof(*priv->segments));
+  priv->segments[priv->num_segments].filename =
+    gavl_strdup(priv->ctx->filename);
+  priv->segments[priv->num_segments].duration = end - priv->segment_start;
+  priv->num_segments++;
+  }
+
+/* Switch to the next file */
+
+static void set_stream(ffmpeg_priv_t * priv, bg_ffmpeg_stream_common_t * com)
+  {
+  com->stream = priv->ctx->streams[com->stream->index];
+  }
+
+static int next_segment(ffmpeg_priv_t * priv, gavl_time_t end)
+  {
+  int i;
+  int ret = 0;
+  AVFormatContext * ctx;
+  AVFormatContext * old_ctx = priv->ctx;
+  AVStream * st;
+  AVStream * old_st;
+  AVDictionary * options = NULL;
+  int result;
+  char * filename;
+
+  /* Finish the current file. Blocks the encoders until the mux
+     queue is empty. */
+  if(!bg_ffmpeg_mux_flush(priv))
+    return 0;
+
+  av_write_trailer(old_ctx);
+  avio_close(old_ctx->pb);
+  old_ctx->pb = NULL;
+
+  add_segment(priv, end);
+
+  if(!write_playlist(priv, 0))
+    {
+    priv->got_error = 1;
+    return 0;
+    }
+
+  /* Setup the new file */
+
+  priv->segment_index++;
+  filename = segment_filename(priv, priv->segment_index);
+
+  if(!bg_encoder_cb_create_output_file(priv->cb, filename))
+    {
+    free(filename);
+    priv->got_error = 1;
+    return 0;
+    }
+
+  ctx = avformat_alloc_context();
+  ctx->oformat = old_ctx->oformat;
+  ctx->max_delay = old_ctx->max_delay;
+  strncpy(ctx->filename, filename, sizeof(ctx->filename));
+  av_dict_copy(&ctx->metadata, old_ctx->metadata, 0);
+  free(filename);
+
+  for(i = 0; i < old_ctx->nb_streams; i++)
+    {
+    old_st = old_ctx->streams[i];
+    st = avformat_new_stream(ctx, NULL);
+
+    avcodec_parameters_copy(st->codecpar, old_st->codecpar);
+    st->time_base = old_st->time_base;
+    st->sample_aspect_ratio = old_st->sample_aspect_ratio;
+    av_dict_copy(&st->metadata, old_st->metadata, 0);
+    }
+
+  if(avio_open(&ctx->pb, ctx->filename, AVIO_FLAG_WRITE) < 0)
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Cannot open %s", ctx->filename);
+    goto fail;
+    }
+
+  av_dict_copy(&options, priv->format_options, 0);
+  result = avformat_write_header(ctx, &options);
+  av_dict_free(&options);
+  
+  if(result)
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "avformat_write_header failed");
+    avio_close(ctx->pb);
+    goto fail;
+    }
+
+  /* Held back packets have timestamps in the old timebases */
+  for(i = 0; i < priv->segment_num_pending; i++)
+    {
+    AVPacket * pkt = priv->segment_pending[i].pkt;
+    av_packet_rescale_ts(pkt,
+                         old_ctx->streams[pkt->stream_index]->time_base,
+                         ctx->streams[pkt->stream_index]->time_base);
+    }
+
+  priv->ctx = ctx;
+
+  for(i = 0; i < priv->num_audio_streams; i++)
+    set_stream(priv, &priv->audio_streams[i].com);
+  for(i = 0; i < priv->num_video_streams; i++)
+    set_stream(priv, &priv->video_streams[i].com);
+  for(i = 0; i < priv->num_text_streams; i++)
+    set_stream(priv, &priv->text_streams[i].com);
+
+  avformat_free_context(old_ctx);
+
+  priv->segment_start = end;
+
+  bg_log(BG_LOG_DEBUG, LOG_DOMAIN, "Starting segment %s", ctx->filename);
+
+  ret = 1;
+  fail:
+
+  if(!ret)
+    {
+    avformat_free_context(ctx);
+    priv->got_error = 1;
+    }
+  return ret;
+  }
+
+/* Write held back packets before limit */
+
+static int write_pending(ffmpeg_priv_t * priv, gavl_time_t limit)
+  {
+  int i;
+  int num = 0;
+  int ret = 1;
+
+  for(i = 0; i < priv->segment_num_pending; i++)
+    {
+    bg_ffmpeg_mux_entry_t * e = &priv->segment_pending[i];
+
+    if((limit == GAVL_TIME_UNDEFINED) || (e->time < limit))
+      {
+      if(ret && !bg_ffmpeg_mux_write(priv, e->pkt))
+        ret = 0;
+      av_packet_free(&e->pkt);
+      }
+    else
+      priv->segment_pending[num++] = *e;
+    }
+  priv->segment_num_pending = num;
+  return ret;
+  }
+
+static int hold_back(ffmpeg_priv_t * priv, AVPacket * pkt, gavl_time_t time)
+  {
+  bg_ffmpeg_mux_entry_t * e;
+
+  if(priv->segment_num_pending == priv->segment_pending_alloc)
+    {
+    priv->segment_pending_alloc += 64;
+    priv->segment_pending = realloc(priv->segment_pending,
+                                    priv->segment_pending_alloc *
+                                    sizeof(*priv->segment_pending));
+    }
+
+  e = &priv->segment_pending[priv->segment_num_pending];
+
+  /* Packet data is owned by the encoder */
+  e->pkt = av_packet_alloc();
+  if(av_packet_ref(e->pkt, pkt) < 0)
+    {
+    av_packet_free(&e->pkt);
+    return 0;
+    }
+  e->time = time;
+  priv->segment_num_pending++;
+  return 1;
+  }
+
+int bg_ffmpeg_segment_write(ffmpeg_priv_t * priv, AVPacket * pkt,
+                            gavl_time_t time)
+  {
+  gavl_time_t end;
+  gavl_time_t target;
+  int idx = pkt->stream_index;
+  AVRational time_base;
+
+  if(!priv->segment_base || (priv->segment_stream < 0) ||
+     (time == GAVL_TIME_UNDEFINED))
+    return bg_ffmpeg_mux_write(priv, pkt);
+
+  /* Switching the file failed */
+  if(priv->got_error)
+    return 0;
+
+  if(priv->segment_start == GAVL_TIME_UNDEFINED)
+    priv->segment_start = time;
+
+  end = time + av_rescale_q(pkt->duration, priv->ctx->streams[idx]->time_base,
+                            AV_TIME_BASE_Q);
+  if((priv->segment_end == GAVL_TIME_UNDEFINED) || (end > priv->segment_end))
+    priv->segment_end = end;
+
+  target = priv->segment_start + priv->segment_duration;
+
+  if(time < target)
+    return bg_ffmpeg_mux_write(priv, pkt);
+
+  if(idx != priv->segment_stream)
+    return hold_back(priv, pkt, time);
+
+  /* Continue the GOP */
+  if(!(pkt->flags & AV_PKT_FLAG_KEY))
+    return bg_ffmpeg_mux_write(priv, pkt);
+
+  /* Boundary */
+
+  if(!write_pending(priv, time))
+    return 0;
+
+  time_base = priv->ctx->streams[idx]->time_base;
+
+  if(!next_segment(priv, time))
+    return 0;
+
+  av_packet_rescale_ts(pkt, time_base, priv->ctx->streams[idx]->time_base);
+
+  if(!bg_ffmpeg_mux_write(priv, pkt))
+    return 0;
+
+  return write_pending(priv, priv->segment_start + priv->segment_duration);
+  }
+
+/* Called before the trailer of the last segment is written */
+
+int bg_ffmpeg_segment_flush(ffmpeg_priv_t * priv)
+  {
+  if(!priv->segment_base)
+    return 1;
+  return write_pending(priv, GAVL_TIME_UNDEFINED);
+  }
+
+/* Called after the last segment is closed */
+
+void bg_ffmpeg_segment_close(ffmpeg_priv_t * priv, int do_delete)
+  {
+  int i;
+
+  if(!priv->segment_base)
+    return;
+
+  if(priv->initialized && (priv->segment_start != GAVL_TIME_UNDEFINED))
+    {
+    add_segment(priv, priv->segment_end);
+
+    if(!do_delete)
+      write_playlist(priv, 1);
+
+    bg_log(BG_LOG_INFO, LOG_DOMAIN, "Wrote %d segments", priv->num_segments);
+    }
+
+  /* The last segment is removed by the caller */
+
+  for(i = 0; i < priv->num_segments; i++)
+    {
+    if(do_delete && (i < priv->num_segments - 1))
+      remove(priv->segments[i].filename);
+    free(priv->segments[i].filename);
+    }
+  if(do_delete)
+    remove(priv->segment_playlist);
+
+  if(priv->segments)
+    {
+    free(priv->segments);
+    priv->segments = NULL;
+    }
+  priv->num_segments = 0;
+
+  for(i = 0; i < priv->segment_num_pending; i++)
+    av_packet_free(&priv->segment_pending[i].pkt);
+  priv->segment_num_pending = 0;
+
+  free(priv->segment_base);
+  priv->segment_base = NULL;
+  free(priv->segment_playlist);
+  priv->segment_playlist = NULL;
+  }
+
+void bg_ffmpeg_segment_free(ffmpeg_priv_t * priv)
+  {
+  if(priv->segment_pending)
+    {
+    free(priv->segment_pending);
+    priv->segment_pending = NULL;
+    }
+  priv->segment_pending_alloc = 0;
+  }
@@ -0,0 +1,273 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Checks the native PCM encoders against libavcodec: The same frames
+ *  are passed to the pcm_encode() function from bg_ffmpeg_pcm_init()
+ *  and to avcodec_send_frame(). The bytes must be the same as the
+ *  ones from avcodec_receive_packet().
+ *
+ *  The 16 bit input contains every value from INT16_MIN to INT16_MAX,
+ *  so the companding tables are checked completely. The 8 bit input
+ *  contains every value 0..255.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "pcm.c"
+
+#define NUM_CHANNELS 2
+
+/* Odd frame size, so the last frame is shorter */
+#define SAMPLES_PER_FRAME 1000
+
+/* All 16 bit values */
+#define NUM_VALUES 65536
+
+static const enum AVCodecID codec_ids[] =
+  {
+    AV_CODEC_ID_PCM_S16LE,
+    AV_CODEC_ID_PCM_S16BE,
+    AV_CODEC_ID_PCM_S8,
+    AV_CODEC_ID_PCM_U8,
+    AV_CODEC_ID_PCM_ALAW,
+    AV_CODEC_ID_PCM_MULAW,
+  };
+
+#define NUM_CODECS (int)(sizeof(codec_ids)/sizeof(codec_ids[0]))
+
+static int16_t src_16[NUM_VALUES];
+static uint8_t src_8[NUM_VALUES];
+
+static uint8_t dst_native[NUM_VALUES * 2];
+static uint8_t dst_lavc[NUM_VALUES * 2];
+
+static void init_src(void)
+  {
+  int i;
+  for(i = 0; i < NUM_VALUES; i++)
+    {
+    src_16[i] = i + INT16_MIN;
+    src_8[i] = i;
+    }
+  }
+
+/* Returns the number of bytes from libavcodec or -1 */
+
+static int encode_lavc(AVCodecContext * avctx, const uint8_t * src,
+                       int src_bytes, int num)
+  {
+  int pos = 0;
+  int len = 0;
+  int result;
+  AVFrame * frame;
+  AVPacket * pkt;
+
+  frame = av_frame_alloc();
+  pkt = av_packet_alloc();
+
+  while(1)
+    {
+    if(pos < num)
+      {
+      frame->nb_samples = num - pos;
+      if(frame->nb_samples > SAMPLES_PER_FRAME)
+        frame->nb_samples = SAMPLES_PER_FRAME;
+      frame->format = avctx->sample_fmt;
+      frame->channels = avctx->channels;
+      frame->channel_layout = avctx->channel_layout;
+      frame->data[0] = (uint8_t *)src + pos * src_bytes;
+      frame->linesize[0] = frame->nb_samples * src_bytes;
+      frame->extended_data = frame->data;
+      pos += frame->nb_samples;
+      result = avcodec_send_frame(avctx, frame);
+      }
+    else
+      result = avcodec_send_frame(avctx, NULL);
+
+    if(result < 0)
+      {
+      len = -1;
+      break;
+      }
+
+    while(!(result = avcodec_receive_packet(avctx, pkt)))
+      {
+      if(len + pkt->size > (int)sizeof(dst_lavc))
+        {
+        av_packet_unref(pkt);
+        len = -1;
+        break;
+        }
+      memcpy(dst_lavc + len, pkt->data, pkt->size);
+      len += pkt->size;
+      av_packet_unref(pkt);
+      }
+
+    if(len < 0)
+      break;
+
+    if(result == AVERROR_EOF)
+      break;
+    else if(result != AVERROR(EAGAIN))
+      {
+      len = -1;
+      break;
+      }
+    }
+
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  return len;
+  }
+
+static int encode_native(bg_ffmpeg_codec_context_t * ctx,
+                         const uint8_t * src, int src_bytes, int num)
+  {
+  int pos = 0;
+  int n;
+  int len = 0;
+
+  while(pos < num)
+    {
+    n = num - pos;
+    if(n > SAMPLES_PER_FRAME)
+      n = SAMPLES_PER_FRAME;
+
+    ctx->pcm_encode(src + pos * src_bytes, dst_native + len,
+                    n * NUM_CHANNELS);
+    len += n * NUM_CHANNELS * ctx->pcm_bytes;
+    pos += n;
+    }
+  return len;
+  }
+
+static int test_codec(enum AVCodecID id)
+  {
+  int i;
+  int ret = 0;
+  int src_bytes;
+  int num;
+  int len_native;
+  int len_lavc;
+  const uint8_t * src;
+  const char * name = bg_ffmpeg_get_codec_name(id);
+  const AVCodec * codec;
+  AVCodecContext * avctx = NULL;
+  bg_ffmpeg_codec_context_t ctx;
+  gavl_audio_format_t fmt;
+
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&fmt, 0, sizeof(fmt));
+
+  if(!(codec = avcodec_find_encoder(id)))
+    {
+    fprintf(stderr, "%s: No encoder in libavcodec\n", name);
+    return 0;
+    }
+
+  /* Set up the format like bg_ffmpeg_codec_open_audio() */
+  fmt.samplerate = 48000;
+  fmt.num_channels = NUM_CHANNELS;
+  fmt.samples_per_frame = SAMPLES_PER_FRAME;
+  fmt.sample_format = GAVL_SAMPLE_S16;
+  fmt.interleave_mode = GAVL_INTERLEAVE_ALL;
+  gavl_set_channel_setup(&fmt);
+
+  avctx = avcodec_alloc_context3(codec);
+  avctx->sample_rate = fmt.samplerate;
+  avctx->channels = fmt.num_channels;
+  avctx->channel_layout = bg_ffmpeg_get_channel_layout(&fmt);
+  avctx->sample_fmt = bg_ffmpeg_choose_sampleformat(codec->sample_fmts, &fmt);
+
+  if(avcodec_open2(avctx, codec, NULL) < 0)
+    {
+    fprintf(stderr, "%s: avcodec_open2 failed\n", name);
+    goto fail;
+    }
+
+  ctx.avctx = avctx;
+
+  if(!bg_ffmpeg_pcm_init(&ctx, &fmt))
+    {
+    fprintf(stderr, "%s: No native encoder for %s\n", name,
+            gavl_sample_format_to_string(fmt.sample_format));
+    goto fail;
+    }
+
+  src_bytes = gavl_bytes_per_sample(fmt.sample_format) * NUM_CHANNELS;
+
+  if(fmt.sample_format == GAVL_SAMPLE_S16)
+    src = (const uint8_t *)src_16;
+  else
+    src = src_8;
+
+  num = NUM_VALUES / NUM_CHANNELS;
+
+  len_native = encode_native(&ctx, src, src_bytes, num);
+  len_lavc = encode_lavc(avctx, src, src_bytes, num);
+
+  if(len_lavc < 0)
+    {
+    fprintf(stderr, "%s: Encoding with libavcodec failed\n", name);
+    goto fail;
+    }
+
+  if(len_native != len_lavc)
+    {
+    fprintf(stderr, "%s: %d bytes, libavcodec %d bytes\n", name,
+            len_native, len_lavc);
+    goto fail;
+    }
+
+  for(i = 0; i < len_native; i++)
+    {
+    if(dst_native[i] != dst_lavc[i])
+      {
+      fprintf(stderr, "%s: Byte %d differs: %02x, libavcodec %02x\n",
+              name, i, dst_native[i], dst_lavc[i]);
+      goto fail;
+      }
+    }
+
+  printf("%-20s %d bytes identical\n", name, len_native);
+  ret = 1;
+
+  fail:
+  avcodec_free_context(&avctx);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int ret = 0;
+
+  init_src();
+
+  for(i = 0; i < NUM_CODECS; i++)
+    {
+    if(!test_codec(codec_ids[i]))
+      ret = 1;
+    }
+  return ret;
+  }
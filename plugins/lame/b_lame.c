@@ -132,8 +132,13 @@ static void set_audio_parameter_lame(void * data, int stream, const char * name,
 static gavl_sink_status_t write_callback(void * data, gavl_packet_t * p)
   {
   b_lame_t * lame = data;
-  return (bg_shout_write(lame->shout, p->data, p->data_len) == p->data_len) ?
-    GAVL_SINK_OK : GAVL_SINK_ERROR;
+  gavl_time_t time = GAVL_TIME_UNDEFINED;
+
+  if(p->pts != GAVL_TIME_UNDEFINED)
+    time = gavl_time_unscale(lame->fmt.samplerate, p->pts);
+  
+  return (bg_shout_write_time(lame->shout, p->data, p->data_len, time) ==
+          p->data_len) ? GAVL_SINK_OK : GAVL_SINK_ERROR;
   }
 
 static int start_lame(void * data)
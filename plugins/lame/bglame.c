@@ -33,6 +33,7 @@
 
 #include <gavl/metatags.h>
 
+#include <gmerlin_encoders.h>
 
 #include <bglame.h>
 
@@ -270,11 +271,14 @@ static int decode_header(mpeg_header * h, uint8_t * ptr)
 
 struct bg_lame_s
   {
+  /* Points into buffer, no data of its own */
   gavl_packet_t gp;
-  
+
+  /* Encoded data, packets are taken from buffer_pos */
   uint8_t * buffer;
   int buffer_alloc;
   int buffer_size;
+  int buffer_pos;
 
   enum vbr_mode_e vbr_mode;
 
@@ -295,7 +299,13 @@ struct bg_lame_s
   int64_t in_pts;
   int64_t out_pts;
   int64_t delay;
-  
+
+  /* Segment parallel encoding */
+  gavl_dictionary_t params; /* For creating the segment encoders */
+  int num_threads;
+  gavl_time_t segment_duration;
+  bgen_parallel_t * parallel;
+  int segment_encoder;
   };
 
 /* Supported samplerates for MPEG-1/2/2.5 */
@@ -403,6 +413,8 @@ void bg_lame_set_packet_sink(bg_lame_t * lame,
                              gavl_packet_sink_t * sink)
   {
   lame->psink = sink;
+  if(lame->parallel)
+    bgen_parallel_set_packet_sink(lame->parallel, sink);
   }
 
 
@@ -414,6 +426,8 @@ void bg_lame_set_parameter(bg_lame_t * lame,
   
   if(!name)
     return;
+
+  gavl_dictionary_set(&lame->params, name, v);
   
   if(!strcmp(name, "bitrate_mode"))
     {
@@ -477,35 +491,76 @@ void bg_lame_set_parameter(bg_lame_t * lame,
     {
     lame->abr_max_bitrate = v->v.i;
     }
+  else if(!strcmp(name, "threads"))
+    {
+    lame->num_threads = v->v.i;
+    }
+  else if(!strcmp(name, "segment_duration"))
+    {
+    lame->segment_duration = gavl_seconds_to_time(v->v.i);
+    }
+  }
+
+/* Bytes lame can output for a number of samples */
+
+#define MP3_BUFFER_SIZE(samples) ((5 * (samples)) / 4 + 7200)
+
+/*
+ *  Make room for one call to the encoder. The remaining bytes are moved
+ *  to the start only if the space at the end is too small.
+ */
+
+static void reserve_buffer(bg_lame_t * lame, int bytes)
+  {
+  if(lame->buffer_alloc - lame->buffer_size >= bytes)
+    return;
+
+  if(lame->buffer_pos)
+    {
+    lame->buffer_size -= lame->buffer_pos;
+    if(lame->buffer_size > 0)
+      memmove(lame->buffer,
+              lame->buffer + lame->buffer_pos,
+              lame->buffer_size);
+    lame->buffer_pos = 0;
+    }
+
+  if(lame->buffer_alloc - lame->buffer_size < bytes)
+    {
+    lame->buffer_alloc = lame->buffer_size + bytes;
+    lame->buffer = realloc(lame->buffer, lame->buffer_alloc);
+    }
   }
 
 static int flush_packets(bg_lame_t * lame, int flush_all)
   {
   mpeg_header h;
   int ret = 0;
+  int bytes;
   memset(&h, 0, sizeof(h));
   
   while(1)
     {
-    if(lame->buffer_size < 4)
+    bytes = lame->buffer_size - lame->buffer_pos;
+    
+    if(bytes < 4)
       break;
 
     /* Got no header -> Things are screwed up */
-    if(!decode_header(&h, lame->buffer))
+    if(!decode_header(&h, lame->buffer + lame->buffer_pos))
       return -1;
 
     /* Output the last (possibly incomplete) packet */
-    if((lame->buffer_size < h.frame_bytes) &&
+    if((bytes < h.frame_bytes) &&
        flush_all)
       {
-      h.frame_bytes = lame->buffer_size;
+      h.frame_bytes = bytes;
       }
     
-    if(lame->buffer_size >= h.frame_bytes)
+    if(bytes >= h.frame_bytes)
       {
-      /* Output packet */
-      gavl_packet_alloc(&lame->gp, h.frame_bytes);
-      memcpy(lame->gp.data, lame->buffer, h.frame_bytes);
+      /* Output packet: The sink gets the data from our buffer */
+      lame->gp.data = lame->buffer + lame->buffer_pos;
       lame->gp.data_len = h.frame_bytes;
 
       /* PTS */
@@ -524,18 +579,20 @@ static int flush_packets(bg_lame_t * lame, int flush_all)
         return -1;
 
       /* Remove packet from buffer */
-      
-      lame->buffer_size -= h.frame_bytes;
-      
-      if(lame->buffer_size > 0)
-        memmove(lame->buffer,
-                lame->buffer + h.frame_bytes,
-                lame->buffer_size);
+      lame->buffer_pos += h.frame_bytes;
       ret++;
       }
     else
       break;
     }
+
+  /* Everything consumed: Start from the beginning */
+  if(lame->buffer_pos == lame->buffer_size)
+    {
+    lame->buffer_pos = 0;
+    lame->buffer_size = 0;
+    }
+  
   return ret;
   }
   
@@ -550,6 +607,8 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     lame->in_pts = frame->timestamp;
     lame->out_pts = lame->in_pts - lame->delay;
     }
+
+  reserve_buffer(lame, MP3_BUFFER_SIZE(frame->valid_samples));
   
   bytes_encoded = lame_encode_buffer_float(lame->lame,
                                            frame->channels.f[0],
@@ -570,6 +629,36 @@ write_audio_func(void * data, gavl_audio_frame_t * frame)
     return GAVL_SINK_OK;
   }
 
+/* Encoder for one segment with the same settings */
+
+static gavl_audio_sink_t *
+create_segment_encoder(void * priv, void ** enc, gavl_packet_sink_t * psink)
+  {
+  int i;
+  gavl_audio_format_t fmt;
+  gavl_audio_sink_t * ret;
+  bg_lame_t * lame = priv;
+  bg_lame_t * seg = bg_lame_create();
+
+  seg->segment_encoder = 1;
+  
+  for(i = 0; i < lame->params.num_entries; i++)
+    bg_lame_set_parameter(seg, lame->params.entries[i].name,
+                          &lame->params.entries[i].v);
+
+  gavl_audio_format_copy(&fmt, &lame->format);
+  ret = bg_lame_open(seg, NULL, &fmt, NULL);
+  bg_lame_set_packet_sink(seg, psink);
+  
+  *enc = seg;
+  return ret;
+  }
+
+static void destroy_segment_encoder(void * enc)
+  {
+  bg_lame_destroy(enc);
+  }
+
 gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
                                  gavl_compression_info_t * ci,
                                  gavl_audio_format_t * fmt,
@@ -651,6 +740,10 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   
   /* Write no xing header */
   lame_set_bWriteVbrTag(lame->lame, 0);
+
+  /* Frames of a segment cannot borrow bytes from the previous segment */
+  if(lame->num_threads > 1)
+    lame_set_disable_reservoir(lame->lame, 1);
   
   if(lame_init_params(lame->lame) < 0)
     bg_log(BG_LOG_ERROR, LOG_DOMAIN,  "lame_init_params failed");
@@ -660,9 +753,10 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   gavl_audio_format_copy(&lame->format, fmt);
   lame->sink = gavl_audio_sink_create(NULL, write_audio_func, lame, &lame->format);
 
-  /* Allocate output buffer */
+  /* Allocate output buffer: Enough for several frames, so the
+     remaining bytes need to be moved only rarely */
   
-  lame->buffer_alloc = (5 * fmt->samples_per_frame) / 4 + 7200 + 4096;
+  lame->buffer_alloc = 4 * MP3_BUFFER_SIZE(fmt->samples_per_frame);
   lame->buffer = malloc(lame->buffer_alloc);
   
   if(ci)
@@ -684,19 +778,45 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
   lame->delay = lame_get_encoder_delay(lame->lame) + 528 + 1; 
   if(ci)
     ci->pre_skip = lame->delay;
+
+  if((lame->num_threads > 1) && !lame->segment_encoder)
+    {
+    lame->parallel = bgen_parallel_create(&lame->format, lame->delay,
+                                          lame->num_threads,
+                                          lame->segment_duration,
+                                          create_segment_encoder,
+                                          destroy_segment_encoder,
+                                          lame);
+    return bgen_parallel_get_sink(lame->parallel);
+    }
+  
   return lame->sink;
   
   
   }
 
+lame_global_flags * bg_lame_get_lame(bg_lame_t * lame)
+  {
+  return lame->lame;
+  }
+
 void bg_lame_destroy(bg_lame_t * lame)
   {
   int bytes_encoded;
   
   /* Flush */
 
+  if(lame->parallel)
+    {
+    bgen_parallel_flush(lame->parallel);
+    bgen_parallel_destroy(lame->parallel);
+    lame->parallel = NULL;
+    }
+  
   if(lame->in_pts != GAVL_TIME_UNDEFINED)
     {
+    reserve_buffer(lame, MP3_BUFFER_SIZE(0));
+    
     bytes_encoded = lame_encode_flush(lame->lame,
                                       lame->buffer + lame->buffer_size, 
                                       lame->buffer_alloc - lame->buffer_size);
@@ -728,7 +848,11 @@ void bg_lame_destroy(bg_lame_t * lame)
     lame->sink = NULL;
     }
   
+  /* The packet data belongs to the buffer */
+  lame->gp.data = NULL;
   gavl_packet_free(&lame->gp);
 
+  gavl_dictionary_free(&lame->params);
+
   free(lame);
   }
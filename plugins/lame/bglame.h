@@ -40,6 +40,9 @@ gavl_audio_sink_t * bg_lame_open(bg_lame_t * lame,
 void bg_lame_set_packet_sink(bg_lame_t * lame,
                              gavl_packet_sink_t * sink);
 
+/* Encoder handle with the final settings (valid after bg_lame_open) */
+lame_global_flags * bg_lame_get_lame(bg_lame_t * lame);
+
 /* Audio parameters */
 
 static const bg_parameter_info_t audio_parameters[] =
@@ -137,5 +140,27 @@ If your selection is no valid mp3 bitrate, we'll choose the closest value.")
 If your selection is no valid mp3 bitrate, we'll choose the closest value.")
     },
 #endif // LAME_FILE
+#ifdef USE_VBR
+    {
+      .name =        "threads",
+      .long_name =   TRS("Threads"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1),
+      .val_max =     GAVL_VALUE_INIT_INT(256),
+      .val_default = GAVL_VALUE_INIT_INT(1),
+      .help_string = TRS("Encode segments of the track in parallel. 1 disables parallel encoding. \
+Parallel encoding disables the bit reservoir, which costs some quality (CBR) or size (VBR, ABR).")
+    },
+    {
+      .name =        "segment_duration",
+      .long_name =   TRS("Segment duration (s)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(5),
+      .val_max =     GAVL_VALUE_INIT_INT(3600),
+      .val_default = GAVL_VALUE_INIT_INT(30),
+      .help_string = TRS("Duration of the segments for parallel encoding. \
+Longer segments have fewer boundaries but need more memory.")
+    },
+#endif
     { /* End of parameters */ }
   };
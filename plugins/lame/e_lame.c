@@ -246,10 +246,20 @@ write_audio_packet_func_lame(void * data, gavl_packet_t * p)
   
   lame = data;
 
-  if((lame->ci.bitrate == GAVL_BITRATE_VBR) &&
-     !lame->xing)
+  /*
+   *  VBR and ABR files get a Xing tag. CBR files get an Info tag with
+   *  the gapless information if it can be updated when closing.
+   */
+  
+  if(!lame->xing &&
+     ((lame->ci.bitrate == GAVL_BITRATE_VBR) ||
+      ((lame->ci.bitrate > 0) && gavf_io_can_seek(lame->output))))
     {
-    lame->xing = bg_xing_create(p->data, p->data_len);
+    /* LAME tag only if we encode ourselves */
+    lame->xing = bg_xing_create(p->data, p->data_len,
+                                lame->compressed ? NULL :
+                                bg_lame_get_lame(lame->codec),
+                                lame->ci.bitrate > 0);
     lame->xing_pos = gavf_io_position(lame->output);
     
     if(!bg_xing_write(lame->xing, lame->output))
@@ -257,7 +267,7 @@ write_audio_packet_func_lame(void * data, gavl_packet_t * p)
     }
 
   if(lame->xing)
-    bg_xing_update(lame->xing, p->data_len);
+    bg_xing_update(lame->xing, p);
   
   if(gavf_io_write_data(lame->output, p->data, p->data_len) < p->data_len)
     return GAVL_SINK_ERROR;
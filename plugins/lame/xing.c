@@ -24,34 +24,75 @@
 #include <string.h>
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <gavl/gavl.h>
 #include <gavl/gavf.h>
 
+#include <lame/lame.h>
+
 #include <xing.h>
 
 /*
  *  Lots of the stuff here was taken from gstxingmux.c from
  *  gstreamer
+ *
+ *  The LAME extension follows the LAME tag specification
+ *  (http://gabriel.mp3-tech.org/mp3infotag.html)
  */
 
 #define MAXFRAMESIZE 2881
 
+/*
+ *  Frame positions for the seek table. We keep at most MAX_POSITIONS
+ *  positions of every pos_step'th frame. If the array is full, every
+ *  second entry is dropped and pos_step is doubled. This keeps the
+ *  memory constant and the resolution above 256 points, which is
+ *  more than the 100 entries with 8 bits each need.
+ */
+
+#define MAX_POSITIONS 512
+
+#define XING_SIZE (4 + 4 + 4 + 4 + 100 + 4) /* Up to the VBR scale */
+#define LAME_SIZE 36
+
+/* Decoder delay of mp3 decoders */
+#define DECODER_DELAY (528 + 1)
+
 struct bg_xing_s
   {
-  /* Frame sizes */
+  /* Frame positions */
 
-  uint32_t * frame_positions;
-  int frame_positions_alloc;
+  uint32_t frame_positions[MAX_POSITIONS];
+  int num_positions;
+  int pos_step;
+  
   int num_frames;
   
   uint32_t total_bytes;
+
+  /* Samples in all frames as reported by the encoder */
+  int64_t total_duration;
   
   uint32_t header;  
   
   int tag_bytes;
   int samples_per_frame;
-
+  int cbr;
+
+  /* LAME extension */
+  int have_lame;
+  char encoder[10];
+  int vbr_method;
+  int vbr_scale;
+  int lowpass;
+  int ath_type;
+  int bitrate;
+  int stereo_mode;
+  int source_rate;
+  int encoder_delay;
+  uint16_t music_crc;
+  
   uint8_t buffer[MAXFRAMESIZE];
   
   };
@@ -68,6 +109,33 @@ struct bg_xing_s
 (p)[1] = ((i)>>16) & 0xff; \
 (p)[0] = ((i)>>24) & 0xff;
 
+/* CRC-16 (polynomial 0x8005, reflected) as used in the LAME tag */
+
+static uint16_t crc16_table[256];
+static pthread_once_t crc16_once = PTHREAD_ONCE_INIT;
+
+static void init_crc16()
+  {
+  int i, j;
+  uint16_t crc;
+  
+  for(i = 0; i < 256; i++)
+    {
+    crc = i;
+    for(j = 0; j < 8; j++)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xa001) : (crc >> 1);
+    crc16_table[i] = crc;
+    }
+  }
+
+static uint16_t crc16_update(uint16_t crc, const uint8_t * data, int len)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    crc = (crc >> 8) ^ crc16_table[(crc ^ data[i]) & 0xff];
+  return crc;
+  }
+
 static int
 get_xing_offset (uint32_t header)
   {
@@ -183,20 +251,108 @@ parse_header(uint32_t header, int * ret_size, int * ret_spf,
   }
 
 
-bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len)
+/* VBR method of the LAME tag for each vbr_mode */
+
+static const int vbr_methods[] = { 1, 5, 3, 2, 4, 0, 3 };
+
+static void set_lame_info(bg_xing_t * ret, lame_global_flags * lame)
+  {
+  int samplerate;
+  int vbr = lame_get_VBR(lame);
+
+  ret->have_lame = 1;
+
+  snprintf(ret->encoder, sizeof(ret->encoder), "LAME%s",
+           get_lame_short_version());
+
+  if((vbr >= 0) && (vbr < sizeof(vbr_methods) / sizeof(vbr_methods[0])))
+    ret->vbr_method = vbr_methods[vbr];
+
+  ret->vbr_scale = 100 - 10 * lame_get_VBR_q(lame) - lame_get_quality(lame);
+  
+  ret->lowpass = (lame_get_lowpassfreq(lame) + 50) / 100;
+  if(ret->lowpass > 255)
+    ret->lowpass = 255;
+
+  ret->ath_type = lame_get_ATHtype(lame);
+  
+  switch(vbr)
+    {
+    case vbr_off:
+      ret->bitrate = lame_get_brate(lame);
+      break;
+    case vbr_abr:
+      ret->bitrate = lame_get_VBR_mean_bitrate_kbps(lame);
+      break;
+    default:
+      ret->bitrate = lame_get_VBR_min_bitrate_kbps(lame);
+      break;
+    }
+  if(ret->bitrate > 255)
+    ret->bitrate = 255;
+
+  switch(lame_get_mode(lame))
+    {
+    case MONO:
+      ret->stereo_mode = 0;
+      break;
+    case STEREO:
+      ret->stereo_mode = 1;
+      break;
+    case DUAL_CHANNEL:
+      ret->stereo_mode = 2;
+      break;
+    case JOINT_STEREO:
+      ret->stereo_mode = lame_get_force_ms(lame) ? 4 : 3;
+      break;
+    default:
+      ret->stereo_mode = 7;
+      break;
+    }
+
+  samplerate = lame_get_in_samplerate(lame);
+  if(samplerate <= 32000)
+    ret->source_rate = 0;
+  else if(samplerate <= 44100)
+    ret->source_rate = 1;
+  else if(samplerate <= 48000)
+    ret->source_rate = 2;
+  else
+    ret->source_rate = 3;
+
+  ret->encoder_delay = lame_get_encoder_delay(lame);
+  }
+
+bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len,
+                           lame_global_flags * lame, int cbr)
   {
   bg_xing_t * ret;
   int bitrate_index = 0;
   int xing_offset;
+  int min_bytes;
   ret = calloc(1, sizeof(*ret));
 
+  pthread_once(&crc16_once, init_crc16);
+  
+  ret->pos_step = 1;
+  ret->cbr = cbr;
+
+  if(lame)
+    set_lame_info(ret, lame);
+  
   /* Get final header */
   ret->header = PTR_2_32BE(first_frame);
 
   /* Switch off crc */
   ret->header |= 0x00010000;
 
-  /* Get bitrate */
+  /*
+   *  Get bitrate. The tag frame of a CBR stream has the bitrate of the
+   *  stream unless the tag doesn't fit.
+   */
+
+  if(cbr)
+    bitrate_index = ((ret->header >> 12) & 0x0f) - 1;
 
   do{
     bitrate_index++;
@@ -206,26 +362,150 @@ bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len)
     
     parse_header (ret->header, &ret->tag_bytes, &ret->samples_per_frame, NULL);
     xing_offset = get_xing_offset(ret->header);
-  } while (ret->tag_bytes < (4 + xing_offset + 4 + 4 + 4 + 4 + 100) && bitrate_index < 0xe);
+
+    min_bytes = 4 + xing_offset + XING_SIZE;
+    if(ret->have_lame)
+      min_bytes += LAME_SIZE;
+    
+  } while (ret->tag_bytes < min_bytes && bitrate_index < 0xe);
   
   return ret;
   }
 
-void bg_xing_update(bg_xing_t * xing, int bytes)
+void bg_xing_update(bg_xing_t * xing, const gavl_packet_t * p)
   {
-  if(xing->frame_positions_alloc < xing->num_frames + 1)
+  int i;
+  
+  if(!(xing->num_frames % xing->pos_step))
     {
-    xing->frame_positions_alloc += 1024;
-    xing->frame_positions = realloc(xing->frame_positions,
-                                    xing->frame_positions_alloc *
-                                    sizeof(*xing->frame_positions));
+    if(xing->num_positions == MAX_POSITIONS)
+      {
+      for(i = 0; i < MAX_POSITIONS / 2; i++)
+        xing->frame_positions[i] = xing->frame_positions[2*i];
+      xing->num_positions = MAX_POSITIONS / 2;
+      xing->pos_step *= 2;
+      }
+    if(!(xing->num_frames % xing->pos_step))
+      xing->frame_positions[xing->num_positions++] = xing->total_bytes;
     }
-  xing->frame_positions[xing->num_frames] = xing->total_bytes;
+  
   xing->num_frames++;
-  xing->total_bytes+= bytes;
+  xing->total_bytes += p->data_len;
+  xing->total_duration += p->duration;
+  
+  if(xing->have_lame)
+    xing->music_crc = crc16_update(xing->music_crc, p->data, p->data_len);
+  }
+
+/* Byte position of a frame, interpolated between the stored positions */
+
+static uint64_t get_frame_position(bg_xing_t * xing, int frame)
+  {
+  int idx = frame / xing->pos_step;
+  int64_t first;
+  int64_t frames;
+  uint64_t pos, next;
+  
+  if(idx >= xing->num_positions)
+    return xing->total_bytes;
+  
+  pos = xing->frame_positions[idx];
+  first = (int64_t)idx * xing->pos_step;
+
+  if(frame == first)
+    return pos;
+
+  if(idx + 1 < xing->num_positions)
+    {
+    next = xing->frame_positions[idx + 1];
+    frames = xing->pos_step;
+    }
+  else
+    {
+    next = xing->total_bytes;
+    frames = xing->num_frames - first;
+    }
+  return pos + ((next - pos) * (frame - first)) / frames;
   }
 
 static const char xing_sig[4] = "Xing";
+static const char info_sig[4] = "Info";
+
+static void write_lame_tag(bg_xing_t * xing, uint8_t * ptr)
+  {
+  int64_t samples;
+  int padding;
+  int delay;
+  uint32_t tmp;
+  uint16_t crc;
+  
+  /* Encoder */
+  memcpy(ptr, xing->encoder, 9); ptr += 9;
+
+  /* Tag revision 0, VBR method */
+  *ptr = xing->vbr_method & 0x0f; ptr++;
+
+  /* Lowpass */
+  *ptr = xing->lowpass; ptr++;
+  
+  /* Replay gain (peak, radio, audiophile): Not calculated */
+  memset(ptr, 0, 8); ptr += 8;
+
+  /* Encoding flags, ATH type */
+  *ptr = xing->ath_type & 0x0f; ptr++;
+
+  /* Bitrate */
+  *ptr = xing->bitrate; ptr++;
+
+  /*
+   *  Delay and padding:
+   *  frames * samples_per_frame = delay + samples + padding
+   *  The packet durations add up to the samples plus the full delay
+   */
+
+  delay = xing->encoder_delay;
+  samples = xing->total_duration - (delay + DECODER_DELAY);
+  padding = (int64_t)xing->num_frames * xing->samples_per_frame -
+    delay - samples;
+
+  if(delay > 0xfff)
+    delay = 0xfff;
+  if(padding < 0)
+    padding = 0;
+  if(padding > 0xfff)
+    padding = 0xfff;
+  
+  ptr[0] = delay >> 4;
+  ptr[1] = ((delay & 0x0f) << 4) | (padding >> 8);
+  ptr[2] = padding & 0xff;
+  ptr += 3;
+
+  /* Misc: Noise shaping 0, stereo mode, unwise settings 0, source rate */
+  *ptr = ((xing->stereo_mode & 0x07) << 2) | ((xing->source_rate & 0x03) << 6);
+  ptr++;
+
+  /* MP3 gain */
+  *ptr = 0; ptr++;
+
+  /* Surround info, preset */
+  ptr[0] = 0;
+  ptr[1] = 0;
+  ptr += 2;
+
+  /* Music length: From the tag frame to the end of the last frame */
+  tmp = xing->tag_bytes + xing->total_bytes;
+  INT_32BE_2_PTR(tmp, ptr); ptr += 4;
+
+  /* Music CRC */
+  ptr[0] = xing->music_crc >> 8;
+  ptr[1] = xing->music_crc & 0xff;
+  ptr += 2;
+
+  /* CRC of the tag frame up to here */
+  crc = crc16_update(0, xing->buffer, ptr - xing->buffer);
+  ptr[0] = crc >> 8;
+  ptr[1] = crc & 0xff;
+  }
 
 int bg_xing_write(bg_xing_t * xing, gavf_io_t * out)
   {
@@ -243,10 +523,13 @@ int bg_xing_write(bg_xing_t * xing, gavf_io_t * out)
 
     ptr += get_xing_offset(xing->header);
 
-    memcpy(ptr, xing_sig, 4); ptr += 4;
+    memcpy(ptr, xing->cbr ? info_sig : xing_sig, 4); ptr += 4;
 
     /* Flags */
-    tmp = 7; // FRAMES_FLAG | BYTES_FLAG | TOC_FLAG
+    if(xing->have_lame)
+      tmp = 15; // FRAMES_FLAG | BYTES_FLAG | TOC_FLAG | VBR_SCALE_FLAG
+    else
+      tmp = 7; // FRAMES_FLAG | BYTES_FLAG | TOC_FLAG
     INT_32BE_2_PTR(tmp, ptr); ptr += 4;
 
     /* Num frames */
@@ -260,7 +543,7 @@ int bg_xing_write(bg_xing_t * xing, gavf_io_t * out)
     /* Seek table */
     for(i = 0; i < 100; i++)
       {
-      tmp_64 = xing->frame_positions[(i * xing->num_frames) / 100];
+      tmp_64 = get_frame_position(xing, (i * (int64_t)xing->num_frames) / 100);
 
       //      fprintf(stderr, "Seek entry %d: %ld ", i, tmp_64);
       
@@ -272,6 +555,15 @@ int bg_xing_write(bg_xing_t * xing, gavf_io_t * out)
       *ptr = tmp_64;
       ptr++;
       }
+
+    if(xing->have_lame)
+      {
+      /* VBR scale */
+      tmp = xing->vbr_scale;
+      INT_32BE_2_PTR(tmp, ptr); ptr += 4;
+      
+      write_lame_tag(xing, ptr);
+      }
     }
   if(gavf_io_write_data(out, xing->buffer, xing->tag_bytes) < xing->tag_bytes)
     return 0;
@@ -281,7 +573,5 @@ int bg_xing_write(bg_xing_t * xing, gavf_io_t * out)
 
 void bg_xing_destroy(bg_xing_t * xing)
   {
-  if(xing->frame_positions)
-    free(xing->frame_positions);
   free(xing);
   }
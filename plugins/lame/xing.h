@@ -21,9 +21,16 @@
 
 typedef struct bg_xing_s bg_xing_t;
 
-bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len);
+/*
+ *  If lame is non-NULL, a LAME tag is written as well. CBR streams get
+ *  an "Info" tag instead of a "Xing" tag, which decoders use for the
+ *  gapless information only.
+ */
 
-void bg_xing_update(bg_xing_t * xing, int bytes);
+bg_xing_t * bg_xing_create(uint8_t * first_frame, int first_frame_len,
+                           lame_global_flags * lame, int cbr);
+
+void bg_xing_update(bg_xing_t * xing, const gavl_packet_t * p);
 
 int bg_xing_write(bg_xing_t * xing, gavf_io_t * out);
 
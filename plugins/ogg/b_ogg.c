@@ -168,7 +168,17 @@ static void * create_b_ogg()
 
 static const bg_parameter_info_t * get_parameters_b_ogg(void * data)
   {
-  return bg_shout_get_parameters();
+  bg_ogg_encoder_t * enc = data;
+
+  if(!enc->parameters)
+    {
+    const bg_parameter_info_t * arr[3];
+    arr[0] = bg_shout_get_parameters();
+    arr[1] = bg_ogg_encoder_get_parameters(enc);
+    arr[2] = NULL;
+    enc->parameters = bg_parameter_info_concat_arrays(arr);
+    }
+  return enc->parameters;
   }
 
 static void set_parameter_b_ogg(void * data, const char * name,
@@ -176,6 +186,7 @@ static void set_parameter_b_ogg(void * data, const char * name,
   {
   bg_ogg_encoder_t * enc = data;
   bg_shout_set_parameter(enc->open_callback_data, name, val);
+  bg_ogg_encoder_set_parameter(enc, name, val);
   }
 
 static int
@@ -288,10 +288,8 @@ const bg_encoder_plugin_t the_plugin =
       .priority =        5,
       .create =            bg_ogg_encoder_create,
       .destroy =           bg_ogg_encoder_destroy,
-#if 0
-      .get_parameters =    get_parameters_oggvideo,
-      .set_parameter =     set_parameter_oggvideo,
-#endif
+      .get_parameters =    bg_ogg_encoder_get_parameters,
+      .set_parameter =     bg_ogg_encoder_set_parameter,
     },
     .max_audio_streams =   -1,
     .max_video_streams =   -1,
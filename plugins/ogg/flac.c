@@ -64,14 +64,36 @@ typedef struct
 
   } flacogg_t;
 
-static int init_compressed_flacogg(bg_ogg_stream_t * s)
+static void create_comment_packet_flacogg(bg_ogg_stream_t * s,
+                                         ogg_packet * op)
   {
-  ogg_packet op;
   int len;
   uint8_t * ptr;
   uint8_t * comment_ptr;
   gavf_io_t * io;
   
+  io = gavf_io_create_mem_write();
+  bg_vorbis_comment_write(io, &s->m_stream, s->m_global, 0);
+  comment_ptr = gavf_io_mem_get_buf(io, &len);
+  
+  op->packet = malloc(4 + len);
+  ptr = op->packet;
+  
+  ptr[0] = 0x84; // Last metadata packet
+  ptr++;
+
+  GAVL_24BE_2_PTR(len, ptr); ptr += 3;
+  memcpy(ptr, comment_ptr, len);
+  op->bytes = len + 4;
+
+  free(comment_ptr);
+  gavf_io_destroy(io);
+  }
+
+static int init_compressed_flacogg(bg_ogg_stream_t * s)
+  {
+  ogg_packet op;
+  
   uint8_t header_bytes[] =
     {
       0x7f,
@@ -104,22 +126,7 @@ static int init_compressed_flacogg(bg_ogg_stream_t * s)
   
   /* Vorbis comment */
   
-  io = gavf_io_create_mem_write();
-  bg_vorbis_comment_write(io, &s->m_stream, s->m_global, 0);
-  comment_ptr = gavf_io_mem_get_buf(io, &len);
-  
-  op.packet = malloc(4 + len);
-  ptr = op.packet;
-  
-  ptr[0] = 0x84; // Last metadata packet
-  ptr++;
-
-  GAVL_24BE_2_PTR(len, ptr); ptr += 3;
-  memcpy(ptr, comment_ptr, len);
-  op.bytes = len + 4;
-
-  free(comment_ptr);
-  gavf_io_destroy(io);
+  create_comment_packet_flacogg(s, &op);
   
   if(!bg_ogg_stream_write_header_packet(s, &op))
     {
@@ -201,6 +208,7 @@ const bg_ogg_codec_t bg_flacogg_codec =
     
     .init_audio =     init_flacogg,
     .init_audio_compressed = init_compressed_flacogg,
+    .create_comment_packet = create_comment_packet_flacogg,
     .set_packet_sink = set_packet_sink,
     .close = close_flacogg,
   };
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include <config.h>
 
@@ -41,20 +43,68 @@
 
 #define LOG_DOMAIN "ogg"
 
+#define DEFAULT_MAX_INTERLEAVE 500 /* ms */
+#define DEFAULT_WRITE_BUFFER   64  /* kB */
+#define DEFAULT_WRITE_DELAY    250 /* ms */
+#define DEFAULT_PAGE_SIZE      16384 /* bytes */
+#define DEFAULT_PAGE_DURATION  100 /* ms */
+#define DEFAULT_INDEX_SIZE     16  /* kB */
+#define WORKER_QUEUE_SIZE      8   /* Frames per stream */
+
+#define PAGE_POLICY_AUTO     0 /* Let libogg decide */
+#define PAGE_POLICY_SIZE     1 /* Pages of a target size */
+#define PAGE_POLICY_DURATION 2 /* Pages of a target duration */
+
+/* Page size used by libogg */
+#define AUTO_PAGE_SIZE 4096
+
 void * bg_ogg_encoder_create()
   {
   bg_ogg_encoder_t * ret;
   ret = calloc(1, sizeof(*ret));
+  ret->max_interleave = DEFAULT_MAX_INTERLEAVE * (GAVL_TIME_SCALE / 1000);
+  ret->out_size  = DEFAULT_WRITE_BUFFER * 1024;
+  ret->out_delay = DEFAULT_WRITE_DELAY * (GAVL_TIME_SCALE / 1000);
+  ret->page_size = DEFAULT_PAGE_SIZE;
+  ret->page_duration = DEFAULT_PAGE_DURATION * (GAVL_TIME_SCALE / 1000);
+  ret->index_size = DEFAULT_INDEX_SIZE * 1024;
+  pthread_mutex_init(&ret->mux_mutex, NULL);
   return ret;
   }
 
 static void free_stream(bg_ogg_stream_t * s)
   {
+  int i;
+  bg_ogg_worker_destroy(s);
   gavl_compression_info_free(&s->ci);
   gavl_dictionary_free(&s->m_stream);
   if(s->stats_file)
     free(s->stats_file);
-  gavl_packet_free(&s->last_packet);
+  gavl_packet_free(&s->packets[0]);
+  gavl_packet_free(&s->packets[1]);
+
+  if(s->packet_times)
+    free(s->packet_times);
+  if(s->keypoints)
+    free(s->keypoints);
+  bg_ogg_pager_free(&s->pager);
+
+  if(s->header_cache)
+    {
+    for(i = 0; i < s->num_header_cache; i++)
+      gavl_packet_free(&s->header_cache[i]);
+    free(s->header_cache);
+    }
+  
+  if(s->pages)
+    {
+    for(i = 0; i < s->pages_alloc; i++)
+      {
+      if(s->pages[i].data)
+        free(s->pages[i].data);
+      }
+    free(s->pages);
+    }
   }
 
 void bg_ogg_encoder_destroy(void * data)
@@ -89,10 +139,141 @@ void bg_ogg_encoder_destroy(void * data)
     bg_parameter_info_destroy_array(e->audio_parameters);
   if(e->video_parameters)
     bg_parameter_info_destroy_array(e->video_parameters);
+  if(e->parameters)
+    bg_parameter_info_destroy_array(e->parameters);
+
+  if(e->out_buf)
+    free(e->out_buf);
+  if(e->header_page.data)
+    free(e->header_page.data);
+
+  pthread_mutex_destroy(&e->mux_mutex);
   
   free(e);
   }
 
+static const bg_parameter_info_t parameters[] =
+  {
+    {
+      .name =        "page_policy",
+      .long_name =   TRS("Page size policy"),
+      .type =        BG_PARAMETER_STRINGLIST,
+      .val_default = GAVL_VALUE_INIT_STRING("auto"),
+      .multi_names = (char const *[]){ "auto", "size", "duration", NULL },
+      .multi_labels = (char const *[]){ TRS("Automatic"), TRS("Page size"),
+                                        TRS("Page duration"), NULL },
+      .help_string = TRS("Automatic: Let libogg decide where pages end\n\
+Page size: Finish pages when they reach the target size. Large pages have less overhead and are good for archiving.\n\
+Page duration: Finish pages when they contain the target duration (but not more than the target size). Short pages reduce the latency of live streams."),
+    },
+    {
+      .name =        "page_size",
+      .long_name =   TRS("Target page size (bytes)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1024),
+      .val_max =     GAVL_VALUE_INIT_INT(65025),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_PAGE_SIZE),
+    },
+    {
+      .name =        "page_duration",
+      .long_name =   TRS("Target page duration (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(10),
+      .val_max =     GAVL_VALUE_INIT_INT(10000),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_PAGE_DURATION),
+    },
+    {
+      .name =        "max_interleave",
+      .long_name =   TRS("Maximum interleave delay (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(10000),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_MAX_INTERLEAVE),
+      .help_string = TRS("Pages of all streams are written in presentation order. If one stream lags behind the others by more than this, pending pages are written anyway to limit the memory usage."),
+    },
+    {
+      .name =        "write_buffer",
+      .long_name =   TRS("Write buffer (kB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(4096),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_WRITE_BUFFER),
+      .help_string = TRS("Collect pages up to this size before writing them at once. This reduces the number of write calls for small pages. 0 writes each page immediately."),
+    },
+    {
+      .name =        "write_delay",
+      .long_name =   TRS("Maximum write delay (ms)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(0),
+      .val_max =     GAVL_VALUE_INIT_INT(10000),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_WRITE_DELAY),
+      .help_string = TRS("Collected pages are written as soon as they span this duration or were held back for this long, even if the write buffer isn't full yet. Lower this for live streams to reduce the latency."),
+    },
+    {
+      .name =        "threads",
+      .long_name =   TRS("Encode streams in parallel"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Encode each stream in its own thread. The output is the same as without threads."),
+    },
+    {
+      .name =        "skeleton",
+      .long_name =   TRS("Write skeleton with seek index"),
+      .type =        BG_PARAMETER_CHECKBUTTON,
+      .val_default = GAVL_VALUE_INIT_INT(0),
+      .help_string = TRS("Write an Ogg Skeleton 4.0 track with a keyframe index for each stream. Players can then seek with one or two reads instead of a bisection search. Only possible for seekable outputs."),
+    },
+    {
+      .name =        "index_size",
+      .long_name =   TRS("Index size (kB)"),
+      .type =        BG_PARAMETER_INT,
+      .val_min =     GAVL_VALUE_INIT_INT(1),
+      .val_max =     GAVL_VALUE_INIT_INT(1024),
+      .val_default = GAVL_VALUE_INIT_INT(DEFAULT_INDEX_SIZE),
+      .help_string = TRS("Space reserved for the index of each stream. 16 kB are enough for a few hours. If the index doesn't fit, the keypoints are thinned out."),
+    },
+    { /* End of parameters */ }
+  };
+
+const bg_parameter_info_t * bg_ogg_encoder_get_parameters(void * data)
+  {
+  return parameters;
+  }
+
+void bg_ogg_encoder_set_parameter(void * data, const char * name,
+                                  const gavl_value_t * val)
+  {
+  bg_ogg_encoder_t * e = data;
+  
+  if(!name)
+    return;
+  else if(!strcmp(name, "max_interleave"))
+    e->max_interleave = (gavl_time_t)val->v.i * (GAVL_TIME_SCALE / 1000);
+  else if(!strcmp(name, "page_policy"))
+    {
+    if(!strcmp(val->v.str, "auto"))
+      e->page_policy = PAGE_POLICY_AUTO;
+    else if(!strcmp(val->v.str, "size"))
+      e->page_policy = PAGE_POLICY_SIZE;
+    else if(!strcmp(val->v.str, "duration"))
+      e->page_policy = PAGE_POLICY_DURATION;
+    }
+  else if(!strcmp(name, "page_size"))
+    e->page_size = val->v.i;
+  else if(!strcmp(name, "page_duration"))
+    e->page_duration = (gavl_time_t)val->v.i * (GAVL_TIME_SCALE / 1000);
+  else if(!strcmp(name, "write_buffer"))
+    e->out_size = val->v.i * 1024;
+  else if(!strcmp(name, "write_delay"))
+    e->out_delay = (gavl_time_t)val->v.i * (GAVL_TIME_SCALE / 1000);
+  else if(!strcmp(name, "threads"))
+    e->threads = val->v.i;
+  else if(!strcmp(name, "skeleton"))
+    e->skeleton = val->v.i;
+  else if(!strcmp(name, "index_size"))
+    e->index_size = val->v.i * 1024;
+  }
+
 void bg_ogg_encoder_set_callbacks(void * data, bg_encoder_callbacks_t * cb)
   {
   bg_ogg_encoder_t * e = data;
@@ -150,25 +331,331 @@ bg_ogg_encoder_open(void * data, const char * file,
   return 1;
   }
 
+/* Page interleaving */
+
+/* Page output */
+
+static int write_data(bg_ogg_encoder_t * e, const uint8_t * data, int len)
+  {
+  if(gavf_io_write_data(e->io, data, len) < len)
+    return 0;
+  e->num_writes++;
+  e->bytes_written += len;
+  return 1;
+  }
+
+static int flush_output(bg_ogg_encoder_t * e)
+  {
+  if(!e->out_len)
+    return 1;
+  if(!write_data(e, e->out_buf, e->out_len))
+    return 0;
+  e->out_len = 0;
+  return 1;
+  }
+
+static gavl_time_t get_wallclock(void)
+  {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (gavl_time_t)ts.tv_sec * GAVL_TIME_SCALE + ts.tv_nsec / 1000;
+  }
+
+/*
+ *  Pages are collected in the output buffer until it is full or
+ *  until the collected pages span more than the maximum write delay.
+ *  The delay is checked in presentation time and in wall clock time,
+ *  so a slow live encoder doesn't hold back pages for longer than
+ *  the delay either. Header pages have an undefined time and are
+ *  written when the headers are complete.
+ */
+
+static int write_page(bg_ogg_encoder_t * e,
+                      const uint8_t * header, int header_len,
+                      const uint8_t * body, int body_len,
+                      gavl_time_t time)
+  {
+  int len = header_len + body_len;
+  
+  if(e->out_len + len > e->out_size)
+    {
+    if(!flush_output(e))
+      return 0;
+    
+    /* Big pages are written directly */
+    if(len >= e->out_size)
+      return write_data(e, header, header_len) &&
+        write_data(e, body, body_len);
+    }
+  
+  if(e->out_alloc < e->out_size)
+    {
+    e->out_alloc = e->out_size;
+    e->out_buf = realloc(e->out_buf, e->out_alloc);
+    }
+  
+  if(!e->out_len)
+    {
+    e->out_time = time;
+    e->out_wall = get_wallclock();
+    }
+  
+  memcpy(e->out_buf + e->out_len, header, header_len);
+  e->out_len += header_len;
+  memcpy(e->out_buf + e->out_len, body, body_len);
+  e->out_len += body_len;
+
+  if((time != GAVL_TIME_UNDEFINED) &&
+     (e->out_time != GAVL_TIME_UNDEFINED) &&
+     (time - e->out_time >= e->out_delay))
+    return flush_output(e);
+  
+  return 1;
+  }
+
+/* Called for each packet after the encoder is started */
+
+static int check_write_delay(bg_ogg_encoder_t * e)
+  {
+  if(e->out_len && (get_wallclock() - e->out_wall >= e->out_delay))
+    return flush_output(e);
+  return 1;
+  }
+
+int bg_ogg_encoder_write_page(bg_ogg_encoder_t * e, bg_ogg_page_t * page)
+  {
+  return write_page(e, page->data, page->header_len,
+                    page->data + page->header_len, page->body_len,
+                    GAVL_TIME_UNDEFINED);
+  }
+
+int64_t bg_ogg_encoder_tell(bg_ogg_encoder_t * e)
+  {
+  return e->bytes_written + e->out_len;
+  }
+
+static bg_ogg_stream_t * get_stream(bg_ogg_encoder_t * e, int idx)
+  {
+  if(idx < e->num_video_streams)
+    return e->video_streams + idx;
+  return e->audio_streams + (idx - e->num_video_streams);
+  }
+
+static void push_packet_time(bg_ogg_stream_t * s, gavl_time_t t)
+  {
+  if(s->num_packet_times == s->packet_times_alloc)
+    {
+    s->packet_times_alloc += 16;
+    s->packet_times = realloc(s->packet_times,
+                              s->packet_times_alloc *
+                              sizeof(*s->packet_times));
+    }
+  s->packet_times[s->num_packet_times++] = t;
+  s->in_time = t;
+
+  /* Pages finished before the first packet get its time */
+  if(s->page_time == GAVL_TIME_UNDEFINED)
+    s->page_time = t;
+  }
+
+/* Get the time of a page, which was just taken out of libogg */
+
+static gavl_time_t get_page_time(bg_ogg_stream_t * s, bg_ogg_page_t * p)
+  {
+  int num;
+
+  num = p->num_packets;
+
+  if(num > s->num_packet_times)
+    num = s->num_packet_times;
+  
+  if(!num)
+    {
+    /* Page is in the middle of a packet */
+    if(s->num_packet_times)
+      return s->packet_times[0];
+    return s->page_time;
+    }
+  
+  s->page_time = s->packet_times[num-1];
+  s->num_packet_times -= num;
+  if(s->num_packet_times)
+    memmove(s->packet_times, s->packet_times + num,
+            s->num_packet_times * sizeof(*s->packet_times));
+  return s->page_time;
+  }
+
+/* Get the buffer for the next page in the queue */
+
+static bg_ogg_page_t * next_page(bg_ogg_stream_t * s)
+  {
+  if(s->num_pages == s->pages_alloc)
+    {
+    s->pages_alloc += 16;
+    s->pages = realloc(s->pages, s->pages_alloc * sizeof(*s->pages));
+    memset(s->pages + s->num_pages, 0,
+           (s->pages_alloc - s->num_pages) * sizeof(*s->pages));
+    }
+  return s->pages + s->num_pages;
+  }
+
+/* Append the page, which was built in the buffer from next_page() */
+
+static void queue_page(bg_ogg_stream_t * s, int old_alloc)
+  {
+  bg_ogg_page_t * p = s->pages + s->num_pages;
+  int len = p->header_len + p->body_len;
+
+  s->enc->queue_alloc += p->alloc - old_alloc;
+  p->time = get_page_time(s, p);
+
+  if(s->key_pending)
+    {
+    p->key_time = s->key_time;
+    s->key_pending = 0;
+    }
+  else
+    p->key_time = GAVL_TIME_UNDEFINED;
+  
+  s->num_pages++;
+
+  s->enc->queue_bytes += len;
+  if(s->enc->queue_bytes > s->enc->queue_bytes_max)
+    s->enc->queue_bytes_max = s->enc->queue_bytes;
+  }
+
+/* Earliest time, the next page of a stream can have */
+
+static gavl_time_t next_page_time(bg_ogg_stream_t * s)
+  {
+  if(s->num_pages)
+    return s->pages[0].time;
+  if(s->num_packet_times)
+    return s->packet_times[0];
+  return s->in_time;
+  }
+
+/*
+ *  Write queued pages in presentation order. A page is written
+ *  only if no other stream can produce an earlier one or if it waits
+ *  longer than the maximum interleave delay.
+ */
+
+static int interleave_pages(bg_ogg_encoder_t * e, int flush)
+  {
+  int i, num_streams;
+  bg_ogg_stream_t * s;
+  bg_ogg_stream_t * min_s;
+  bg_ogg_page_t tmp;
+  gavl_time_t max_time;
+  
+  num_streams = e->num_audio_streams + e->num_video_streams;
+  
+  while(1)
+    {
+    min_s = NULL;
+    max_time = GAVL_TIME_UNDEFINED;
+    
+    for(i = 0; i < num_streams; i++)
+      {
+      s = get_stream(e, i);
+      if(!s->num_pages)
+        continue;
+      
+      if(!min_s || (s->pages[0].time < min_s->pages[0].time))
+        min_s = s;
+      if((max_time == GAVL_TIME_UNDEFINED) ||
+         (s->pages[s->num_pages-1].time > max_time))
+        max_time = s->pages[s->num_pages-1].time;
+      }
+    
+    if(!min_s)
+      break;
+
+    if(!flush && (max_time - min_s->pages[0].time < e->max_interleave))
+      {
+      for(i = 0; i < num_streams; i++)
+        {
+        s = get_stream(e, i);
+        if((s == min_s) || s->num_pages || (s->flags & STREAM_EOS))
+          continue;
+        if(next_page_time(s) < min_s->pages[0].time)
+          break;
+        }
+      if(i < num_streams) /* Wait for other streams */
+        break;
+      }
+    
+    if(min_s->pages[0].key_time != GAVL_TIME_UNDEFINED)
+      bg_ogg_skeleton_add_keypoint(min_s, min_s->pages[0].key_time);
+    
+    if(!write_page(e, min_s->pages[0].data, min_s->pages[0].header_len,
+                   min_s->pages[0].data + min_s->pages[0].header_len,
+                   min_s->pages[0].body_len, min_s->pages[0].time))
+      return 0;
+    
+    e->queue_bytes -= min_s->pages[0].header_len + min_s->pages[0].body_len;
+    
+    /* Move the buffer to the end for reusing it */
+    tmp = min_s->pages[0];
+    min_s->num_pages--;
+    if(min_s->num_pages)
+      memmove(min_s->pages, min_s->pages + 1,
+              min_s->num_pages * sizeof(*min_s->pages));
+    min_s->pages[min_s->num_pages] = tmp;
+    }
+  return check_write_delay(e);
+  }
+
 static int bg_ogg_stream_flush_page(bg_ogg_stream_t * s, int force)
   {
   int result;
-  ogg_page og;
-  memset(&og, 0, sizeof(og));
-  if(force || (s->flags & STREAM_FORCE_FLUSH))
-    result = ogg_stream_flush(&s->os,&og);
+  int old_alloc;
+  bg_ogg_page_t * p;
+  bg_ogg_encoder_t * e = s->enc;
+
+  /* Build the page directly in the queue */
+  if(e->started)
+    p = next_page(s);
   else
-    result = ogg_stream_pageout(&s->os,&og);
+    p = &e->header_page;
+
+  old_alloc = p->alloc;
+  
+  switch(e->page_policy)
+    {
+    case PAGE_POLICY_AUTO:
+      if(force || (s->flags & STREAM_FORCE_FLUSH))
+        result = bg_ogg_pager_flush(&s->pager, p, AUTO_PAGE_SIZE);
+      else
+        result = bg_ogg_pager_pageout(&s->pager, p, AUTO_PAGE_SIZE);
+      break;
+    case PAGE_POLICY_DURATION:
+      /* Finish the page if the pending packets span the target duration */
+      if(!force && !(s->flags & STREAM_FORCE_FLUSH) &&
+         s->num_packet_times &&
+         (s->in_time - s->page_time >= e->page_duration))
+        force = 1;
+      /* Fall through */
+    default:
+      if(force || (s->flags & STREAM_FORCE_FLUSH))
+        result = bg_ogg_pager_flush(&s->pager, p, e->page_size);
+      else
+        result = bg_ogg_pager_pageout(&s->pager, p, e->page_size);
+      break;
+    }
   
   if(result)
     {
-    if((gavf_io_write_data(s->enc->io,
-                           og.header,og.header_len) < og.header_len) ||
-       (gavf_io_write_data(s->enc->io,
-                           og.body,og.body_len) < og.body_len))
-      return -1;
-    else
-      return 1;
+    s->pages_out++;
+    s->page_header_bytes += p->header_len;
+    s->page_body_bytes += p->body_len;
+    
+    /* Header pages are written in the order they come */
+    if(!e->started)
+      return bg_ogg_encoder_write_page(e, p) ? 1 : -1;
+    queue_page(s, old_alloc);
+    return 1;
     }
   return 0;
   }
@@ -181,7 +668,23 @@ int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s, ogg_packet * p)
     p->b_o_s = 0;
   
   p->packetno = s->packetno++;
-  ogg_stream_packetin(&s->os, p);
+  bg_ogg_pager_packetin(&s->pager, p->packet, p->bytes,
+                        p->granulepos, p->e_o_s);
+
+  /* Remember the headers of the first chain link */
+  if(s->codec->create_comment_packet &&
+     (s->num_headers == s->num_header_cache))
+    {
+    gavl_packet_t * c;
+    s->header_cache = realloc(s->header_cache, (s->num_header_cache+1) *
+                              sizeof(*s->header_cache));
+    c = &s->header_cache[s->num_header_cache++];
+    memset(c, 0, sizeof(*c));
+    gavl_packet_alloc(c, p->bytes);
+    memcpy(c->data, p->packet, p->bytes);
+    c->data_len = p->bytes;
+    }
+  
   if(!s->num_headers)
     {
     if(bg_ogg_stream_flush_page(s, 1) <= 0)
@@ -194,6 +697,37 @@ int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s, ogg_packet * p)
   return 1;
   }
 
+/* Write the cached header packets for a new chain link.
+   Only the comment packet is built again */
+
+static int rewrite_header_packets(bg_ogg_stream_t * s)
+  {
+  int i;
+  int ret;
+  ogg_packet op;
+
+  for(i = 0; i < s->num_header_cache; i++)
+    {
+    memset(&op, 0, sizeof(op));
+    
+    if(i == 1)
+      {
+      s->codec->create_comment_packet(s, &op);
+      ret = bg_ogg_stream_write_header_packet(s, &op);
+      bg_ogg_free_comment_packet(&op);
+      }
+    else
+      {
+      op.packet = s->header_cache[i].data;
+      op.bytes  = s->header_cache[i].data_len;
+      ret = bg_ogg_stream_write_header_packet(s, &op);
+      }
+    if(!ret)
+      return 0;
+    }
+  return 1;
+  }
+
 int bg_ogg_stream_flush(bg_ogg_stream_t * s, int force)
   {
   int result, ret = 0;
@@ -202,6 +736,10 @@ int bg_ogg_stream_flush(bg_ogg_stream_t * s, int force)
   
   if(result < 0)
     return result;
+
+  if(s->enc->started && !interleave_pages(s->enc, 0))
+    return -1;
+  
   return ret;
   }
 
@@ -238,42 +776,94 @@ void bg_ogg_packet_from_gavl(bg_ogg_stream_t * s, gavl_packet_t * src,
     s->codec->convert_packet(s, src, dst);
   }
 
-static gavl_sink_status_t write_gavl_packet(void * data, gavl_packet_t * p)
+static gavl_packet_t * get_gavl_packet(void * data)
   {
   bg_ogg_stream_t * s = data;
 
+  /* Encoding in the worker thread */
+  if(s->worker && s->worker->cur)
+    return bg_ogg_worker_get_packet(s);
+  
+  return &s->packets[!s->last_packet];
+  }
+
+gavl_sink_status_t
+bg_ogg_stream_write_gavl_packet(bg_ogg_stream_t * s, gavl_packet_t * p)
+  {
+  gavl_packet_t * last = &s->packets[s->last_packet];
+
+  if(s->enc->mux_error)
+    return GAVL_SINK_ERROR;
+  
   /* Flush the last packet */
-  if(s->last_packet.data_len)
+  if(last->data_len)
     {
     ogg_packet op;
     memset(&op, 0, sizeof(op));
-    bg_ogg_packet_from_gavl(s, &s->last_packet, &op);
-    op.packetno = s->packetno++;
-    ogg_stream_packetin(&s->os, &op);
+    bg_ogg_packet_from_gavl(s, last, &op);
+    bg_ogg_skeleton_check_keyframe(s, last);
+    s->packetno++;
+    push_packet_time(s, gavl_time_unscale(s->timescale,
+                                          last->pts + last->duration));
+
+    /* Pass the packet without copying. last gets an unused buffer. */
+    bg_ogg_pager_packetin_gavl(&s->pager, last, op.granulepos, op.e_o_s);
+    last->data_len = 0;
+    
     /* Flush pages if any */
     if(bg_ogg_stream_flush(s, 0) < 0)
       return GAVL_SINK_ERROR;
     }
+  
   /* Save this packet */
-  gavl_packet_copy(&s->last_packet, p);
+  s->last_packet = !s->last_packet;
+  
+  if((p != &s->packets[s->last_packet]) &&
+     !bg_ogg_worker_take_packet(s, p, &s->packets[s->last_packet]))
+    {
+    gavl_packet_copy(&s->packets[s->last_packet], p);
+    s->bytes_copied += p->data_len;
+    }
+  s->bytes_in += s->packets[s->last_packet].data_len;
   return GAVL_SINK_OK;
   }
 
+static gavl_sink_status_t write_gavl_packet(void * data, gavl_packet_t * p)
+  {
+  bg_ogg_stream_t * s = data;
+
+  /* Encoding in the worker thread: Packets are multiplexed later */
+  if(s->worker && s->worker->cur)
+    return bg_ogg_worker_put_packet(s, p);
+
+  return bg_ogg_stream_write_gavl_packet(s, p);
+  }
+
 static int flush_stream(bg_ogg_stream_t * s)
   {
+  gavl_packet_t * last = &s->packets[s->last_packet];
+  
+  s->flags |= STREAM_EOS;
+  
   /* Flush the last packet */
-  if(s->last_packet.data_len)
+  if(last->data_len)
     {
     ogg_packet op;
     memset(&op, 0, sizeof(op));
-    bg_ogg_packet_from_gavl(s, &s->last_packet, &op);
-    op.packetno = s->packetno++;
-    op.e_o_s = 1;
-    ogg_stream_packetin(&s->os, &op);
+    bg_ogg_packet_from_gavl(s, last, &op);
+    bg_ogg_skeleton_check_keyframe(s, last);
+    s->packetno++;
+    push_packet_time(s, gavl_time_unscale(s->timescale,
+                                          last->pts + last->duration));
+    bg_ogg_pager_packetin_gavl(&s->pager, last, op.granulepos, 1);
+    last->data_len = 0;
+    
     /* Flush pages if any */
     if(bg_ogg_stream_flush(s, 1) < 0)
       return 0;
     }
+  else if(s->enc->started && !interleave_pages(s->enc, 0))
+    return 0;
   return 1;
   }
 
@@ -292,13 +882,17 @@ static bg_ogg_stream_t * append_stream(bg_ogg_encoder_t * e,
   ret->index = num_streams;
   
   memset(ret, 0, sizeof(*ret));
-  ogg_stream_init(&ret->os, e->serialno++);
+  bg_ogg_pager_init(&ret->pager, e->serialno++);
   
   gavl_dictionary_copy(&ret->m_stream, m);
   
   ret->enc = e;
   ret->index = num_streams;
   ret->m_global = &e->metadata;
+  ret->in_time = GAVL_TIME_UNDEFINED;
+  ret->page_time = GAVL_TIME_UNDEFINED;
+  ret->start_time = GAVL_TIME_UNDEFINED;
+  ret->key_time = GAVL_TIME_UNDEFINED;
   
   num_streams++;
   
@@ -330,6 +924,7 @@ bg_ogg_encoder_add_video_stream(void * data,
   s = append_stream(e, &e->video_streams, &e->num_video_streams, m);
   gavl_video_format_copy(&s->vfmt, format);
   gavl_metadata_delete_compression_fields(&s->m_stream);
+  s->flags |= STREAM_VIDEO;
   return s;
   }
 
@@ -359,7 +954,7 @@ bg_ogg_encoder_add_video_stream_compressed(void * data,
   s = append_stream(e, &e->video_streams, &e->num_video_streams, m);
   gavl_compression_info_copy(&s->ci, ci);
   gavl_video_format_copy(&s->vfmt, format);
-  s->flags |= STREAM_COMPRESSED;
+  s->flags |= STREAM_COMPRESSED | STREAM_VIDEO;
   return s;
   }
 
@@ -423,7 +1018,14 @@ static int start_audio(bg_ogg_encoder_t * e, int stream)
         return 0;
       }
     }
-  s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
+
+  /* Opus timestamps are always in 48 kHz units */
+  if(s->ci.id == GAVL_CODEC_ID_OPUS)
+    s->timescale = 48000;
+  else
+    s->timescale = s->afmt.samplerate;
+  
+  s->psink_out = gavl_packet_sink_create(get_gavl_packet, write_gavl_packet, s);
   s->codec->set_packet_sink(s->codec_priv, s->psink_out);
   return 1;
   }
@@ -461,7 +1063,9 @@ static int start_video(bg_ogg_encoder_t * e, int stream)
       return 0;
     }
 
-  s->psink_out = gavl_packet_sink_create(NULL, write_gavl_packet, s);
+  s->timescale = s->vfmt.timescale;
+  
+  s->psink_out = gavl_packet_sink_create(get_gavl_packet, write_gavl_packet, s);
   s->codec->set_packet_sink(s->codec_priv, s->psink_out);
   return 1;
   }
@@ -470,6 +1074,10 @@ int bg_ogg_encoder_start(void * data)
   {
   int i;
   bg_ogg_encoder_t * e = data;
+
+  /* The skeleton BOS page must be the first page */
+  if(!bg_ogg_skeleton_write_bos(e))
+    return 0;
   
   /* Start encoders and write identification headers */
   for(i = 0; i < e->num_video_streams; i++)
@@ -483,6 +1091,9 @@ int bg_ogg_encoder_start(void * data)
       return 0;
     }
 
+  if(!bg_ogg_skeleton_write_headers(e))
+    return 0;
+  
   /* Write remaining header pages */
   for(i = 0; i < e->num_video_streams; i++)
     {
@@ -496,34 +1107,57 @@ int bg_ogg_encoder_start(void * data)
     if(bg_ogg_stream_flush(s, 1) < 0)
       return 0;
     }
+  
+  if(!bg_ogg_skeleton_write_eos(e) ||
+     !flush_output(e))
+    return 0;
+  
   e->started = 1;
+
+  if(e->threads)
+    {
+    for(i = 0; i < e->num_video_streams; i++)
+      {
+      if(!bg_ogg_worker_create(&e->video_streams[i], WORKER_QUEUE_SIZE))
+        return 0;
+      }
+    for(i = 0; i < e->num_audio_streams; i++)
+      {
+      if(!bg_ogg_worker_create(&e->audio_streams[i], WORKER_QUEUE_SIZE))
+        return 0;
+      }
+    }
   return 1;
   }
 
 gavl_audio_sink_t * bg_ogg_encoder_get_audio_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
-  return e->audio_streams[stream].asink;
+  bg_ogg_stream_t * s = &e->audio_streams[stream];
+  return s->worker ? s->worker->asink : s->asink;
   }
 
 gavl_video_sink_t * bg_ogg_encoder_get_video_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
-  return e->video_streams[stream].vsink;
+  bg_ogg_stream_t * s = &e->video_streams[stream];
+  return s->worker ? s->worker->vsink : s->vsink;
   }
 
 gavl_packet_sink_t *
 bg_ogg_encoder_get_audio_packet_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
-  return e->audio_streams[stream].psink_out;
+  bg_ogg_stream_t * s = &e->audio_streams[stream];
+  return s->worker ? s->worker->psink : s->psink_out;
   }
 
 gavl_packet_sink_t *
 bg_ogg_encoder_get_video_packet_sink(void * data, int stream)
   {
   bg_ogg_encoder_t * e = data;
-  return e->video_streams[stream].psink_out;
+  bg_ogg_stream_t * s = &e->video_streams[stream];
+  return s->worker ? s->worker->psink : s->psink_out;
   }
 
 void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_metadata)
@@ -537,6 +1171,12 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
   
   if(!e->started)
     return;
+
+  /* Wait for the worker threads */
+  for(i = 0; i < e->num_audio_streams; i++)
+    bg_ogg_worker_drain(&e->audio_streams[i]);
+  for(i = 0; i < e->num_video_streams; i++)
+    bg_ogg_worker_drain(&e->video_streams[i]);
   
   /* Flush all data */
   for(i = 0; i < e->num_audio_streams; i++)
@@ -549,17 +1189,37 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
     bg_ogg_stream_t * s = &e->video_streams[i];
     bg_ogg_stream_reset(s, e->serialno++);
     }
+
+  /* The old chain link must be complete before the new one starts */
+  if(!interleave_pages(e, 1) || !flush_output(e))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+           "Writing the end of the chain link failed");
+    /* Further frames are rejected and closing fails */
+    e->mux_error = 1;
+    return;
+    }
+  e->started = 0;
+
+  /* The seek index covers only the first chain link */
+  bg_ogg_skeleton_end_segment(e);
   
   /* Reinitialize with new metadata */
   for(i = 0; i < e->num_audio_streams; i++)
     {
     bg_ogg_stream_t * s = &e->audio_streams[i];
-    s->codec->init_audio_compressed(s);
+    if(s->num_header_cache)
+      rewrite_header_packets(s);
+    else
+      s->codec->init_audio_compressed(s);
     }
   for(i = 0; i < e->num_video_streams; i++)
     {
     bg_ogg_stream_t * s = &e->video_streams[i];
-    s->codec->init_video_compressed(s);
+    if(s->num_header_cache)
+      rewrite_header_packets(s);
+    else
+      s->codec->init_video_compressed(s);
     }
   
   /* Re-write header packets */
@@ -573,7 +1233,33 @@ void bg_ogg_encoder_update_metadata(void * data, const gavl_dictionary_t * new_m
     bg_ogg_stream_t * s = &e->video_streams[i];
     bg_ogg_stream_flush(s, 1);
     }
+  if(!flush_output(e))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+           "Writing the headers of the new chain link failed");
+    e->mux_error = 1;
+    }
+  e->started = 1;
+  }
+
+static void log_stream_stats(bg_ogg_stream_t * s, const char * type)
+  {
+  if(s->pages_out)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "%s stream %d: %"PRId64" pages, %"PRId64" bytes, overhead: %.2f %%",
+           type, s->index + 1, s->pages_out,
+           s->page_header_bytes + s->page_body_bytes,
+           100.0 * (double)s->page_header_bytes /
+           (double)(s->page_header_bytes + s->page_body_bytes));
   
+  /* Besides these, each byte is copied once into its page and once
+     more if the page goes through the write buffer */
+  if(s->bytes_in && s->pages_out)
+    bg_log(BG_LOG_DEBUG, LOG_DOMAIN,
+           "%s stream %d: Copied %"PRId64" of %"PRId64" packet bytes, %.2f per output byte",
+           type, s->index + 1, s->bytes_copied, s->bytes_in,
+           (double)s->bytes_copied /
+           (double)(s->page_header_bytes + s->page_body_bytes));
   }
 
 int bg_ogg_encoder_close(void * data, int do_delete)
@@ -584,6 +1270,20 @@ int bg_ogg_encoder_close(void * data, int do_delete)
 
   if(!e->io)
     return 1;
+
+  /* Encode queued frames and stop the worker threads. Their
+     buffers are freed after the codecs are flushed. */
+  for(i = 0; i < e->num_audio_streams; i++)
+    bg_ogg_worker_drain(&e->audio_streams[i]);
+  for(i = 0; i < e->num_video_streams; i++)
+    bg_ogg_worker_drain(&e->video_streams[i]);
+  for(i = 0; i < e->num_audio_streams; i++)
+    bg_ogg_worker_stop(&e->audio_streams[i]);
+  for(i = 0; i < e->num_video_streams; i++)
+    bg_ogg_worker_stop(&e->video_streams[i]);
+
+  if(e->mux_error)
+    ret = 0;
   
   for(i = 0; i < e->num_audio_streams; i++)
     {
@@ -596,7 +1296,7 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       }
 
     flush_stream(s);
-    ogg_stream_clear(&s->os);
+    log_stream_stats(s, "Audio");
     
     if(s->asink)
       {
@@ -618,7 +1318,7 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       break;
       }
     flush_stream(s);
-    ogg_stream_clear(&s->os);
+    log_stream_stats(s, "Video");
 
     if(s->vsink)
       {
@@ -632,6 +1332,28 @@ int bg_ogg_encoder_close(void * data, int do_delete)
       }
     }
 
+  /* Write remaining pages */
+  if(!interleave_pages(e, 1) || !flush_output(e))
+    ret = 0;
+
+  for(i = 0; i < e->num_audio_streams; i++)
+    bg_ogg_worker_destroy(&e->audio_streams[i]);
+  for(i = 0; i < e->num_video_streams; i++)
+    bg_ogg_worker_destroy(&e->video_streams[i]);
+
+  /* Fill in the seek index */
+  if(!bg_ogg_skeleton_finalize(e))
+    ret = 0;
+
+  bg_log(BG_LOG_DEBUG, LOG_DOMAIN,
+         "Wrote %"PRId64" bytes with %"PRId64" write calls",
+         e->bytes_written, e->num_writes);
+
+  if(e->queue_alloc)
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Interleaving queue: %"PRId64" bytes max. queued, %"PRId64" bytes allocated",
+           e->queue_bytes_max, e->queue_alloc);
+  
   if(e->io_priv)
     gavf_io_destroy(e->io_priv);
   
@@ -807,9 +1529,10 @@ void bg_ogg_set_vorbis_channel_setup(gavl_audio_format_t * format)
 void bg_ogg_stream_reset(bg_ogg_stream_t * s, long serialno)
   {
   flush_stream(s);
+  s->flags &= ~STREAM_EOS;
+  s->num_packet_times = 0;
   s->packetno = 0;
   s->num_headers = 0;
-  ogg_stream_clear(&s->os);
-  ogg_stream_init(&s->os, serialno);
+  bg_ogg_pager_reset(&s->pager, serialno);
   
   }
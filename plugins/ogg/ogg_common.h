@@ -20,6 +20,7 @@
  * *****************************************************************/
 
 #include <ogg/ogg.h>
+#include <pthread.h>
 
 /* Generic struct for a codec. Here, we'll implement
    encoders for vorbis, theora, speex and flac */
@@ -29,6 +30,130 @@ typedef struct bg_ogg_stream_s bg_ogg_stream_t;
 
 #define STREAM_FORCE_FLUSH (1<<0)
 #define STREAM_COMPRESSED  (1<<1)
+#define STREAM_EOS         (1<<2) /* No more packets will come */
+#define STREAM_VIDEO       (1<<3)
+
+/* Page waiting in the interleaving queue */
+
+typedef struct
+  {
+  uint8_t * data; /* Header followed by body */
+  int header_len;
+  int body_len;
+  int alloc;
+
+  int num_packets; /* Packets finished on this page */
+
+  /* Presentation time of the last packet finished on this page */
+  gavl_time_t time;
+
+  /* Time of a keyframe starting on this page or on a later one */
+  gavl_time_t key_time;
+  } bg_ogg_page_t;
+
+/* Packets to pages (pager.c) */
+
+typedef struct
+  {
+  long serialno;
+  long pageno;
+  int64_t packetno;
+  int b_o_s; /* First page is out */
+  int e_o_s; /* Last packet is in */
+
+  /* Segments, which are not on a page yet.
+     0x100 marks the first segment of a packet */
+  int * lacing_vals;
+  int64_t * granule_vals;
+  int lacing_fill;
+  int lacing_alloc;
+
+  /* Packets, which are not completely on a page yet,
+     followed by unused buffers */
+  gavl_packet_t * packets;
+  int num_packets;
+  int packets_alloc;
+  int packet_pos; /* Bytes of packets[0], which are on a page already */
+  } bg_ogg_pager_t;
+
+void bg_ogg_pager_init(bg_ogg_pager_t * p, long serialno);
+void bg_ogg_pager_reset(bg_ogg_pager_t * p, long serialno);
+void bg_ogg_pager_free(bg_ogg_pager_t * p);
+
+void bg_ogg_pager_packetin(bg_ogg_pager_t * p,
+                           const uint8_t * data, int len,
+                           int64_t granulepos, int e_o_s);
+
+/* Take over the packet buffer. pkt gets an unused buffer in exchange */
+void bg_ogg_pager_packetin_gavl(bg_ogg_pager_t * p,
+                                gavl_packet_t * pkt,
+                                int64_t granulepos, int e_o_s);
+
+/* Same as ogg_stream_pageout_fill() and ogg_stream_flush_fill() */
+int bg_ogg_pager_pageout(bg_ogg_pager_t * p, bg_ogg_page_t * page, int nfill);
+int bg_ogg_pager_flush(bg_ogg_pager_t * p, bg_ogg_page_t * page, int nfill);
+
+uint32_t bg_ogg_crc(uint32_t crc, const uint8_t * data, int len);
+
+/* Encoding in worker threads (workers.c) */
+
+typedef struct
+  {
+  gavl_audio_frame_t * aframe;
+  gavl_video_frame_t * vframe;
+
+  int64_t ticket; /* Counts the put calls of all streams */
+
+  /* Packets from the encoder */
+  gavl_packet_t * packets;
+  int num_packets;
+  int packets_alloc;
+
+  int64_t bytes_copied; /* Packet bytes, which had to be copied */
+  } bg_ogg_job_t;
+
+typedef struct
+  {
+  pthread_t thread;
+  int running;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  /* Ring buffer */
+  bg_ogg_job_t * jobs;
+  int jobs_alloc;
+  int head;        /* Oldest job */
+  int num_jobs;    /* Queued jobs */
+  int num_encoded; /* Encoded jobs starting at head */
+  int quit;
+  int error;
+
+  bg_ogg_job_t * cur; /* Job in the encoder */
+
+  /* Sinks for the caller */
+  gavl_audio_sink_t * asink;
+  gavl_video_sink_t * vsink;
+  gavl_packet_sink_t * psink;
+  gavl_packet_t packet;
+  } bg_ogg_worker_t;
+
+/* Entry of the skeleton index */
+
+typedef struct
+  {
+  int64_t offset;   /* Page offset relative to the segment start */
+  gavl_time_t time; /* Presentation time of the keyframe */
+  } bg_ogg_keypoint_t;
+
+/* Location of a skeleton packet, which is rewritten at the end */
+
+typedef struct
+  {
+  int64_t offset;
+  int64_t len;
+  long pageno;
+  } bg_ogg_skeleton_packet_t;
 
 typedef struct
   {
@@ -51,6 +176,11 @@ typedef struct
 
   int (*init_audio_compressed)(bg_ogg_stream_t * s);
   int (*init_video_compressed)(bg_ogg_stream_t * s);
+
+  /* Build the comment packet (always the second header packet),
+     free it with bg_ogg_free_comment_packet(). If this is present,
+     the other header packets are cached and re-used for chaining */
+  void (*create_comment_packet)(bg_ogg_stream_t * s, ogg_packet * op);
   
   int (*set_video_pass)(void*, int pass, int total_passes,
                         const char * stats_file);
@@ -82,7 +212,7 @@ struct bg_ogg_stream_s
 
   gavl_packet_sink_t * psink_out;
   
-  ogg_stream_state os;
+  bg_ogg_pager_t pager;
 
   int flags;
   
@@ -94,14 +224,67 @@ struct bg_ogg_stream_s
   /* Counter for header packets */
   int num_headers;
 
+  /* Header packets of the first chain link. The comment packet
+     is rebuilt for each link, the others are written from here */
+  gavl_packet_t * header_cache;
+  int num_header_cache;
+
   /* Counter for packets */
   int64_t packetno;
   
   int index;
 
-  /* Last packet */
-  gavl_packet_t last_packet;
+  /*
+   *  Last packet (needed for setting the EOS flag).
+   *  Codecs, which encode into the packet returned by
+   *  gavl_packet_sink_get_packet(), write into the buffer, which is
+   *  not the last packet. It is then swapped in without copying.
+   */
+  gavl_packet_t packets[2];
+  int last_packet; /* Index into packets */
+
+  /* Statistics */
+  int64_t bytes_in;
+  int64_t bytes_copied;
+
+  int64_t pages_out;
+  int64_t page_header_bytes;
+  int64_t page_body_bytes;
+
+  /* Interleaving */
+  int timescale;
 
+  /* End times of the packets, which were passed to libogg
+     but are not on a finished page yet */
+  gavl_time_t * packet_times;
+  int num_packet_times;
+  int packet_times_alloc;
+
+  gavl_time_t in_time;   /* End time of the last packet passed to libogg */
+  gavl_time_t page_time; /* Time of the last finished page */
+
+  /* Finished pages, which wait for being written */
+  bg_ogg_page_t * pages;
+  int num_pages;
+  int pages_alloc;
+
+  /* Seek index */
+  int granule_shift;
+
+  gavl_time_t start_time; /* Presentation time of the first packet */
+
+  int key_pending;        /* Next page gets a keypoint */
+  gavl_time_t key_time;   /* Time of the last keypoint */
+
+  bg_ogg_keypoint_t * keypoints;
+  int num_keypoints;
+  int keypoints_alloc;
+
+  bg_ogg_skeleton_packet_t index_packet;
+
+  /* Worker thread or NULL */
+  bg_ogg_worker_t * worker;
+  
   /* Metadata */
 
   const gavl_dictionary_t * m_global;
@@ -112,8 +295,8 @@ struct bg_ogg_stream_s
 int bg_ogg_stream_write_header_packet(bg_ogg_stream_t * s,
                                       ogg_packet * p);
 
-int bg_ogg_stream_write_gavl_packet(bg_ogg_stream_t * s,
-                                    gavl_packet_t * p);
+gavl_sink_status_t
+bg_ogg_stream_write_gavl_packet(bg_ogg_stream_t * s, gavl_packet_t * p);
 
 int bg_ogg_stream_flush(bg_ogg_stream_t * s, int force);
 
@@ -157,6 +340,57 @@ struct bg_ogg_encoder_s
   //  void (*close_callback)(void * priv);
   int (*open_callback)(void * priv);
   void * open_callback_data;
+
+  /* Page sizing */
+  int page_policy;
+  int page_size;
+  gavl_time_t page_duration;
+  
+  /* Interleaving */
+  gavl_time_t max_interleave;
+
+  int64_t queue_bytes;     /* Bytes currently queued */
+  int64_t queue_bytes_max; /* Peak of queue_bytes */
+  int64_t queue_alloc;     /* Bytes allocated for page buffers */
+
+  /* Output buffer for writing several pages at once */
+  uint8_t * out_buf;
+  int out_len;
+  int out_alloc;
+
+  int out_size;          /* Write when this many bytes are buffered */
+  gavl_time_t out_delay; /* Write when the buffered pages span this time */
+  gavl_time_t out_time;  /* Time of the first buffered page */
+  gavl_time_t out_wall;  /* Wall clock time of the first buffered page */
+
+  int64_t num_writes;
+  int64_t bytes_written;
+
+  /* Header pages are built here */
+  bg_ogg_page_t header_page;
+
+  /* Worker threads */
+  int threads;          /* Parameter */
+  pthread_mutex_t mux_mutex;
+  int64_t next_ticket;  /* Ticket of the next job */
+  int64_t mux_ticket;   /* Ticket of the next job to multiplex */
+  int mux_error;
+  
+  /* Skeleton */
+  int skeleton;      /* Parameter */
+  int have_skeleton; /* Skeleton is written */
+  int index_size;    /* Bytes reserved for each index packet */
+
+  bg_ogg_pager_t skeleton_pager;
+  bg_ogg_skeleton_packet_t fishead;
+  
+  int64_t io_start; /* io position of offset 0 */
+  int64_t segment_start;
+  int64_t segment_end;
+  int64_t content_start;
+  
+  /* Global parameters (if different from bg_ogg_encoder_get_parameters()) */
+  bg_parameter_info_t * parameters;
   };
 
 void * bg_ogg_encoder_create(void);
@@ -171,6 +405,17 @@ int bg_ogg_encoder_open(void *, const char * file,
 
 void bg_ogg_encoder_destroy(void*);
 
+const bg_parameter_info_t * bg_ogg_encoder_get_parameters(void * data);
+
+/* Write a header page */
+int bg_ogg_encoder_write_page(bg_ogg_encoder_t * e, bg_ogg_page_t * page);
+
+/* Offset of the next page */
+int64_t bg_ogg_encoder_tell(bg_ogg_encoder_t * e);
+
+void bg_ogg_encoder_set_parameter(void * data, const char * name,
+                                  const gavl_value_t * val);
+
 //int bg_ogg_flush_page(ogg_stream_state * os, bg_ogg_encoder_t * output, int force);
 int bg_ogg_flush(ogg_stream_state * os, bg_ogg_encoder_t * output, int force);
 
@@ -249,3 +494,31 @@ bg_ogg_create_comment_packet(const uint8_t * prefix,
 void bg_ogg_free_comment_packet(ogg_packet * op);
 
 void bg_ogg_set_vorbis_channel_setup(gavl_audio_format_t * format);
+
+/* skeleton.c */
+
+int bg_ogg_skeleton_write_bos(bg_ogg_encoder_t * e);
+int bg_ogg_skeleton_write_headers(bg_ogg_encoder_t * e);
+int bg_ogg_skeleton_write_eos(bg_ogg_encoder_t * e);
+
+void bg_ogg_skeleton_check_keyframe(bg_ogg_stream_t * s,
+                                    const gavl_packet_t * p);
+
+void bg_ogg_skeleton_add_keypoint(bg_ogg_stream_t * s, gavl_time_t time);
+
+void bg_ogg_skeleton_end_segment(bg_ogg_encoder_t * e);
+
+int bg_ogg_skeleton_finalize(bg_ogg_encoder_t * e);
+
+/* workers.c */
+
+int bg_ogg_worker_create(bg_ogg_stream_t * s, int queue_size);
+void bg_ogg_worker_drain(bg_ogg_stream_t * s);
+void bg_ogg_worker_stop(bg_ogg_stream_t * s);
+void bg_ogg_worker_destroy(bg_ogg_stream_t * s);
+
+gavl_packet_t * bg_ogg_worker_get_packet(bg_ogg_stream_t * s);
+gavl_sink_status_t bg_ogg_worker_put_packet(bg_ogg_stream_t * s,
+                                            gavl_packet_t * p);
+int bg_ogg_worker_take_packet(bg_ogg_stream_t * s, gavl_packet_t * p,
+                              gavl_packet_t * dst);
@@ -89,7 +89,6 @@ typedef struct
 
   int64_t samples_read;
 
-  uint8_t * enc_buffer;
   int enc_buffer_size;
 
   int64_t pts;
@@ -298,7 +297,7 @@ static void set_parameter_opus(void * data, const char * name,
 
 static int flush_frame(opus_t * opus, int eof)
   {
-  gavl_packet_t gp;
+  gavl_packet_t * gp;
   int result;
 
   //  fprintf(stderr, "Flush frame %d %d\n", opus->frame->valid_samples,
@@ -318,12 +317,17 @@ static int flush_frame(opus_t * opus, int eof)
              block_align);
       }
 
+    /* Encode directly into the packet buffer of the sink */
+    gp = gavl_packet_sink_get_packet(opus->psink);
+    gavl_packet_reset(gp);
+    gavl_packet_alloc(gp, opus->enc_buffer_size);
+    
     if(opus->format->sample_format == GAVL_SAMPLE_FLOAT)
       {
       result = opus_multistream_encode_float(opus->enc,
                                              opus->frame->samples.f,
                                              opus->format->samples_per_frame,
-                                             opus->enc_buffer,
+                                             gp->data,
                                              opus->enc_buffer_size);
       }
     else
@@ -331,7 +335,7 @@ static int flush_frame(opus_t * opus, int eof)
       result = opus_multistream_encode(opus->enc,
                                        opus->frame->samples.s_16,
                                        opus->format->samples_per_frame,
-                                       opus->enc_buffer,
+                                       gp->data,
                                        opus->enc_buffer_size);
       }
     
@@ -341,17 +345,15 @@ static int flush_frame(opus_t * opus, int eof)
       return 0;
       }
     
-    /* Create packet */
-    gavl_packet_init(&gp);
-    gp.data = opus->enc_buffer;
-    gp.data_len = result;
+    /* Finish packet */
+    gp->data_len = result;
     if(eof)
-      gp.flags |= GAVL_PACKET_LAST;
+      gp->flags |= GAVL_PACKET_LAST;
 
-    gp.duration = (opus->frame->valid_samples * 48000) / opus->format->samplerate;
-    gp.pts = opus->pts;
-    opus->pts += gp.duration;
-    gavl_packet_sink_put_packet(opus->psink, &gp);
+    gp->duration = (opus->frame->valid_samples * 48000) / opus->format->samplerate;
+    gp->pts = opus->pts;
+    opus->pts += gp->duration;
+    gavl_packet_sink_put_packet(opus->psink, gp);
     opus->frame->valid_samples = 0;
     }
   return 1;
@@ -530,16 +532,21 @@ init_opus(void * data, gavl_compression_info_t * ci,
   gavl_dictionary_set_string(stream_metadata, GAVL_META_SOFTWARE,
                     opus_get_version_string());
   
-  /* Allocate encoder buffer */
+  /* Maximum packet size */
 
   // Size taken from opusenc.c
   opus->enc_buffer_size = opus->h.chtab.stream_count * (1275*3+7); 
-  opus->enc_buffer = malloc(opus->enc_buffer_size);
   
   return gavl_audio_sink_create(NULL, write_audio_frame_opus, opus,
                                 opus->format);
   }
 
+static void create_comment_packet_opus(bg_ogg_stream_t * s, ogg_packet * op)
+  {
+  bg_ogg_create_comment_packet((uint8_t*)"OpusTags", 8,
+                               &s->m_stream, s->m_global, 0, op);
+  }
+
 static int init_compressed_opus(bg_ogg_stream_t * s)
   {
   ogg_packet op;
@@ -570,8 +577,7 @@ static int init_compressed_opus(bg_ogg_stream_t * s)
     vendor = opus_get_version_string();
     }
   
-  bg_ogg_create_comment_packet((uint8_t*)"OpusTags", 8,
-                               &s->m_stream, s->m_global, 0, &op);
+  create_comment_packet_opus(s, &op);
   
   op.b_o_s = 0;
   op.e_o_s = 0;
@@ -595,8 +601,6 @@ static int close_opus(void * data)
   
   if(opus->frame)
     gavl_audio_frame_destroy(opus->frame);
-  if(opus->enc_buffer)
-    free(opus->enc_buffer);
   
   opus_multistream_encoder_destroy(opus->enc);
   free(opus);
@@ -614,6 +618,7 @@ const bg_ogg_codec_t bg_opus_codec =
     
     .init_audio  =     init_opus,
     .init_audio_compressed =     init_compressed_opus,
+    .create_comment_packet =     create_comment_packet_opus,
     .set_packet_sink = set_packet_sink,
     
     //    .write_packet = write_audio_packet_opus,
@@ -0,0 +1,520 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Ogg page builder
+ *
+ *  This replaces ogg_stream_packetin() / ogg_stream_pageout() /
+ *  ogg_stream_flush(). Pages are split exactly like libogg-1.3 does it,
+ *  so the output is the same byte for byte. Differences are:
+ *
+ *  - Packets from the gavl packet sink are not copied into a body
+ *    buffer. The pager takes over the packet buffer instead.
+ *  - Pages are built directly in the buffer, where they are queued.
+ *  - The CRC is calculated 8 bytes at a time (slicing-by-8) or with
+ *    carry-less multiplication (PCLMULQDQ) if the CPU supports it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include <gavl/numptr.h>
+
+#include <gmerlin/plugin.h>
+
+#include "ogg_common.h"
+
+/* CRC */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86
+#include <immintrin.h>
+#define TARGET_CLMUL __attribute__((target("pclmul,ssse3")))
+#endif
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*crc_func)(uint32_t crc, const uint8_t * data, int len);
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t * data, int len)
+  {
+  while(len >= 8)
+    {
+    crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+      ((uint32_t)data[2] << 8) | data[3];
+
+    crc = crc_table[7][crc >> 24] ^
+      crc_table[6][(crc >> 16) & 0xff] ^
+      crc_table[5][(crc >> 8) & 0xff] ^
+      crc_table[4][crc & 0xff] ^
+      crc_table[3][data[4]] ^
+      crc_table[2][data[5]] ^
+      crc_table[1][data[6]] ^
+      crc_table[0][data[7]];
+
+    data += 8;
+    len -= 8;
+    }
+
+  while(len--)
+    crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *(data++)];
+
+  return crc;
+  }
+
+#ifdef HAVE_X86
+
+/*
+ *  Carry-less multiply version: The data is folded 128 bits at a
+ *  time (4 blocks in parallel) into one 128 bit remainder, which has
+ *  the same CRC. Blocks are byte reversed, so bit n is the coefficient
+ *  of x^n. Folding a block over d bits multiplies its upper and lower
+ *  halves with x^(d+64) mod P and x^d mod P.
+ */
+
+static uint64_t fold_4[2]; /* x^512 mod P, x^576 mod P */
+static uint64_t fold_1[2]; /* x^128 mod P, x^192 mod P */
+
+TARGET_CLMUL static inline __m128i crc_fold(__m128i x, __m128i k)
+  {
+  return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                       _mm_clmulepi64_si128(x, k, 0x11));
+  }
+
+TARGET_CLMUL
+static uint32_t crc_clmul(uint32_t crc, const uint8_t * data, int len)
+  {
+  __m128i x0, x1, x2, x3, k;
+  uint8_t rem[16];
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                    8, 9, 10, 11, 12, 13, 14, 15);
+
+  if(len < 64)
+    return crc_slice8(crc, data, len);
+
+#define LOAD(i) \
+  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data + i), swap)
+
+  x0 = LOAD(0);
+  x1 = LOAD(1);
+  x2 = LOAD(2);
+  x3 = LOAD(3);
+
+  /* The initial CRC is added to the first 32 bits */
+  x0 = _mm_xor_si128(x0, _mm_slli_si128(_mm_cvtsi32_si128(crc), 12));
+
+  data += 64;
+  len -= 64;
+
+  k = _mm_loadu_si128((const __m128i*)fold_4);
+
+  while(len >= 64)
+    {
+    x0 = _mm_xor_si128(crc_fold(x0, k), LOAD(0));
+    x1 = _mm_xor_si128(crc_fold(x1, k), LOAD(1));
+    x2 = _mm_xor_si128(crc_fold(x2, k), LOAD(2));
+    x3 = _mm_xor_si128(crc_fold(x3, k), LOAD(3));
+    data += 64;
+    len -= 64;
+    }
+
+  k = _mm_loadu_si128((const __m128i*)fold_1);
+
+  x0 = _mm_xor_si128(crc_fold(x0, k), x1);
+  x0 = _mm_xor_si128(crc_fold(x0, k), x2);
+  x0 = _mm_xor_si128(crc_fold(x0, k), x3);
+
+  while(len >= 16)
+    {
+    x0 = _mm_xor_si128(crc_fold(x0, k), LOAD(0));
+    data += 16;
+    len -= 16;
+    }
+#undef LOAD
+
+  /* The table version does the remainder and the rest */
+  _mm_storeu_si128((__m128i*)rem, _mm_shuffle_epi8(x0, swap));
+  crc = crc_slice8(0, rem, 16);
+  return crc_slice8(crc, data, len);
+  }
+
+#endif // HAVE_X86
+
+/* x^n mod P */
+
+static uint32_t crc_xpow(int n)
+  {
+  uint32_t r = 1;
+  while(n--)
+    r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+  return r;
+  }
+
+static void crc_init()
+  {
+  int i, j;
+  uint32_t r;
+
+  /* Polynomial 0x04c11db7, MSB first */
+  for(i = 0; i < 256; i++)
+    {
+    r = (uint32_t)i << 24;
+    for(j = 0; j < 8; j++)
+      r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+    crc_table[0][i] = r;
+    }
+
+  /* crc_table[j][i] is the CRC of byte i followed by j zero bytes */
+  for(j = 1; j < 8; j++)
+    {
+    for(i = 0; i < 256; i++)
+      crc_table[j][i] = (crc_table[j-1][i] << 8) ^
+        crc_table[0][crc_table[j-1][i] >> 24];
+    }
+
+  crc_func = crc_slice8;
+  
+#ifdef HAVE_X86
+  __builtin_cpu_init();
+  
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    {
+    fold_4[0] = crc_xpow(512);
+    fold_4[1] = crc_xpow(576);
+    fold_1[0] = crc_xpow(128);
+    fold_1[1] = crc_xpow(192);
+    crc_func = crc_clmul;
+    }
+#endif
+  }
+
+uint32_t bg_ogg_crc(uint32_t crc, const uint8_t * data, int len)
+  {
+  pthread_once(&crc_once, crc_init);
+  return crc_func(crc, data, len);
+  }
+
+/* Pager */
+
+void bg_ogg_pager_init(bg_ogg_pager_t * p, long serialno)
+  {
+  memset(p, 0, sizeof(*p));
+  p->serialno = serialno;
+  }
+
+void bg_ogg_pager_reset(bg_ogg_pager_t * p, long serialno)
+  {
+  /* Keep the unused packet buffers */
+  p->num_packets = 0;
+  p->packet_pos = 0;
+  p->lacing_fill = 0;
+  p->pageno = 0;
+  p->packetno = 0;
+  p->b_o_s = 0;
+  p->e_o_s = 0;
+  p->serialno = serialno;
+  }
+
+void bg_ogg_pager_free(bg_ogg_pager_t * p)
+  {
+  int i;
+
+  if(p->packets)
+    {
+    for(i = 0; i < p->packets_alloc; i++)
+      gavl_packet_free(&p->packets[i]);
+    free(p->packets);
+    }
+  if(p->lacing_vals)
+    free(p->lacing_vals);
+  if(p->granule_vals)
+    free(p->granule_vals);
+  memset(p, 0, sizeof(*p));
+  }
+
+static gavl_packet_t * next_packet(bg_ogg_pager_t * p)
+  {
+  if(p->num_packets == p->packets_alloc)
+    {
+    p->packets_alloc += 16;
+    p->packets = realloc(p->packets, p->packets_alloc * sizeof(*p->packets));
+    memset(p->packets + p->num_packets, 0,
+           (p->packets_alloc - p->num_packets) * sizeof(*p->packets));
+    }
+  return p->packets + p->num_packets;
+  }
+
+static void add_lacing(bg_ogg_pager_t * p, int bytes,
+                       int64_t granulepos, int e_o_s)
+  {
+  int i;
+  int num = bytes / 255 + 1;
+
+  if(p->lacing_fill + num > p->lacing_alloc)
+    {
+    p->lacing_alloc = p->lacing_fill + num + 1024;
+    p->lacing_vals = realloc(p->lacing_vals,
+                             p->lacing_alloc * sizeof(*p->lacing_vals));
+    p->granule_vals = realloc(p->granule_vals,
+                              p->lacing_alloc * sizeof(*p->granule_vals));
+    }
+
+  for(i = 0; i < num - 1; i++)
+    {
+    p->lacing_vals[p->lacing_fill + i] = 255;
+    p->granule_vals[p->lacing_fill + i] = -1;
+    }
+  p->lacing_vals[p->lacing_fill + i] = bytes % 255;
+  p->granule_vals[p->lacing_fill + i] = granulepos;
+
+  /* Flag the first segment as the beginning of the packet */
+  p->lacing_vals[p->lacing_fill] |= 0x100;
+
+  p->lacing_fill += num;
+  p->num_packets++;
+  p->packetno++;
+
+  if(e_o_s)
+    p->e_o_s = 1;
+  }
+
+void bg_ogg_pager_packetin(bg_ogg_pager_t * p,
+                           const uint8_t * data, int len,
+                           int64_t granulepos, int e_o_s)
+  {
+  gavl_packet_t * pkt = next_packet(p);
+
+  gavl_packet_alloc(pkt, len);
+  if(len)
+    memcpy(pkt->data, data, len);
+  pkt->data_len = len;
+  add_lacing(p, len, granulepos, e_o_s);
+  }
+
+void bg_ogg_pager_packetin_gavl(bg_ogg_pager_t * p,
+                                gavl_packet_t * pkt,
+                                int64_t granulepos, int e_o_s)
+  {
+  gavl_packet_t tmp;
+  gavl_packet_t * dst = next_packet(p);
+
+  tmp = *dst;
+  *dst = *pkt;
+  *pkt = tmp;
+
+  add_lacing(p, dst->data_len, granulepos, e_o_s);
+  }
+
+static void reverse_packets(gavl_packet_t * packets, int num)
+  {
+  int i;
+  gavl_packet_t tmp;
+
+  for(i = 0; i < num / 2; i++)
+    {
+    tmp = packets[i];
+    packets[i] = packets[num - 1 - i];
+    packets[num - 1 - i] = tmp;
+    }
+  }
+
+/*
+ *  The first num packets are completely on pages: Keep the buffers
+ *  for reusing them. This is done once per page, because shifting the
+ *  array for each packet is quadratic in the packets per page.
+ */
+
+static void release_packets(bg_ogg_pager_t * p, int num)
+  {
+  /* Rotate the finished packets behind the pending ones */
+  reverse_packets(p->packets, num);
+  reverse_packets(p->packets + num, p->num_packets - num);
+  reverse_packets(p->packets, p->num_packets);
+
+  p->num_packets -= num;
+  }
+
+/* Port of ogg_stream_flush_i() from libogg-1.3 */
+
+static int build_page(bg_ogg_pager_t * p, bg_ogg_page_t * page,
+                      int force, int nfill)
+  {
+  int i;
+  int vals;
+  int maxvals;
+  int bytes = 0;
+  int len;
+  int run;
+  long acc = 0;
+  int64_t granulepos = -1;
+  uint8_t * ptr;
+  uint32_t crc;
+
+  maxvals = (p->lacing_fill > 255) ? 255 : p->lacing_fill;
+
+  if(!maxvals)
+    return 0;
+
+  if(!p->b_o_s)
+    {
+    /* The first page contains only the first packet */
+    granulepos = 0;
+    for(vals = 0; vals < maxvals; vals++)
+      {
+      if((p->lacing_vals[vals] & 0xff) < 255)
+        {
+        vals++;
+        break;
+        }
+      }
+    }
+  else
+    {
+    /*
+     *  Don't span pages unnecessarily and don't finish pages
+     *  with less than 4 packets unless it's necessary.
+     */
+    int packets_done = 0;
+    int packet_just_done = 0;
+
+    for(vals = 0; vals < maxvals; vals++)
+      {
+      if((acc > nfill) && (packet_just_done >= 4))
+        {
+        force = 1;
+        break;
+        }
+      acc += p->lacing_vals[vals] & 0xff;
+      if((p->lacing_vals[vals] & 0xff) < 255)
+        {
+        granulepos = p->granule_vals[vals];
+        packet_just_done = ++packets_done;
+        }
+      else
+        packet_just_done = 0;
+      }
+    if(vals == 255)
+      force = 1;
+    }
+
+  if(!force)
+    return 0;
+
+  for(i = 0; i < vals; i++)
+    bytes += p->lacing_vals[i] & 0xff;
+
+  page->header_len = 27 + vals;
+  page->body_len = bytes;
+  len = page->header_len + page->body_len;
+
+  if(page->alloc < len)
+    {
+    page->alloc = len + 1024;
+    page->data = realloc(page->data, page->alloc);
+    }
+
+  /* Header */
+  ptr = page->data;
+
+  memcpy(ptr, "OggS", 4);
+  ptr[4] = 0x00; /* Version */
+
+  ptr[5] = 0x00;
+  if(!(p->lacing_vals[0] & 0x100))
+    ptr[5] |= 0x01; /* Continued packet */
+  if(!p->b_o_s)
+    ptr[5] |= 0x02; /* First page */
+  if(p->e_o_s && (p->lacing_fill == vals))
+    ptr[5] |= 0x04; /* Last page */
+  p->b_o_s = 1;
+
+  GAVL_64LE_2_PTR(granulepos, ptr + 6);
+  GAVL_32LE_2_PTR(p->serialno, ptr + 14);
+  GAVL_32LE_2_PTR(p->pageno, ptr + 18);
+  p->pageno++;
+  GAVL_32LE_2_PTR(0, ptr + 22); /* CRC */
+  ptr[26] = vals;
+
+  for(i = 0; i < vals; i++)
+    ptr[27 + i] = p->lacing_vals[i] & 0xff;
+
+  /* Body */
+  ptr += page->header_len;
+  page->num_packets = 0;
+  run = 0;
+
+  for(i = 0; i < vals; i++)
+    {
+    run += p->lacing_vals[i] & 0xff;
+
+    if((p->lacing_vals[i] & 0xff) < 255)
+      {
+      if(run)
+        memcpy(ptr, p->packets[page->num_packets].data + p->packet_pos, run);
+      ptr += run;
+      run = 0;
+      p->packet_pos = 0;
+      page->num_packets++;
+      }
+    }
+
+  if(run)
+    {
+    memcpy(ptr, p->packets[page->num_packets].data + p->packet_pos, run);
+    p->packet_pos += run;
+    }
+
+  if(page->num_packets)
+    release_packets(p, page->num_packets);
+
+  p->lacing_fill -= vals;
+  if(p->lacing_fill)
+    {
+    memmove(p->lacing_vals, p->lacing_vals + vals,
+            p->lacing_fill * sizeof(*p->lacing_vals));
+    memmove(p->granule_vals, p->granule_vals + vals,
+            p->lacing_fill * sizeof(*p->granule_vals));
+    }
+
+  crc = bg_ogg_crc(0, page->data, len);
+  GAVL_32LE_2_PTR(crc, page->data + 22);
+  return 1;
+  }
+
+int bg_ogg_pager_pageout(bg_ogg_pager_t * p, bg_ogg_page_t * page, int nfill)
+  {
+  int force = 0;
+
+  if((p->e_o_s && p->lacing_fill) || /* Last packet is in */
+     (p->lacing_fill && !p->b_o_s))  /* ID header page */
+    force = 1;
+
+  return build_page(p, page, force, nfill);
+  }
+
+int bg_ogg_pager_flush(bg_ogg_pager_t * p, bg_ogg_page_t * page, int nfill)
+  {
+  return build_page(p, page, 1, nfill);
+  }
@@ -57,8 +57,9 @@ typedef struct
   gavl_video_format_t * gavl_format;
 
   uint32_t pic_num_max;
-  
-  gavl_packet_t pkt;
+
+  /* Packet of the sink, into which we write the data */
+  gavl_packet_t * pkt;
 
   bg_encoder_framerate_t fr;
 
@@ -679,26 +680,20 @@ static gavl_sink_status_t flush_data(schro_t * s)
         
         parse_code = buf->data[4];
 
+        /* Append the data to the packet of the sink */
+        if(!s->pkt)
+          {
+          s->pkt = gavl_packet_sink_get_packet(s->psink);
+          gavl_packet_reset(s->pkt);
+          }
+        gavl_packet_alloc(s->pkt, s->pkt->data_len + buf->length);
+        memcpy(s->pkt->data + s->pkt->data_len, buf->data, buf->length);
+        s->pkt->data_len += buf->length;
+        
         if(SCHRO_PARSE_CODE_IS_PICTURE(parse_code))
           {
           uint32_t pic_num;
-          gavl_packet_t * out_pkt;
-          gavl_packet_t pkt;
-          
-          if(s->pkt.data_len) // Have data already
-            {
-            gavl_packet_alloc(&s->pkt, s->pkt.data_len + buf->length);
-            memcpy(s->pkt.data + s->pkt.data_len, buf->data, buf->length);
-            s->pkt.data_len += buf->length;
-            out_pkt = &s->pkt;
-            }
-          else
-            {
-            gavl_packet_init(&pkt);
-            pkt.data_len = buf->length;
-            pkt.data = buf->data;
-            out_pkt = &pkt;
-            }
+          gavl_packet_t * out_pkt = s->pkt;
           
           pic_num = GAVL_PTR_2_32BE(buf->data + 13);
 
@@ -730,19 +725,13 @@ static gavl_sink_status_t flush_data(schro_t * s)
           //          fprintf(stderr, "Got picture\n");
           //          gavl_packet_dump(out_pkt);
           
+          s->pkt = NULL;
+          
           if((st = gavl_packet_sink_put_packet(s->psink, out_pkt)) != GAVL_SINK_OK)
             return st;
-          
-          gavl_packet_reset(&s->pkt);
-          }
-        else
-          {
-          gavl_packet_alloc(&s->pkt, s->pkt.data_len + buf->length);
-          memcpy(s->pkt.data + s->pkt.data_len, buf->data, buf->length);
-          s->pkt.data_len += buf->length;
-          if(SCHRO_PARSE_CODE_IS_SEQ_HEADER(parse_code))
-            s->pkt.header_size = s->pkt.data_len;
           }
+        else if(SCHRO_PARSE_CODE_IS_SEQ_HEADER(parse_code))
+          s->pkt->header_size = s->pkt->data_len;
         schro_buffer_unref(buf);
         }
         break;
@@ -938,6 +927,7 @@ static int init_compressed_schro(bg_ogg_stream_t * s)
     return 0;
 
   sch->decode_frame_number = -1;
+  s->granule_shift = 22;
 
   /* Flush stream after each packet as
      mandated by the Dirac mapping specification */  
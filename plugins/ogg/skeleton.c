@@ -0,0 +1,491 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Ogg Skeleton 4.0 with keyframe index
+ *
+ *  The skeleton stream consists of the fishead packet (BOS page),
+ *  one fisbone packet per stream, one index packet per stream and
+ *  an empty EOS packet, which terminates the header section.
+ *
+ *  The index packets have a fixed size, which is reserved when the
+ *  headers are written. When the file is closed, the collected
+ *  keypoints are written into the reserved space and the fishead
+ *  packet is updated with the segment length.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <config.h>
+
+#include <gavl/numptr.h>
+
+#include <gmerlin/translation.h>
+#include <gmerlin/plugin.h>
+#include <gmerlin/utils.h>
+#include <gmerlin/log.h>
+
+#include "ogg_common.h"
+
+#define LOG_DOMAIN "ogg.skeleton"
+
+#define FISHEAD_SIZE      80
+#define FISBONE_SIZE      52 /* Without message headers */
+#define INDEX_HEADER_SIZE 42
+
+/* Timestamp denominator of the index */
+#define INDEX_TIMESCALE 1000
+
+/* Same as ogg_stream_flush() */
+#define SKELETON_PAGE_SIZE 4096
+
+/* Keypoints are at least this far apart */
+#define MIN_KEYPOINT_DISTANCE GAVL_TIME_SCALE
+
+/* Write and rewrite skeleton packets */
+
+static int write_packet(bg_ogg_encoder_t * e, uint8_t * data, int len,
+                        int eos, bg_ogg_skeleton_packet_t * pos)
+  {
+  if(pos)
+    {
+    pos->offset = bg_ogg_encoder_tell(e);
+    pos->pageno = e->skeleton_pager.pageno;
+    }
+
+  bg_ogg_pager_packetin(&e->skeleton_pager, data, len, 0, eos);
+
+  /* Skeleton packets start on a new page */
+  while(bg_ogg_pager_flush(&e->skeleton_pager, &e->header_page,
+                           SKELETON_PAGE_SIZE))
+    {
+    if(!bg_ogg_encoder_write_page(e, &e->header_page))
+      return 0;
+    }
+
+  if(pos)
+    pos->len = bg_ogg_encoder_tell(e) - pos->offset;
+  return 1;
+  }
+
+/*
+ *  Page a packet exactly like write_packet() did and overwrite the
+ *  original pages. The packet must have the same size as the original one.
+ */
+
+static int rewrite_packet(bg_ogg_encoder_t * e, uint8_t * data, int len,
+                          const bg_ogg_skeleton_packet_t * pos)
+  {
+  bg_ogg_pager_t pager;
+  bg_ogg_page_t * page = &e->header_page;
+  uint8_t * buf;
+  int64_t buf_len = 0;
+  int ret = 0;
+
+  bg_ogg_pager_init(&pager, e->skeleton_pager.serialno);
+  pager.pageno = pos->pageno;
+
+  /* Only the first page has the BOS flag */
+  if(pos->pageno)
+    pager.b_o_s = 1;
+
+  bg_ogg_pager_packetin(&pager, data, len, 0, 0);
+
+  buf = malloc(pos->len);
+
+  while(bg_ogg_pager_flush(&pager, page, SKELETON_PAGE_SIZE))
+    {
+    int page_len = page->header_len + page->body_len;
+    if(buf_len + page_len > pos->len)
+      break;
+    memcpy(buf + buf_len, page->data, page_len);
+    buf_len += page_len;
+    }
+
+  if(buf_len != pos->len)
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN,
+           "Page layout changed when rewriting skeleton packet");
+    goto fail;
+    }
+
+  gavf_io_seek(e->io, e->io_start + pos->offset, SEEK_SET);
+  if(gavf_io_write_data(e->io, buf, buf_len) < buf_len)
+    goto fail;
+
+  ret = 1;
+  fail:
+  free(buf);
+  bg_ogg_pager_free(&pager);
+  return ret;
+  }
+
+/* fishead */
+
+static void create_fishead(bg_ogg_encoder_t * e, uint8_t * buf,
+                           int64_t segment_len, int64_t content_offset)
+  {
+  memset(buf, 0, FISHEAD_SIZE);
+  memcpy(buf, "fishead", 8);
+  GAVL_16LE_2_PTR(4, buf+8);    /* Version major */
+  GAVL_16LE_2_PTR(0, buf+10);   /* Version minor */
+  GAVL_64LE_2_PTR(0, buf+12);   /* Presentation time */
+  GAVL_64LE_2_PTR(INDEX_TIMESCALE, buf+20);
+  GAVL_64LE_2_PTR(0, buf+28);   /* Base time */
+  GAVL_64LE_2_PTR(INDEX_TIMESCALE, buf+36);
+  /* UTC time (20 bytes) stays zero */
+  GAVL_64LE_2_PTR(segment_len, buf+64);
+  GAVL_64LE_2_PTR(content_offset, buf+72);
+  }
+
+/* fisbone */
+
+static int write_fisbone(bg_ogg_encoder_t * e, bg_ogg_stream_t * s,
+                         const char * role)
+  {
+  int len;
+  int ret;
+  uint8_t * buf;
+  char * headers;
+  const char * mime;
+  int64_t granulerate_n = 0;
+  int64_t granulerate_d = 1;
+  int preroll = 0;
+
+  switch(s->ci.id)
+    {
+    case GAVL_CODEC_ID_VORBIS:
+      mime = "audio/vorbis";
+      granulerate_n = s->afmt.samplerate;
+      preroll = 2;
+      break;
+    case GAVL_CODEC_ID_SPEEX:
+      mime = "audio/speex";
+      granulerate_n = s->afmt.samplerate;
+      preroll = 3;
+      break;
+    case GAVL_CODEC_ID_OPUS:
+      mime = "audio/opus";
+      granulerate_n = 48000;
+      break;
+    case GAVL_CODEC_ID_FLAC:
+      mime = "audio/flac";
+      granulerate_n = s->afmt.samplerate;
+      break;
+    case GAVL_CODEC_ID_THEORA:
+      mime = "video/theora";
+      granulerate_n = s->vfmt.timescale;
+      granulerate_d = s->vfmt.frame_duration;
+      break;
+    case GAVL_CODEC_ID_DIRAC:
+      /* Granules count fields */
+      mime = "video/dirac";
+      granulerate_n = 2 * s->vfmt.timescale;
+      granulerate_d = s->vfmt.frame_duration;
+      break;
+    default:
+      mime = "application/octet-stream";
+      break;
+    }
+
+  headers = bg_sprintf("Content-Type: %s\r\nRole: %s\r\n", mime, role);
+  len = FISBONE_SIZE + strlen(headers);
+  buf = calloc(1, len);
+
+  memcpy(buf, "fisbone", 8);
+  GAVL_32LE_2_PTR(FISBONE_SIZE - 8, buf+8); /* Offset of the message headers */
+  GAVL_32LE_2_PTR(s->pager.serialno, buf+12);
+  GAVL_32LE_2_PTR(s->num_headers, buf+16);
+  GAVL_64LE_2_PTR(granulerate_n, buf+20);
+  GAVL_64LE_2_PTR(granulerate_d, buf+28);
+  GAVL_64LE_2_PTR(0, buf+36);    /* Base granule */
+  GAVL_32LE_2_PTR(preroll, buf+44);
+  buf[48] = s->granule_shift;
+  /* 3 bytes padding */
+  memcpy(buf + FISBONE_SIZE, headers, len - FISBONE_SIZE);
+
+  ret = write_packet(e, buf, len, 0, NULL);
+
+  free(buf);
+  free(headers);
+  return ret;
+  }
+
+/* index */
+
+static int put_varint(uint8_t * ptr, uint64_t val)
+  {
+  int len = 0;
+
+  /* 7 bits per byte, the last byte has the high bit set */
+  while(val > 0x7f)
+    {
+    ptr[len++] = val & 0x7f;
+    val >>= 7;
+    }
+  ptr[len++] = val | 0x80;
+  return len;
+  }
+
+static int64_t index_time(gavl_time_t t)
+  {
+  if((t == GAVL_TIME_UNDEFINED) || (t < 0))
+    return 0;
+  return gavl_time_scale(INDEX_TIMESCALE, t);
+  }
+
+/* Returns the number of keypoints, which fit into the buffer */
+
+static int create_index(bg_ogg_encoder_t * e, bg_ogg_stream_t * s,
+                        uint8_t * buf, int len)
+  {
+  int i;
+  int pos;
+  int64_t offset;
+  int64_t time;
+  int64_t t;
+
+  memset(buf, 0, len);
+
+  pos = INDEX_HEADER_SIZE;
+  offset = 0;
+  time = 0;
+
+  for(i = 0; i < s->num_keypoints; i++)
+    {
+    /* Each keypoint takes 20 bytes at most */
+    if(pos + 20 > len)
+      break;
+
+    pos += put_varint(buf + pos, s->keypoints[i].offset - offset);
+    offset = s->keypoints[i].offset;
+
+    t = index_time(s->keypoints[i].time);
+    if(t < time)
+      t = time;
+    pos += put_varint(buf + pos, t - time);
+    time = t;
+    }
+
+  memcpy(buf, "index", 6);
+  GAVL_32LE_2_PTR(s->pager.serialno, buf+6);
+  GAVL_64LE_2_PTR(i, buf+10);
+  GAVL_64LE_2_PTR(INDEX_TIMESCALE, buf+18);
+  GAVL_64LE_2_PTR(index_time(s->start_time), buf+26);
+  GAVL_64LE_2_PTR(index_time(s->in_time), buf+34);
+  return i;
+  }
+
+/* Public functions */
+
+int bg_ogg_skeleton_write_bos(bg_ogg_encoder_t * e)
+  {
+  uint8_t buf[FISHEAD_SIZE];
+
+  e->have_skeleton = 0;
+
+  if(!e->skeleton)
+    return 1;
+
+  if(!gavf_io_can_seek(e->io))
+    {
+    bg_log(BG_LOG_INFO, LOG_DOMAIN,
+           "Output is not seekable, writing no skeleton");
+    return 1;
+    }
+
+  e->have_skeleton = 1;
+  e->io_start = gavf_io_position(e->io) - bg_ogg_encoder_tell(e);
+  e->segment_start = bg_ogg_encoder_tell(e);
+  e->segment_end = 0;
+
+  bg_ogg_pager_init(&e->skeleton_pager, e->serialno++);
+
+  create_fishead(e, buf, 0, 0);
+  return write_packet(e, buf, FISHEAD_SIZE, 0, &e->fishead);
+  }
+
+int bg_ogg_skeleton_write_headers(bg_ogg_encoder_t * e)
+  {
+  int i;
+  int ret = 1;
+  uint8_t * buf;
+
+  if(!e->have_skeleton)
+    return 1;
+
+  for(i = 0; i < e->num_video_streams; i++)
+    {
+    if(!write_fisbone(e, &e->video_streams[i],
+                      i ? "video/alternate" : "video/main"))
+      return 0;
+    }
+  for(i = 0; i < e->num_audio_streams; i++)
+    {
+    if(!write_fisbone(e, &e->audio_streams[i],
+                      i ? "audio/alternate" : "audio/main"))
+      return 0;
+    }
+
+  /* Reserve space for the index packets */
+  buf = calloc(1, e->index_size);
+
+  for(i = 0; i < e->num_video_streams; i++)
+    {
+    bg_ogg_stream_t * s = &e->video_streams[i];
+    if(!(ret = write_packet(e, buf, e->index_size, 0, &s->index_packet)))
+      break;
+    }
+  for(i = 0; ret && (i < e->num_audio_streams); i++)
+    {
+    bg_ogg_stream_t * s = &e->audio_streams[i];
+    if(!(ret = write_packet(e, buf, e->index_size, 0, &s->index_packet)))
+      break;
+    }
+
+  free(buf);
+  return ret;
+  }
+
+int bg_ogg_skeleton_write_eos(bg_ogg_encoder_t * e)
+  {
+  if(!e->have_skeleton)
+    return 1;
+  if(!write_packet(e, NULL, 0, 1, NULL))
+    return 0;
+  e->content_start = bg_ogg_encoder_tell(e);
+  return 1;
+  }
+
+void bg_ogg_skeleton_check_keyframe(bg_ogg_stream_t * s,
+                                    const gavl_packet_t * p)
+  {
+  gavl_time_t t;
+
+  if(!s->enc->have_skeleton || s->enc->segment_end)
+    return;
+
+  t = gavl_time_unscale(s->timescale, p->pts);
+
+  if(s->start_time == GAVL_TIME_UNDEFINED)
+    s->start_time = t;
+
+  /* Every audio packet is a keyframe */
+  if(s->key_pending ||
+     ((s->flags & STREAM_VIDEO) && !(p->flags & GAVL_PACKET_KEYFRAME)))
+    return;
+
+  if((s->key_time != GAVL_TIME_UNDEFINED) &&
+     (t - s->key_time < MIN_KEYPOINT_DISTANCE))
+    return;
+
+  s->key_pending = 1;
+  s->key_time = t;
+  }
+
+void bg_ogg_skeleton_add_keypoint(bg_ogg_stream_t * s, gavl_time_t time)
+  {
+  bg_ogg_encoder_t * e = s->enc;
+
+  if(!e->have_skeleton || e->segment_end)
+    return;
+
+  if(s->num_keypoints == s->keypoints_alloc)
+    {
+    s->keypoints_alloc += 256;
+    s->keypoints = realloc(s->keypoints,
+                           s->keypoints_alloc * sizeof(*s->keypoints));
+    }
+  s->keypoints[s->num_keypoints].offset =
+    bg_ogg_encoder_tell(e) - e->segment_start;
+  s->keypoints[s->num_keypoints].time = time;
+  s->num_keypoints++;
+  }
+
+void bg_ogg_skeleton_end_segment(bg_ogg_encoder_t * e)
+  {
+  if(e->have_skeleton && !e->segment_end)
+    e->segment_end = bg_ogg_encoder_tell(e);
+  }
+
+static int finalize_index(bg_ogg_encoder_t * e, bg_ogg_stream_t * s,
+                          uint8_t * buf, const char * type)
+  {
+  int i, num;
+
+  while(((num = create_index(e, s, buf, e->index_size)) < s->num_keypoints) &&
+        (s->num_keypoints > 1))
+    {
+    /* Drop every second keypoint until the index fits */
+    for(i = 1; 2 * i < s->num_keypoints; i++)
+      s->keypoints[i] = s->keypoints[2*i];
+    s->num_keypoints = i;
+    }
+
+  bg_log(BG_LOG_DEBUG, LOG_DOMAIN, "%s stream %d: Wrote %d keypoints",
+         type, s->index + 1, num);
+
+  return rewrite_packet(e, buf, e->index_size, &s->index_packet);
+  }
+
+int bg_ogg_skeleton_finalize(bg_ogg_encoder_t * e)
+  {
+  int i;
+  int ret = 0;
+  int64_t end;
+  uint8_t * buf;
+
+  if(!e->have_skeleton)
+    return 1;
+
+  end = bg_ogg_encoder_tell(e);
+  if(!e->segment_end)
+    e->segment_end = end;
+
+  buf = malloc(e->index_size > FISHEAD_SIZE ? e->index_size : FISHEAD_SIZE);
+
+  create_fishead(e, buf, e->segment_end - e->segment_start,
+                 e->content_start - e->segment_start);
+  if(!rewrite_packet(e, buf, FISHEAD_SIZE, &e->fishead))
+    goto fail;
+
+  for(i = 0; i < e->num_video_streams; i++)
+    {
+    if(!finalize_index(e, &e->video_streams[i], buf, "Video"))
+      goto fail;
+    }
+  for(i = 0; i < e->num_audio_streams; i++)
+    {
+    if(!finalize_index(e, &e->audio_streams[i], buf, "Audio"))
+      goto fail;
+    }
+  ret = 1;
+  fail:
+
+  gavf_io_seek(e->io, e->io_start + end, SEEK_SET);
+
+  free(buf);
+  bg_ogg_pager_free(&e->skeleton_pager);
+  e->have_skeleton = 0;
+  return ret;
+  }
@@ -71,8 +71,6 @@ typedef struct
   
   int frames_encoded;
 
-  uint8_t buffer[BUFFER_SIZE];
-
   gavl_packet_sink_t * psink;
   SpeexHeader header;
   
@@ -222,6 +220,11 @@ static void set_parameter_speex(void * data, const char * name,
     }
   }
 
+static void create_comment_packet_speex(bg_ogg_stream_t * s, ogg_packet * op)
+  {
+  bg_ogg_create_comment_packet(NULL, 0, &s->m_stream, s->m_global, 0, op);
+  }
+
 static int init_compressed_speex(bg_ogg_stream_t * s)
   {
   ogg_packet op;
@@ -231,7 +234,7 @@ static int init_compressed_speex(bg_ogg_stream_t * s)
   if(!bg_ogg_stream_write_header_packet(s, &op))
     return 0;
   
-  bg_ogg_create_comment_packet(NULL, 0, &s->m_stream, s->m_global, 0, &op);
+  create_comment_packet_speex(s, &op);
 
   if(!bg_ogg_stream_write_header_packet(s, &op))
     return 0;
@@ -242,23 +245,25 @@ static int init_compressed_speex(bg_ogg_stream_t * s)
 
 static int flush_packet(speex_t * speex)
   {
-  gavl_packet_t p;
-  gavl_packet_init(&p);
+  gavl_packet_t * p;
 
   //  fprintf(stderr, "Flush packet\n");
   
-  /* Flush packet */
-  p.data_len  = speex_bits_write(&speex->bits, (char*)speex->buffer,
-                                 BUFFER_SIZE);
-  p.data = speex->buffer;
+  /* Flush packet directly into the buffer of the sink */
+  p = gavl_packet_sink_get_packet(speex->psink);
+  gavl_packet_reset(p);
+  gavl_packet_alloc(p, BUFFER_SIZE);
+  
+  p->data_len  = speex_bits_write(&speex->bits, (char*)p->data,
+                                  BUFFER_SIZE);
 
-  p.pts = speex->pts;
-  p.duration = speex->duration;
+  p->pts = speex->pts;
+  p->duration = speex->duration;
 
   speex->pts += speex->duration;
   speex->duration = 0;
   
-  if(gavl_packet_sink_put_packet(speex->psink, &p) != GAVL_SINK_OK)
+  if(gavl_packet_sink_put_packet(speex->psink, p) != GAVL_SINK_OK)
     return 0;
   speex_bits_reset(&speex->bits);
   
@@ -529,6 +534,7 @@ const bg_ogg_codec_t bg_speex_codec =
     //  int (*init_video)(void*, gavl_video_format_t * format);
 
     .init_audio_compressed = init_compressed_speex,
+    .create_comment_packet = create_comment_packet_speex,
     .set_packet_sink = set_packet_sink,
 
     .convert_packet = convert_packet,
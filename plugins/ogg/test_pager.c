@@ -0,0 +1,304 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Checks the pager against libogg: Packet sequences, which look like
+ *  the ones of the codecs, are passed to the pager and to
+ *  ogg_stream_packetin(). The pages from bg_ogg_pager_pageout() and
+ *  bg_ogg_pager_flush() must be the same byte for byte as the ones
+ *  from ogg_stream_pageout_fill() and ogg_stream_flush_fill().
+ *
+ *  The CRC versions are checked against ogg_page_checksum_set().
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "pager.c"
+
+/* Packet sizes of the codecs */
+
+typedef struct
+  {
+  const char * name;
+  int header_sizes[3];
+  int num_headers;
+  int min_size;
+  int max_size;
+  int granule_step;
+  } profile_t;
+
+static const profile_t profiles[] =
+  {
+    { "vorbis", { 30, 3500, 5000 }, 3, 60,  700,    1024 },
+    { "opus",   { 19, 60 },         2, 3,   400,    960  },
+    { "speex",  { 80, 70 },         2, 10,  120,    320  },
+    { "flac",   { 51, 40 },         2, 14,  12000,  4096 },
+    { "theora", { 42, 150, 2800 },  3, 0,   90000,  1    },
+    { "dirac",  { 30 },             1, 0,   400000, 2    },
+  };
+
+#define NUM_PROFILES (int)(sizeof(profiles)/sizeof(profiles[0]))
+
+static const int fill_sizes[] = { 4096, 1024, 8192, 65307 };
+
+#define NUM_FILL_SIZES (int)(sizeof(fill_sizes)/sizeof(fill_sizes[0]))
+
+/* Reproducible on all platforms */
+
+static uint32_t rand_state = 1;
+
+static uint32_t get_rand(void)
+  {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+  }
+
+static void fill_random(uint8_t * data, int len)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    data[i] = get_rand();
+  }
+
+static int compare_page(const ogg_page * og, const bg_ogg_page_t * page,
+                        const char * name, int fill, int64_t num)
+  {
+  if((og->header_len != page->header_len) ||
+     (og->body_len != page->body_len) ||
+     memcmp(og->header, page->data, og->header_len) ||
+     memcmp(og->body, page->data + page->header_len, og->body_len))
+    {
+    fprintf(stderr, "%s, fill %d: Page %"PRId64" differs\n",
+            name, fill, num);
+    return 0;
+    }
+  return 1;
+  }
+
+/* Get all pages from libogg and the pager and compare them */
+
+static int get_pages(ogg_stream_state * os, bg_ogg_pager_t * p,
+                     bg_ogg_page_t * page, int flush, int fill,
+                     const char * name, int64_t * num)
+  {
+  ogg_page og;
+  int result, ret;
+
+  while(1)
+    {
+    if(flush)
+      {
+      ret = ogg_stream_flush_fill(os, &og, fill);
+      result = bg_ogg_pager_flush(p, page, fill);
+      }
+    else
+      {
+      ret = ogg_stream_pageout_fill(os, &og, fill);
+      result = bg_ogg_pager_pageout(p, page, fill);
+      }
+    if(!ret != !result)
+      {
+      fprintf(stderr, "%s, fill %d: libogg %s a page, the pager %s\n",
+              name, fill, ret ? "returned" : "didn't return",
+              result ? "did" : "didn't");
+      return 0;
+      }
+    if(!ret)
+      return 1;
+    if(!compare_page(&og, page, name, fill, *num))
+      return 0;
+    (*num)++;
+    }
+  }
+
+static int test_profile(const profile_t * prof, int fill)
+  {
+  int i, len, num_packets;
+  ogg_stream_state os;
+  ogg_packet op;
+  bg_ogg_pager_t p;
+  bg_ogg_page_t page;
+  gavl_packet_t gp;
+  uint8_t * data;
+  int64_t granulepos = 0;
+  int64_t num_pages = 0;
+  int ret = 0;
+  long serialno = get_rand();
+
+  ogg_stream_init(&os, serialno);
+  bg_ogg_pager_init(&p, serialno);
+  memset(&page, 0, sizeof(page));
+  gavl_packet_init(&gp);
+
+  data = malloc(prof->max_size > 5000 ? prof->max_size : 5000);
+  
+  num_packets = prof->num_headers + 200 + get_rand() % 200;
+  
+  for(i = 0; i < num_packets; i++)
+    {
+    memset(&op, 0, sizeof(op));
+    
+    if(i < prof->num_headers)
+      len = prof->header_sizes[i];
+    else
+      {
+      len = prof->min_size +
+        get_rand() % (prof->max_size - prof->min_size + 1);
+      /* Some packets are multiples of the segment size */
+      if(!(get_rand() % 16))
+        len = 255 * (len / 255);
+      granulepos += prof->granule_step;
+      }
+    
+    fill_random(data, len);
+    
+    op.packet = data;
+    op.bytes = len;
+    op.b_o_s = !i;
+    op.e_o_s = (i == num_packets - 1);
+    op.granulepos = (i < prof->num_headers) ? 0 : granulepos;
+    op.packetno = i;
+    
+    ogg_stream_packetin(&os, &op);
+
+    /* Use both ways to pass packets */
+    if(i & 1)
+      bg_ogg_pager_packetin(&p, data, len, op.granulepos, op.e_o_s);
+    else
+      {
+      gavl_packet_alloc(&gp, len);
+      if(len)
+        memcpy(gp.data, data, len);
+      gp.data_len = len;
+      bg_ogg_pager_packetin_gavl(&p, &gp, op.granulepos, op.e_o_s);
+      }
+
+    /* Header pages are flushed, sometimes also pages in the stream
+       like with the duration page policy */
+    if(!get_pages(&os, &p, &page,
+                  (i == prof->num_headers - 1) || !(get_rand() % 20),
+                  fill, prof->name, &num_pages))
+      goto fail;
+    }
+  
+  if(!get_pages(&os, &p, &page, 1, fill, prof->name, &num_pages))
+    goto fail;
+
+  if(p.num_packets)
+    {
+    fprintf(stderr, "%s, fill %d: %d packets left in the pager\n",
+            prof->name, fill, p.num_packets);
+    goto fail;
+    }
+  
+  printf("%-8s fill %5d: %"PRId64" pages identical\n",
+         prof->name, fill, num_pages);
+  ret = 1;
+  fail:
+  
+  ogg_stream_clear(&os);
+  bg_ogg_pager_free(&p);
+  gavl_packet_free(&gp);
+  if(page.data)
+    free(page.data);
+  free(data);
+  return ret;
+  }
+
+/* CRC of a page with the header and body given */
+
+static uint32_t libogg_crc(uint8_t * header, uint8_t * body, int body_len)
+  {
+  ogg_page og;
+
+  og.header = header;
+  og.header_len = 27;
+  og.body = body;
+  og.body_len = body_len;
+  ogg_page_checksum_set(&og);
+  return GAVL_PTR_2_32LE(header + 22);
+  }
+
+static int test_crc_func(const char * name,
+                         uint32_t (*func)(uint32_t crc,
+                                          const uint8_t * data, int len))
+  {
+  int i, len;
+  uint8_t header[27];
+  uint8_t * body;
+  uint32_t crc;
+  
+  body = malloc(70000);
+
+  for(i = 0; i < 2000; i++)
+    {
+    /* All short lengths, then random ones */
+    len = (i < 300) ? i : get_rand() % 70000;
+    
+    fill_random(header, 27);
+    fill_random(body, len);
+    
+    memset(header + 22, 0, 4);
+    crc = func(0, header, 27);
+    crc = func(crc, body, len);
+
+    if(crc != libogg_crc(header, body, len))
+      {
+      fprintf(stderr, "%s CRC differs for %d bytes\n", name, len);
+      free(body);
+      return 0;
+      }
+    }
+  printf("%s CRC identical\n", name);
+  free(body);
+  return 1;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i, j;
+  int ret = 0;
+  
+  pthread_once(&crc_once, crc_init);
+  
+  if(!test_crc_func("Slicing-by-8", crc_slice8))
+    ret = 1;
+#ifdef HAVE_X86
+  if(crc_func == crc_clmul)
+    {
+    if(!test_crc_func("Carry-less multiply", crc_clmul))
+      ret = 1;
+    }
+  else
+    printf("Carry-less multiply not supported by the CPU\n");
+#endif
+
+  for(i = 0; i < NUM_PROFILES; i++)
+    {
+    for(j = 0; j < NUM_FILL_SIZES; j++)
+      {
+      if(!test_profile(&profiles[i], fill_sizes[j]))
+        ret = 1;
+      }
+    }
+  return ret;
+  }
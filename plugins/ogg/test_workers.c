@@ -0,0 +1,549 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Checks, that the output is the same with and without worker
+ *  threads. The file is encoded twice with two synthetic codecs, which
+ *  behave like the real ones in the ways relevant for the workers:
+ *
+ *  - The audio codec writes one or two packets per frame. It encodes
+ *    either into the packet from gavl_packet_sink_get_packet() or
+ *    into its own buffer, which must be copied.
+ *  - The video codec provides its own frames and keeps one packet
+ *    from gavl_packet_sink_get_packet() until the next frame comes
+ *    (like schroedinger). The last packet is written when it is
+ *    closed.
+ *
+ *  Besides the output, the number of copied packet bytes must be the
+ *  same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <config.h>
+
+#include <gmerlin/translation.h>
+#include <gmerlin/plugin.h>
+
+#include <gavl/metatags.h>
+
+#include "ogg_common.h"
+
+#define NUM_FRAMES 200
+
+static const bg_parameter_info_t no_parameters[] =
+  {
+    { /* End of parameters */ }
+  };
+
+static const bg_parameter_info_t * get_parameters_test(void)
+  {
+  return no_parameters;
+  }
+
+static void set_parameter_test(void * data, const char * name,
+                               const gavl_value_t * v)
+  {
+  }
+
+/* Packet payload depends on the frame content only */
+
+static uint32_t hash_bytes(uint32_t h, const uint8_t * data, int len)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    h = h * 16777619 ^ data[i];
+  return h;
+  }
+
+static void fill_payload(uint8_t * data, int len, uint32_t h)
+  {
+  int i;
+  for(i = 0; i < len; i++)
+    {
+    h = h * 1103515245 + 12345;
+    data[i] = h >> 16;
+    }
+  }
+
+static int write_headers(bg_ogg_stream_t * s, const char * id)
+  {
+  int i;
+  ogg_packet op;
+  uint8_t buf[64];
+
+  for(i = 0; i < 2; i++)
+    {
+    memset(&op, 0, sizeof(op));
+    memset(buf, i, sizeof(buf));
+    memcpy(buf, id, strlen(id));
+    op.packet = buf;
+    op.bytes = i ? 64 : 30;
+    if(!bg_ogg_stream_write_header_packet(s, &op))
+      return 0;
+    }
+  return 1;
+  }
+
+/* Audio */
+
+typedef struct
+  {
+  gavl_audio_format_t fmt;
+  gavl_packet_sink_t * psink;
+  int64_t pts;
+  int frames;
+
+  gavl_packet_t own; /* Packets in own memory */
+  } audio_t;
+
+static void * create_audio(void)
+  {
+  return calloc(1, sizeof(audio_t));
+  }
+
+static gavl_sink_status_t put_packet_audio(audio_t * a, uint32_t h,
+                                           int samples, int own)
+  {
+  gavl_packet_t * p;
+  int len = 50 + h % 700;
+
+  if(own)
+    p = &a->own;
+  else
+    p = gavl_packet_sink_get_packet(a->psink);
+
+  gavl_packet_reset(p);
+  gavl_packet_alloc(p, len);
+  fill_payload(p->data, len, h);
+  p->data_len = len;
+  p->pts = a->pts;
+  p->duration = samples;
+  a->pts += samples;
+  return gavl_packet_sink_put_packet(a->psink, p);
+  }
+
+static gavl_sink_status_t put_frame_audio(void * data, gavl_audio_frame_t * f)
+  {
+  uint32_t h;
+  gavl_sink_status_t st;
+  audio_t * a = data;
+
+  h = hash_bytes(2166136261u, f->samples.u_8,
+                 f->valid_samples * a->fmt.num_channels * 2);
+  a->frames++;
+
+  if(a->frames % 3)
+    return put_packet_audio(a, h, f->valid_samples, a->frames % 2);
+
+  if((st = put_packet_audio(a, h, f->valid_samples / 2, 0)) !=
+     GAVL_SINK_OK)
+    return st;
+  return put_packet_audio(a, h ^ 0x5555, f->valid_samples -
+                          f->valid_samples / 2, 1);
+  }
+
+static gavl_audio_sink_t *
+init_audio_test(void * data, gavl_compression_info_t * ci,
+                gavl_audio_format_t * format,
+                gavl_dictionary_t * stream_metadata)
+  {
+  audio_t * a = data;
+  ci->id = GAVL_CODEC_ID_VORBIS;
+  gavl_audio_format_copy(&a->fmt, format);
+  return gavl_audio_sink_create(NULL, put_frame_audio, a, &a->fmt);
+  }
+
+static int init_audio_compressed_test(bg_ogg_stream_t * s)
+  {
+  return write_headers(s, "\001audio");
+  }
+
+static void set_packet_sink_audio(void * data, gavl_packet_sink_t * psink)
+  {
+  audio_t * a = data;
+  a->psink = psink;
+  }
+
+static int close_audio(void * data)
+  {
+  audio_t * a = data;
+  int ret = 1;
+
+  /* Trailing packet */
+  if(a->psink)
+    {
+    gavl_packet_t * p = gavl_packet_sink_get_packet(a->psink);
+    gavl_packet_reset(p);
+    gavl_packet_alloc(p, 10);
+    fill_payload(p->data, 10, 1);
+    p->data_len = 10;
+    p->pts = a->pts;
+    p->duration = 0;
+    p->flags = GAVL_PACKET_LAST;
+    if(gavl_packet_sink_put_packet(a->psink, p) != GAVL_SINK_OK)
+      ret = 0;
+    }
+  gavl_packet_free(&a->own);
+  free(a);
+  return ret;
+  }
+
+static const bg_ogg_codec_t audio_codec =
+  {
+    .name =      "test_audio",
+    .long_name = "Test audio codec",
+    .create =    create_audio,
+    .get_parameters = get_parameters_test,
+    .set_parameter =  set_parameter_test,
+    .init_audio =     init_audio_test,
+    .init_audio_compressed = init_audio_compressed_test,
+    .set_packet_sink = set_packet_sink_audio,
+    .close = close_audio,
+  };
+
+/* Video */
+
+#define KEYFRAME_INTERVAL 12
+#define GRANULE_SHIFT      4
+
+typedef struct
+  {
+  gavl_video_format_t fmt;
+  gavl_video_frame_t * frame;
+  gavl_packet_sink_t * psink;
+  int64_t frames;
+
+  gavl_packet_t * pkt; /* Packet kept until the next frame */
+  } video_t;
+
+static void * create_video(void)
+  {
+  return calloc(1, sizeof(video_t));
+  }
+
+static gavl_video_frame_t * get_frame_video(void * data)
+  {
+  video_t * v = data;
+  return v->frame;
+  }
+
+static gavl_sink_status_t put_frame_video(void * data, gavl_video_frame_t * f)
+  {
+  int len;
+  uint32_t h;
+  gavl_packet_t * p;
+  video_t * v = data;
+
+  h = hash_bytes(2166136261u, f->planes[0],
+                 f->strides[0] * v->fmt.frame_height);
+
+  /* Finish the packet of the previous frame */
+  if(v->pkt)
+    {
+    p = v->pkt;
+    v->pkt = NULL;
+    if(gavl_packet_sink_put_packet(v->psink, p) != GAVL_SINK_OK)
+      return GAVL_SINK_ERROR;
+    }
+
+  v->pkt = gavl_packet_sink_get_packet(v->psink);
+  gavl_packet_reset(v->pkt);
+
+  if(!(v->frames % KEYFRAME_INTERVAL))
+    {
+    len = 3000 + h % 2000;
+    v->pkt->flags |= GAVL_PACKET_KEYFRAME;
+    }
+  else
+    len = 100 + h % 900;
+
+  gavl_packet_alloc(v->pkt, len);
+  fill_payload(v->pkt->data, len, h);
+  v->pkt->data_len = len;
+  v->pkt->pts = v->frames * v->fmt.frame_duration;
+  v->pkt->duration = v->fmt.frame_duration;
+  v->frames++;
+  return GAVL_SINK_OK;
+  }
+
+static gavl_video_sink_t *
+init_video_test(void * data, gavl_compression_info_t * ci,
+                gavl_video_format_t * format,
+                gavl_dictionary_t * stream_metadata)
+  {
+  video_t * v = data;
+  ci->id = GAVL_CODEC_ID_THEORA;
+  gavl_video_format_copy(&v->fmt, format);
+  v->frame = gavl_video_frame_create(&v->fmt);
+  return gavl_video_sink_create(get_frame_video, put_frame_video,
+                                v, &v->fmt);
+  }
+
+static int init_video_compressed_test(bg_ogg_stream_t * s)
+  {
+  s->granule_shift = GRANULE_SHIFT;
+  return write_headers(s, "\200video");
+  }
+
+static void set_packet_sink_video(void * data, gavl_packet_sink_t * psink)
+  {
+  video_t * v = data;
+  v->psink = psink;
+  }
+
+/* Theora style granulepos */
+
+static void convert_packet_video(bg_ogg_stream_t * s,
+                                 gavl_packet_t * src, ogg_packet * dst)
+  {
+  int64_t frame = src->pts / s->vfmt.frame_duration;
+  int64_t key = frame - frame % KEYFRAME_INTERVAL;
+
+  dst->granulepos = (key << GRANULE_SHIFT) + (frame - key);
+  }
+
+static int close_video(void * data)
+  {
+  video_t * v = data;
+  int ret = 1;
+
+  if(v->pkt)
+    {
+    v->pkt->flags |= GAVL_PACKET_LAST;
+    if(gavl_packet_sink_put_packet(v->psink, v->pkt) != GAVL_SINK_OK)
+      ret = 0;
+    }
+  if(v->frame)
+    gavl_video_frame_destroy(v->frame);
+  free(v);
+  return ret;
+  }
+
+static const bg_ogg_codec_t video_codec =
+  {
+    .name =      "test_video",
+    .long_name = "Test video codec",
+    .create =    create_video,
+    .get_parameters = get_parameters_test,
+    .set_parameter =  set_parameter_test,
+    .init_video =     init_video_test,
+    .init_video_compressed = init_video_compressed_test,
+    .set_packet_sink = set_packet_sink_video,
+    .convert_packet = convert_packet_video,
+    .close = close_video,
+  };
+
+/* Encoding */
+
+static void set_int(void * enc, const char * name, int val)
+  {
+  gavl_value_t v;
+  gavl_value_init(&v);
+  gavl_value_set_int(&v, val);
+  bg_ogg_encoder_set_parameter(enc, name, &v);
+  gavl_value_free(&v);
+  }
+
+static void fill_audio_frame(gavl_audio_frame_t * f,
+                             const gavl_audio_format_t * fmt, int n)
+  {
+  int i;
+  for(i = 0; i < fmt->samples_per_frame * fmt->num_channels; i++)
+    f->samples.s_16[i] = (i * 31 + n * 17) & 0x7fff;
+  f->valid_samples = fmt->samples_per_frame;
+  f->timestamp = (int64_t)n * fmt->samples_per_frame;
+  }
+
+static void fill_video_frame(gavl_video_frame_t * f,
+                             const gavl_video_format_t * fmt, int n)
+  {
+  int i, j;
+  for(i = 0; i < fmt->frame_height; i++)
+    {
+    for(j = 0; j < fmt->frame_width; j++)
+      f->planes[0][i * f->strides[0] + j] = i + j * n;
+    }
+  f->timestamp = (int64_t)n * fmt->frame_duration;
+  f->duration = fmt->frame_duration;
+  }
+
+static uint8_t * encode(int threads, int * len, int64_t * bytes_copied)
+  {
+  int i, a = 0;
+  void * enc;
+  gavf_io_t * io;
+  uint8_t * ret;
+  gavl_dictionary_t m;
+  gavl_dictionary_t m_stream;
+  gavl_audio_format_t afmt;
+  gavl_video_format_t vfmt;
+  gavl_audio_sink_t * asink;
+  gavl_video_sink_t * vsink;
+  gavl_audio_frame_t * af;
+  gavl_video_frame_t * vf;
+  bg_ogg_stream_t * s;
+  bg_ogg_encoder_t * e;
+
+  /* Serial numbers come from rand() */
+  srand(1);
+
+  memset(&afmt, 0, sizeof(afmt));
+  afmt.samplerate = 48000;
+  afmt.num_channels = 2;
+  afmt.samples_per_frame = 1024;
+  afmt.sample_format = GAVL_SAMPLE_S16;
+  afmt.interleave_mode = GAVL_INTERLEAVE_ALL;
+
+  memset(&vfmt, 0, sizeof(vfmt));
+  vfmt.image_width = vfmt.frame_width = 64;
+  vfmt.image_height = vfmt.frame_height = 48;
+  vfmt.pixel_width = vfmt.pixel_height = 1;
+  vfmt.pixelformat = GAVL_YUV_420_P;
+  vfmt.timescale = 25;
+  vfmt.frame_duration = 1;
+
+  gavl_dictionary_init(&m);
+  gavl_dictionary_init(&m_stream);
+  gavl_dictionary_set_string(&m, GAVL_META_TITLE, "First");
+
+  enc = bg_ogg_encoder_create();
+  e = enc;
+  set_int(enc, "threads", threads);
+  set_int(enc, "skeleton", 1);
+
+  io = gavf_io_create_mem_write();
+
+  if(!bg_ogg_encoder_open(enc, NULL, io, &m, "ogv"))
+    return NULL;
+
+  s = bg_ogg_encoder_add_audio_stream(enc, &m_stream, &afmt);
+  bg_ogg_encoder_init_stream(enc, s, &audio_codec);
+  s = bg_ogg_encoder_add_video_stream(enc, &m_stream, &vfmt);
+  bg_ogg_encoder_init_stream(enc, s, &video_codec);
+
+  if(!bg_ogg_encoder_start(enc))
+    return NULL;
+
+  asink = bg_ogg_encoder_get_audio_sink(enc, 0);
+  vsink = bg_ogg_encoder_get_video_sink(enc, 0);
+
+  /* Caller frames, which must be copied */
+  af = gavl_audio_frame_create(&afmt);
+  vf = gavl_video_frame_create(&vfmt);
+
+  for(i = 0; i < NUM_FRAMES; i++)
+    {
+    gavl_video_frame_t * vframe = NULL;
+    gavl_audio_frame_t * aframe;
+
+    if(i == NUM_FRAMES / 2)
+      {
+      gavl_dictionary_set_string(&m, GAVL_META_TITLE, "Second");
+      bg_ogg_encoder_update_metadata(enc, &m);
+      }
+
+    /* Alternate between frames of the sink and own frames */
+    if(i % 2)
+      vframe = gavl_video_sink_get_frame(vsink);
+    if(!vframe)
+      vframe = vf;
+    fill_video_frame(vframe, &vfmt, i);
+    if(gavl_video_sink_put_frame(vsink, vframe) != GAVL_SINK_OK)
+      return NULL;
+
+    while((int64_t)a * 1024 * 25 < (int64_t)(i + 1) * 48000)
+      {
+      aframe = NULL;
+      if(a % 2)
+        aframe = gavl_audio_sink_get_frame(asink);
+      if(!aframe)
+        aframe = af;
+      fill_audio_frame(aframe, &afmt, a);
+      if(gavl_audio_sink_put_frame(asink, aframe) != GAVL_SINK_OK)
+        return NULL;
+      a++;
+      }
+    }
+
+  if(!bg_ogg_encoder_close(enc, 0))
+    return NULL;
+
+  *bytes_copied = e->audio_streams[0].bytes_copied +
+    e->video_streams[0].bytes_copied;
+
+  bg_ogg_encoder_destroy(enc);
+
+  ret = gavf_io_mem_get_buf(io, len);
+  gavf_io_destroy(io);
+
+  gavl_audio_frame_destroy(af);
+  gavl_video_frame_destroy(vf);
+  gavl_dictionary_free(&m);
+  gavl_dictionary_free(&m_stream);
+  return ret;
+  }
+
+int main(int argc, char ** argv)
+  {
+  int i;
+  int ret = 0;
+  int len[2];
+  int64_t bytes_copied[2];
+  uint8_t * buf[2];
+
+  for(i = 0; i < 2; i++)
+    {
+    if(!(buf[i] = encode(i, &len[i], &bytes_copied[i])))
+      {
+      fprintf(stderr, "Encoding with threads %s failed\n", i ? "on" : "off");
+      return 1;
+      }
+    printf("Threads %s: %d bytes, %"PRId64" packet bytes copied\n",
+           i ? "on" : "off", len[i], bytes_copied[i]);
+    }
+
+  if((len[0] != len[1]) || memcmp(buf[0], buf[1], len[0]))
+    {
+    for(i = 0; (i < len[0]) && (i < len[1]); i++)
+      {
+      if(buf[0][i] != buf[1][i])
+        break;
+      }
+    fprintf(stderr, "Output differs at byte %d\n", i);
+    ret = 1;
+    }
+  else
+    printf("Output identical\n");
+
+  if(bytes_copied[0] != bytes_copied[1])
+    {
+    fprintf(stderr, "Different number of copied bytes\n");
+    ret = 1;
+    }
+
+  free(buf[0]);
+  free(buf[1]);
+  return ret;
+  }
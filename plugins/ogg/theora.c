@@ -305,6 +305,8 @@ static int init_compressed_theora(bg_ogg_stream_t * s)
   theora->ti.keyframe_granule_shift |=
     (packet.packet[41] & 0xe0) >> 5;
 
+  s->granule_shift = theora->ti.keyframe_granule_shift;
+
   if(!bg_ogg_stream_write_header_packet(s, &packet))
     return 0;
   
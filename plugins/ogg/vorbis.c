@@ -153,6 +153,12 @@ static const bg_parameter_info_t * get_parameters_vorbis()
 
 static const uint8_t comment_header[7] = { 0x03, 'v', 'o', 'r', 'b', 'i', 's' };
 
+static void create_comment_packet_vorbis(bg_ogg_stream_t * s, ogg_packet * op)
+  {
+  bg_ogg_create_comment_packet(comment_header, 7,
+                               &s->m_stream, s->m_global, 1, op);
+  }
+
 static int init_compressed_vorbis(bg_ogg_stream_t * s)
   {
   ogg_packet packet;
@@ -179,8 +185,7 @@ static int init_compressed_vorbis(bg_ogg_stream_t * s)
   
   /* Build comment packet */
 
-  bg_ogg_create_comment_packet(comment_header, 7,
-                               &s->m_stream, s->m_global, 1, &packet);
+  create_comment_packet_vorbis(s, &packet);
 
   if(!bg_ogg_stream_write_header_packet(s, &packet))
     return 0;
@@ -452,6 +457,7 @@ const bg_ogg_codec_t bg_vorbis_codec =
     
     .init_audio            = init_vorbis,
     .init_audio_compressed = init_compressed_vorbis,
+    .create_comment_packet = create_comment_packet_vorbis,
     
     //    .encode_audio = write_audio_frame_vorbis,
     //    .write_packet = write_packet_vorbis,
@@ -0,0 +1,489 @@
+/*****************************************************************
+ * gmerlin-encoders - encoder plugins for gmerlin
+ *
+ * Copyright (c) 2001 - 2012 Members of the Gmerlin project
+ * gmerlin-general@lists.sourceforge.net
+ * http://gmerlin.sourceforge.net
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * *****************************************************************/
+
+/*
+ *  Encoding in worker threads
+ *
+ *  Each stream gets a queue of jobs. A job is a frame (or a packet
+ *  for compressed streams) together with the packets, the encoder
+ *  produced from it. The caller fills jobs, the worker thread of the
+ *  stream encodes them.
+ *
+ *  Each job gets a ticket, which counts the put calls of all streams.
+ *  The packets of finished jobs are passed to the multiplexer in the
+ *  order of the tickets. The multiplexer therefore sees the same
+ *  sequence of packets as without threads and the output is identical.
+ *
+ *  Buffers are swapped instead of copied where the single threaded
+ *  path does this: The caller writes into the frame of the job, the
+ *  encoder writes into the packets of the job and these are swapped
+ *  into the stream by the multiplexer. Only encoders with their own
+ *  frame buffer (schroedinger) need one more copy from the job frame,
+ *  because their single frame can't be queued.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include <gmerlin/translation.h>
+#include <gmerlin/plugin.h>
+#include <gmerlin/log.h>
+
+#include "ogg_common.h"
+
+#define LOG_DOMAIN "ogg.workers"
+
+/* Must be called with the multiplexer locked */
+
+static int process_jobs(bg_ogg_encoder_t * e)
+  {
+  int i, j;
+  int num_streams;
+  bg_ogg_stream_t * s = NULL;
+  bg_ogg_worker_t * w = NULL;
+  bg_ogg_job_t * job = NULL;
+  gavl_packet_t tmp;
+
+  num_streams = e->num_audio_streams + e->num_video_streams;
+
+  while(1)
+    {
+    /* Find the job with the next ticket */
+    for(i = 0; i < num_streams; i++)
+      {
+      if(i < e->num_audio_streams)
+        s = e->audio_streams + i;
+      else
+        s = e->video_streams + (i - e->num_audio_streams);
+
+      if(!(w = s->worker))
+        continue;
+
+      pthread_mutex_lock(&w->mutex);
+      if(w->num_encoded)
+        job = &w->jobs[w->head];
+      else
+        job = NULL;
+      pthread_mutex_unlock(&w->mutex);
+
+      if(job && (job->ticket == e->mux_ticket))
+        break;
+      }
+
+    if(i == num_streams)
+      return 1;
+
+    for(j = 0; j < job->num_packets; j++)
+      {
+      /* Swap the packet into the spare buffer of the stream */
+      gavl_packet_t * p = &s->packets[!s->last_packet];
+      tmp = *p;
+      *p = job->packets[j];
+      job->packets[j] = tmp;
+
+      if(bg_ogg_stream_write_gavl_packet(s, p) != GAVL_SINK_OK)
+        e->mux_error = 1;
+      }
+    job->num_packets = 0;
+
+    s->bytes_copied += job->bytes_copied;
+    job->bytes_copied = 0;
+
+    pthread_mutex_lock(&w->mutex);
+    w->head = (w->head + 1) % w->jobs_alloc;
+    w->num_jobs--;
+    w->num_encoded--;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+
+    e->mux_ticket++;
+    }
+  return 1;
+  }
+
+static void * worker_thread(void * data)
+  {
+  bg_ogg_stream_t * s = data;
+  bg_ogg_worker_t * w = s->worker;
+  bg_ogg_encoder_t * e = s->enc;
+  bg_ogg_job_t * job;
+  gavl_sink_status_t st;
+
+  while(1)
+    {
+    pthread_mutex_lock(&w->mutex);
+    while((w->num_encoded == w->num_jobs) && !w->quit)
+      pthread_cond_wait(&w->cond, &w->mutex);
+
+    if(w->num_encoded == w->num_jobs)
+      {
+      pthread_mutex_unlock(&w->mutex);
+      break;
+      }
+    job = &w->jobs[(w->head + w->num_encoded) % w->jobs_alloc];
+    pthread_mutex_unlock(&w->mutex);
+
+    /* Encode */
+    w->cur = job;
+
+    if(job->aframe)
+      {
+      gavl_audio_frame_t * f = gavl_audio_sink_get_frame(s->asink);
+      if(f)
+        {
+        gavl_audio_frame_copy(&s->afmt, f, job->aframe, 0, 0,
+                              job->aframe->valid_samples,
+                              job->aframe->valid_samples);
+        f->valid_samples = job->aframe->valid_samples;
+        f->timestamp = job->aframe->timestamp;
+        }
+      else
+        f = job->aframe;
+      st = gavl_audio_sink_put_frame(s->asink, f);
+      }
+    else
+      {
+      gavl_video_frame_t * f = gavl_video_sink_get_frame(s->vsink);
+      if(f)
+        {
+        gavl_video_frame_copy(&s->vfmt, f, job->vframe);
+        gavl_video_frame_copy_metadata(f, job->vframe);
+        }
+      else
+        f = job->vframe;
+      st = gavl_video_sink_put_frame(s->vsink, f);
+      }
+
+    w->cur = NULL;
+
+    if(st != GAVL_SINK_OK)
+      w->error = 1;
+
+    /* Pass finished jobs to the multiplexer */
+    pthread_mutex_lock(&e->mux_mutex);
+    pthread_mutex_lock(&w->mutex);
+    w->num_encoded++;
+    pthread_mutex_unlock(&w->mutex);
+    process_jobs(e);
+    pthread_mutex_unlock(&e->mux_mutex);
+    }
+  return NULL;
+  }
+
+/* Get a free job for the caller. Blocks while the queue is full. */
+
+static bg_ogg_job_t * acquire_job(bg_ogg_worker_t * w)
+  {
+  bg_ogg_job_t * ret;
+
+  pthread_mutex_lock(&w->mutex);
+  while(w->num_jobs == w->jobs_alloc)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  ret = &w->jobs[(w->head + w->num_jobs) % w->jobs_alloc];
+  pthread_mutex_unlock(&w->mutex);
+  return ret;
+  }
+
+static gavl_sink_status_t submit_job(bg_ogg_stream_t * s, bg_ogg_job_t * job,
+                                     int done)
+  {
+  bg_ogg_encoder_t * e = s->enc;
+  bg_ogg_worker_t * w = s->worker;
+
+  pthread_mutex_lock(&e->mux_mutex);
+  job->ticket = e->next_ticket++;
+
+  pthread_mutex_lock(&w->mutex);
+  w->num_jobs++;
+  if(done)
+    w->num_encoded++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+
+  if(done)
+    process_jobs(e);
+
+  pthread_mutex_unlock(&e->mux_mutex);
+
+  if(w->error || e->mux_error)
+    return GAVL_SINK_ERROR;
+  return GAVL_SINK_OK;
+  }
+
+/* Sinks for the caller */
+
+static gavl_audio_frame_t * get_audio_frame(void * data)
+  {
+  bg_ogg_stream_t * s = data;
+  return acquire_job(s->worker)->aframe;
+  }
+
+static gavl_sink_status_t put_audio_frame(void * data, gavl_audio_frame_t * f)
+  {
+  bg_ogg_stream_t * s = data;
+  bg_ogg_job_t * job = acquire_job(s->worker);
+
+  if(f != job->aframe)
+    {
+    gavl_audio_frame_copy(&s->afmt, job->aframe, f, 0, 0,
+                          f->valid_samples, f->valid_samples);
+    job->aframe->valid_samples = f->valid_samples;
+    job->aframe->timestamp = f->timestamp;
+    }
+  return submit_job(s, job, 0);
+  }
+
+static gavl_video_frame_t * get_video_frame(void * data)
+  {
+  bg_ogg_stream_t * s = data;
+  return acquire_job(s->worker)->vframe;
+  }
+
+static gavl_sink_status_t put_video_frame(void * data, gavl_video_frame_t * f)
+  {
+  bg_ogg_stream_t * s = data;
+  bg_ogg_job_t * job = acquire_job(s->worker);
+
+  if(f != job->vframe)
+    {
+    gavl_video_frame_copy(&s->vfmt, job->vframe, f);
+    gavl_video_frame_copy_metadata(job->vframe, f);
+    }
+  return submit_job(s, job, 0);
+  }
+
+static gavl_packet_t * get_packet(void * data)
+  {
+  bg_ogg_stream_t * s = data;
+  return &s->worker->packet;
+  }
+
+static gavl_sink_status_t put_packet(void * data, gavl_packet_t * p)
+  {
+  gavl_packet_t tmp;
+  bg_ogg_stream_t * s = data;
+  bg_ogg_job_t * job = acquire_job(s->worker);
+
+  if(!job->packets_alloc)
+    {
+    job->packets_alloc = 1;
+    job->packets = calloc(1, sizeof(*job->packets));
+    }
+
+  if(p == &s->worker->packet)
+    {
+    tmp = job->packets[0];
+    job->packets[0] = *p;
+    *p = tmp;
+    }
+  else
+    {
+    gavl_packet_copy(&job->packets[0], p);
+    job->bytes_copied += p->data_len;
+    }
+  job->num_packets = 1;
+  return submit_job(s, job, 1);
+  }
+
+/* Packet sink of the encoder, called from the worker thread */
+
+gavl_packet_t * bg_ogg_worker_get_packet(bg_ogg_stream_t * s)
+  {
+  bg_ogg_job_t * job = s->worker->cur;
+
+  if(job->num_packets == job->packets_alloc)
+    {
+    job->packets_alloc += 4;
+    job->packets = realloc(job->packets,
+                           job->packets_alloc * sizeof(*job->packets));
+    memset(job->packets + job->num_packets, 0,
+           (job->packets_alloc - job->num_packets) * sizeof(*job->packets));
+    }
+  return &job->packets[job->num_packets];
+  }
+
+gavl_sink_status_t bg_ogg_worker_put_packet(bg_ogg_stream_t * s,
+                                            gavl_packet_t * p)
+  {
+  gavl_packet_t * dst = bg_ogg_worker_get_packet(s);
+  bg_ogg_job_t * job = s->worker->cur;
+
+  if((p != dst) && !bg_ogg_worker_take_packet(s, p, dst))
+    {
+    gavl_packet_copy(dst, p);
+    job->bytes_copied += p->data_len;
+    }
+  job->num_packets++;
+  return GAVL_SINK_OK;
+  }
+
+/*
+ *  Encoders with latency (e.g. schroedinger) keep a packet from
+ *  gavl_packet_sink_get_packet() and pass it with a later frame or
+ *  when they are closed. If p is such a packet of one of our jobs, it
+ *  is swapped into dst instead of being copied.
+ */
+
+int bg_ogg_worker_take_packet(bg_ogg_stream_t * s, gavl_packet_t * p,
+                              gavl_packet_t * dst)
+  {
+  int i;
+  gavl_packet_t tmp;
+  bg_ogg_worker_t * w = s->worker;
+
+  if(!w)
+    return 0;
+
+  for(i = 0; i < w->jobs_alloc; i++)
+    {
+    if((p >= w->jobs[i].packets) &&
+       (p < w->jobs[i].packets + w->jobs[i].packets_alloc))
+      {
+      tmp = *dst;
+      *dst = *p;
+      *p = tmp;
+      return 1;
+      }
+    }
+  return 0;
+  }
+
+/* Public functions */
+
+int bg_ogg_worker_create(bg_ogg_stream_t * s, int queue_size)
+  {
+  int i;
+  bg_ogg_worker_t * w;
+
+  w = calloc(1, sizeof(*w));
+  s->worker = w;
+
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  w->jobs_alloc = queue_size;
+  w->jobs = calloc(w->jobs_alloc, sizeof(*w->jobs));
+
+  if(s->flags & STREAM_COMPRESSED)
+    {
+    /* Packets are only queued for keeping the order */
+    w->psink = gavl_packet_sink_create(get_packet, put_packet, s);
+    return 1;
+    }
+
+  for(i = 0; i < w->jobs_alloc; i++)
+    {
+    if(s->flags & STREAM_VIDEO)
+      w->jobs[i].vframe = gavl_video_frame_create(&s->vfmt);
+    else
+      w->jobs[i].aframe = gavl_audio_frame_create(&s->afmt);
+    }
+
+  if(s->flags & STREAM_VIDEO)
+    w->vsink = gavl_video_sink_create(get_video_frame, put_video_frame,
+                                      s, &s->vfmt);
+  else
+    w->asink = gavl_audio_sink_create(get_audio_frame, put_audio_frame,
+                                      s, &s->afmt);
+
+  if(pthread_create(&w->thread, NULL, worker_thread, s))
+    {
+    bg_log(BG_LOG_ERROR, LOG_DOMAIN, "Cannot create worker thread");
+    return 0;
+    }
+  w->running = 1;
+  return 1;
+  }
+
+/* Wait until all jobs are multiplexed */
+
+void bg_ogg_worker_drain(bg_ogg_stream_t * s)
+  {
+  bg_ogg_worker_t * w = s->worker;
+
+  if(!w)
+    return;
+
+  pthread_mutex_lock(&w->mutex);
+  while(w->num_jobs)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  pthread_mutex_unlock(&w->mutex);
+  }
+
+/*
+ *  Stop the thread. The buffers stay valid, because codecs can still
+ *  hold packets from the jobs, which they fill when they are flushed.
+ *  After this, the encoder is called directly again.
+ */
+
+void bg_ogg_worker_stop(bg_ogg_stream_t * s)
+  {
+  bg_ogg_worker_t * w = s->worker;
+
+  if(!w || !w->running)
+    return;
+
+  pthread_mutex_lock(&w->mutex);
+  w->quit = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+  pthread_join(w->thread, NULL);
+  w->running = 0;
+  }
+
+void bg_ogg_worker_destroy(bg_ogg_stream_t * s)
+  {
+  int i, j;
+  bg_ogg_worker_t * w = s->worker;
+
+  if(!w)
+    return;
+
+  bg_ogg_worker_stop(s);
+
+  for(i = 0; i < w->jobs_alloc; i++)
+    {
+    if(w->jobs[i].aframe)
+      gavl_audio_frame_destroy(w->jobs[i].aframe);
+    if(w->jobs[i].vframe)
+      gavl_video_frame_destroy(w->jobs[i].vframe);
+    for(j = 0; j < w->jobs[i].packets_alloc; j++)
+      gavl_packet_free(&w->jobs[i].packets[j]);
+    if(w->jobs[i].packets)
+      free(w->jobs[i].packets);
+    }
+  free(w->jobs);
+
+  if(w->asink)
+    gavl_audio_sink_destroy(w->asink);
+  if(w->vsink)
+    gavl_video_sink_destroy(w->vsink);
+  if(w->psink)
+    gavl_packet_sink_destroy(w->psink);
+  gavl_packet_free(&w->packet);
+
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->cond);
+  free(w);
+  s->worker = NULL;
+  }